@@ -23,6 +23,7 @@ LICENSE@@@ */
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <time.h>
 
 enum YapType {
@@ -50,18 +51,29 @@ struct YapAsyncCmd {
     QString cmd;
     QString cmdValue;
     TypeArgPairList inArgs;
+    QString cmdClass;   // kYapCommandInput, kYapCommandControl or kYapCommandBulk
+    bool coalesce;      // newer ones may be folded in, see YapServer::canCoalesce()
+
+    YapAsyncCmd() : cmdClass("kYapCommandControl"), coalesce(false) {}
 };
 
 struct YapMsg {
     QString msg;
     QString msgValue;
     TypeArgPairList inArgs;
+    bool coalesce;
+    QString coalesceKeyArg;
+
+    YapMsg() : coalesce(false) {}
 };
 
 static QList<YapSyncCmd>  gSyncCmdList;
 static QList<YapAsyncCmd> gAsyncCmdList;
 static QList<YapMsg>      gMsgList;
 
+// Time and count every server side command handler and message sender
+static bool gStats = false;
+
 static bool
 ignoreLine(const char* line)
 {
@@ -142,6 +154,59 @@ parseTypeArgPairList(QString str, TypeArgPairList& retList)
     return true;
 }
 
+static bool
+parseCoalesceSpec(QString str, YapMsg& msg)
+{
+    str = str.trimmed();
+    if (str.isEmpty())
+        return true;
+
+    QStringList specList = str.split(" ", QString::SkipEmptyParts);
+    if (specList.size() > 2 || specList.at(0) != "coalesce")
+        return false;
+
+    msg.coalesce = true;
+    if (specList.size() == 1)
+        return true;
+
+    // The key has to be one of the message's string args
+    for (int i = 0; i < msg.inArgs.size(); i++) {
+        if (msg.inArgs.at(i).second == specList.at(1) && msg.inArgs.at(i).first == YapString) {
+            msg.coalesceKeyArg = specList.at(1);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Scheduling class and coalesce flag given after the args of an async command
+static bool
+parseCmdClass(QString str, YapAsyncCmd& cmd)
+{
+    str = str.trimmed();
+    if (str.isEmpty())
+        return true;
+
+    QStringList specList = str.split(" ", QString::SkipEmptyParts);
+
+    for (int i = 0; i < specList.size(); i++) {
+        QString spec = specList.at(i);
+        if (spec == "input")
+            cmd.cmdClass = "kYapCommandInput";
+        else if (spec == "control")
+            cmd.cmdClass = "kYapCommandControl";
+        else if (spec == "bulk")
+            cmd.cmdClass = "kYapCommandBulk";
+        else if (spec == "coalesce")
+            cmd.coalesce = true;
+        else
+            return false;
+    }
+
+    return true;
+}
+
 static void
 printInputTypeArgPair(FILE* f, TypeArgPair pair)
 {
@@ -187,6 +252,16 @@ printTypeArgPair(FILE* f, TypeArgPair pair)
     }
 }
 
+// Local for an incoming arg. Strings are borrowed from the packet for the dispatch
+static void
+printInputLocalTypeArgPair(FILE* f, TypeArgPair pair)
+{
+    if (pair.first == YapString)
+        fprintf(f, "const char* %s = 0", pair.second.toLocal8Bit().constData());
+    else
+        printTypeArgPair(f, pair);
+}
+
 static void
 printInputTypeArgPairConverted(FILE* f, TypeArgPair pair, const char* source)
 {
@@ -226,6 +301,86 @@ printInputTypeArgPairConverted(FILE* f, TypeArgPair pair, const char* source)
     }
 }
 
+// All fixed width args, which the native encoding lays out like a packed struct
+static bool
+isFixedLayout(const TypeArgPairList& args)
+{
+    // A single field gains nothing from a block copy
+    if (args.size() < 2)
+        return false;
+
+    for (int i = 0; i < args.size(); i++) {
+        if (args.at(i).first == YapString)
+            return false;
+    }
+
+    return true;
+}
+
+static void
+printArgStruct(FILE* f, const char* indent, QString name, const TypeArgPairList& args)
+{
+    fprintf(f, "%sstruct %s {\n", indent, name.toLocal8Bit().constData());
+    for (int i = 0; i < args.size(); i++) {
+        fprintf(f, "%s%s", indent, indent);
+        printInputTypeArgPair(f, args.at(i));
+        fprintf(f, ";\n");
+    }
+    fprintf(f, "%s} __attribute__((packed));\n", indent);
+}
+
+// Fill the locals of the args from a block if the packet is native, field by field otherwise
+static void
+printReadArgs(FILE* f, const char* indent, const char* packet, QString structName, const TypeArgPairList& args)
+{
+    if (!isFixedLayout(args)) {
+        for (int j = 0; j < args.size(); j++) {
+            fprintf(f, "%s(*%s) >> %s;\n", indent, packet,
+                   args.at(j).second.toLocal8Bit().constData());
+        }
+        return;
+    }
+
+    fprintf(f, "%s%s _args;\n", indent, structName.toLocal8Bit().constData());
+    fprintf(f, "%sif (%s->readBlock(&_args, sizeof(_args))) {\n", indent, packet);
+    for (int j = 0; j < args.size(); j++) {
+        fprintf(f, "%s\t%s = _args.%s;\n", indent,
+               args.at(j).second.toLocal8Bit().constData(),
+               args.at(j).second.toLocal8Bit().constData());
+    }
+    fprintf(f, "%s}\n", indent);
+    fprintf(f, "%selse {\n", indent);
+    for (int j = 0; j < args.size(); j++) {
+        fprintf(f, "%s\t(*%s) >> %s;\n", indent, packet,
+               args.at(j).second.toLocal8Bit().constData());
+    }
+    fprintf(f, "%s}\n", indent);
+}
+
+static void
+printWriteArgs(FILE* f, const char* packet, QString structName, const TypeArgPairList& args)
+{
+    if (!isFixedLayout(args)) {
+        for (int j = 0; j < args.size(); j++) {
+            fprintf(f, "\t(*%s) << %s;\n", packet,
+                   args.at(j).second.toLocal8Bit().constData());
+        }
+        return;
+    }
+
+    fprintf(f, "\t%s _args = { ", structName.toLocal8Bit().constData());
+    for (int j = 0; j < args.size(); j++) {
+        fprintf(f, "%s%s", j ? ", " : "", args.at(j).second.toLocal8Bit().constData());
+    }
+    fprintf(f, " };\n");
+    fprintf(f, "\tif (!%s->writeBlock(&_args, sizeof(_args))) {\n", packet);
+    for (int j = 0; j < args.size(); j++) {
+        fprintf(f, "\t\t(*%s) << %s;\n", packet,
+               args.at(j).second.toLocal8Bit().constData());
+    }
+    fprintf(f, "\t}\n");
+}
+
 static
 void writeCopyrightTextToFile(FILE *fp)
 {
@@ -270,6 +425,7 @@ void writeServerHeaderFile(QString className)
     fprintf(f, "#include <YapServer.h>\n");
     fprintf(f, "#include <YapProxy.h>\n");
     fprintf(f, "#include <YapPacket.h>\n");
+    fprintf(f, "#include <YapCommandStats.h>\n");
     fprintf(f, "\n");
 
     fprintf(f, "class %s : public YapServer\n", className.toLocal8Bit().constData());
@@ -290,10 +446,32 @@ void writeServerHeaderFile(QString className)
         fprintf(f, ");\n");
     }
 
+    fprintf(f, "\n");
+    fprintf(f, "    // Counters of the async commands and messages, empty unless generated with --stats\n");
+    fprintf(f, "    static const YapCommandStats* asyncCommandStats(int& count);\n");
+    fprintf(f, "    static const YapCommandStats* messageStats(int& count);\n");
+    fprintf(f, "    static void resetCommandStats();\n");
+
     fprintf(f, "\n");
     fprintf(f, "protected:\n\n");
     fprintf(f, "    virtual void handleSyncCommand(YapProxy* proxy, YapPacket* cmd, YapPacket* reply);\n");
     fprintf(f, "    virtual void handleAsyncCommand(YapProxy* proxy, YapPacket* cmd);\n");
+    fprintf(f, "    virtual YapCommandClass commandClass(int16_t cmdValue) const;\n");
+    fprintf(f, "\n");
+    fprintf(f, "    struct AsyncCommandInfo {\n");
+    fprintf(f, "        int16_t         cmdValue;\n");
+    fprintf(f, "        const char*     name;\n");
+    fprintf(f, "        YapCommandClass cmdClass;\n");
+    fprintf(f, "        bool            coalesce; // newer ones may be folded in, see canCoalesce()\n");
+    fprintf(f, "        void          (*decode)(%s* server, YapProxy* proxy, YapPacket* cmd);\n",
+            className.toLocal8Bit().constData());
+    fprintf(f, "    };\n");
+    fprintf(f, "\n");
+    fprintf(f, "    static const AsyncCommandInfo* asyncCommandInfo(int16_t cmdValue);\n");
+    fprintf(f, "\n");
+    fprintf(f, "    // Input commands may be followed by a sequence number and client timestamp\n");
+    fprintf(f, "    virtual void traceInput(YapProxy* proxy, int32_t seq, int64_t clientTimeUs) {}\n");
+    fprintf(f, "    virtual void traceInputDone(YapProxy* proxy) {}\n");
 
     fprintf(f, "\n");
     fprintf(f, "    // Sync Commands\n");
@@ -323,6 +501,30 @@ void writeServerHeaderFile(QString className)
         fprintf(f, ") = 0;\n");
     }
 
+    fprintf(f, "\n");
+    fprintf(f, "private:\n\n");
+    fprintf(f, "    // Argument blocks of the native encoding\n");
+    for (int i = 0; i < gAsyncCmdList.size(); i++) {
+        YapAsyncCmd y = gAsyncCmdList.at(i);
+        if (isFixedLayout(y.inArgs))
+            printArgStruct(f, "    ", "AsyncCmd" + y.cmd + "Args", y.inArgs);
+    }
+    for (int i = 0; i < gMsgList.size(); i++) {
+        YapMsg y = gMsgList.at(i);
+        if (isFixedLayout(y.inArgs))
+            printArgStruct(f, "    ", "Msg" + y.msg + "Args", y.inArgs);
+    }
+    fprintf(f, "\n");
+    fprintf(f, "    struct AsyncDecoders;\n");
+    fprintf(f, "\n");
+    fprintf(f, "    static const AsyncCommandInfo s_asyncCommands[];\n");
+    fprintf(f, "    static const int s_asyncCommandCount;\n");
+    if (gStats) {
+        fprintf(f, "\n");
+        fprintf(f, "    static YapCommandStats s_asyncCommandStats[]; // parallel to s_asyncCommands\n");
+        fprintf(f, "    static YapCommandStats s_messageStats[];\n");
+    }
+
     fprintf(f, "};\n\n");
     fprintf(f, "#endif // %s_H \n", className.toUpper().toLocal8Bit().constData());
 
@@ -345,6 +547,9 @@ void writeServerCppFile(QString className)
     fprintf(f, "#include <stdio.h>\n");
     fprintf(f, "#include <%s.h>\n", className.toLocal8Bit().constData());
     fprintf(f, "\n");
+    fprintf(f, "static const int kAsyncCmdRangeStart = 0x1000;\n");
+    fprintf(f, "static const int kAsyncCmdRangeLen   = 0x1000;\n");
+    fprintf(f, "\n");
 
     // Sync Command
     fprintf(f, "void %s::handleSyncCommand(YapProxy* proxy, YapPacket* cmd, YapPacket* reply)\n",
@@ -366,10 +571,8 @@ void writeServerCppFile(QString className)
         fprintf(f, "\t\t\n");
         for (int j = 0; j < y.inArgs.size(); j++) {
             fprintf(f, "\t\t");
-            printTypeArgPair(f, y.inArgs.at(j));
+            printInputLocalTypeArgPair(f, y.inArgs.at(j));
             fprintf(f, ";\n");
-            if (y.inArgs.at(j).first == YapString)
-                stringsToFree.append(y.inArgs.at(j).second);
         }
 
 
@@ -404,11 +607,13 @@ void writeServerCppFile(QString className)
                    y.outArgs.at(j).second.toLocal8Bit().constData());
         }
 
-        fprintf(f, "\t\t\n");
-        for (int j = 0; j < stringsToFree.size(); j++) {
-            fprintf(f, "\t\tif (%s) free(%s);\n",
-                   stringsToFree.at(j).toLocal8Bit().constData(),
-                   stringsToFree.at(j).toLocal8Bit().constData());
+        if (!stringsToFree.isEmpty()) {
+            fprintf(f, "\t\t\n");
+            for (int j = 0; j < stringsToFree.size(); j++) {
+                fprintf(f, "\t\tif (%s) free(%s);\n",
+                       stringsToFree.at(j).toLocal8Bit().constData(),
+                       stringsToFree.at(j).toLocal8Bit().constData());
+            }
         }
 
         fprintf(f, "\t\t\n");
@@ -420,59 +625,178 @@ void writeServerCppFile(QString className)
     fprintf(f, "\t}\n");
     fprintf(f, "}\n\n");
 
-    // Async Commands
-    fprintf(f, "void %s::handleAsyncCommand(YapProxy* proxy, YapPacket* cmd)\n",
-           className.toLocal8Bit().constData());
+    // Async commands, one decoder each. Nested in the class for access to the handlers
+    fprintf(f, "struct %s::AsyncDecoders\n", className.toLocal8Bit().constData());
     fprintf(f, "{\n");
-    fprintf(f, "\tint16_t cmdValue;\n");
-    fprintf(f, "\n");
-    fprintf(f, "\t(*cmd) >> cmdValue;\n");
-    fprintf(f, "\n");
-    fprintf(f, "\tswitch (cmdValue) {\n");
     for (int i = 0; i < gAsyncCmdList.size(); i++) {
         YapAsyncCmd y = gAsyncCmdList.at(i);
-        fprintf(f, "\tcase %s: { // %s\n",
-               y.cmdValue.toLocal8Bit().constData(),
-               y.cmd.toLocal8Bit().constData());
-
-        QStringList stringsToFree;
+        if (i != 0)
+            fprintf(f, "\n");
+        fprintf(f, "\tstatic void %s(%s* server, YapProxy* proxy, YapPacket* cmd)\n",
+               y.cmd.toLocal8Bit().constData(),
+               className.toLocal8Bit().constData());
+        fprintf(f, "\t{\n");
 
-        fprintf(f, "\t\t\n");
         for (int j = 0; j < y.inArgs.size(); j++) {
             fprintf(f, "\t\t");
-            printTypeArgPair(f, y.inArgs.at(j));
+            printInputLocalTypeArgPair(f, y.inArgs.at(j));
             fprintf(f, ";\n");
-            if (y.inArgs.at(j).first == YapString)
-                stringsToFree.append(y.inArgs.at(j).second);
         }
 
-        fprintf(f, "\t\t\n");
-        for (int j = 0; j < y.inArgs.size(); j++) {
-            fprintf(f, "\t\t(*cmd) >> %s;\n",
-                   y.inArgs.at(j).second.toLocal8Bit().constData());
+        if (!y.inArgs.isEmpty())
+            fprintf(f, "\n");
+        printReadArgs(f, "\t\t", "cmd", "AsyncCmd" + y.cmd + "Args", y.inArgs);
+
+        bool traced = y.cmdClass == "kYapCommandInput";
+        if (traced) {
+            fprintf(f, "\n");
+            fprintf(f, "\t\tint32_t _traceSeq = 0;\n");
+            fprintf(f, "\t\tint64_t _traceTimeUs = 0;\n");
+            fprintf(f, "\t\tbool _traced = cmd->hasMore();\n");
+            fprintf(f, "\t\tif (_traced) {\n");
+            fprintf(f, "\t\t\t(*cmd) >> _traceSeq;\n");
+            fprintf(f, "\t\t\t(*cmd) >> _traceTimeUs;\n");
+            fprintf(f, "\t\t\tserver->traceInput(proxy, _traceSeq, _traceTimeUs);\n");
+            fprintf(f, "\t\t}\n");
         }
 
-        fprintf(f, "\t\t\n");
-        fprintf(f, "\t\tasyncCmd%s(proxy", y.cmd.toLocal8Bit().constData());
+        if (!y.inArgs.isEmpty() || traced)
+            fprintf(f, "\n");
+        fprintf(f, "\t\tserver->asyncCmd%s(proxy", y.cmd.toLocal8Bit().constData());
         for (int j = 0; j < y.inArgs.size(); j++) {
             fprintf(f, ", %s", y.inArgs.at(j).second.toLocal8Bit().constData());
         }
         fprintf(f, ");\n");
 
-        fprintf(f, "\t\t\n");
-        for (int j = 0; j < stringsToFree.size(); j++) {
-            fprintf(f, "\t\tif (%s) free(%s);\n",
-                   stringsToFree.at(j).toLocal8Bit().constData(),
-                   stringsToFree.at(j).toLocal8Bit().constData());
+        if (traced) {
+            fprintf(f, "\n");
+            fprintf(f, "\t\tif (_traced)\n");
+            fprintf(f, "\t\t\tserver->traceInputDone(proxy);\n");
         }
-
-        fprintf(f, "\t\t\n");
-        fprintf(f, "\t\tbreak;\n");
         fprintf(f, "\t}\n");
     }
-    fprintf(f, "\tdefault:\n");
+    fprintf(f, "};\n\n");
+
+    // Command table, in the order of the defs file
+    fprintf(f, "const %s::AsyncCommandInfo %s::s_asyncCommands[] = {\n",
+           className.toLocal8Bit().constData(),
+           className.toLocal8Bit().constData());
+    for (int i = 0; i < gAsyncCmdList.size(); i++) {
+        YapAsyncCmd y = gAsyncCmdList.at(i);
+        fprintf(f, "\t{ %s, \"%s\", %s, %s, &AsyncDecoders::%s },\n",
+               y.cmdValue.toLocal8Bit().constData(),
+               y.cmd.toLocal8Bit().constData(),
+               y.cmdClass.toLocal8Bit().constData(),
+               y.coalesce ? "true" : "false",
+               y.cmd.toLocal8Bit().constData());
+    }
+    fprintf(f, "};\n\n");
+    fprintf(f, "const int %s::s_asyncCommandCount = sizeof(s_asyncCommands) / sizeof(s_asyncCommands[0]);\n\n",
+           className.toLocal8Bit().constData());
+
+    // Lookup by command value
+    fprintf(f, "const %s::AsyncCommandInfo* %s::asyncCommandInfo(int16_t cmdValue)\n",
+           className.toLocal8Bit().constData(),
+           className.toLocal8Bit().constData());
+    fprintf(f, "{\n");
+    fprintf(f, "\t// Position in s_asyncCommands plus one for each value in the async range\n");
+    fprintf(f, "\tstatic uint16_t index[kAsyncCmdRangeLen];\n");
+    fprintf(f, "\tstatic bool indexed = false;\n");
+    fprintf(f, "\n");
+    fprintf(f, "\tif (!indexed) {\n");
+    fprintf(f, "\t\tfor (int i = 0; i < s_asyncCommandCount; i++)\n");
+    fprintf(f, "\t\t\tindex[s_asyncCommands[i].cmdValue - kAsyncCmdRangeStart] = i + 1;\n");
+    fprintf(f, "\t\tindexed = true;\n");
+    fprintf(f, "\t}\n");
+    fprintf(f, "\n");
+    fprintf(f, "\tint slot = cmdValue - kAsyncCmdRangeStart;\n");
+    fprintf(f, "\tif (slot < 0 || slot >= kAsyncCmdRangeLen || !index[slot])\n");
+    fprintf(f, "\t\treturn 0;\n");
+    fprintf(f, "\n");
+    fprintf(f, "\treturn &s_asyncCommands[index[slot] - 1];\n");
+    fprintf(f, "}\n\n");
+
+    fprintf(f, "void %s::handleAsyncCommand(YapProxy* proxy, YapPacket* cmd)\n",
+           className.toLocal8Bit().constData());
+    fprintf(f, "{\n");
+    fprintf(f, "\tint16_t cmdValue;\n");
+    fprintf(f, "\n");
+    fprintf(f, "\t(*cmd) >> cmdValue;\n");
+    fprintf(f, "\n");
+    fprintf(f, "\tconst AsyncCommandInfo* info = asyncCommandInfo(cmdValue);\n");
+    fprintf(f, "\tif (!info) {\n");
     fprintf(f, "\t\tfprintf(stderr, \"Unknown async cmd: %%d\\n\", cmdValue);\n");
+    fprintf(f, "\t\treturn;\n");
     fprintf(f, "\t}\n");
+    fprintf(f, "\n");
+    if (gStats) {
+        fprintf(f, "\tint64_t startNs = YapCommandStats::nowNs();\n");
+        fprintf(f, "\tinfo->decode(this, proxy, cmd);\n");
+        fprintf(f, "\ts_asyncCommandStats[info - s_asyncCommands].record(cmd->length(), YapCommandStats::nowNs() - startNs);\n");
+    }
+    else {
+        fprintf(f, "\tinfo->decode(this, proxy, cmd);\n");
+    }
+    fprintf(f, "}\n\n");
+
+    // Command classes
+    fprintf(f, "YapCommandClass %s::commandClass(int16_t cmdValue) const\n",
+           className.toLocal8Bit().constData());
+    fprintf(f, "{\n");
+    fprintf(f, "\tconst AsyncCommandInfo* info = asyncCommandInfo(cmdValue);\n");
+    fprintf(f, "\treturn info ? info->cmdClass : kYapCommandControl;\n");
+    fprintf(f, "}\n\n");
+
+    // Command and message counters
+    if (gStats) {
+        fprintf(f, "YapCommandStats %s::s_asyncCommandStats[] = {\n",
+               className.toLocal8Bit().constData());
+        for (int i = 0; i < gAsyncCmdList.size(); i++)
+            fprintf(f, "\t{ \"%s\" },\n", gAsyncCmdList.at(i).cmd.toLocal8Bit().constData());
+        fprintf(f, "};\n\n");
+
+        fprintf(f, "YapCommandStats %s::s_messageStats[] = {\n",
+               className.toLocal8Bit().constData());
+        for (int i = 0; i < gMsgList.size(); i++)
+            fprintf(f, "\t{ \"%s\" },\n", gMsgList.at(i).msg.toLocal8Bit().constData());
+        fprintf(f, "};\n\n");
+    }
+
+    fprintf(f, "const YapCommandStats* %s::asyncCommandStats(int& count)\n",
+           className.toLocal8Bit().constData());
+    fprintf(f, "{\n");
+    if (gStats) {
+        fprintf(f, "\tcount = s_asyncCommandCount;\n");
+        fprintf(f, "\treturn s_asyncCommandStats;\n");
+    }
+    else {
+        fprintf(f, "\tcount = 0;\n");
+        fprintf(f, "\treturn 0;\n");
+    }
+    fprintf(f, "}\n\n");
+
+    fprintf(f, "const YapCommandStats* %s::messageStats(int& count)\n",
+           className.toLocal8Bit().constData());
+    fprintf(f, "{\n");
+    if (gStats) {
+        fprintf(f, "\tcount = sizeof(s_messageStats) / sizeof(s_messageStats[0]);\n");
+        fprintf(f, "\treturn s_messageStats;\n");
+    }
+    else {
+        fprintf(f, "\tcount = 0;\n");
+        fprintf(f, "\treturn 0;\n");
+    }
+    fprintf(f, "}\n\n");
+
+    fprintf(f, "void %s::resetCommandStats()\n",
+           className.toLocal8Bit().constData());
+    fprintf(f, "{\n");
+    if (gStats) {
+        fprintf(f, "\tfor (int i = 0; i < s_asyncCommandCount; i++)\n");
+        fprintf(f, "\t\ts_asyncCommandStats[i].reset();\n");
+        fprintf(f, "\tfor (unsigned i = 0; i < sizeof(s_messageStats) / sizeof(s_messageStats[0]); i++)\n");
+        fprintf(f, "\t\ts_messageStats[i].reset();\n");
+    }
     fprintf(f, "}\n\n");
 
     // Async messages
@@ -487,15 +811,26 @@ void writeServerCppFile(QString className)
         }
         fprintf(f, ")\n");
         fprintf(f, "{\n");
+        if (gStats)
+            fprintf(f, "\tint64_t _startNs = YapCommandStats::nowNs();\n");
         fprintf(f, "\tYapPacket* pkt = proxy->packetMessage();\n");
         fprintf(f, "\t(*pkt) << (int16_t) %s; // %s\n",
                y.msgValue.toLocal8Bit().constData(),
                y.msg.toLocal8Bit().constData());
-        for (int j = 0; j < y.inArgs.size(); j++) {
-            fprintf(f, "\t(*pkt) << %s;\n",
-                   y.inArgs.at(j).second.toLocal8Bit().constData());
-        }
-        fprintf(f, "\tproxy->sendMessage();\n");
+        printWriteArgs(f, "pkt", "Msg" + y.msg + "Args", y.inArgs);
+        if (gStats)
+            fprintf(f, "\tint _len = pkt->length();\n");
+        if (!y.coalesce)
+            fprintf(f, "\tproxy->sendMessage();\n");
+        else if (y.coalesceKeyArg.isEmpty())
+            fprintf(f, "\tproxy->sendMessage(%s);\n",
+                   y.msgValue.toLocal8Bit().constData());
+        else
+            fprintf(f, "\tproxy->sendMessage(%s, %s);\n",
+                   y.msgValue.toLocal8Bit().constData(),
+                   y.coalesceKeyArg.toLocal8Bit().constData());
+        if (gStats)
+            fprintf(f, "\ts_messageStats[%d].record(_len, YapCommandStats::nowNs() - _startNs);\n", i);
         fprintf(f, "}\n\n");
     }
 
@@ -586,6 +921,20 @@ void writeClientHeaderFile(QString className)
     fprintf(f, "\t// Overriden functions\n");
     fprintf(f, "\tvirtual void handleAsyncMessage(YapPacket* msg);\n");
 
+    fprintf(f, "\n");
+    fprintf(f, "private:\n\n");
+    fprintf(f, "\t// Argument blocks of the native encoding\n");
+    for (int i = 0; i < gAsyncCmdList.size(); i++) {
+        YapAsyncCmd y = gAsyncCmdList.at(i);
+        if (isFixedLayout(y.inArgs))
+            printArgStruct(f, "\t", "AsyncCmd" + y.cmd + "Args", y.inArgs);
+    }
+    for (int i = 0; i < gMsgList.size(); i++) {
+        YapMsg y = gMsgList.at(i);
+        if (isFixedLayout(y.inArgs))
+            printArgStruct(f, "\t", "Msg" + y.msg + "Args", y.inArgs);
+    }
+
     fprintf(f, "};\n\n");
     fprintf(f, "#endif // %s_H \n", className.toUpper().toLocal8Bit().constData());
 
@@ -668,10 +1017,9 @@ void writeClientCppFile(QString className)
         fprintf(f, "\t(*_cmd) << (int16_t) %s; // %s\n",
                 y.cmdValue.toLocal8Bit().constData(),
                 y.cmd.toLocal8Bit().constData());
-        for (int j = 0; j < y.inArgs.size(); j++) {
-            fprintf(f, "\t(*_cmd) << %s;\n",
-                    y.inArgs.at(j).second.toLocal8Bit().constData());
-        }
+        printWriteArgs(f, "_cmd", "AsyncCmd" + y.cmd + "Args", y.inArgs);
+        if (y.cmdClass == "kYapCommandInput")
+            fprintf(f, "\tappendTrace(_cmd);\n");
         fprintf(f, "\tsendAsyncCommand();\n");
         fprintf(f, "}\n\n");
     }
@@ -795,15 +1143,12 @@ void writeClientCppFile(QString className)
         fprintf(f, "\n");
         for (int j = 0; j < y.inArgs.size(); j++) {
             fprintf(f, "\t\t");
-            printTypeArgPair(f, y.inArgs.at(j));
+            printInputLocalTypeArgPair(f, y.inArgs.at(j));
             fprintf(f, ";\n");
         }
 
         fprintf(f, "\n");
-        for (int j = 0; j < y.inArgs.size(); j++) {
-            fprintf(f, "\t\t(*_msg) >> %s;\n",
-                    y.inArgs.at(j).second.toLocal8Bit().constData());
-        }
+        printReadArgs(f, "\t\t", "_msg", "Msg" + y.msg + "Args", y.inArgs);
 
         fprintf(f, "\n");
         fprintf(f, "\t\tmsg%s(", y.msg.toLocal8Bit().constData());
@@ -814,13 +1159,6 @@ void writeClientCppFile(QString className)
         }
         fprintf(f, ");\n");
 
-        // Free the strings
-        for (int j = 0; j < y.inArgs.size(); j++) {
-            if(y.inArgs.at(j).first == YapString) {
-                fprintf(f, "\t\tfree(%s);\n", y.inArgs.at(j).second.toLocal8Bit().constData());
-            }
-        }
-
         fprintf(f, "\t\tbreak;\n");
         fprintf(f, "\t}\n");
     }
@@ -836,7 +1174,7 @@ void writeClientCppFile(QString className)
 
 static void
 printUsage() {
-    printf("Usage: YapCodeGen client/server <basename> <defsfile>\n");
+    printf("Usage: YapCodeGen client/server <basename> <defsfile> [--stats]\n");
 }
 
 
@@ -862,6 +1200,14 @@ int main(int argc, char** argv)
         return -1;
     }
 
+    if (argc > 4) {
+        if (strcmp(argv[4], "--stats") != 0) {
+            printUsage();
+            return -1;
+        }
+        gStats = true;
+    }
+
     QString className(argv[2]);
     className += clientCodeGen ? "ClientBase" : "ServerBase";
 
@@ -938,6 +1284,27 @@ int main(int argc, char** argv)
                 return -1;
             }
 
+            for (int i = 3; i < argsQStrList.size(); i++) {
+                if (!parseCmdClass(argsQStrList.at(i), y)) {
+                    fprintf(stderr, "Error parsing async cmd class at line number: %d: %s", lineNum, line);
+                    return -1;
+                }
+            }
+
+            // Has to fit the dispatch table, see asyncCommandInfo()
+            bool ok = false;
+            int value = y.cmdValue.toInt(&ok, 0);
+            if (!ok || value < 0x1000 || value > 0x1FFF) {
+                fprintf(stderr, "Async cmd value out of range at line number: %d: %s", lineNum, line);
+                return -1;
+            }
+            for (int i = 0; i < gAsyncCmdList.size(); i++) {
+                if (gAsyncCmdList.at(i).cmdValue.toInt(0, 0) == value) {
+                    fprintf(stderr, "Duplicate async cmd value at line number: %d: %s", lineNum, line);
+                    return -1;
+                }
+            }
+
             gAsyncCmdList.append(y);
         }
         else if (type == "msg") {
@@ -954,6 +1321,11 @@ int main(int argc, char** argv)
                 return -1;
             }
 
+            if (argsQStrList.size() > 3 && !parseCoalesceSpec(argsQStrList.at(3), y)) {
+                fprintf(stderr, "Error parsing msg coalesce spec at line number: %d: %s", lineNum, line);
+                return -1;
+            }
+
             gMsgList.append(y);
         }
         else {
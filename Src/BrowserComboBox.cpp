@@ -70,24 +70,27 @@ static inline pbnjson::JValue createJSONPopupData(const QWebSelectData& listData
     return result;
 }
 
-static inline QString writeJSONPopupData(int id, const QWebSelectData& listData)
+static inline QString writeJSONPopupData(int id, const std::string& data)
 {
     QFile file(QString("/tmp/ComboBoxPopup%1").arg(id));
     if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
         return QString();
 
-    pbnjson::JValue content = createJSONPopupData(listData);
-    std::string result;
-    jsonToString(content, result);
-    const char* data = result.c_str();
-    file.write(data, strlen(data));
+    file.write(data.c_str(), data.size());
 
     return file.flush() ? file.fileName() : QString();
 }
 
 void BrowserComboBox::show(const QWebSelectData& data)
 {
-    QString fileName = writeJSONPopupData(m_id, data);
+    std::string json;
+    jsonToString(createJSONPopupData(data), json);
+
+    // Clients that can't take the data directly get the file
+    if (m_server.showComboBoxPopupData(m_id, json.c_str(), json.size()))
+        return;
+
+    QString fileName = writeJSONPopupData(m_id, json);
     if (fileName.isEmpty() || !m_server.showComboBoxPopup(m_id, fileName.toUtf8().constData()))
         QTimer::singleShot(0, this, SIGNAL(didHide()));
 }
@@ -27,6 +27,7 @@ LICENSE@@@ */
 class BrowserComboBoxServer {
 public:
     virtual bool showComboBoxPopup(int id, const char* fileName) = 0;
+    virtual bool showComboBoxPopupData(int id, const char* data, int len) = 0;
     virtual void hideComboBoxPopup(int id) = 0;
 };
 
@@ -0,0 +1,115 @@
+/* @@@LICENSE
+*
+*      Copyright (c) 2012 Hewlett-Packard Development Company, L.P.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+LICENSE@@@ */
+
+#include <errno.h>
+
+#include "BrowserCommon.h"
+#include "BrowserPage.h"
+#include "BrowserImageEncoder.h"
+
+BrowserImageEncoder* BrowserImageEncoder::s_instance = 0;
+
+BrowserImageEncoder* BrowserImageEncoder::instance()
+{
+    if (!s_instance)
+        s_instance = new BrowserImageEncoder;
+
+    return s_instance;
+}
+
+BrowserImageEncoder::BrowserImageEncoder()
+    : m_pool(0)
+{
+    GError* error = NULL;
+
+    // A single thread keeps the encodes in order and bounds the memory they take
+    m_pool = g_thread_pool_new(encodeJob, this, 1, FALSE, &error);
+    if (!m_pool) {
+        g_warning("Failed to create image encoder thread: %s", error ? error->message : "");
+        if (error)
+            g_error_free(error);
+    }
+}
+
+BrowserImageEncoder::~BrowserImageEncoder()
+{
+    if (m_pool)
+        g_thread_pool_free(m_pool, FALSE, TRUE);
+}
+
+/**
+ * Queue the image for writing. The page gets renderToFileDone() once it is
+ * written, or right away if there is no worker thread.
+ */
+void BrowserImageEncoder::encode(BrowserPage* page, int32_t queryNum, const QImage& image,
+                                 const char* filename, const char* format, int quality)
+{
+    Job* job = new Job;
+    job->page     = page;
+    job->queryNum = queryNum;
+    job->image    = image;
+    job->filename = filename ? filename : "";
+    job->format   = format ? format : "";
+    job->quality  = quality;
+    job->result   = 0;
+
+    m_jobs.push_back(job);
+
+    if (m_pool)
+        g_thread_pool_push(m_pool, job, NULL);
+    else
+        encodeJob(job, this);
+}
+
+/**
+ * Forget about the page, its pending images are still written.
+ */
+void BrowserImageEncoder::cancel(BrowserPage* page)
+{
+    for (std::list<Job*>::iterator it = m_jobs.begin(); it != m_jobs.end(); ++it) {
+        if ((*it)->page == page)
+            (*it)->page = 0;
+    }
+}
+
+// Runs on the worker thread, only touches the job's own image and result
+void BrowserImageEncoder::encodeJob(gpointer data, gpointer userData)
+{
+    Job* job = static_cast<Job*>(data);
+
+    const char* format = job->format.empty() ? 0 : job->format.c_str();
+    if (!job->image.save(QString::fromUtf8(job->filename.c_str()), format, job->quality))
+        job->result = EIO;
+
+    // Release the pixels before going back to the main thread
+    job->image = QImage();
+
+    g_idle_add(jobDone, job);
+}
+
+gboolean BrowserImageEncoder::jobDone(gpointer data)
+{
+    Job* job = static_cast<Job*>(data);
+
+    s_instance->m_jobs.remove(job);
+    if (job->page)
+        job->page->renderToFileDone(job->queryNum, job->filename.c_str(), job->result);
+
+    delete job;
+    return FALSE;
+}
@@ -0,0 +1,71 @@
+/* @@@LICENSE
+*
+*      Copyright (c) 2012 Hewlett-Packard Development Company, L.P.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+LICENSE@@@ */
+
+#ifndef BROWSERIMAGEENCODER_H
+#define BROWSERIMAGEENCODER_H
+
+#include <glib.h>
+#include <list>
+#include <string>
+
+#include <QImage>
+
+class BrowserPage;
+
+/**
+ * Encodes and writes images on a worker thread, one at a time, and hands the
+ * result back to the page on the main thread.
+ */
+class BrowserImageEncoder
+{
+public:
+
+    static BrowserImageEncoder* instance();
+
+    void encode(BrowserPage* page, int32_t queryNum, const QImage& image,
+                const char* filename, const char* format, int quality);
+    void cancel(BrowserPage* page);
+
+private:
+
+    struct Job {
+        BrowserPage* page;      ///< Cleared if the page goes away meanwhile
+        int32_t      queryNum;
+        QImage       image;
+        std::string  filename;
+        std::string  format;    ///< Empty to go by the file name
+        int          quality;   ///< -1 for the format's default
+        int          result;    ///< 0 or an errno value, set by the worker
+    };
+
+    BrowserImageEncoder();
+    ~BrowserImageEncoder();
+
+    static void encodeJob(gpointer data, gpointer userData);
+    static gboolean jobDone(gpointer data);
+
+    GThreadPool*    m_pool;
+    std::list<Job*> m_jobs;     ///< Only touched on the main thread
+
+    static BrowserImageEncoder* s_instance;
+
+    BrowserImageEncoder(const BrowserImageEncoder&);
+    BrowserImageEncoder& operator=(const BrowserImageEncoder&);
+};
+
+#endif /* BROWSERIMAGEENCODER_H */
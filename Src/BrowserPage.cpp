@@ -19,6 +19,7 @@ LICENSE@@@ */
 #include <sys/types.h>
 #include <sys/shm.h>
 #include <sys/time.h>
+#include <time.h>
 #include <stdlib.h>
 #include <math.h>
 #include <assert.h>
@@ -53,6 +54,7 @@ LICENSE@@@ */
 #include "BrowserPage.h"
 #include "BrowserPageManager.h"
 #include "BrowserOffscreenQt.h"
+#include "BrowserImageEncoder.h"
 #include "webosmisc.h"
 #include <BufferLock.h>
 
@@ -131,6 +133,14 @@ unsigned int BrowserPage::idGen = 0;
 
 int BrowserPage::inspectorPort = 0;
 
+// Same clock YapProxy and the client stamp input with
+static inline int64_t PrvMonotonicTimeUs()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static inline bool PrvIsEqual(double a, double b)
 {
     return (fabs(a-b) < kDoubleZeroTolerance);
@@ -286,6 +296,13 @@ BrowserPage::BrowserPage(BrowserServer* server, YapProxy* proxy)
     , m_selectionRect(QRect())
     , m_bufferLock(0)
     , m_bufferLockName(0)
+    , m_tracePending(false)
+    , m_traceFirstSeq(0)
+    , m_traceLastSeq(0)
+    , m_traceClientTime(0)
+    , m_traceDispatchStart(0)
+    , m_traceDispatchEnd(0)
+    , m_tracePaintEnd(0)
 {
     BDBG("%p", this);
     assert(proxy != NULL);
@@ -297,6 +314,8 @@ BrowserPage::BrowserPage(BrowserServer* server, YapProxy* proxy)
 
 BrowserPage::~BrowserPage()
 {
+    BrowserImageEncoder::instance()->cancel(this);
+
     if (m_driver)
         m_driver->releaseBuffers();
 
@@ -352,6 +371,40 @@ void BrowserPage::paintEvent(QPaintEvent* event)
         m_missedPaintEvent = true;
 
     QGraphicsView::paintEvent(event);
+
+    if (m_tracePending && !m_tracePaintEnd) {
+        m_tracePaintEnd = PrvMonotonicTimeUs();
+        m_server->recordInputLatency(BrowserServer::InputPaint, m_tracePaintEnd - m_traceDispatchEnd);
+    }
+}
+
+/**
+ * Called before WebKit handles an input command the client tagged with a
+ * sequence number. All input up to the latest one is reported with the next
+ * frame flushed after painting it.
+ */
+void BrowserPage::traceInput(int32_t seq, int64_t clientTimeUs, int64_t receiveTimeUs)
+{
+    int64_t now = PrvMonotonicTimeUs();
+
+    m_server->recordInputLatency(BrowserServer::InputQueueWait, now - receiveTimeUs);
+
+    if (!m_tracePending) {
+        m_tracePending    = true;
+        m_traceFirstSeq   = seq;
+        m_traceClientTime = clientTimeUs;
+    }
+
+    m_traceLastSeq       = seq;
+    m_traceDispatchStart = now;
+}
+
+void BrowserPage::traceInputDone()
+{
+    m_traceDispatchEnd = PrvMonotonicTimeUs();
+    m_tracePaintEnd    = 0;
+
+    m_server->recordInputLatency(BrowserServer::InputDispatch, m_traceDispatchEnd - m_traceDispatchStart);
 }
 
 void BrowserPage::flushBuffer(int buffer)
@@ -368,10 +421,24 @@ void BrowserPage::flushBuffer(int buffer)
         if (m_driver)
             m_driver->setBufferState(buffer, false);
 
-        m_server->msgPainted(m_proxy, buffer == 0 ? m_offscreen0->key() : m_offscreen1->key());
+        int key = buffer == 0 ? m_offscreen0->key() : m_offscreen1->key();
+        m_server->msgPainted(m_proxy, key);
+
+        if (m_tracePending && m_tracePaintEnd) {
+            int64_t now = PrvMonotonicTimeUs();
+
+            m_server->recordInputLatency(BrowserServer::InputBufferWait, now - m_tracePaintEnd);
+            m_server->recordInputLatency(BrowserServer::InputTotal, now - m_traceClientTime);
+            m_server->msgInputPainted(m_proxy, key, m_traceFirstSeq, m_traceLastSeq, now);
+
+            m_tracePending = false;
+        }
 
         if (m_bufferLock) {
 
+            // Don't block on the buffer lock with the Painted message still queued
+            m_proxy->flushMessages();
+
             if (sem_wait(m_bufferLock) == 0) {
 
                 if (buffer == 0) {
@@ -559,6 +626,34 @@ BrowserPage::renderToFile(const char* filename, int32_t viewX, int32_t viewY, in
     return 0;
 }
 
+/**
+ * Like renderToFile() but only the rendering happens here, the image is encoded
+ * and written by BrowserImageEncoder. The client gets RenderToFileResponse.
+ */
+void
+BrowserPage::renderToFileAsync(int32_t queryNum, const char* filename, int32_t viewX, int32_t viewY, int32_t viewW, int32_t viewH,
+                               const char* format, int32_t quality)
+{
+    if (viewW <= 0 || viewH <= 0) {
+        m_server->msgRenderToFileResponse(m_proxy, queryNum, filename, EINVAL);
+        return;
+    }
+
+    QImage out(viewW, viewH, QImage::Format_ARGB32_Premultiplied);
+    {
+        QPainter painter(&out);
+        m_graphicsView->render(&painter, QRect(viewX, viewY, viewW, viewH), QRect(viewX, viewY, viewW, viewH));
+    }
+
+    BrowserImageEncoder::instance()->encode(this, queryNum, out, filename, format, quality);
+}
+
+void
+BrowserPage::renderToFileDone(int32_t queryNum, const char* filename, int result)
+{
+    m_server->msgRenderToFileResponse(m_proxy, queryNum, filename, result);
+}
+
 /**
  * @brief Called when BA is ready to be paired with a BrowserPage and to 
  * display a new _target page
@@ -861,6 +956,23 @@ BrowserPage::setHTML( const char* url, const char* body )
 
 }
 
+/**
+ * Like setHTML() for a body that isn't NUL terminated, e.g. a YapBulk. The body
+ * is decoded into the page straight from there.
+ */
+void
+BrowserPage::setHTML( const char* url, const char* body, int bodyLen )
+{
+    BDBG("setHTML");
+
+    if (!m_webPage) {
+        BERR("No page created");
+        return;
+    }
+
+    m_webPage->mainFrame()->setHtml(QString::fromLatin1(body, bodyLen), QUrl(url));
+}
+
 void
 BrowserPage::setShowClickedLink(bool enable)
 {
@@ -1784,6 +1896,9 @@ BrowserPage::dialogAlert(const char* inMsg)
 
     m_server->msgDialogAlert(m_proxy, m_syncReplyPipe->pipePath(), inMsg);
 
+    // The dialog message must reach the client before we block on its reply
+    m_proxy->flushMessages();
+
     GPtrArray* replyArray;
     if (!m_syncReplyPipe->getReply(&replyArray, m_proxy->commandSocketFd()))
         return false;
@@ -1806,6 +1921,8 @@ BrowserPage::dialogConfirm(const char* inMsg)
 
     m_server->msgDialogConfirm(m_proxy, m_syncReplyPipe->pipePath(), inMsg);    
 
+    m_proxy->flushMessages();
+
     GPtrArray* replyArray;
     if (!m_syncReplyPipe->getReply(&replyArray, m_proxy->commandSocketFd()))
         return false;
@@ -1830,6 +1947,8 @@ BrowserPage::dialogPrompt(const char* inMsg, const char* defaultValue, std::stri
 
     m_server->msgDialogPrompt(m_proxy, m_syncReplyPipe->pipePath(), inMsg, defaultValue);    
 
+    m_proxy->flushMessages();
+
     GPtrArray* replyArray;
     if (!m_syncReplyPipe->getReply(&replyArray, m_proxy->commandSocketFd()))
         return false;
@@ -1864,6 +1983,8 @@ BrowserPage::dialogUserPassword(const char* inMsg, std::string& userName, std::s
 
     m_server->msgDialogUserPassword(m_proxy, m_syncReplyPipe->pipePath(), inMsg);
 
+    m_proxy->flushMessages();
+
     GPtrArray* replyArray(NULL);
     if (!m_syncReplyPipe->getReply(&replyArray, m_proxy->commandSocketFd()) || replyArray == NULL)
         return false;
@@ -1951,6 +2072,8 @@ BrowserPage::dialogSSLConfirm(SSLValidationInfo& sslInfo)
 
     g_debug("BrowserServer [bpage = %u]: (ssl) sent up the dialog",bpageId);
 
+    m_proxy->flushMessages();
+
     GPtrArray* replyArray;
     if (!m_syncReplyPipe->getReply(&replyArray, m_proxy->commandSocketFd())) {
         g_warning("BrowserServer [bpage = %u]: (ssl) returned from dialog - reply error",bpageId);
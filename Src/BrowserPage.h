@@ -111,6 +111,7 @@ public:
     void openUrl(const char* pUrl);
 
     void setHTML( const char* url, const char* body );
+    void setHTML( const char* url, const char* body, int bodyLen );
     void setIgnoreMetaRefreshTags(bool ignore);
     void setIgnoreMetaViewport(bool ignore);
     void setNetworkInterface(const char* interfaceName);
@@ -132,6 +133,13 @@ public:
 
     int renderToFile(const char* filename, int32_t viewX, int32_t viewY, int32_t viewW, int32_t viewH);
 
+    void renderToFileAsync(int32_t queryNum, const char* filename, int32_t viewX, int32_t viewY, int32_t viewW, int32_t viewH,
+                           const char* format, int32_t quality);
+    void renderToFileDone(int32_t queryNum, const char* filename, int result);
+
+    void traceInput(int32_t seq, int64_t clientTimeUs, int64_t receiveTimeUs);
+    void traceInputDone();
+
     void setScrollPosition(int cx, int cy, int cw, int ch);
 
     void getVirtualWindowSize(int& width, int& height);
@@ -451,6 +459,7 @@ private:
 #endif //USE_LUNA_SERVICE
 
     static void flush(void *context, int key);
+
     void loadSelectionMarkers();
     void hideSelectionMarkers();
 
@@ -470,6 +479,15 @@ private:
     sem_t* m_bufferLock;
     char* m_bufferLockName;
 
+    // Traced input not yet in a flushed frame, see traceInput()
+    bool    m_tracePending;
+    int32_t m_traceFirstSeq;
+    int32_t m_traceLastSeq;
+    int64_t m_traceClientTime;    ///< Client timestamp of m_traceFirstSeq
+    int64_t m_traceDispatchStart;
+    int64_t m_traceDispatchEnd;   ///< Of the latest traced command
+    int64_t m_tracePaintEnd;      ///< 0 until painted after m_traceDispatchEnd
+
 };
 
 #endif /* BROWSERPAGE_H */
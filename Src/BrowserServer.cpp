@@ -22,10 +22,14 @@ LICENSE@@@ */
 #include <errno.h>
 #include <syslog.h>
 #include <fstream>
+#include <string.h>
 #include <strings.h>
 #include <time.h>
 #include <assert.h>
 #include <malloc.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include <pbnjson.hpp>
 #include <qpersistentcookiejar.h>
@@ -37,6 +41,8 @@ LICENSE@@@ */
 
 #include "YapProxy.h"
 #include "YapPacket.h"
+#include "YapBulk.h"
+#include "IpcBuffer.h"
 
 #ifdef USE_LUNA_SERVICE
 #include "lunaservice.h"
@@ -64,6 +70,17 @@ static bool  __attribute__((unused)) gHeapProfilerOn = false;
 
 static const int kTimerSecs = 15;
 
+// Commands folded together when newer ones are already waiting, values from
+// BrowserYapCommandMessages.defs
+static const int16_t kCmdDragProcess  = 0x101B;
+static const int16_t kCmdMouseEvent   = 0x110C;
+static const int16_t kCmdGestureEvent = 0x110D;
+static const int16_t kCmdTouchEvent   = 0x1508;
+
+static const int32_t kMouseMove     = 2; // as handled by BrowserPage::mouseEvent
+static const int32_t kGestureChange = 1; // Palm::GestureEventType
+static const int32_t kTouchMove     = 1; // Palm::TouchEventType
+
 #ifdef USE_LUNA_SERVICE
 // Luna Service 
 
@@ -71,6 +88,8 @@ static LSMethod s_serviceMethods[] = {
     { "deleteImage",  BrowserServer::serviceCmdDeleteImage  },
     { "clearCache",   BrowserServer::serviceCmdClearCache   },
     { "clearCookies", BrowserServer::serviceCmdClearCookies },
+    { "inputLatency", BrowserServer::serviceCmdInputLatency },
+    { "commandStats", BrowserServer::serviceCmdCommandStats },
 #ifdef USE_HEAP_PROFILER
     { "dumpHeapProfile", BrowserServer::serviceCmdDumpHeapProfiler },
 #endif
@@ -319,6 +338,24 @@ BrowserServer::asyncCmdConnect(YapProxy* proxy, int32_t pageWidth, int32_t pageH
     BrowserPageManager::instance()->raisePagePriority(pPage);
 }
 
+/**
+ * Connect with buffers the client created with IpcBuffer::createMemFd(). They
+ * are attached by their keys as usual once their descriptors are adopted.
+ */
+void
+BrowserServer::asyncCmdConnectMemFd(YapProxy* proxy, int32_t pageWidth, int32_t pageHeight,
+                                    int32_t sharedBufferBulkId1, int32_t sharedBufferBulkId2,
+                                    int32_t sharedBufferSize, int32_t identifier)
+{
+    int key1 = IpcBuffer::adoptFd(proxy->receiveBulkFd(sharedBufferBulkId1));
+    int key2 = IpcBuffer::adoptFd(proxy->receiveBulkFd(sharedBufferBulkId2));
+
+    asyncCmdConnect(proxy, pageWidth, pageHeight, key1, key2, sharedBufferSize, identifier);
+
+    IpcBuffer::dropAdoptedFd(key1);
+    IpcBuffer::dropAdoptedFd(key2);
+}
+
 void BrowserServer::asyncCmdDisconnect(YapProxy *proxy)
 {
     proxy->setTerminate();
@@ -405,6 +442,26 @@ BrowserServer::asyncCmdSetHtml(YapProxy* proxy, const char* url, const char* bod
     pPage->setHTML(url, body);
 }
 
+void
+BrowserServer::asyncCmdSetHtmlBulk(YapProxy* proxy, const char* url, int32_t bodyBulkId)
+{
+    BrowserPage* pPage = static_cast<BrowserPage*>(proxy->privateData());
+    if (!pPage) {
+        BERR("No page for this client.");
+        return;
+    }
+
+    YapBulk* bulk = proxy->receiveBulk(bodyBulkId);
+    if (!url || !bulk) {
+        BERR("No body for %s", url ? url : "(null)");
+        delete bulk;
+        return;
+    }
+
+    pPage->setHTML(url, (const char*) bulk->data(), bulk->length());
+    delete bulk;
+}
+
 void
 BrowserServer::asyncCmdClickAt(YapProxy* proxy, int32_t contentX, int32_t contentY, int32_t numClicks, int32_t counter)
 {
@@ -574,6 +631,33 @@ bool BrowserServer::showComboBoxPopup(int id, const char* fileName)
     return true;
 }
 
+/**
+ * Pass the popup menu JSON along as a YapBulk instead of a file in /tmp.
+ *
+ * @return false if the client can't take it that way.
+ */
+bool BrowserServer::showComboBoxPopupData(int id, const char* data, int len)
+{
+    BrowserPage* page = BrowserPageManager::instance()->focusedPage();
+    if (!page)
+        return false;
+
+    YapBulk* bulk = YapBulk::create(data, len);
+    if (!bulk)
+        return false;
+
+    uint32_t bulkId = page->getProxy()->sendBulk(bulk);
+    delete bulk;
+
+    if (!bulkId)
+        return false;
+
+    char idStr[20];
+    ::snprintf(idStr, 20, "%d", id);
+    msgPopupMenuShowBulk(page->getProxy(), idStr, bulkId);
+    return true;
+}
+
 void BrowserServer::hideComboBoxPopup(int id)
 {
     BrowserPage* page = BrowserPageManager::instance()->focusedPage();
@@ -632,6 +716,228 @@ void BrowserServer::asyncCmdDragStart(YapProxy* proxy, int32_t contentX, int32_t
     BrowserPageManager::instance()->raisePagePriority(pPage);
 }
 
+/**
+ * Drags, mouse moves, gesture changes and touch moves can be folded into a newer
+ * one of the same kind.
+ */
+bool BrowserServer::canCoalesce(YapPacket* cmd)
+{
+    int16_t cmdValue = 0;
+    int32_t type = 0;
+
+    (*cmd) >> cmdValue;
+
+    const AsyncCommandInfo* info = asyncCommandInfo(cmdValue);
+    if (!info || !info->coalesce)
+        return false;
+
+    switch (cmdValue) {
+    case kCmdDragProcess:
+        return true;
+    case kCmdMouseEvent:
+        (*cmd) >> type;
+        return type == kMouseMove;
+    case kCmdGestureEvent:
+        (*cmd) >> type;
+        return type == kGestureChange;
+    case kCmdTouchEvent:
+        (*cmd) >> type;
+        return type == kTouchMove;
+    default:
+        return false;
+    }
+}
+
+/**
+ * A merged input command reports the newest sequence number, so the client
+ * sees all of the folded in ones as painted with it. Only some of the commands
+ * may be traced, so the held one's trace is kept if the next one has none.
+ * Both packets have to be read up to the trace.
+ */
+static void copyTrace(YapPacket* held, YapPacket* next, YapPacket* merged)
+{
+    YapPacket* traced = next->hasMore() ? next : held;
+    if (!traced->hasMore())
+        return;
+
+    int32_t seq = 0;
+    int64_t timeUs = 0;
+    (*traced) >> seq;
+    (*traced) >> timeUs;
+
+    (*merged) << seq;
+    (*merged) << timeUs;
+}
+
+/**
+ * Drag deltas add up, everything else only needs the latest position.
+ */
+bool BrowserServer::coalesceCommands(YapPacket* held, YapPacket* next, YapPacket* merged)
+{
+    int16_t cmdValue = 0;
+    int16_t nextCmdValue = 0;
+
+    (*held) >> cmdValue;
+    (*next) >> nextCmdValue;
+
+    if (cmdValue != nextCmdValue)
+        return false;
+
+    if (cmdValue == kCmdDragProcess) {
+        int32_t deltaX = 0, deltaY = 0, nextDeltaX = 0, nextDeltaY = 0;
+
+        (*held) >> deltaX;
+        (*held) >> deltaY;
+        (*next) >> nextDeltaX;
+        (*next) >> nextDeltaY;
+
+        (*merged) << cmdValue;
+        (*merged) << (int32_t) (deltaX + nextDeltaX);
+        (*merged) << (int32_t) (deltaY + nextDeltaY);
+        copyTrace(held, next, merged);
+        return true;
+    }
+
+    int32_t type = 0;
+    (*next) >> type;
+
+    switch (cmdValue) {
+    case kCmdMouseEvent: {
+        if (type != kMouseMove)
+            return false;
+
+        int32_t heldType = 0, contentX = 0, contentY = 0, detail = 0;
+        (*held) >> heldType;
+        (*held) >> contentX;
+        (*held) >> contentY;
+        (*held) >> detail;
+
+        (*next) >> contentX;
+        (*next) >> contentY;
+        (*next) >> detail;
+
+        (*merged) << cmdValue;
+        (*merged) << type;
+        (*merged) << contentX;
+        (*merged) << contentY;
+        (*merged) << detail;
+        copyTrace(held, next, merged);
+        return true;
+    }
+    case kCmdGestureEvent: {
+        if (type != kGestureChange)
+            return false;
+
+        int32_t contentX = 0, contentY = 0, centerX = 0, centerY = 0;
+        double scale = 0, rotate = 0;
+        int32_t heldType = 0;
+        (*held) >> heldType;
+        (*held) >> contentX;
+        (*held) >> contentY;
+        (*held) >> scale;
+        (*held) >> rotate;
+        (*held) >> centerX;
+        (*held) >> centerY;
+
+        (*next) >> contentX;
+        (*next) >> contentY;
+        (*next) >> scale;
+        (*next) >> rotate;
+        (*next) >> centerX;
+        (*next) >> centerY;
+
+        (*merged) << cmdValue;
+        (*merged) << type;
+        (*merged) << contentX;
+        (*merged) << contentY;
+        (*merged) << scale;
+        (*merged) << rotate;
+        (*merged) << centerX;
+        (*merged) << centerY;
+        copyTrace(held, next, merged);
+        return true;
+    }
+    case kCmdTouchEvent: {
+        int32_t heldType = 0, heldTouchCount = 0, heldModifiers = 0;
+        const char* heldTouchesJson = 0;
+        (*held) >> heldType;
+        (*held) >> heldTouchCount;
+        (*held) >> heldModifiers;
+        (*held) >> heldTouchesJson;
+
+        int32_t touchCount = 0, modifiers = 0;
+        const char* touchesJson = 0;
+        (*next) >> touchCount;
+        (*next) >> modifiers;
+        (*next) >> touchesJson;
+
+        // A finger added or lifted has to be seen
+        if (type != kTouchMove || touchCount != heldTouchCount)
+            return false;
+
+        (*merged) << cmdValue;
+        (*merged) << type;
+        (*merged) << touchCount;
+        (*merged) << modifiers;
+        (*merged) << touchesJson;
+        copyTrace(held, next, merged);
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+void BrowserServer::traceInput(YapProxy* proxy, int32_t seq, int64_t clientTimeUs)
+{
+    BrowserPage* pPage = static_cast<BrowserPage*>(proxy->privateData());
+    if (pPage)
+        pPage->traceInput(seq, clientTimeUs, proxy->commandReceiveTime());
+}
+
+void BrowserServer::traceInputDone(YapProxy* proxy)
+{
+    BrowserPage* pPage = static_cast<BrowserPage*>(proxy->privateData());
+    if (pPage)
+        pPage->traceInputDone();
+}
+
+void BrowserServer::recordInputLatency(InputLatencyStage stage, int64_t us)
+{
+    m_inputLatency[stage].record(us);
+}
+
+/**
+ * Write the per command counters to a text file, see YapCommandStats::dump().
+ * The file is only readable by this user, and a symlink in its place is not
+ * followed.
+ */
+void BrowserServer::dumpCommandStats(const char* path)
+{
+    int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        g_warning("Failed to open %s: %s", path, strerror(errno));
+        return;
+    }
+
+    FILE* f = ::fdopen(fd, "w");
+    if (!f) {
+        g_warning("Failed to open %s: %s", path, strerror(errno));
+        ::close(fd);
+        return;
+    }
+
+    int count = 0;
+    const YapCommandStats* stats = asyncCommandStats(count);
+    YapCommandStats::dump(f, "Async commands", stats, count);
+
+    stats = messageStats(count);
+    fprintf(f, "\n");
+    YapCommandStats::dump(f, "Messages", stats, count);
+
+    fclose(f);
+}
+
 void BrowserServer::asyncCmdDragProcess(YapProxy* proxy, int32_t deltaX, int32_t deltaY)
 {
     BrowserPage* pPage = static_cast<BrowserPage*>(proxy->privateData());
@@ -862,6 +1168,17 @@ void BrowserServer::asyncCmdThaw(YapProxy* proxy, int32_t sharedBufferKey1, int3
     pPage->thaw(sharedBufferKey1, sharedBufferKey2, sharedBufferSize); 
 }
 
+void BrowserServer::asyncCmdThawMemFd(YapProxy* proxy, int32_t sharedBufferBulkId1, int32_t sharedBufferBulkId2, int32_t sharedBufferSize)
+{
+    int key1 = IpcBuffer::adoptFd(proxy->receiveBulkFd(sharedBufferBulkId1));
+    int key2 = IpcBuffer::adoptFd(proxy->receiveBulkFd(sharedBufferBulkId2));
+
+    asyncCmdThaw(proxy, key1, key2, sharedBufferSize);
+
+    IpcBuffer::dropAdoptedFd(key1);
+    IpcBuffer::dropAdoptedFd(key2);
+}
+
 void BrowserServer::asyncCmdReturnBuffer(YapProxy* proxy, int32_t sharedBufferKey)
 {
     BrowserPage* pPage = static_cast<BrowserPage*>(proxy->privateData());
@@ -928,6 +1245,18 @@ void BrowserServer::syncCmdRenderToFile(YapProxy* proxy, const char* filename, i
     result = pPage->renderToFile(filename, viewX, viewY, viewW, viewH);
 }
 
+void BrowserServer::asyncCmdRenderToFileAsync(YapProxy* proxy, int32_t queryNum, const char* filename, int32_t viewX, int32_t viewY, int32_t viewW, int32_t viewH, const char* format, int32_t quality)
+{
+    BrowserPage* pPage = static_cast<BrowserPage*>(proxy->privateData());
+    if (!pPage) {
+        BERR("No page for this client.");
+        msgRenderToFileResponse(proxy, queryNum, filename, EINVAL);
+        return;
+    }
+
+    pPage->renderToFileAsync(queryNum, filename, viewX, viewY, viewW, viewH, format, quality);
+}
+
 void BrowserServer::asyncCmdGetHistoryState(YapProxy* proxy, int32_t queryNum)
 {
     BrowserPage* pPage = static_cast<BrowserPage*>(proxy->privateData());
@@ -1620,6 +1949,123 @@ BrowserServer::serviceCmdClearCookies(LSHandle *lsHandle, LSMessage *message, vo
 
     return true;
 }
+
+/**
+ * {"count":n, "meanUs":n, "maxUs":n, "buckets":[{"belowUs":n, "count":n}, ...]}
+ * with empty buckets left out.
+ */
+static pbnjson::JValue latencyToJValue(const LatencyHistogram& histogram)
+{
+    pbnjson::JValue result = pbnjson::Object();
+    pbnjson::JValue buckets = pbnjson::Array();
+
+    for (int i = 0; i < LatencyHistogram::kBucketCount; i++) {
+        if (!histogram.bucket(i))
+            continue;
+
+        pbnjson::JValue bucket = pbnjson::Object();
+        if (i < LatencyHistogram::kBucketCount - 1)
+            bucket.put("belowUs", (int64_t) 1 << i);
+        bucket.put("count", (int64_t) histogram.bucket(i));
+        buckets.append(bucket);
+    }
+
+    result.put("count", (int64_t) histogram.count());
+    result.put("meanUs", histogram.meanUs());
+    result.put("maxUs", histogram.maxUs());
+    result.put("buckets", buckets);
+
+    return result;
+}
+
+/**
+ * Histograms of traced input latency, cleared with {"reset":true}.
+ */
+bool
+BrowserServer::serviceCmdInputLatency(LSHandle *lsHandle, LSMessage *message, void *ctx)
+{
+    static const char* const stageNames[InputLatencyStageCount] = {
+        "queueWait", "dispatch", "paint", "bufferWait", "total"
+    };
+
+    pbnjson::JValue args;
+    (void) lsMessageToJValue(args, message);
+
+    pbnjson::JValue response = pbnjson::Object();
+    response.put("returnValue", true);
+
+    bool reset = args.isObject() && args["reset"].isBoolean() && args["reset"].asBool();
+
+    BrowserServer* server = instance();
+    for (int i = 0; i < InputLatencyStageCount; i++) {
+        response.put(stageNames[i], latencyToJValue(server->m_inputLatency[i]));
+        if (reset)
+            server->m_inputLatency[i].reset();
+    }
+
+    LSError lsError;
+    LSErrorInit(&lsError);
+
+    std::string responseStr;
+    if (!jValueToJsonString(responseStr, response))
+        responseStr = k_pszSimpleJsonFailureResponse;
+
+    if (!LSMessageReply(lsHandle, message, responseStr.c_str(), &lsError)) {
+        LSErrorFree(&lsError);
+    }
+
+    return true;
+}
+
+static pbnjson::JValue commandStatsToJValue(const YapCommandStats* stats, int count)
+{
+    pbnjson::JValue result = pbnjson::Array();
+
+    for (int i = 0; i < count; i++) {
+        const YapCommandStats& s = stats[i];
+        if (!s.latency.count())
+            continue;
+
+        pbnjson::JValue entry = latencyToJValue(s.latency);
+        entry.put("name", s.name);
+        entry.put("bytes", (int64_t) s.bytes);
+        result.append(entry);
+    }
+
+    return result;
+}
+
+bool
+BrowserServer::serviceCmdCommandStats(LSHandle *lsHandle, LSMessage *message, void *ctx)
+{
+    pbnjson::JValue args;
+    (void) lsMessageToJValue(args, message);
+
+    pbnjson::JValue response = pbnjson::Object();
+    response.put("returnValue", true);
+
+    int count = 0;
+    const YapCommandStats* stats = asyncCommandStats(count);
+    response.put("commands", commandStatsToJValue(stats, count));
+    stats = messageStats(count);
+    response.put("messages", commandStatsToJValue(stats, count));
+
+    if (args.isObject() && args["reset"].isBoolean() && args["reset"].asBool())
+        resetCommandStats();
+
+    LSError lsError;
+    LSErrorInit(&lsError);
+
+    std::string responseStr;
+    if (!jValueToJsonString(responseStr, response))
+        responseStr = k_pszSimpleJsonFailureResponse;
+
+    if (!LSMessageReply(lsHandle, message, responseStr.c_str(), &lsError)) {
+        LSErrorFree(&lsError);
+    }
+
+    return true;
+}
 #ifdef USE_HEAP_PROFILER
 
 bool
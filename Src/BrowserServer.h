@@ -28,6 +28,7 @@ LICENSE@@@ */
 #endif //USE_LUNA_SERVICE
 #include <QtCore/QString>
 #include "BrowserComboBox.h"
+#include "LatencyHistogram.h"
 
 #include <glib.h>  // memchute doesn't include it currently
 
@@ -59,6 +60,23 @@ public:
 
     virtual void clientConnected(YapProxy* proxy);
     virtual void clientDisconnected(YapProxy* proxy);
+    virtual bool canCoalesce(YapPacket* cmd);
+    virtual bool coalesceCommands(YapPacket* held, YapPacket* next, YapPacket* merged);
+    virtual void traceInput(YapProxy* proxy, int32_t seq, int64_t clientTimeUs);
+    virtual void traceInputDone(YapProxy* proxy);
+
+    // Stages of traced input from the client to the flushed frame
+    enum InputLatencyStage {
+        InputQueueWait = 0, ///< Received until WebKit gets it
+        InputDispatch,      ///< Handled by WebKit
+        InputPaint,         ///< Until the page has painted
+        InputBufferWait,    ///< Until the buffer has been flushed
+        InputTotal,         ///< From the client's timestamp to the flush
+        InputLatencyStageCount
+    };
+
+    void recordInputLatency(InputLatencyStage stage, int64_t us);
+    static void dumpCommandStats(const char* path);
 
     QNetworkAccessManager *networkAccessManager() { return m_networkAccessManager; }
 
@@ -67,6 +85,8 @@ public:
     static bool serviceCmdDeleteImage(LSHandle *lsHandle, LSMessage *message, void *ctx);
     static bool serviceCmdClearCache(LSHandle *lsHandle, LSMessage *message, void *ctx);
     static bool serviceCmdClearCookies(LSHandle *lsHandle, LSMessage *message, void *ctx);
+    static bool serviceCmdInputLatency(LSHandle *lsHandle, LSMessage *message, void *ctx);
+    static bool serviceCmdCommandStats(LSHandle *lsHandle, LSMessage *message, void *ctx);
 #ifdef USE_HEAP_PROFILER
     static bool serviceCmdDumpHeapProfiler(LSHandle* lsHandle, LSMessage *message, void *ctx);
 #endif
@@ -132,6 +152,8 @@ private:
 
     BrowserComboBoxList m_comboBoxes;
 
+    LatencyHistogram m_inputLatency[InputLatencyStageCount];
+
     void registerForConnectionManager();
 
 #ifdef USE_LUNA_SERVICE
@@ -141,11 +163,13 @@ private:
 
     // Async Commands
     virtual void asyncCmdConnect(YapProxy* proxy, int32_t pageWidth, int32_t pageHeight, int32_t sharedBufferKey1, int32_t sharedBufferKey2, int32_t sharedBufferSize, int32_t identifier);
+    virtual void asyncCmdConnectMemFd(YapProxy* proxy, int32_t pageWidth, int32_t pageHeight, int32_t sharedBufferBulkId1, int32_t sharedBufferBulkId2, int32_t sharedBufferSize, int32_t identifier);
     virtual void asyncCmdSetWindowSize(YapProxy* proxy, int32_t width, int32_t height);
     virtual void asyncCmdSetVirtualWindowSize(YapProxy* proxy, int32_t width, int32_t height);
     virtual void asyncCmdSetUserAgent(YapProxy* proxy, const char* userAgent);
     virtual void asyncCmdOpenUrl(YapProxy* proxy, const char* url);
     virtual void asyncCmdSetHtml(YapProxy* proxy, const char* url, const char* body);
+    virtual void asyncCmdSetHtmlBulk(YapProxy* proxy, const char* url, int32_t bodyBulkId);
     virtual void asyncCmdClickAt(YapProxy* proxy, int32_t contentX, int32_t contentY, int32_t numClicks, int32_t counter);
     virtual void asyncCmdHoldAt(YapProxy* proxy, int32_t contentX, int32_t contentY);
     virtual void asyncCmdKeyDown(YapProxy* proxy, int32_t key, int32_t modifiers, int32_t chr);
@@ -211,13 +235,16 @@ private:
     virtual void asyncCmdGetTextCaretBounds(YapProxy* proxy, int32_t queryNum);
     virtual void asyncCmdFreeze(YapProxy* proxy);
     virtual void asyncCmdThaw(YapProxy* proxy, int32_t sharedBufferKey1, int32_t sharedBufferKey2, int32_t sharedBufferSize);
+    virtual void asyncCmdThawMemFd(YapProxy* proxy, int32_t sharedBufferBulkId1, int32_t sharedBufferBulkId2, int32_t sharedBufferSize);
     virtual void asyncCmdReturnBuffer(YapProxy* proxy, int32_t sharedBufferKey);
     virtual void asyncCmdSetZoomAndScroll(YapProxy* proxy, double zoom, int32_t cx, int32_t cy);
     virtual void asyncCmdScrollLayer(YapProxy* proxy, int32_t id, int32_t deltaX, int32_t deltaY);
     virtual void asyncCmdSetDNSServers(YapProxy* proxy, const char* servers);
+    virtual void asyncCmdRenderToFileAsync(YapProxy* proxy, int32_t queryNum, const char* filename, int32_t viewX, int32_t viewY, int32_t viewW, int32_t viewH, const char* format, int32_t quality);
 
     void initPlatformPlugin();
     virtual bool showComboBoxPopup(int id, const char* fileName);
+    virtual bool showComboBoxPopupData(int id, const char* data, int len);
     virtual void hideComboBoxPopup(int id);
     void clearCache();
 };
@@ -22,6 +22,9 @@ LICENSE@@@ */
 #include <stdio.h>
 #include <BrowserServerBase.h>
 
+static const int kAsyncCmdRangeStart = 0x1000;
+static const int kAsyncCmdRangeLen   = 0x1000;
+
 void BrowserServerBase::handleSyncCommand(YapProxy* proxy, YapPacket* cmd, YapPacket* reply)
 {
 	int16_t cmdValue;
@@ -31,7 +34,7 @@ void BrowserServerBase::handleSyncCommand(YapProxy* proxy, YapPacket* cmd, YapPa
 	switch (cmdValue) {
 	case 0x0014: { // RenderToFile
 		
-		char* filename = 0;
+		const char* filename = 0;
 		int32_t viewX = 0;
 		int32_t viewY = 0;
 		int32_t viewW = 0;
@@ -49,8 +52,6 @@ void BrowserServerBase::handleSyncCommand(YapProxy* proxy, YapPacket* cmd, YapPa
 		
 		(*reply) << result;
 		
-		if (filename) free(filename);
-		
 		break;
 	}
 	default:
@@ -58,382 +59,458 @@ void BrowserServerBase::handleSyncCommand(YapProxy* proxy, YapPacket* cmd, YapPa
 	}
 }
 
-void BrowserServerBase::handleAsyncCommand(YapProxy* proxy, YapPacket* cmd)
+struct BrowserServerBase::AsyncDecoders
 {
-	int16_t cmdValue;
-
-	(*cmd) >> cmdValue;
-
-	switch (cmdValue) {
-	case 0x1000: { // Connect
-		
+	static void Connect(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t pageWidth = 0;
 		int32_t pageHeight = 0;
 		int32_t sharedBufferKey1 = 0;
 		int32_t sharedBufferKey2 = 0;
 		int32_t sharedBufferSize = 0;
 		int32_t identifier = 0;
-		
-		(*cmd) >> pageWidth;
-		(*cmd) >> pageHeight;
-		(*cmd) >> sharedBufferKey1;
-		(*cmd) >> sharedBufferKey2;
-		(*cmd) >> sharedBufferSize;
-		(*cmd) >> identifier;
-		
-		asyncCmdConnect(proxy, pageWidth, pageHeight, sharedBufferKey1, sharedBufferKey2, sharedBufferSize, identifier);
-		
-		
-		break;
-	}
-	case 0x1001: { // SetWindowSize
-		
+
+		AsyncCmdConnectArgs _args;
+		if (cmd->readBlock(&_args, sizeof(_args))) {
+			pageWidth = _args.pageWidth;
+			pageHeight = _args.pageHeight;
+			sharedBufferKey1 = _args.sharedBufferKey1;
+			sharedBufferKey2 = _args.sharedBufferKey2;
+			sharedBufferSize = _args.sharedBufferSize;
+			identifier = _args.identifier;
+		}
+		else {
+			(*cmd) >> pageWidth;
+			(*cmd) >> pageHeight;
+			(*cmd) >> sharedBufferKey1;
+			(*cmd) >> sharedBufferKey2;
+			(*cmd) >> sharedBufferSize;
+			(*cmd) >> identifier;
+		}
+
+		server->asyncCmdConnect(proxy, pageWidth, pageHeight, sharedBufferKey1, sharedBufferKey2, sharedBufferSize, identifier);
+	}
+
+	static void SetWindowSize(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t width = 0;
 		int32_t height = 0;
-		
-		(*cmd) >> width;
-		(*cmd) >> height;
-		
-		asyncCmdSetWindowSize(proxy, width, height);
-		
-		
-		break;
+
+		AsyncCmdSetWindowSizeArgs _args;
+		if (cmd->readBlock(&_args, sizeof(_args))) {
+			width = _args.width;
+			height = _args.height;
+		}
+		else {
+			(*cmd) >> width;
+			(*cmd) >> height;
+		}
+
+		server->asyncCmdSetWindowSize(proxy, width, height);
 	}
-	case 0x1003: { // SetUserAgent
-		
-		char* userAgent = 0;
-		
+
+	static void SetUserAgent(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		const char* userAgent = 0;
+
 		(*cmd) >> userAgent;
-		
-		asyncCmdSetUserAgent(proxy, userAgent);
-		
-		if (userAgent) free(userAgent);
-		
-		break;
+
+		server->asyncCmdSetUserAgent(proxy, userAgent);
 	}
-	case 0x1004: { // OpenUrl
-		
-		char* url = 0;
-		
+
+	static void OpenUrl(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		const char* url = 0;
+
 		(*cmd) >> url;
-		
-		asyncCmdOpenUrl(proxy, url);
-		
-		if (url) free(url);
-		
-		break;
+
+		server->asyncCmdOpenUrl(proxy, url);
 	}
-	case 0x1005: { // SetHtml
-		
-		char* url = 0;
-		char* body = 0;
-		
+
+	static void SetHtml(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		const char* url = 0;
+		const char* body = 0;
+
 		(*cmd) >> url;
 		(*cmd) >> body;
-		
-		asyncCmdSetHtml(proxy, url, body);
-		
-		if (url) free(url);
-		if (body) free(body);
-		
-		break;
+
+		server->asyncCmdSetHtml(proxy, url, body);
 	}
-	case 0x1007: { // ClickAt
-		
+
+	static void ClickAt(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t contentX = 0;
 		int32_t contentY = 0;
 		int32_t numClicks = 0;
 		int32_t counter = 0;
-		
-		(*cmd) >> contentX;
-		(*cmd) >> contentY;
-		(*cmd) >> numClicks;
-		(*cmd) >> counter;
-		
-		asyncCmdClickAt(proxy, contentX, contentY, numClicks, counter);
-		
-		
-		break;
-	}
-	case 0x1008: { // KeyDown
-		
+
+		AsyncCmdClickAtArgs _args;
+		if (cmd->readBlock(&_args, sizeof(_args))) {
+			contentX = _args.contentX;
+			contentY = _args.contentY;
+			numClicks = _args.numClicks;
+			counter = _args.counter;
+		}
+		else {
+			(*cmd) >> contentX;
+			(*cmd) >> contentY;
+			(*cmd) >> numClicks;
+			(*cmd) >> counter;
+		}
+
+		int32_t _traceSeq = 0;
+		int64_t _traceTimeUs = 0;
+		bool _traced = cmd->hasMore();
+		if (_traced) {
+			(*cmd) >> _traceSeq;
+			(*cmd) >> _traceTimeUs;
+			server->traceInput(proxy, _traceSeq, _traceTimeUs);
+		}
+
+		server->asyncCmdClickAt(proxy, contentX, contentY, numClicks, counter);
+
+		if (_traced)
+			server->traceInputDone(proxy);
+	}
+
+	static void KeyDown(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t key = 0;
 		int32_t modifiers = 0;
-      int32_t chr = 0;
-		
-		(*cmd) >> key;
-		(*cmd) >> modifiers;
-		(*cmd) >> chr;
-		
-		asyncCmdKeyDown(proxy, key, modifiers, chr);
-		
-		
-		break;
-	}
-	case 0x1009: { // KeyUp
-		
+		int32_t chr = 0;
+
+		AsyncCmdKeyDownArgs _args;
+		if (cmd->readBlock(&_args, sizeof(_args))) {
+			key = _args.key;
+			modifiers = _args.modifiers;
+			chr = _args.chr;
+		}
+		else {
+			(*cmd) >> key;
+			(*cmd) >> modifiers;
+			(*cmd) >> chr;
+		}
+
+		int32_t _traceSeq = 0;
+		int64_t _traceTimeUs = 0;
+		bool _traced = cmd->hasMore();
+		if (_traced) {
+			(*cmd) >> _traceSeq;
+			(*cmd) >> _traceTimeUs;
+			server->traceInput(proxy, _traceSeq, _traceTimeUs);
+		}
+
+		server->asyncCmdKeyDown(proxy, key, modifiers, chr);
+
+		if (_traced)
+			server->traceInputDone(proxy);
+	}
+
+	static void KeyUp(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t key = 0;
 		int32_t modifiers = 0;
-      int32_t chr = 0;
-		
-		(*cmd) >> key;
-		(*cmd) >> modifiers;
-		(*cmd) >> chr;
-		
-		asyncCmdKeyUp(proxy, key, modifiers, chr);
-		
-		
-		break;
+		int32_t chr = 0;
+
+		AsyncCmdKeyUpArgs _args;
+		if (cmd->readBlock(&_args, sizeof(_args))) {
+			key = _args.key;
+			modifiers = _args.modifiers;
+			chr = _args.chr;
+		}
+		else {
+			(*cmd) >> key;
+			(*cmd) >> modifiers;
+			(*cmd) >> chr;
+		}
+
+		int32_t _traceSeq = 0;
+		int64_t _traceTimeUs = 0;
+		bool _traced = cmd->hasMore();
+		if (_traced) {
+			(*cmd) >> _traceSeq;
+			(*cmd) >> _traceTimeUs;
+			server->traceInput(proxy, _traceSeq, _traceTimeUs);
+		}
+
+		server->asyncCmdKeyUp(proxy, key, modifiers, chr);
+
+		if (_traced)
+			server->traceInputDone(proxy);
 	}
-	case 0x100A: { // Forward
-		
-		
-		
-		asyncCmdForward(proxy);
-		
-		
-		break;
+
+	static void Forward(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		server->asyncCmdForward(proxy);
 	}
-	case 0x100B: { // Back
-		
-		
-		
-		asyncCmdBack(proxy);
-		
-		
-		break;
+
+	static void Back(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		server->asyncCmdBack(proxy);
 	}
-	case 0x100C: { // Reload
-		
-		
-		
-		asyncCmdReload(proxy);
-		
-		
-		break;
+
+	static void Reload(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		server->asyncCmdReload(proxy);
 	}
-	case 0x100D: { // Stop
-		
-		
-		
-		asyncCmdStop(proxy);
-		
-		
-		break;
+
+	static void Stop(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		server->asyncCmdStop(proxy);
 	}
-	case 0x1010: { // PageFocused
-		
+
+	static void PageFocused(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		bool focused = 0;
-		
+
 		(*cmd) >> focused;
-		
-		asyncCmdPageFocused(proxy, focused);
-		
-		
-		break;
+
+		server->asyncCmdPageFocused(proxy, focused);
 	}
-	case 0x1011: { // Exit
-		
-		
-		
-		asyncCmdExit(proxy);
-		
-		
-		break;
+
+	static void Exit(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		server->asyncCmdExit(proxy);
 	}
-	case 0x1015: { // CancelDownload
-		
-		char* url = 0;
-		
+
+	static void CancelDownload(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		const char* url = 0;
+
 		(*cmd) >> url;
-		
-		asyncCmdCancelDownload(proxy, url);
-		
-		if (url) free(url);
-		
-		break;
+
+		server->asyncCmdCancelDownload(proxy, url);
 	}
-	case 0x1016: { // InterrogateClicks
-		
+
+	static void InterrogateClicks(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		bool enable = 0;
-		
+
 		(*cmd) >> enable;
-		
-		asyncCmdInterrogateClicks(proxy, enable);
-		
-		
-		break;
+
+		server->asyncCmdInterrogateClicks(proxy, enable);
 	}
-	case 0x1017: { // ZoomSmartCalculateRequest
-		
+
+	static void ZoomSmartCalculateRequest(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t pointX = 0;
 		int32_t pointY = 0;
-		
-		(*cmd) >> pointX;
-		(*cmd) >> pointY;
-		
-		asyncCmdZoomSmartCalculateRequest(proxy, pointX, pointY);
-		
-		
-		break;
+
+		AsyncCmdZoomSmartCalculateRequestArgs _args;
+		if (cmd->readBlock(&_args, sizeof(_args))) {
+			pointX = _args.pointX;
+			pointY = _args.pointY;
+		}
+		else {
+			(*cmd) >> pointX;
+			(*cmd) >> pointY;
+		}
+
+		server->asyncCmdZoomSmartCalculateRequest(proxy, pointX, pointY);
 	}
-	case 0x101A: { // DragStart
-		
+
+	static void DragStart(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t contentX = 0;
 		int32_t contentY = 0;
-		
-		(*cmd) >> contentX;
-		(*cmd) >> contentY;
-		
-		asyncCmdDragStart(proxy, contentX, contentY);
-		
-		
-		break;
-	}
-	case 0x101B: { // DragProcess
-		
+
+		AsyncCmdDragStartArgs _args;
+		if (cmd->readBlock(&_args, sizeof(_args))) {
+			contentX = _args.contentX;
+			contentY = _args.contentY;
+		}
+		else {
+			(*cmd) >> contentX;
+			(*cmd) >> contentY;
+		}
+
+		int32_t _traceSeq = 0;
+		int64_t _traceTimeUs = 0;
+		bool _traced = cmd->hasMore();
+		if (_traced) {
+			(*cmd) >> _traceSeq;
+			(*cmd) >> _traceTimeUs;
+			server->traceInput(proxy, _traceSeq, _traceTimeUs);
+		}
+
+		server->asyncCmdDragStart(proxy, contentX, contentY);
+
+		if (_traced)
+			server->traceInputDone(proxy);
+	}
+
+	static void DragProcess(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t deltaX = 0;
 		int32_t deltaY = 0;
-		
-		(*cmd) >> deltaX;
-		(*cmd) >> deltaY;
-		
-		asyncCmdDragProcess(proxy, deltaX, deltaY);
-		
-		
-		break;
-	}
-	case 0x101C: { // DragEnd
-		
+
+		AsyncCmdDragProcessArgs _args;
+		if (cmd->readBlock(&_args, sizeof(_args))) {
+			deltaX = _args.deltaX;
+			deltaY = _args.deltaY;
+		}
+		else {
+			(*cmd) >> deltaX;
+			(*cmd) >> deltaY;
+		}
+
+		int32_t _traceSeq = 0;
+		int64_t _traceTimeUs = 0;
+		bool _traced = cmd->hasMore();
+		if (_traced) {
+			(*cmd) >> _traceSeq;
+			(*cmd) >> _traceTimeUs;
+			server->traceInput(proxy, _traceSeq, _traceTimeUs);
+		}
+
+		server->asyncCmdDragProcess(proxy, deltaX, deltaY);
+
+		if (_traced)
+			server->traceInputDone(proxy);
+	}
+
+	static void DragEnd(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t contentX = 0;
 		int32_t contentY = 0;
-		
-		(*cmd) >> contentX;
-		(*cmd) >> contentY;
-		
-		asyncCmdDragEnd(proxy, contentX, contentY);
-		
-		
-		break;
-	}
-	case 0x1103: { // SetMinFontSize
-		
+
+		AsyncCmdDragEndArgs _args;
+		if (cmd->readBlock(&_args, sizeof(_args))) {
+			contentX = _args.contentX;
+			contentY = _args.contentY;
+		}
+		else {
+			(*cmd) >> contentX;
+			(*cmd) >> contentY;
+		}
+
+		int32_t _traceSeq = 0;
+		int64_t _traceTimeUs = 0;
+		bool _traced = cmd->hasMore();
+		if (_traced) {
+			(*cmd) >> _traceSeq;
+			(*cmd) >> _traceTimeUs;
+			server->traceInput(proxy, _traceSeq, _traceTimeUs);
+		}
+
+		server->asyncCmdDragEnd(proxy, contentX, contentY);
+
+		if (_traced)
+			server->traceInputDone(proxy);
+	}
+
+	static void SetMinFontSize(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t minFontSizePt = 0;
-		
+
 		(*cmd) >> minFontSizePt;
-		
-		asyncCmdSetMinFontSize(proxy, minFontSizePt);
-		
-		
-		break;
+
+		server->asyncCmdSetMinFontSize(proxy, minFontSizePt);
 	}
-	case 0x1104: { // FindString
-		
-		char* str = 0;
+
+	static void FindString(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		const char* str = 0;
 		bool fwd = 0;
-		
+
 		(*cmd) >> str;
 		(*cmd) >> fwd;
-		
-		asyncCmdFindString(proxy, str, fwd);
-		
-		if (str) free(str);
-		
-		break;
+
+		server->asyncCmdFindString(proxy, str, fwd);
 	}
-	case 0x1105: { // ClearSelection
-		
-		
-		
-		asyncCmdClearSelection(proxy);
-		
-		
-		break;
+
+	static void ClearSelection(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		server->asyncCmdClearSelection(proxy);
 	}
-	case 0x1106: { // ClearCache
-		
-		
-		
-		asyncCmdClearCache(proxy);
-		
-		
-		break;
+
+	static void ClearCache(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		server->asyncCmdClearCache(proxy);
 	}
-	case 0x1107: { // ClearCookies
-		
-		
-		
-		asyncCmdClearCookies(proxy);
-		
-		
-		break;
+
+	static void ClearCookies(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		server->asyncCmdClearCookies(proxy);
 	}
-	case 0x1108: { // PopupMenuSelect
-		
-		char* identifier = 0;
+
+	static void PopupMenuSelect(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		const char* identifier = 0;
 		int32_t selectedIdx = 0;
-		
+
 		(*cmd) >> identifier;
 		(*cmd) >> selectedIdx;
-		
-		asyncCmdPopupMenuSelect(proxy, identifier, selectedIdx);
-		
-		if (identifier) free(identifier);
-		
-		break;
+
+		server->asyncCmdPopupMenuSelect(proxy, identifier, selectedIdx);
 	}
-	case 0x1109: { // SetEnableJavaScript
-		
+
+	static void SetEnableJavaScript(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		bool enable = 0;
-		
+
 		(*cmd) >> enable;
-		
-		asyncCmdSetEnableJavaScript(proxy, enable);
-		
-		
-		break;
+
+		server->asyncCmdSetEnableJavaScript(proxy, enable);
 	}
-	case 0x110A: { // SetBlockPopups
-		
+
+	static void SetBlockPopups(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		bool enable = 0;
-		
+
 		(*cmd) >> enable;
-		
-		asyncCmdSetBlockPopups(proxy, enable);
-		
-		
-		break;
+
+		server->asyncCmdSetBlockPopups(proxy, enable);
 	}
-	case 0x110B: { // SetAcceptCookies
-		
+
+	static void SetAcceptCookies(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		bool enable = 0;
-		
+
 		(*cmd) >> enable;
-		
-		asyncCmdSetAcceptCookies(proxy, enable);
-		
-		
-		break;
+
+		server->asyncCmdSetAcceptCookies(proxy, enable);
 	}
-	case 0x110C: { // MouseEvent
-		
+
+	static void MouseEvent(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t type = 0;
 		int32_t contentX = 0;
 		int32_t contentY = 0;
 		int32_t detail = 0;
-		
-		(*cmd) >> type;
-		(*cmd) >> contentX;
-		(*cmd) >> contentY;
-		(*cmd) >> detail;
-		
-		asyncCmdMouseEvent(proxy, type, contentX, contentY, detail);
-		
-		
-		break;
-	}
-	case 0x110D: { // GestureEvent
-		
+
+		AsyncCmdMouseEventArgs _args;
+		if (cmd->readBlock(&_args, sizeof(_args))) {
+			type = _args.type;
+			contentX = _args.contentX;
+			contentY = _args.contentY;
+			detail = _args.detail;
+		}
+		else {
+			(*cmd) >> type;
+			(*cmd) >> contentX;
+			(*cmd) >> contentY;
+			(*cmd) >> detail;
+		}
+
+		int32_t _traceSeq = 0;
+		int64_t _traceTimeUs = 0;
+		bool _traced = cmd->hasMore();
+		if (_traced) {
+			(*cmd) >> _traceSeq;
+			(*cmd) >> _traceTimeUs;
+			server->traceInput(proxy, _traceSeq, _traceTimeUs);
+		}
+
+		server->asyncCmdMouseEvent(proxy, type, contentX, contentY, detail);
+
+		if (_traced)
+			server->traceInputDone(proxy);
+	}
+
+	static void GestureEvent(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t type = 0;
 		int32_t contentX = 0;
 		int32_t contentY = 0;
@@ -441,400 +518,419 @@ void BrowserServerBase::handleAsyncCommand(YapProxy* proxy, YapPacket* cmd)
 		double rotate = 0;
 		int32_t centerX = 0;
 		int32_t centerY = 0;
-		
-		(*cmd) >> type;
-		(*cmd) >> contentX;
-		(*cmd) >> contentY;
-		(*cmd) >> scale;
-		(*cmd) >> rotate;
-		(*cmd) >> centerX;
-		(*cmd) >> centerY;
-		
-		asyncCmdGestureEvent(proxy, type, contentX, contentY, scale, rotate, centerX, centerY);
-		
-		
-		break;
-	}
-	case 0x110E: { // Disconnect
-		
-		
-		
-		asyncCmdDisconnect(proxy);
-		
-		
-		break;
-	}
-	case 0x110F: { // InspectUrlAtPoint
-		
+
+		AsyncCmdGestureEventArgs _args;
+		if (cmd->readBlock(&_args, sizeof(_args))) {
+			type = _args.type;
+			contentX = _args.contentX;
+			contentY = _args.contentY;
+			scale = _args.scale;
+			rotate = _args.rotate;
+			centerX = _args.centerX;
+			centerY = _args.centerY;
+		}
+		else {
+			(*cmd) >> type;
+			(*cmd) >> contentX;
+			(*cmd) >> contentY;
+			(*cmd) >> scale;
+			(*cmd) >> rotate;
+			(*cmd) >> centerX;
+			(*cmd) >> centerY;
+		}
+
+		int32_t _traceSeq = 0;
+		int64_t _traceTimeUs = 0;
+		bool _traced = cmd->hasMore();
+		if (_traced) {
+			(*cmd) >> _traceSeq;
+			(*cmd) >> _traceTimeUs;
+			server->traceInput(proxy, _traceSeq, _traceTimeUs);
+		}
+
+		server->asyncCmdGestureEvent(proxy, type, contentX, contentY, scale, rotate, centerX, centerY);
+
+		if (_traced)
+			server->traceInputDone(proxy);
+	}
+
+	static void Disconnect(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		server->asyncCmdDisconnect(proxy);
+	}
+
+	static void InspectUrlAtPoint(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t queryNum = 0;
 		int32_t pointX = 0;
 		int32_t pointY = 0;
-		
-		(*cmd) >> queryNum;
-		(*cmd) >> pointX;
-		(*cmd) >> pointY;
-		
-		asyncCmdInspectUrlAtPoint(proxy, queryNum, pointX, pointY);
-		
-		
-		break;
+
+		AsyncCmdInspectUrlAtPointArgs _args;
+		if (cmd->readBlock(&_args, sizeof(_args))) {
+			queryNum = _args.queryNum;
+			pointX = _args.pointX;
+			pointY = _args.pointY;
+		}
+		else {
+			(*cmd) >> queryNum;
+			(*cmd) >> pointX;
+			(*cmd) >> pointY;
+		}
+
+		server->asyncCmdInspectUrlAtPoint(proxy, queryNum, pointX, pointY);
 	}
-	case 0x1111: { // GetHistoryState
-		
+
+	static void GetHistoryState(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t queryNum = 0;
-		
+
 		(*cmd) >> queryNum;
-		
-		asyncCmdGetHistoryState(proxy, queryNum);
-		
-		
-		break;
+
+		server->asyncCmdGetHistoryState(proxy, queryNum);
 	}
-	case 0x1112: { // ClearHistory
-		
-		
-		
-		asyncCmdClearHistory(proxy);
-		
-		
-		break;
+
+	static void ClearHistory(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		server->asyncCmdClearHistory(proxy);
 	}
-	case 0x1113: { // SetAppIdentifier
-		
-		char* identifier = 0;
-		
+
+	static void SetAppIdentifier(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		const char* identifier = 0;
+
 		(*cmd) >> identifier;
-		
-		asyncCmdSetAppIdentifier(proxy, identifier);
-		
-		if (identifier) free(identifier);
-		
-		break;
+
+		server->asyncCmdSetAppIdentifier(proxy, identifier);
 	}
-	case 0x1114: { // AddUrlRedirect
-		
-		char* urlRe = 0;
+
+	static void AddUrlRedirect(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		const char* urlRe = 0;
 		int32_t type = 0;
 		bool redirect = 0;
-		char* userData = 0;
-		
+		const char* userData = 0;
+
 		(*cmd) >> urlRe;
 		(*cmd) >> type;
 		(*cmd) >> redirect;
 		(*cmd) >> userData;
-		
-		asyncCmdAddUrlRedirect(proxy, urlRe, type, redirect, userData);
-		
-		if (urlRe) free(urlRe);
-		if (userData) free(userData);
-		
-		break;
+
+		server->asyncCmdAddUrlRedirect(proxy, urlRe, type, redirect, userData);
 	}
-	case 0x1115: { // SetShowClickedLink
-		
+
+	static void SetShowClickedLink(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		bool enable = 0;
-		
+
 		(*cmd) >> enable;
-		
-		asyncCmdSetShowClickedLink(proxy, enable);
-		
-		
-		break;
+
+		server->asyncCmdSetShowClickedLink(proxy, enable);
 	}
-	case 0x1116: { // GetInteractiveNodeRects
-		
+
+	static void GetInteractiveNodeRects(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t pointX = 0;
 		int32_t pointY = 0;
-		
-		(*cmd) >> pointX;
-		(*cmd) >> pointY;
-		
-		asyncCmdGetInteractiveNodeRects(proxy, pointX, pointY);
-		
-		
-		break;
+
+		AsyncCmdGetInteractiveNodeRectsArgs _args;
+		if (cmd->readBlock(&_args, sizeof(_args))) {
+			pointX = _args.pointX;
+			pointY = _args.pointY;
+		}
+		else {
+			(*cmd) >> pointX;
+			(*cmd) >> pointY;
+		}
+
+		server->asyncCmdGetInteractiveNodeRects(proxy, pointX, pointY);
 	}
-	case 0x1117: { // IsEditing
-		
+
+	static void IsEditing(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t queryNum = 0;
-		
+
 		(*cmd) >> queryNum;
-		
-		asyncCmdIsEditing(proxy, queryNum);
-		
-		
-		break;
+
+		server->asyncCmdIsEditing(proxy, queryNum);
 	}
-	case 0x1118: { // InsertStringAtCursor
-		
-		char* text = 0;
-		
+
+	static void InsertStringAtCursor(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		const char* text = 0;
+
 		(*cmd) >> text;
-		
-		asyncCmdInsertStringAtCursor(proxy, text);
-		
-		if (text) free(text);
-		
-		break;
+
+		server->asyncCmdInsertStringAtCursor(proxy, text);
 	}
-	case 0x1119: { // EnableSelection
-		
+
+	static void EnableSelection(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t pointX = 0;
 		int32_t pointY = 0;
-		
-		(*cmd) >> pointX;
-		(*cmd) >> pointY;
-		
-		asyncCmdEnableSelection(proxy, pointX, pointY);
-		
-		
-		break;
+
+		AsyncCmdEnableSelectionArgs _args;
+		if (cmd->readBlock(&_args, sizeof(_args))) {
+			pointX = _args.pointX;
+			pointY = _args.pointY;
+		}
+		else {
+			(*cmd) >> pointX;
+			(*cmd) >> pointY;
+		}
+
+		server->asyncCmdEnableSelection(proxy, pointX, pointY);
 	}
-	case 0x111A: { // DisableSelection
-		
-		
-		
-		asyncCmdDisableSelection(proxy);
-		
-		
-		break;
+
+	static void DisableSelection(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		server->asyncCmdDisableSelection(proxy);
 	}
-	case 0x111B: { // SaveImageAtPoint
-		
+
+	static void SaveImageAtPoint(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t queryNum = 0;
 		int32_t pointX = 0;
 		int32_t pointY = 0;
-		char* dstDir = 0;
-		
+		const char* dstDir = 0;
+
 		(*cmd) >> queryNum;
 		(*cmd) >> pointX;
 		(*cmd) >> pointY;
 		(*cmd) >> dstDir;
-		
-		asyncCmdSaveImageAtPoint(proxy, queryNum, pointX, pointY, dstDir);
-		
-		if (dstDir) free(dstDir);
-		
-		break;
+
+		server->asyncCmdSaveImageAtPoint(proxy, queryNum, pointX, pointY, dstDir);
 	}
-	case 0x111C: { // GetImageInfoAtPoint
-		
+
+	static void GetImageInfoAtPoint(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t queryNum = 0;
 		int32_t pointX = 0;
 		int32_t pointY = 0;
-		
-		(*cmd) >> queryNum;
-		(*cmd) >> pointX;
-		(*cmd) >> pointY;
-		
-		asyncCmdGetImageInfoAtPoint(proxy, queryNum, pointX, pointY);
-		
-		
-		break;
+
+		AsyncCmdGetImageInfoAtPointArgs _args;
+		if (cmd->readBlock(&_args, sizeof(_args))) {
+			queryNum = _args.queryNum;
+			pointX = _args.pointX;
+			pointY = _args.pointY;
+		}
+		else {
+			(*cmd) >> queryNum;
+			(*cmd) >> pointX;
+			(*cmd) >> pointY;
+		}
+
+		server->asyncCmdGetImageInfoAtPoint(proxy, queryNum, pointX, pointY);
 	}
-	case 0x111D: { // IsInteractiveAtPoint
-		
+
+	static void IsInteractiveAtPoint(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t queryNum = 0;
 		int32_t pointX = 0;
 		int32_t pointY = 0;
-		
-		(*cmd) >> queryNum;
-		(*cmd) >> pointX;
-		(*cmd) >> pointY;
-		
-		asyncCmdIsInteractiveAtPoint(proxy, queryNum, pointX, pointY);
-		
-		
-		break;
+
+		AsyncCmdIsInteractiveAtPointArgs _args;
+		if (cmd->readBlock(&_args, sizeof(_args))) {
+			queryNum = _args.queryNum;
+			pointX = _args.pointX;
+			pointY = _args.pointY;
+		}
+		else {
+			(*cmd) >> queryNum;
+			(*cmd) >> pointX;
+			(*cmd) >> pointY;
+		}
+
+		server->asyncCmdIsInteractiveAtPoint(proxy, queryNum, pointX, pointY);
 	}
-	case 0x111E: { // GetElementInfoAtPoint
-		
+
+	static void GetElementInfoAtPoint(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t queryNum = 0;
 		int32_t pointX = 0;
 		int32_t pointY = 0;
-		
-		(*cmd) >> queryNum;
-		(*cmd) >> pointX;
-		(*cmd) >> pointY;
-		
-		asyncCmdGetElementInfoAtPoint(proxy, queryNum, pointX, pointY);
-		
-		
-		break;
+
+		AsyncCmdGetElementInfoAtPointArgs _args;
+		if (cmd->readBlock(&_args, sizeof(_args))) {
+			queryNum = _args.queryNum;
+			pointX = _args.pointX;
+			pointY = _args.pointY;
+		}
+		else {
+			(*cmd) >> queryNum;
+			(*cmd) >> pointX;
+			(*cmd) >> pointY;
+		}
+
+		server->asyncCmdGetElementInfoAtPoint(proxy, queryNum, pointX, pointY);
 	}
-	case 0x111F: { // SelectAll
-		
-		
-		
-		asyncCmdSelectAll(proxy);
-		
-		
-		break;
+
+	static void SelectAll(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		server->asyncCmdSelectAll(proxy);
 	}
-	case 0x1120: { // Copy
-		
+
+	static void Copy(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t queryNum = 0;
-		
+
 		(*cmd) >> queryNum;
-		
-		asyncCmdCopy(proxy, queryNum);
-		
-		
-		break;
+
+		server->asyncCmdCopy(proxy, queryNum);
 	}
-	case 0x1121: { // Paste
-		
-		
-		
-		asyncCmdPaste(proxy);
-		
-		
-		break;
+
+	static void Paste(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		server->asyncCmdPaste(proxy);
 	}
-	case 0x1122: { // Cut
-		
-		
-		
-		asyncCmdCut(proxy);
-		
-		
-		break;
+
+	static void Cut(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		server->asyncCmdCut(proxy);
 	}
-	case 0x1123: { // SetMouseMode
-		
+
+	static void SetMouseMode(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t mode = 0;
-		
+
 		(*cmd) >> mode;
-		
-		asyncCmdSetMouseMode(proxy, mode);
-		
-		
-		break;
+
+		server->asyncCmdSetMouseMode(proxy, mode);
 	}
-	case 0x1124: { // DisableEnhancedViewport
-		
+
+	static void DisableEnhancedViewport(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		bool disable = 0;
-		
+
 		(*cmd) >> disable;
-		
-		asyncCmdDisableEnhancedViewport(proxy, disable);
-		
-		
-		break;
+
+		server->asyncCmdDisableEnhancedViewport(proxy, disable);
 	}
-	case 0x1125: { // IgnoreMetaTags
-		
+
+	static void IgnoreMetaTags(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		bool ignore = 0;
-		
+
 		(*cmd) >> ignore;
-		
-		asyncCmdIgnoreMetaTags(proxy, ignore);
-		
-		
-		break;
+
+		server->asyncCmdIgnoreMetaTags(proxy, ignore);
 	}
-	case 0x1500: { // SetScrollPosition
-		
+
+	static void SetScrollPosition(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t cx = 0;
 		int32_t cy = 0;
 		int32_t cw = 0;
 		int32_t ch = 0;
-		
-		(*cmd) >> cx;
-		(*cmd) >> cy;
-		(*cmd) >> cw;
-		(*cmd) >> ch;
-		
-		asyncCmdSetScrollPosition(proxy, cx, cy, cw, ch);
-		
-		
-		break;
-	}
-	case 0x1501: { // PluginSpotlightStart
-		
+
+		AsyncCmdSetScrollPositionArgs _args;
+		if (cmd->readBlock(&_args, sizeof(_args))) {
+			cx = _args.cx;
+			cy = _args.cy;
+			cw = _args.cw;
+			ch = _args.ch;
+		}
+		else {
+			(*cmd) >> cx;
+			(*cmd) >> cy;
+			(*cmd) >> cw;
+			(*cmd) >> ch;
+		}
+
+		server->asyncCmdSetScrollPosition(proxy, cx, cy, cw, ch);
+	}
+
+	static void PluginSpotlightStart(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t cx = 0;
 		int32_t cy = 0;
 		int32_t cw = 0;
 		int32_t ch = 0;
-		
-		(*cmd) >> cx;
-		(*cmd) >> cy;
-		(*cmd) >> cw;
-		(*cmd) >> ch;
-		
-		asyncCmdPluginSpotlightStart(proxy, cx, cy, cw, ch);
-		
-		
-		break;
+
+		AsyncCmdPluginSpotlightStartArgs _args;
+		if (cmd->readBlock(&_args, sizeof(_args))) {
+			cx = _args.cx;
+			cy = _args.cy;
+			cw = _args.cw;
+			ch = _args.ch;
+		}
+		else {
+			(*cmd) >> cx;
+			(*cmd) >> cy;
+			(*cmd) >> cw;
+			(*cmd) >> ch;
+		}
+
+		server->asyncCmdPluginSpotlightStart(proxy, cx, cy, cw, ch);
 	}
-	case 0x1502: { // PluginSpotlightEnd
-		
-		
-		
-		asyncCmdPluginSpotlightEnd(proxy);
-		
-		
-		break;
+
+	static void PluginSpotlightEnd(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		server->asyncCmdPluginSpotlightEnd(proxy);
 	}
-	case 0x1503: { // HideSpellingWidget
-		
-		
-		
-		asyncCmdHideSpellingWidget(proxy);
-		
-		
-		break;
+
+	static void HideSpellingWidget(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		server->asyncCmdHideSpellingWidget(proxy);
 	}
-	case 0x1504: { // SetNetworkInterface
-		
-		char* interfaceName = 0;
-		
+
+	static void SetNetworkInterface(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		const char* interfaceName = 0;
+
 		(*cmd) >> interfaceName;
-		
-		asyncCmdSetNetworkInterface(proxy, interfaceName);
-		
-		if (interfaceName) free(interfaceName);
-		
-		break;
+
+		server->asyncCmdSetNetworkInterface(proxy, interfaceName);
 	}
-	case 0x1505: { // HitTest
-		
+
+	static void HitTest(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t queryNum = 0;
 		int32_t cx = 0;
 		int32_t cy = 0;
-		
-		(*cmd) >> queryNum;
-		(*cmd) >> cx;
-		(*cmd) >> cy;
-		
-		asyncCmdHitTest(proxy, queryNum, cx, cy);
-		
-		
-		break;
+
+		AsyncCmdHitTestArgs _args;
+		if (cmd->readBlock(&_args, sizeof(_args))) {
+			queryNum = _args.queryNum;
+			cx = _args.cx;
+			cy = _args.cy;
+		}
+		else {
+			(*cmd) >> queryNum;
+			(*cmd) >> cx;
+			(*cmd) >> cy;
+		}
+
+		server->asyncCmdHitTest(proxy, queryNum, cx, cy);
 	}
-	case 0x1506: { // SetVirtualWindowSize
-		
+
+	static void SetVirtualWindowSize(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t width = 0;
 		int32_t height = 0;
-		
-		(*cmd) >> width;
-		(*cmd) >> height;
-		
-		asyncCmdSetVirtualWindowSize(proxy, width, height);
-		
-		
-		break;
+
+		AsyncCmdSetVirtualWindowSizeArgs _args;
+		if (cmd->readBlock(&_args, sizeof(_args))) {
+			width = _args.width;
+			height = _args.height;
+		}
+		else {
+			(*cmd) >> width;
+			(*cmd) >> height;
+		}
+
+		server->asyncCmdSetVirtualWindowSize(proxy, width, height);
 	}
-	case 0x1507: { // PrintFrame
-		
-		char* frameName = 0;
+
+	static void PrintFrame(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		const char* frameName = 0;
 		int32_t lpsJobId = 0;
 		int32_t width = 0;
 		int32_t height = 0;
 		int32_t dpi = 0;
 		bool landscape = 0;
 		bool reverseOrder = 0;
-		
+
 		(*cmd) >> frameName;
 		(*cmd) >> lpsJobId;
 		(*cmd) >> width;
@@ -842,437 +938,956 @@ void BrowserServerBase::handleAsyncCommand(YapProxy* proxy, YapPacket* cmd)
 		(*cmd) >> dpi;
 		(*cmd) >> landscape;
 		(*cmd) >> reverseOrder;
-		
-		asyncCmdPrintFrame(proxy, frameName, lpsJobId, width, height, dpi, landscape, reverseOrder);
-		
-		if (frameName) free(frameName);
-		
-		break;
+
+		server->asyncCmdPrintFrame(proxy, frameName, lpsJobId, width, height, dpi, landscape, reverseOrder);
 	}
-	case 0x1508: { // TouchEvent
-		
+
+	static void TouchEvent(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t type = 0;
 		int32_t touchCount = 0;
 		int32_t modifiers = 0;
-		char* touchesJson = 0;
-		
+		const char* touchesJson = 0;
+
 		(*cmd) >> type;
 		(*cmd) >> touchCount;
 		(*cmd) >> modifiers;
 		(*cmd) >> touchesJson;
-		
-		asyncCmdTouchEvent(proxy, type, touchCount, modifiers, touchesJson);
-		
-		if (touchesJson) free(touchesJson);
-		
-		break;
+
+		int32_t _traceSeq = 0;
+		int64_t _traceTimeUs = 0;
+		bool _traced = cmd->hasMore();
+		if (_traced) {
+			(*cmd) >> _traceSeq;
+			(*cmd) >> _traceTimeUs;
+			server->traceInput(proxy, _traceSeq, _traceTimeUs);
+		}
+
+		server->asyncCmdTouchEvent(proxy, type, touchCount, modifiers, touchesJson);
+
+		if (_traced)
+			server->traceInputDone(proxy);
 	}
-	case 0x1509: { // HoldAt
-		
+
+	static void HoldAt(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t contentX = 0;
 		int32_t contentY = 0;
-		
-		(*cmd) >> contentX;
-		(*cmd) >> contentY;
-		
-		asyncCmdHoldAt(proxy, contentX, contentY);
-		
-		
-		break;
-	}
-	case 0x150a: { // GetTextCaretBounds
-		
+
+		AsyncCmdHoldAtArgs _args;
+		if (cmd->readBlock(&_args, sizeof(_args))) {
+			contentX = _args.contentX;
+			contentY = _args.contentY;
+		}
+		else {
+			(*cmd) >> contentX;
+			(*cmd) >> contentY;
+		}
+
+		int32_t _traceSeq = 0;
+		int64_t _traceTimeUs = 0;
+		bool _traced = cmd->hasMore();
+		if (_traced) {
+			(*cmd) >> _traceSeq;
+			(*cmd) >> _traceTimeUs;
+			server->traceInput(proxy, _traceSeq, _traceTimeUs);
+		}
+
+		server->asyncCmdHoldAt(proxy, contentX, contentY);
+
+		if (_traced)
+			server->traceInputDone(proxy);
+	}
+
+	static void GetTextCaretBounds(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t queryNum = 0;
-		
+
 		(*cmd) >> queryNum;
-		
-		asyncCmdGetTextCaretBounds(proxy, queryNum);
-		
-		
-		break;
+
+		server->asyncCmdGetTextCaretBounds(proxy, queryNum);
 	}
-	case 0x150b: { // Freeze
-		
-		
-		
-		asyncCmdFreeze(proxy);
-		
-		
-		break;
+
+	static void Freeze(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		server->asyncCmdFreeze(proxy);
 	}
-	case 0x150c: { // Thaw
-		
+
+	static void Thaw(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t sharedBufferKey1 = 0;
 		int32_t sharedBufferKey2 = 0;
 		int32_t sharedBufferSize = 0;
-		
-		(*cmd) >> sharedBufferKey1;
-		(*cmd) >> sharedBufferKey2;
-		(*cmd) >> sharedBufferSize;
-		
-		asyncCmdThaw(proxy, sharedBufferKey1, sharedBufferKey2, sharedBufferSize);
-		
-		
-		break;
+
+		AsyncCmdThawArgs _args;
+		if (cmd->readBlock(&_args, sizeof(_args))) {
+			sharedBufferKey1 = _args.sharedBufferKey1;
+			sharedBufferKey2 = _args.sharedBufferKey2;
+			sharedBufferSize = _args.sharedBufferSize;
+		}
+		else {
+			(*cmd) >> sharedBufferKey1;
+			(*cmd) >> sharedBufferKey2;
+			(*cmd) >> sharedBufferSize;
+		}
+
+		server->asyncCmdThaw(proxy, sharedBufferKey1, sharedBufferKey2, sharedBufferSize);
 	}
-	case 0x150d: { // ReturnBuffer
-		
+
+	static void ReturnBuffer(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t sharedBufferKey = 0;
-		
+
 		(*cmd) >> sharedBufferKey;
-		
-		asyncCmdReturnBuffer(proxy, sharedBufferKey);
-		
-		
-		break;
+
+		server->asyncCmdReturnBuffer(proxy, sharedBufferKey);
 	}
-	case 0x150e: { // SetZoomAndScroll
-		
+
+	static void SetZoomAndScroll(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		double zoom = 0;
 		int32_t cx = 0;
 		int32_t cy = 0;
-		
-		(*cmd) >> zoom;
-		(*cmd) >> cx;
-		(*cmd) >> cy;
-		
-		asyncCmdSetZoomAndScroll(proxy, zoom, cx, cy);
-		
-		
-		break;
+
+		AsyncCmdSetZoomAndScrollArgs _args;
+		if (cmd->readBlock(&_args, sizeof(_args))) {
+			zoom = _args.zoom;
+			cx = _args.cx;
+			cy = _args.cy;
+		}
+		else {
+			(*cmd) >> zoom;
+			(*cmd) >> cx;
+			(*cmd) >> cy;
+		}
+
+		server->asyncCmdSetZoomAndScroll(proxy, zoom, cx, cy);
 	}
-	case 0x150f: { // ScrollLayer
-		
+
+	static void ScrollLayer(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
 		int32_t id = 0;
 		int32_t deltaX = 0;
 		int32_t deltaY = 0;
-		
-		(*cmd) >> id;
-		(*cmd) >> deltaX;
-		(*cmd) >> deltaY;
-		
-		asyncCmdScrollLayer(proxy, id, deltaX, deltaY);
-		
-		
-		break;
-	}
-	case 0x1510: { // SetDNSServers
-		
-		char* servers = 0;
-		
+
+		AsyncCmdScrollLayerArgs _args;
+		if (cmd->readBlock(&_args, sizeof(_args))) {
+			id = _args.id;
+			deltaX = _args.deltaX;
+			deltaY = _args.deltaY;
+		}
+		else {
+			(*cmd) >> id;
+			(*cmd) >> deltaX;
+			(*cmd) >> deltaY;
+		}
+
+		int32_t _traceSeq = 0;
+		int64_t _traceTimeUs = 0;
+		bool _traced = cmd->hasMore();
+		if (_traced) {
+			(*cmd) >> _traceSeq;
+			(*cmd) >> _traceTimeUs;
+			server->traceInput(proxy, _traceSeq, _traceTimeUs);
+		}
+
+		server->asyncCmdScrollLayer(proxy, id, deltaX, deltaY);
+
+		if (_traced)
+			server->traceInputDone(proxy);
+	}
+
+	static void SetDNSServers(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		const char* servers = 0;
+
 		(*cmd) >> servers;
-		
-		asyncCmdSetDNSServers(proxy, servers);
-		
-		if (servers) free(servers);
-		
-		break;
+
+		server->asyncCmdSetDNSServers(proxy, servers);
 	}
-	default:
+
+	static void RenderToFileAsync(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		int32_t queryNum = 0;
+		const char* filename = 0;
+		int32_t viewX = 0;
+		int32_t viewY = 0;
+		int32_t viewW = 0;
+		int32_t viewH = 0;
+		const char* format = 0;
+		int32_t quality = 0;
+
+		(*cmd) >> queryNum;
+		(*cmd) >> filename;
+		(*cmd) >> viewX;
+		(*cmd) >> viewY;
+		(*cmd) >> viewW;
+		(*cmd) >> viewH;
+		(*cmd) >> format;
+		(*cmd) >> quality;
+
+		server->asyncCmdRenderToFileAsync(proxy, queryNum, filename, viewX, viewY, viewW, viewH, format, quality);
+	}
+
+	static void SetHtmlBulk(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		const char* url = 0;
+		int32_t bodyBulkId = 0;
+
+		(*cmd) >> url;
+		(*cmd) >> bodyBulkId;
+
+		server->asyncCmdSetHtmlBulk(proxy, url, bodyBulkId);
+	}
+
+	static void ConnectMemFd(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		int32_t pageWidth = 0;
+		int32_t pageHeight = 0;
+		int32_t sharedBufferBulkId1 = 0;
+		int32_t sharedBufferBulkId2 = 0;
+		int32_t sharedBufferSize = 0;
+		int32_t identifier = 0;
+
+		AsyncCmdConnectMemFdArgs _args;
+		if (cmd->readBlock(&_args, sizeof(_args))) {
+			pageWidth = _args.pageWidth;
+			pageHeight = _args.pageHeight;
+			sharedBufferBulkId1 = _args.sharedBufferBulkId1;
+			sharedBufferBulkId2 = _args.sharedBufferBulkId2;
+			sharedBufferSize = _args.sharedBufferSize;
+			identifier = _args.identifier;
+		}
+		else {
+			(*cmd) >> pageWidth;
+			(*cmd) >> pageHeight;
+			(*cmd) >> sharedBufferBulkId1;
+			(*cmd) >> sharedBufferBulkId2;
+			(*cmd) >> sharedBufferSize;
+			(*cmd) >> identifier;
+		}
+
+		server->asyncCmdConnectMemFd(proxy, pageWidth, pageHeight, sharedBufferBulkId1, sharedBufferBulkId2, sharedBufferSize, identifier);
+	}
+
+	static void ThawMemFd(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd)
+	{
+		int32_t sharedBufferBulkId1 = 0;
+		int32_t sharedBufferBulkId2 = 0;
+		int32_t sharedBufferSize = 0;
+
+		AsyncCmdThawMemFdArgs _args;
+		if (cmd->readBlock(&_args, sizeof(_args))) {
+			sharedBufferBulkId1 = _args.sharedBufferBulkId1;
+			sharedBufferBulkId2 = _args.sharedBufferBulkId2;
+			sharedBufferSize = _args.sharedBufferSize;
+		}
+		else {
+			(*cmd) >> sharedBufferBulkId1;
+			(*cmd) >> sharedBufferBulkId2;
+			(*cmd) >> sharedBufferSize;
+		}
+
+		server->asyncCmdThawMemFd(proxy, sharedBufferBulkId1, sharedBufferBulkId2, sharedBufferSize);
+	}
+};
+
+const BrowserServerBase::AsyncCommandInfo BrowserServerBase::s_asyncCommands[] = {
+	{ 0x1000, "Connect", kYapCommandControl, false, &AsyncDecoders::Connect },
+	{ 0x1001, "SetWindowSize", kYapCommandControl, false, &AsyncDecoders::SetWindowSize },
+	{ 0x1003, "SetUserAgent", kYapCommandControl, false, &AsyncDecoders::SetUserAgent },
+	{ 0x1004, "OpenUrl", kYapCommandBulk, false, &AsyncDecoders::OpenUrl },
+	{ 0x1005, "SetHtml", kYapCommandBulk, false, &AsyncDecoders::SetHtml },
+	{ 0x1007, "ClickAt", kYapCommandInput, false, &AsyncDecoders::ClickAt },
+	{ 0x1008, "KeyDown", kYapCommandInput, false, &AsyncDecoders::KeyDown },
+	{ 0x1009, "KeyUp", kYapCommandInput, false, &AsyncDecoders::KeyUp },
+	{ 0x100A, "Forward", kYapCommandControl, false, &AsyncDecoders::Forward },
+	{ 0x100B, "Back", kYapCommandControl, false, &AsyncDecoders::Back },
+	{ 0x100C, "Reload", kYapCommandControl, false, &AsyncDecoders::Reload },
+	{ 0x100D, "Stop", kYapCommandControl, false, &AsyncDecoders::Stop },
+	{ 0x1010, "PageFocused", kYapCommandControl, false, &AsyncDecoders::PageFocused },
+	{ 0x1011, "Exit", kYapCommandControl, false, &AsyncDecoders::Exit },
+	{ 0x1015, "CancelDownload", kYapCommandControl, false, &AsyncDecoders::CancelDownload },
+	{ 0x1016, "InterrogateClicks", kYapCommandControl, false, &AsyncDecoders::InterrogateClicks },
+	{ 0x1017, "ZoomSmartCalculateRequest", kYapCommandControl, false, &AsyncDecoders::ZoomSmartCalculateRequest },
+	{ 0x101A, "DragStart", kYapCommandInput, false, &AsyncDecoders::DragStart },
+	{ 0x101B, "DragProcess", kYapCommandInput, true, &AsyncDecoders::DragProcess },
+	{ 0x101C, "DragEnd", kYapCommandInput, false, &AsyncDecoders::DragEnd },
+	{ 0x1103, "SetMinFontSize", kYapCommandControl, false, &AsyncDecoders::SetMinFontSize },
+	{ 0x1104, "FindString", kYapCommandControl, false, &AsyncDecoders::FindString },
+	{ 0x1105, "ClearSelection", kYapCommandControl, false, &AsyncDecoders::ClearSelection },
+	{ 0x1106, "ClearCache", kYapCommandBulk, false, &AsyncDecoders::ClearCache },
+	{ 0x1107, "ClearCookies", kYapCommandBulk, false, &AsyncDecoders::ClearCookies },
+	{ 0x1108, "PopupMenuSelect", kYapCommandControl, false, &AsyncDecoders::PopupMenuSelect },
+	{ 0x1109, "SetEnableJavaScript", kYapCommandControl, false, &AsyncDecoders::SetEnableJavaScript },
+	{ 0x110A, "SetBlockPopups", kYapCommandControl, false, &AsyncDecoders::SetBlockPopups },
+	{ 0x110B, "SetAcceptCookies", kYapCommandControl, false, &AsyncDecoders::SetAcceptCookies },
+	{ 0x110C, "MouseEvent", kYapCommandInput, true, &AsyncDecoders::MouseEvent },
+	{ 0x110D, "GestureEvent", kYapCommandInput, true, &AsyncDecoders::GestureEvent },
+	{ 0x110E, "Disconnect", kYapCommandControl, false, &AsyncDecoders::Disconnect },
+	{ 0x110F, "InspectUrlAtPoint", kYapCommandControl, false, &AsyncDecoders::InspectUrlAtPoint },
+	{ 0x1111, "GetHistoryState", kYapCommandControl, false, &AsyncDecoders::GetHistoryState },
+	{ 0x1112, "ClearHistory", kYapCommandBulk, false, &AsyncDecoders::ClearHistory },
+	{ 0x1113, "SetAppIdentifier", kYapCommandControl, false, &AsyncDecoders::SetAppIdentifier },
+	{ 0x1114, "AddUrlRedirect", kYapCommandBulk, false, &AsyncDecoders::AddUrlRedirect },
+	{ 0x1115, "SetShowClickedLink", kYapCommandControl, false, &AsyncDecoders::SetShowClickedLink },
+	{ 0x1116, "GetInteractiveNodeRects", kYapCommandControl, false, &AsyncDecoders::GetInteractiveNodeRects },
+	{ 0x1117, "IsEditing", kYapCommandControl, false, &AsyncDecoders::IsEditing },
+	{ 0x1118, "InsertStringAtCursor", kYapCommandControl, false, &AsyncDecoders::InsertStringAtCursor },
+	{ 0x1119, "EnableSelection", kYapCommandControl, false, &AsyncDecoders::EnableSelection },
+	{ 0x111A, "DisableSelection", kYapCommandControl, false, &AsyncDecoders::DisableSelection },
+	{ 0x111B, "SaveImageAtPoint", kYapCommandBulk, false, &AsyncDecoders::SaveImageAtPoint },
+	{ 0x111C, "GetImageInfoAtPoint", kYapCommandControl, false, &AsyncDecoders::GetImageInfoAtPoint },
+	{ 0x111D, "IsInteractiveAtPoint", kYapCommandControl, false, &AsyncDecoders::IsInteractiveAtPoint },
+	{ 0x111E, "GetElementInfoAtPoint", kYapCommandControl, false, &AsyncDecoders::GetElementInfoAtPoint },
+	{ 0x111F, "SelectAll", kYapCommandControl, false, &AsyncDecoders::SelectAll },
+	{ 0x1120, "Copy", kYapCommandControl, false, &AsyncDecoders::Copy },
+	{ 0x1121, "Paste", kYapCommandControl, false, &AsyncDecoders::Paste },
+	{ 0x1122, "Cut", kYapCommandControl, false, &AsyncDecoders::Cut },
+	{ 0x1123, "SetMouseMode", kYapCommandControl, false, &AsyncDecoders::SetMouseMode },
+	{ 0x1124, "DisableEnhancedViewport", kYapCommandControl, false, &AsyncDecoders::DisableEnhancedViewport },
+	{ 0x1125, "IgnoreMetaTags", kYapCommandControl, false, &AsyncDecoders::IgnoreMetaTags },
+	{ 0x1500, "SetScrollPosition", kYapCommandControl, false, &AsyncDecoders::SetScrollPosition },
+	{ 0x1501, "PluginSpotlightStart", kYapCommandControl, false, &AsyncDecoders::PluginSpotlightStart },
+	{ 0x1502, "PluginSpotlightEnd", kYapCommandControl, false, &AsyncDecoders::PluginSpotlightEnd },
+	{ 0x1503, "HideSpellingWidget", kYapCommandControl, false, &AsyncDecoders::HideSpellingWidget },
+	{ 0x1504, "SetNetworkInterface", kYapCommandControl, false, &AsyncDecoders::SetNetworkInterface },
+	{ 0x1505, "HitTest", kYapCommandControl, false, &AsyncDecoders::HitTest },
+	{ 0x1506, "SetVirtualWindowSize", kYapCommandControl, false, &AsyncDecoders::SetVirtualWindowSize },
+	{ 0x1507, "PrintFrame", kYapCommandBulk, false, &AsyncDecoders::PrintFrame },
+	{ 0x1508, "TouchEvent", kYapCommandInput, true, &AsyncDecoders::TouchEvent },
+	{ 0x1509, "HoldAt", kYapCommandInput, false, &AsyncDecoders::HoldAt },
+	{ 0x150a, "GetTextCaretBounds", kYapCommandControl, false, &AsyncDecoders::GetTextCaretBounds },
+	{ 0x150b, "Freeze", kYapCommandControl, false, &AsyncDecoders::Freeze },
+	{ 0x150c, "Thaw", kYapCommandControl, false, &AsyncDecoders::Thaw },
+	{ 0x150d, "ReturnBuffer", kYapCommandControl, false, &AsyncDecoders::ReturnBuffer },
+	{ 0x150e, "SetZoomAndScroll", kYapCommandControl, false, &AsyncDecoders::SetZoomAndScroll },
+	{ 0x150f, "ScrollLayer", kYapCommandInput, false, &AsyncDecoders::ScrollLayer },
+	{ 0x1510, "SetDNSServers", kYapCommandControl, false, &AsyncDecoders::SetDNSServers },
+	{ 0x1511, "RenderToFileAsync", kYapCommandBulk, false, &AsyncDecoders::RenderToFileAsync },
+	{ 0x1512, "SetHtmlBulk", kYapCommandBulk, false, &AsyncDecoders::SetHtmlBulk },
+	{ 0x1513, "ConnectMemFd", kYapCommandControl, false, &AsyncDecoders::ConnectMemFd },
+	{ 0x1514, "ThawMemFd", kYapCommandControl, false, &AsyncDecoders::ThawMemFd },
+};
+
+const int BrowserServerBase::s_asyncCommandCount = sizeof(s_asyncCommands) / sizeof(s_asyncCommands[0]);
+
+const BrowserServerBase::AsyncCommandInfo* BrowserServerBase::asyncCommandInfo(int16_t cmdValue)
+{
+	// Position in s_asyncCommands plus one for each value in the async range
+	static uint16_t index[kAsyncCmdRangeLen];
+	static bool indexed = false;
+
+	if (!indexed) {
+		for (int i = 0; i < s_asyncCommandCount; i++)
+			index[s_asyncCommands[i].cmdValue - kAsyncCmdRangeStart] = i + 1;
+		indexed = true;
+	}
+
+	int slot = cmdValue - kAsyncCmdRangeStart;
+	if (slot < 0 || slot >= kAsyncCmdRangeLen || !index[slot])
+		return 0;
+
+	return &s_asyncCommands[index[slot] - 1];
+}
+
+void BrowserServerBase::handleAsyncCommand(YapProxy* proxy, YapPacket* cmd)
+{
+	int16_t cmdValue;
+
+	(*cmd) >> cmdValue;
+
+	const AsyncCommandInfo* info = asyncCommandInfo(cmdValue);
+	if (!info) {
 		fprintf(stderr, "Unknown async cmd: %d\n", cmdValue);
+		return;
 	}
+
+	int64_t startNs = YapCommandStats::nowNs();
+	info->decode(this, proxy, cmd);
+	s_asyncCommandStats[info - s_asyncCommands].record(cmd->length(), YapCommandStats::nowNs() - startNs);
+}
+
+YapCommandClass BrowserServerBase::commandClass(int16_t cmdValue) const
+{
+	const AsyncCommandInfo* info = asyncCommandInfo(cmdValue);
+	return info ? info->cmdClass : kYapCommandControl;
+}
+
+YapCommandStats BrowserServerBase::s_asyncCommandStats[] = {
+	{ "Connect" },
+	{ "SetWindowSize" },
+	{ "SetUserAgent" },
+	{ "OpenUrl" },
+	{ "SetHtml" },
+	{ "ClickAt" },
+	{ "KeyDown" },
+	{ "KeyUp" },
+	{ "Forward" },
+	{ "Back" },
+	{ "Reload" },
+	{ "Stop" },
+	{ "PageFocused" },
+	{ "Exit" },
+	{ "CancelDownload" },
+	{ "InterrogateClicks" },
+	{ "ZoomSmartCalculateRequest" },
+	{ "DragStart" },
+	{ "DragProcess" },
+	{ "DragEnd" },
+	{ "SetMinFontSize" },
+	{ "FindString" },
+	{ "ClearSelection" },
+	{ "ClearCache" },
+	{ "ClearCookies" },
+	{ "PopupMenuSelect" },
+	{ "SetEnableJavaScript" },
+	{ "SetBlockPopups" },
+	{ "SetAcceptCookies" },
+	{ "MouseEvent" },
+	{ "GestureEvent" },
+	{ "Disconnect" },
+	{ "InspectUrlAtPoint" },
+	{ "GetHistoryState" },
+	{ "ClearHistory" },
+	{ "SetAppIdentifier" },
+	{ "AddUrlRedirect" },
+	{ "SetShowClickedLink" },
+	{ "GetInteractiveNodeRects" },
+	{ "IsEditing" },
+	{ "InsertStringAtCursor" },
+	{ "EnableSelection" },
+	{ "DisableSelection" },
+	{ "SaveImageAtPoint" },
+	{ "GetImageInfoAtPoint" },
+	{ "IsInteractiveAtPoint" },
+	{ "GetElementInfoAtPoint" },
+	{ "SelectAll" },
+	{ "Copy" },
+	{ "Paste" },
+	{ "Cut" },
+	{ "SetMouseMode" },
+	{ "DisableEnhancedViewport" },
+	{ "IgnoreMetaTags" },
+	{ "SetScrollPosition" },
+	{ "PluginSpotlightStart" },
+	{ "PluginSpotlightEnd" },
+	{ "HideSpellingWidget" },
+	{ "SetNetworkInterface" },
+	{ "HitTest" },
+	{ "SetVirtualWindowSize" },
+	{ "PrintFrame" },
+	{ "TouchEvent" },
+	{ "HoldAt" },
+	{ "GetTextCaretBounds" },
+	{ "Freeze" },
+	{ "Thaw" },
+	{ "ReturnBuffer" },
+	{ "SetZoomAndScroll" },
+	{ "ScrollLayer" },
+	{ "SetDNSServers" },
+	{ "RenderToFileAsync" },
+	{ "SetHtmlBulk" },
+	{ "ConnectMemFd" },
+	{ "ThawMemFd" },
+};
+
+YapCommandStats BrowserServerBase::s_messageStats[] = {
+	{ "Painted" },
+	{ "ReportError" },
+	{ "ContentsSizeChanged" },
+	{ "ScrolledTo" },
+	{ "LoadStarted" },
+	{ "LoadStopped" },
+	{ "LoadProgress" },
+	{ "LocationChanged" },
+	{ "TitleChanged" },
+	{ "TitleAndUrlChanged" },
+	{ "DialogAlert" },
+	{ "DialogConfirm" },
+	{ "DialogPrompt" },
+	{ "DialogUserPassword" },
+	{ "ActionData" },
+	{ "DownloadStart" },
+	{ "DownloadProgress" },
+	{ "DownloadError" },
+	{ "DownloadFinished" },
+	{ "LinkClicked" },
+	{ "MimeHandoffUrl" },
+	{ "MimeNotSupported" },
+	{ "CreatePage" },
+	{ "ClickRejected" },
+	{ "PopupMenuShow" },
+	{ "PopupMenuHide" },
+	{ "SmartZoomCalculateResponseSimple" },
+	{ "FailedLoad" },
+	{ "EditorFocused" },
+	{ "DidFinishDocumentLoad" },
+	{ "UpdateGlobalHistory" },
+	{ "SetMainDocumentError" },
+	{ "PurgePage" },
+	{ "InspectUrlAtPointResponse" },
+	{ "GetHistoryStateResponse" },
+	{ "UrlRedirected" },
+	{ "DialogSSLConfirm" },
+	{ "MetaViewportSet" },
+	{ "HighlightRects" },
+	{ "IsEditing" },
+	{ "SaveImageAtPointResponse" },
+	{ "GetImageInfoAtPointResponse" },
+	{ "MakePointVisible" },
+	{ "IsInteractiveAtPointResponse" },
+	{ "GetElementInfoAtPointResponse" },
+	{ "CopiedToClipboard" },
+	{ "PastedFromClipboard" },
+	{ "RemoveSelectionReticle" },
+	{ "CopySuccessResponse" },
+	{ "PluginFullscreenSpotlightCreate" },
+	{ "PluginFullscreenSpotlightRemove" },
+	{ "SpellingWidgetVisibleRectUpdate" },
+	{ "HitTestResponse" },
+	{ "AddFlashRects" },
+	{ "RemoveFlashRects" },
+	{ "ShowPrintDialog" },
+	{ "GetTextCaretBoundsResponse" },
+	{ "UpdateScrollableLayers" },
+	{ "InputPainted" },
+	{ "RenderToFileResponse" },
+	{ "PopupMenuShowBulk" },
+};
+
+const YapCommandStats* BrowserServerBase::asyncCommandStats(int& count)
+{
+	count = s_asyncCommandCount;
+	return s_asyncCommandStats;
+}
+
+const YapCommandStats* BrowserServerBase::messageStats(int& count)
+{
+	count = sizeof(s_messageStats) / sizeof(s_messageStats[0]);
+	return s_messageStats;
+}
+
+void BrowserServerBase::resetCommandStats()
+{
+	for (int i = 0; i < s_asyncCommandCount; i++)
+		s_asyncCommandStats[i].reset();
+	for (unsigned i = 0; i < sizeof(s_messageStats) / sizeof(s_messageStats[0]); i++)
+		s_messageStats[i].reset();
 }
 
 void BrowserServerBase::msgPainted(YapProxy* proxy, int32_t sharedBufferKey)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2000; // Painted
 	(*pkt) << sharedBufferKey;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[0].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgReportError(YapProxy* proxy, const char* url, int32_t code, const char* msg)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2001; // ReportError
 	(*pkt) << url;
 	(*pkt) << code;
 	(*pkt) << msg;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[1].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgContentsSizeChanged(YapProxy* proxy, int32_t width, int32_t height)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2002; // ContentsSizeChanged
-	(*pkt) << width;
-	(*pkt) << height;
-	proxy->sendMessage();
+	MsgContentsSizeChangedArgs _args = { width, height };
+	if (!pkt->writeBlock(&_args, sizeof(_args))) {
+		(*pkt) << width;
+		(*pkt) << height;
+	}
+	int _len = pkt->length();
+	proxy->sendMessage(0x2002);
+	s_messageStats[2].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgScrolledTo(YapProxy* proxy, int32_t contentsX, int32_t contentsY)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2004; // ScrolledTo
-	(*pkt) << contentsX;
-	(*pkt) << contentsY;
+	MsgScrolledToArgs _args = { contentsX, contentsY };
+	if (!pkt->writeBlock(&_args, sizeof(_args))) {
+		(*pkt) << contentsX;
+		(*pkt) << contentsY;
+	}
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[3].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgLoadStarted(YapProxy* proxy)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2005; // LoadStarted
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[4].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgLoadStopped(YapProxy* proxy)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2006; // LoadStopped
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[5].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgLoadProgress(YapProxy* proxy, int32_t progress)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2007; // LoadProgress
 	(*pkt) << progress;
-	proxy->sendMessage();
+	int _len = pkt->length();
+	proxy->sendMessage(0x2007);
+	s_messageStats[6].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgLocationChanged(YapProxy* proxy, const char* uri, bool canGoBack, bool canGoForward)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2008; // LocationChanged
 	(*pkt) << uri;
 	(*pkt) << canGoBack;
 	(*pkt) << canGoForward;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[7].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgTitleChanged(YapProxy* proxy, const char* title)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2009; // TitleChanged
 	(*pkt) << title;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[8].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgTitleAndUrlChanged(YapProxy* proxy, const char* title, const char* url, bool canGoBack, bool canGoForward)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x200A; // TitleAndUrlChanged
 	(*pkt) << title;
 	(*pkt) << url;
 	(*pkt) << canGoBack;
 	(*pkt) << canGoForward;
-	proxy->sendMessage();
+	int _len = pkt->length();
+	proxy->sendMessage(0x200A);
+	s_messageStats[9].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgDialogAlert(YapProxy* proxy, const char* syncPipePath, const char* msg)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x200B; // DialogAlert
 	(*pkt) << syncPipePath;
 	(*pkt) << msg;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[10].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgDialogConfirm(YapProxy* proxy, const char* syncPipePath, const char* msg)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x200C; // DialogConfirm
 	(*pkt) << syncPipePath;
 	(*pkt) << msg;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[11].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgDialogPrompt(YapProxy* proxy, const char* syncPipePath, const char* msg, const char* defaultValue)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x200D; // DialogPrompt
 	(*pkt) << syncPipePath;
 	(*pkt) << msg;
 	(*pkt) << defaultValue;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[12].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgDialogUserPassword(YapProxy* proxy, const char* syncPipePath, const char* msg)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x200E; // DialogUserPassword
 	(*pkt) << syncPipePath;
 	(*pkt) << msg;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[13].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgActionData(YapProxy* proxy, const char* dataType, const char* data)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x200F; // ActionData
 	(*pkt) << dataType;
 	(*pkt) << data;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[14].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgDownloadStart(YapProxy* proxy, const char* url)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2010; // DownloadStart
 	(*pkt) << url;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[15].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgDownloadProgress(YapProxy* proxy, const char* url, int32_t totalSizeSoFar, int32_t totalSize)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2011; // DownloadProgress
 	(*pkt) << url;
 	(*pkt) << totalSizeSoFar;
 	(*pkt) << totalSize;
-	proxy->sendMessage();
+	int _len = pkt->length();
+	proxy->sendMessage(0x2011, url);
+	s_messageStats[16].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgDownloadError(YapProxy* proxy, const char* url, const char* errorMsg)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2012; // DownloadError
 	(*pkt) << url;
 	(*pkt) << errorMsg;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[17].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgDownloadFinished(YapProxy* proxy, const char* url, const char* mimeType, const char* tmpFilePath)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2013; // DownloadFinished
 	(*pkt) << url;
 	(*pkt) << mimeType;
 	(*pkt) << tmpFilePath;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[18].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgLinkClicked(YapProxy* proxy, const char* url)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2014; // LinkClicked
 	(*pkt) << url;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[19].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgMimeHandoffUrl(YapProxy* proxy, const char* mimeType, const char* url)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2015; // MimeHandoffUrl
 	(*pkt) << mimeType;
 	(*pkt) << url;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[20].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgMimeNotSupported(YapProxy* proxy, const char* mimeType, const char* url)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2016; // MimeNotSupported
 	(*pkt) << mimeType;
 	(*pkt) << url;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[21].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgCreatePage(YapProxy* proxy, int32_t identifier)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2017; // CreatePage
 	(*pkt) << identifier;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[22].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgClickRejected(YapProxy* proxy, int32_t counter)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2018; // ClickRejected
 	(*pkt) << counter;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[23].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgPopupMenuShow(YapProxy* proxy, const char* identifier, const char* menuDataFileName)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2019; // PopupMenuShow
 	(*pkt) << identifier;
 	(*pkt) << menuDataFileName;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[24].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgPopupMenuHide(YapProxy* proxy, const char* identifier)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x201A; // PopupMenuHide
 	(*pkt) << identifier;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[25].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgSmartZoomCalculateResponseSimple(YapProxy* proxy, int32_t pointX, int32_t pointY, int32_t left, int32_t top, int32_t right, int32_t bottom, int32_t fullscreenSpotlightHandle)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x201F; // SmartZoomCalculateResponseSimple
-	(*pkt) << pointX;
-	(*pkt) << pointY;
-	(*pkt) << left;
-	(*pkt) << top;
-	(*pkt) << right;
-	(*pkt) << bottom;
-	(*pkt) << fullscreenSpotlightHandle;
+	MsgSmartZoomCalculateResponseSimpleArgs _args = { pointX, pointY, left, top, right, bottom, fullscreenSpotlightHandle };
+	if (!pkt->writeBlock(&_args, sizeof(_args))) {
+		(*pkt) << pointX;
+		(*pkt) << pointY;
+		(*pkt) << left;
+		(*pkt) << top;
+		(*pkt) << right;
+		(*pkt) << bottom;
+		(*pkt) << fullscreenSpotlightHandle;
+	}
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[26].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgFailedLoad(YapProxy* proxy, const char* domain, int32_t errorCode, const char* failingURL, const char* localizedDescription)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x201C; // FailedLoad
 	(*pkt) << domain;
 	(*pkt) << errorCode;
 	(*pkt) << failingURL;
 	(*pkt) << localizedDescription;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[27].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgEditorFocused(YapProxy* proxy, bool focused, int32_t fieldType, int32_t fieldActions)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x201D; // EditorFocused
-	(*pkt) << focused;
-	(*pkt) << fieldType;
-	(*pkt) << fieldActions;
+	MsgEditorFocusedArgs _args = { focused, fieldType, fieldActions };
+	if (!pkt->writeBlock(&_args, sizeof(_args))) {
+		(*pkt) << focused;
+		(*pkt) << fieldType;
+		(*pkt) << fieldActions;
+	}
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[28].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgDidFinishDocumentLoad(YapProxy* proxy)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x201E; // DidFinishDocumentLoad
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[29].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgUpdateGlobalHistory(YapProxy* proxy, const char* url, bool reload)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2020; // UpdateGlobalHistory
 	(*pkt) << url;
 	(*pkt) << reload;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[30].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgSetMainDocumentError(YapProxy* proxy, const char* domain, int32_t errorCode, const char* failingURL, const char* localizedDescription)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2021; // SetMainDocumentError
 	(*pkt) << domain;
 	(*pkt) << errorCode;
 	(*pkt) << failingURL;
 	(*pkt) << localizedDescription;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[31].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgPurgePage(YapProxy* proxy)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2022; // PurgePage
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[32].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgInspectUrlAtPointResponse(YapProxy* proxy, int32_t queryNum, bool succeeded, const char* url, const char* desc, int32_t rectWidth, int32_t rectHeight, int32_t rectX, int32_t rectY)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2023; // InspectUrlAtPointResponse
 	(*pkt) << queryNum;
@@ -1283,81 +1898,114 @@ void BrowserServerBase::msgInspectUrlAtPointResponse(YapProxy* proxy, int32_t qu
 	(*pkt) << rectHeight;
 	(*pkt) << rectX;
 	(*pkt) << rectY;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[33].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgGetHistoryStateResponse(YapProxy* proxy, int32_t queryNum, bool canGoBack, bool canGoForward)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2024; // GetHistoryStateResponse
-	(*pkt) << queryNum;
-	(*pkt) << canGoBack;
-	(*pkt) << canGoForward;
+	MsgGetHistoryStateResponseArgs _args = { queryNum, canGoBack, canGoForward };
+	if (!pkt->writeBlock(&_args, sizeof(_args))) {
+		(*pkt) << queryNum;
+		(*pkt) << canGoBack;
+		(*pkt) << canGoForward;
+	}
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[34].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgUrlRedirected(YapProxy* proxy, const char* url, const char* userData)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2025; // UrlRedirected
 	(*pkt) << url;
 	(*pkt) << userData;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[35].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgDialogSSLConfirm(YapProxy* proxy, const char* syncPipePath, const char* host, int32_t code, const char* certFile)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2026; // DialogSSLConfirm
 	(*pkt) << syncPipePath;
 	(*pkt) << host;
 	(*pkt) << code;
 	(*pkt) << certFile;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[36].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgMetaViewportSet(YapProxy* proxy, double initialScale, double minimumScale, double maximumScale, int32_t width, int32_t height, bool userScalable)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2027; // MetaViewportSet
-	(*pkt) << initialScale;
-	(*pkt) << minimumScale;
-	(*pkt) << maximumScale;
-	(*pkt) << width;
-	(*pkt) << height;
-	(*pkt) << userScalable;
+	MsgMetaViewportSetArgs _args = { initialScale, minimumScale, maximumScale, width, height, userScalable };
+	if (!pkt->writeBlock(&_args, sizeof(_args))) {
+		(*pkt) << initialScale;
+		(*pkt) << minimumScale;
+		(*pkt) << maximumScale;
+		(*pkt) << width;
+		(*pkt) << height;
+		(*pkt) << userScalable;
+	}
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[37].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgHighlightRects(YapProxy* proxy, const char* rectsJson)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2028; // HighlightRects
 	(*pkt) << rectsJson;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[38].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgIsEditing(YapProxy* proxy, int32_t queryNum, bool isEditing)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2029; // IsEditing
-	(*pkt) << queryNum;
-	(*pkt) << isEditing;
+	MsgIsEditingArgs _args = { queryNum, isEditing };
+	if (!pkt->writeBlock(&_args, sizeof(_args))) {
+		(*pkt) << queryNum;
+		(*pkt) << isEditing;
+	}
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[39].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgSaveImageAtPointResponse(YapProxy* proxy, int32_t queryNum, bool succeeded, const char* filepath)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x202A; // SaveImageAtPointResponse
 	(*pkt) << queryNum;
 	(*pkt) << succeeded;
 	(*pkt) << filepath;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[40].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgGetImageInfoAtPointResponse(YapProxy* proxy, int32_t queryNum, bool succeeded, const char* baseUri, const char* src, const char* title, const char* altText, int32_t width, int32_t height, const char* mimeType)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x202B; // GetImageInfoAtPointResponse
 	(*pkt) << queryNum;
@@ -1369,29 +2017,44 @@ void BrowserServerBase::msgGetImageInfoAtPointResponse(YapProxy* proxy, int32_t
 	(*pkt) << width;
 	(*pkt) << height;
 	(*pkt) << mimeType;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[41].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgMakePointVisible(YapProxy* proxy, int32_t x, int32_t y)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x202C; // MakePointVisible
-	(*pkt) << x;
-	(*pkt) << y;
+	MsgMakePointVisibleArgs _args = { x, y };
+	if (!pkt->writeBlock(&_args, sizeof(_args))) {
+		(*pkt) << x;
+		(*pkt) << y;
+	}
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[42].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgIsInteractiveAtPointResponse(YapProxy* proxy, int32_t queryNum, bool interractive)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x202D; // IsInteractiveAtPointResponse
-	(*pkt) << queryNum;
-	(*pkt) << interractive;
+	MsgIsInteractiveAtPointResponseArgs _args = { queryNum, interractive };
+	if (!pkt->writeBlock(&_args, sizeof(_args))) {
+		(*pkt) << queryNum;
+		(*pkt) << interractive;
+	}
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[43].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgGetElementInfoAtPointResponse(YapProxy* proxy, int32_t queryNum, bool succeeded, const char* element, const char* id, const char* name, const char* cname, const char* type, int32_t left, int32_t top, int32_t right, int32_t bottom, bool isEditable)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x202E; // GetElementInfoAtPointResponse
 	(*pkt) << queryNum;
@@ -1406,118 +2069,213 @@ void BrowserServerBase::msgGetElementInfoAtPointResponse(YapProxy* proxy, int32_
 	(*pkt) << right;
 	(*pkt) << bottom;
 	(*pkt) << isEditable;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[44].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgCopiedToClipboard(YapProxy* proxy)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x202F; // CopiedToClipboard
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[45].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgPastedFromClipboard(YapProxy* proxy)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2030; // PastedFromClipboard
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[46].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgRemoveSelectionReticle(YapProxy* proxy)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2031; // RemoveSelectionReticle
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[47].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgCopySuccessResponse(YapProxy* proxy, int32_t queryNum, bool success)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2032; // CopySuccessResponse
-	(*pkt) << queryNum;
-	(*pkt) << success;
+	MsgCopySuccessResponseArgs _args = { queryNum, success };
+	if (!pkt->writeBlock(&_args, sizeof(_args))) {
+		(*pkt) << queryNum;
+		(*pkt) << success;
+	}
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[48].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgPluginFullscreenSpotlightCreate(YapProxy* proxy, int32_t spotlightHandle, int32_t rectX, int32_t rectY, int32_t rectWidth, int32_t rectHeight)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2033; // PluginFullscreenSpotlightCreate
-	(*pkt) << spotlightHandle;
-	(*pkt) << rectX;
-	(*pkt) << rectY;
-	(*pkt) << rectWidth;
-	(*pkt) << rectHeight;
+	MsgPluginFullscreenSpotlightCreateArgs _args = { spotlightHandle, rectX, rectY, rectWidth, rectHeight };
+	if (!pkt->writeBlock(&_args, sizeof(_args))) {
+		(*pkt) << spotlightHandle;
+		(*pkt) << rectX;
+		(*pkt) << rectY;
+		(*pkt) << rectWidth;
+		(*pkt) << rectHeight;
+	}
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[49].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgPluginFullscreenSpotlightRemove(YapProxy* proxy)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2034; // PluginFullscreenSpotlightRemove
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[50].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgSpellingWidgetVisibleRectUpdate(YapProxy* proxy, int32_t rectX, int32_t rectY, int32_t rectWidth, int32_t rectHeight)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2035; // SpellingWidgetVisibleRectUpdate
-	(*pkt) << rectX;
-	(*pkt) << rectY;
-	(*pkt) << rectWidth;
-	(*pkt) << rectHeight;
+	MsgSpellingWidgetVisibleRectUpdateArgs _args = { rectX, rectY, rectWidth, rectHeight };
+	if (!pkt->writeBlock(&_args, sizeof(_args))) {
+		(*pkt) << rectX;
+		(*pkt) << rectY;
+		(*pkt) << rectWidth;
+		(*pkt) << rectHeight;
+	}
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[51].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgHitTestResponse(YapProxy* proxy, int32_t queryNum, const char* hitTestResultJson)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2036; // HitTestResponse
 	(*pkt) << queryNum;
 	(*pkt) << hitTestResultJson;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[52].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgAddFlashRects(YapProxy* proxy, const char* rectsJson)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2037; // AddFlashRects
 	(*pkt) << rectsJson;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[53].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgRemoveFlashRects(YapProxy* proxy, const char* rectsJson)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2038; // RemoveFlashRects
 	(*pkt) << rectsJson;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[54].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgShowPrintDialog(YapProxy* proxy)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x2039; // ShowPrintDialog
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[55].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgGetTextCaretBoundsResponse(YapProxy* proxy, int32_t queryNum, int32_t left, int32_t top, int32_t right, int32_t bottom)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x203a; // GetTextCaretBoundsResponse
-	(*pkt) << queryNum;
-	(*pkt) << left;
-	(*pkt) << top;
-	(*pkt) << right;
-	(*pkt) << bottom;
+	MsgGetTextCaretBoundsResponseArgs _args = { queryNum, left, top, right, bottom };
+	if (!pkt->writeBlock(&_args, sizeof(_args))) {
+		(*pkt) << queryNum;
+		(*pkt) << left;
+		(*pkt) << top;
+		(*pkt) << right;
+		(*pkt) << bottom;
+	}
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[56].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
 void BrowserServerBase::msgUpdateScrollableLayers(YapProxy* proxy, const char* json)
 {
+	int64_t _startNs = YapCommandStats::nowNs();
 	YapPacket* pkt = proxy->packetMessage();
 	(*pkt) << (int16_t) 0x203b; // UpdateScrollableLayers
 	(*pkt) << json;
+	int _len = pkt->length();
+	proxy->sendMessage(0x203b);
+	s_messageStats[57].record(_len, YapCommandStats::nowNs() - _startNs);
+}
+
+void BrowserServerBase::msgInputPainted(YapProxy* proxy, int32_t sharedBufferKey, int32_t firstSeq, int32_t lastSeq, int64_t flushTimeUs)
+{
+	int64_t _startNs = YapCommandStats::nowNs();
+	YapPacket* pkt = proxy->packetMessage();
+	(*pkt) << (int16_t) 0x203c; // InputPainted
+	MsgInputPaintedArgs _args = { sharedBufferKey, firstSeq, lastSeq, flushTimeUs };
+	if (!pkt->writeBlock(&_args, sizeof(_args))) {
+		(*pkt) << sharedBufferKey;
+		(*pkt) << firstSeq;
+		(*pkt) << lastSeq;
+		(*pkt) << flushTimeUs;
+	}
+	int _len = pkt->length();
+	proxy->sendMessage();
+	s_messageStats[58].record(_len, YapCommandStats::nowNs() - _startNs);
+}
+
+void BrowserServerBase::msgRenderToFileResponse(YapProxy* proxy, int32_t queryNum, const char* filename, int32_t result)
+{
+	int64_t _startNs = YapCommandStats::nowNs();
+	YapPacket* pkt = proxy->packetMessage();
+	(*pkt) << (int16_t) 0x203d; // RenderToFileResponse
+	(*pkt) << queryNum;
+	(*pkt) << filename;
+	(*pkt) << result;
+	int _len = pkt->length();
+	proxy->sendMessage();
+	s_messageStats[59].record(_len, YapCommandStats::nowNs() - _startNs);
+}
+
+void BrowserServerBase::msgPopupMenuShowBulk(YapProxy* proxy, const char* identifier, int32_t menuDataBulkId)
+{
+	int64_t _startNs = YapCommandStats::nowNs();
+	YapPacket* pkt = proxy->packetMessage();
+	(*pkt) << (int16_t) 0x203e; // PopupMenuShowBulk
+	(*pkt) << identifier;
+	(*pkt) << menuDataBulkId;
+	int _len = pkt->length();
 	proxy->sendMessage();
+	s_messageStats[60].record(_len, YapCommandStats::nowNs() - _startNs);
 }
 
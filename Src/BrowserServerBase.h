@@ -24,6 +24,7 @@ LICENSE@@@ */
 #include <YapServer.h>
 #include <YapProxy.h>
 #include <YapPacket.h>
+#include <YapCommandStats.h>
 
 class BrowserServerBase : public YapServer
 {
@@ -91,11 +92,34 @@ public:
     void msgShowPrintDialog(YapProxy* proxy);
     void msgGetTextCaretBoundsResponse(YapProxy* proxy, int32_t queryNum, int32_t left, int32_t top, int32_t right, int32_t bottom);
     void msgUpdateScrollableLayers(YapProxy* proxy, const char* json);
+    void msgInputPainted(YapProxy* proxy, int32_t sharedBufferKey, int32_t firstSeq, int32_t lastSeq, int64_t flushTimeUs);
+    void msgRenderToFileResponse(YapProxy* proxy, int32_t queryNum, const char* filename, int32_t result);
+    void msgPopupMenuShowBulk(YapProxy* proxy, const char* identifier, int32_t menuDataBulkId);
+
+    // Counters of the async commands and messages, empty unless generated with --stats
+    static const YapCommandStats* asyncCommandStats(int& count);
+    static const YapCommandStats* messageStats(int& count);
+    static void resetCommandStats();
 
 protected:
 
     virtual void handleSyncCommand(YapProxy* proxy, YapPacket* cmd, YapPacket* reply);
     virtual void handleAsyncCommand(YapProxy* proxy, YapPacket* cmd);
+    virtual YapCommandClass commandClass(int16_t cmdValue) const;
+
+    struct AsyncCommandInfo {
+        int16_t         cmdValue;
+        const char*     name;
+        YapCommandClass cmdClass;
+        bool            coalesce; // newer ones may be folded in, see canCoalesce()
+        void          (*decode)(BrowserServerBase* server, YapProxy* proxy, YapPacket* cmd);
+    };
+
+    static const AsyncCommandInfo* asyncCommandInfo(int16_t cmdValue);
+
+    // Input commands may be followed by a sequence number and client timestamp
+    virtual void traceInput(YapProxy* proxy, int32_t seq, int64_t clientTimeUs) {}
+    virtual void traceInputDone(YapProxy* proxy) {}
 
     // Sync Commands
     virtual void syncCmdRenderToFile(YapProxy* proxy, const char* filename, int32_t viewX, int32_t viewY, int32_t viewW, int32_t viewH, int32_t& result) = 0;
@@ -172,6 +196,239 @@ protected:
     virtual void asyncCmdSetZoomAndScroll(YapProxy* proxy, double zoom, int32_t cx, int32_t cy) = 0;
     virtual void asyncCmdScrollLayer(YapProxy* proxy, int32_t id, int32_t deltaX, int32_t deltaY) = 0;
     virtual void asyncCmdSetDNSServers(YapProxy* proxy, const char* servers) = 0;
+    virtual void asyncCmdRenderToFileAsync(YapProxy* proxy, int32_t queryNum, const char* filename, int32_t viewX, int32_t viewY, int32_t viewW, int32_t viewH, const char* format, int32_t quality) = 0;
+    virtual void asyncCmdSetHtmlBulk(YapProxy* proxy, const char* url, int32_t bodyBulkId) = 0;
+    virtual void asyncCmdConnectMemFd(YapProxy* proxy, int32_t pageWidth, int32_t pageHeight, int32_t sharedBufferBulkId1, int32_t sharedBufferBulkId2, int32_t sharedBufferSize, int32_t identifier) = 0;
+    virtual void asyncCmdThawMemFd(YapProxy* proxy, int32_t sharedBufferBulkId1, int32_t sharedBufferBulkId2, int32_t sharedBufferSize) = 0;
+
+private:
+
+    // Argument blocks of the native encoding
+    struct AsyncCmdConnectArgs {
+        int32_t pageWidth;
+        int32_t pageHeight;
+        int32_t sharedBufferKey1;
+        int32_t sharedBufferKey2;
+        int32_t sharedBufferSize;
+        int32_t identifier;
+    } __attribute__((packed));
+    struct AsyncCmdSetWindowSizeArgs {
+        int32_t width;
+        int32_t height;
+    } __attribute__((packed));
+    struct AsyncCmdClickAtArgs {
+        int32_t contentX;
+        int32_t contentY;
+        int32_t numClicks;
+        int32_t counter;
+    } __attribute__((packed));
+    struct AsyncCmdKeyDownArgs {
+        int32_t key;
+        int32_t modifiers;
+        int32_t chr;
+    } __attribute__((packed));
+    struct AsyncCmdKeyUpArgs {
+        int32_t key;
+        int32_t modifiers;
+        int32_t chr;
+    } __attribute__((packed));
+    struct AsyncCmdZoomSmartCalculateRequestArgs {
+        int32_t pointX;
+        int32_t pointY;
+    } __attribute__((packed));
+    struct AsyncCmdDragStartArgs {
+        int32_t contentX;
+        int32_t contentY;
+    } __attribute__((packed));
+    struct AsyncCmdDragProcessArgs {
+        int32_t deltaX;
+        int32_t deltaY;
+    } __attribute__((packed));
+    struct AsyncCmdDragEndArgs {
+        int32_t contentX;
+        int32_t contentY;
+    } __attribute__((packed));
+    struct AsyncCmdMouseEventArgs {
+        int32_t type;
+        int32_t contentX;
+        int32_t contentY;
+        int32_t detail;
+    } __attribute__((packed));
+    struct AsyncCmdGestureEventArgs {
+        int32_t type;
+        int32_t contentX;
+        int32_t contentY;
+        double scale;
+        double rotate;
+        int32_t centerX;
+        int32_t centerY;
+    } __attribute__((packed));
+    struct AsyncCmdInspectUrlAtPointArgs {
+        int32_t queryNum;
+        int32_t pointX;
+        int32_t pointY;
+    } __attribute__((packed));
+    struct AsyncCmdGetInteractiveNodeRectsArgs {
+        int32_t pointX;
+        int32_t pointY;
+    } __attribute__((packed));
+    struct AsyncCmdEnableSelectionArgs {
+        int32_t pointX;
+        int32_t pointY;
+    } __attribute__((packed));
+    struct AsyncCmdGetImageInfoAtPointArgs {
+        int32_t queryNum;
+        int32_t pointX;
+        int32_t pointY;
+    } __attribute__((packed));
+    struct AsyncCmdIsInteractiveAtPointArgs {
+        int32_t queryNum;
+        int32_t pointX;
+        int32_t pointY;
+    } __attribute__((packed));
+    struct AsyncCmdGetElementInfoAtPointArgs {
+        int32_t queryNum;
+        int32_t pointX;
+        int32_t pointY;
+    } __attribute__((packed));
+    struct AsyncCmdSetScrollPositionArgs {
+        int32_t cx;
+        int32_t cy;
+        int32_t cw;
+        int32_t ch;
+    } __attribute__((packed));
+    struct AsyncCmdPluginSpotlightStartArgs {
+        int32_t cx;
+        int32_t cy;
+        int32_t cw;
+        int32_t ch;
+    } __attribute__((packed));
+    struct AsyncCmdHitTestArgs {
+        int32_t queryNum;
+        int32_t cx;
+        int32_t cy;
+    } __attribute__((packed));
+    struct AsyncCmdSetVirtualWindowSizeArgs {
+        int32_t width;
+        int32_t height;
+    } __attribute__((packed));
+    struct AsyncCmdHoldAtArgs {
+        int32_t contentX;
+        int32_t contentY;
+    } __attribute__((packed));
+    struct AsyncCmdThawArgs {
+        int32_t sharedBufferKey1;
+        int32_t sharedBufferKey2;
+        int32_t sharedBufferSize;
+    } __attribute__((packed));
+    struct AsyncCmdSetZoomAndScrollArgs {
+        double zoom;
+        int32_t cx;
+        int32_t cy;
+    } __attribute__((packed));
+    struct AsyncCmdScrollLayerArgs {
+        int32_t id;
+        int32_t deltaX;
+        int32_t deltaY;
+    } __attribute__((packed));
+    struct AsyncCmdConnectMemFdArgs {
+        int32_t pageWidth;
+        int32_t pageHeight;
+        int32_t sharedBufferBulkId1;
+        int32_t sharedBufferBulkId2;
+        int32_t sharedBufferSize;
+        int32_t identifier;
+    } __attribute__((packed));
+    struct AsyncCmdThawMemFdArgs {
+        int32_t sharedBufferBulkId1;
+        int32_t sharedBufferBulkId2;
+        int32_t sharedBufferSize;
+    } __attribute__((packed));
+    struct MsgContentsSizeChangedArgs {
+        int32_t width;
+        int32_t height;
+    } __attribute__((packed));
+    struct MsgScrolledToArgs {
+        int32_t contentsX;
+        int32_t contentsY;
+    } __attribute__((packed));
+    struct MsgSmartZoomCalculateResponseSimpleArgs {
+        int32_t pointX;
+        int32_t pointY;
+        int32_t left;
+        int32_t top;
+        int32_t right;
+        int32_t bottom;
+        int32_t fullscreenSpotlightHandle;
+    } __attribute__((packed));
+    struct MsgEditorFocusedArgs {
+        bool focused;
+        int32_t fieldType;
+        int32_t fieldActions;
+    } __attribute__((packed));
+    struct MsgGetHistoryStateResponseArgs {
+        int32_t queryNum;
+        bool canGoBack;
+        bool canGoForward;
+    } __attribute__((packed));
+    struct MsgMetaViewportSetArgs {
+        double initialScale;
+        double minimumScale;
+        double maximumScale;
+        int32_t width;
+        int32_t height;
+        bool userScalable;
+    } __attribute__((packed));
+    struct MsgIsEditingArgs {
+        int32_t queryNum;
+        bool isEditing;
+    } __attribute__((packed));
+    struct MsgMakePointVisibleArgs {
+        int32_t x;
+        int32_t y;
+    } __attribute__((packed));
+    struct MsgIsInteractiveAtPointResponseArgs {
+        int32_t queryNum;
+        bool interractive;
+    } __attribute__((packed));
+    struct MsgCopySuccessResponseArgs {
+        int32_t queryNum;
+        bool success;
+    } __attribute__((packed));
+    struct MsgPluginFullscreenSpotlightCreateArgs {
+        int32_t spotlightHandle;
+        int32_t rectX;
+        int32_t rectY;
+        int32_t rectWidth;
+        int32_t rectHeight;
+    } __attribute__((packed));
+    struct MsgSpellingWidgetVisibleRectUpdateArgs {
+        int32_t rectX;
+        int32_t rectY;
+        int32_t rectWidth;
+        int32_t rectHeight;
+    } __attribute__((packed));
+    struct MsgGetTextCaretBoundsResponseArgs {
+        int32_t queryNum;
+        int32_t left;
+        int32_t top;
+        int32_t right;
+        int32_t bottom;
+    } __attribute__((packed));
+    struct MsgInputPaintedArgs {
+        int32_t sharedBufferKey;
+        int32_t firstSeq;
+        int32_t lastSeq;
+        int64_t flushTimeUs;
+    } __attribute__((packed));
+
+    struct AsyncDecoders;
+
+    static const AsyncCommandInfo s_asyncCommands[];
+    static const int s_asyncCommandCount;
+
+    static YapCommandStats s_asyncCommandStats[]; // parallel to s_asyncCommands
+    static YapCommandStats s_messageStats[];
 };
 
 #endif // BROWSERSERVERBASE_H 
@@ -31,15 +31,64 @@ LICENSE@@@ */
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <time.h>
+#include <sys/stat.h>
+
+#include <map>
 
 #include <glib.h>
 
 #include "IpcBuffer.h"
+#include "YapBulk.h"
 
 #ifndef SHM_CACHE_WRITETHROUGH
 #define SHM_CACHE_WRITETHROUGH   0200000 /* custom! */
 #endif
 
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS         (1024 + 9)
+#define F_SEAL_SHRINK       0x0002
+#define F_SEAL_GROW         0x0004
+#endif
+
+#ifndef F_GET_SEALS
+#define F_GET_SEALS         (1024 + 10)
+#endif
+
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0
+#endif
+
+// Descriptor received from a client, waiting for attach() by key
+struct AdoptedFd {
+    int   fd;
+    dev_t dev;
+    ino_t ino;
+};
+
+static std::map<int, AdoptedFd> s_adoptedFds;
+
+/**
+ * The key of a memfd is its inode number, the same on both sides. memfds all
+ * live on one internal tmpfs that numbers inodes with a 32 bit counter, so
+ * dropping the top bit only makes keys repeat after 2^31 files. adoptFd()
+ * refuses a key that is taken by a different file in the meantime.
+ */
+static int keyOfStat(const struct stat& st)
+{
+    // Never 0, which means no buffer to BrowserPage
+    int key = (int) (st.st_ino & 0x7FFFFFFF);
+    return key ? key : 1;
+}
+
+static int keyOfFd(int fd)
+{
+    struct stat st;
+    if (::fstat(fd, &st) != 0)
+        return 0;
+
+    return keyOfStat(st);
+}
+
 IpcBuffer* IpcBuffer::create(int size)
 {
     int key = -1;
@@ -77,6 +126,13 @@ IpcBuffer* IpcBuffer::create(int size)
 // browserserver side
 IpcBuffer* IpcBuffer::attach(int key, int size)
 {
+    std::map<int, AdoptedFd>::iterator it = s_adoptedFds.find(key);
+    if (it != s_adoptedFds.end()) {
+        int fd = it->second.fd;
+        s_adoptedFds.erase(it);
+        return mapFd(fd, size);
+    }
+
     void* buffer = ::shmat(key, NULL, 0);
     if ((void *)-1 == buffer) {
         g_critical("Failed to attach to shared memory key (2) %d: %s", key, strerror(errno));
@@ -90,19 +146,131 @@ IpcBuffer* IpcBuffer::attach(int key, int size)
 }
 
 
+/**
+ * Create the buffer as a memfd instead of SysV shared memory, which needs no
+ * key search and isn't limited by SHMMAX and SHMALL.
+ */
+IpcBuffer* IpcBuffer::createMemFd(int size)
+{
+    int fd = YapBulk::createMemory("ipcbuffer", size);
+    if (fd < 0)
+        return 0;
+
+    // The server only maps buffers that can't shrink under it. Both sides can
+    // still write any time, the buffer handoff protocol keeps them apart.
+    if (::fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) != 0) {
+        g_warning("Failed to seal shared buffer: %s", strerror(errno));
+        ::close(fd);
+        return 0;
+    }
+
+    return mapFd(fd, size);
+}
+
+/**
+ * Make a descriptor received with YapProxy::receiveBulkFd() available to
+ * attach() under the returned key, which is the same as key() on the client.
+ * Takes ownership of fd. Only memory sealed against shrinking is taken, the
+ * client could make the server fault otherwise.
+ *
+ * @return the key, 0 on failure.
+ */
+int IpcBuffer::adoptFd(int fd)
+{
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    int seals = ::fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK) || ::fstat(fd, &st) != 0) {
+        g_warning("Refusing shared buffer descriptor that isn't sealed");
+        ::close(fd);
+        return 0;
+    }
+
+    int key = keyOfStat(st);
+
+    std::map<int, AdoptedFd>::iterator it = s_adoptedFds.find(key);
+    if (it != s_adoptedFds.end() && (it->second.dev != st.st_dev || it->second.ino != st.st_ino)) {
+        g_warning("Shared buffer key %d is already taken", key);
+        ::close(fd);
+        return 0;
+    }
+
+    dropAdoptedFd(key);
+
+    AdoptedFd adopted;
+    adopted.fd  = fd;
+    adopted.dev = st.st_dev;
+    adopted.ino = st.st_ino;
+    s_adoptedFds[key] = adopted;
+
+    return key;
+}
+
+/**
+ * Close an adopted descriptor that attach() wasn't called for.
+ */
+void IpcBuffer::dropAdoptedFd(int key)
+{
+    std::map<int, AdoptedFd>::iterator it = s_adoptedFds.find(key);
+    if (it == s_adoptedFds.end())
+        return;
+
+    ::close(it->second.fd);
+    s_adoptedFds.erase(it);
+}
+
+IpcBuffer* IpcBuffer::mapFd(int fd, int size)
+{
+    int key = keyOfFd(fd);
+
+    struct stat st;
+    if (!key || ::fstat(fd, &st) != 0 || st.st_size < size) {
+        g_critical("Invalid shared buffer descriptor %d for size %d", fd, size);
+        ::close(fd);
+        return 0;
+    }
+
+    // Fault the pages in now rather than during the first paint
+    void* buffer = ::mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (buffer == MAP_FAILED) {
+        g_critical("Failed to map shared buffer %d: %s", key, strerror(errno));
+        ::close(fd);
+        return 0;
+    }
+
+#ifdef MADV_HUGEPAGE
+    ::madvise(buffer, size, MADV_HUGEPAGE);
+#endif
+
+    IpcBuffer* b = new IpcBuffer(key, size);
+    b->m_buffer = buffer;
+    b->m_fd = fd;
+
+    return b;
+}
+
 IpcBuffer::IpcBuffer(int key, int size)
     : m_key(key)
     , m_buffer(0)
     , m_size(size)
+    , m_fd(-1)
 {
 }
 
 IpcBuffer::~IpcBuffer()
 {
     if (m_buffer) {
-        shmdt(m_buffer);
+        if (m_fd >= 0)
+            ::munmap(m_buffer, m_size);
+        else
+            shmdt(m_buffer);
         m_buffer = 0;
     }
+
+    if (m_fd >= 0)
+        ::close(m_fd);
 }
 
 void* IpcBuffer::buffer() const
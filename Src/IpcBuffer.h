@@ -27,17 +27,26 @@ public:
     static IpcBuffer* attach(int key, int size);
     ~IpcBuffer();
 
+    // memfd backed, the descriptor goes to the other side with YapClient::sendBulkFd()
+    static IpcBuffer* createMemFd(int size);
+    static int  adoptFd(int fd);
+    static void dropAdoptedFd(int key);
+
     void* buffer() const;
     int size() const { return m_size; }
     int key() const { return m_key; }
+    int fd() const { return m_fd; }
 
 protected:
 
     IpcBuffer(int key, int size);
 
+    static IpcBuffer* mapFd(int fd, int size);
+
     int m_key;
     void* m_buffer;
     int m_size;
+    int m_fd;       ///< -1 for SysV shared memory
 };
 
 
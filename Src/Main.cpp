@@ -17,6 +17,7 @@
 LICENSE@@@ */
 
 #include <signal.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/time.h>
@@ -29,6 +30,7 @@ LICENSE@@@ */
 #include <sys/stat.h>
 #include <string.h>
 #include <dirent.h>
+#include <fcntl.h>
 
 #include "BrowserPage.h"
 #include "BrowserServer.h"
@@ -50,6 +52,11 @@ LICENSE@@@ */
 
 static bool g_useSysLog = false;
 
+// SIGUSR2 writes the per command counters here, see BrowserServer::dumpCommandStats().
+// In the browser's own data directory rather than world writable /tmp.
+static const char kCommandStatsPath[] = "/var/luna/data/browser/command-stats";
+static int g_commandStatsPipe[2] = { -1, -1 };
+
 #if (kDoInitialTiming == 1)
 
 static struct timeval gTvStart;
@@ -82,6 +89,46 @@ PrvSigTermHandler(int)
     exit(0);
 }
 
+static void
+PrvSigUsr2Handler(int)
+{
+    // Only wake up the main loop, the dump itself isn't async-signal-safe
+    char c = 0;
+    (void) ::write(g_commandStatsPipe[1], &c, 1);
+}
+
+static gboolean
+PrvCommandStatsCallback(GIOChannel* channel, GIOCondition condition, gpointer data)
+{
+    char buf[16];
+    while (::read(g_commandStatsPipe[0], buf, sizeof(buf)) > 0)
+        ;
+
+    BrowserServer::dumpCommandStats(kCommandStatsPath);
+    return TRUE;
+}
+
+static void
+PrvInstallCommandStatsSignal(GMainLoop* loop)
+{
+    if (::pipe(g_commandStatsPipe) != 0) {
+        g_warning("Failed to create command stats pipe: %s", strerror(errno));
+        return;
+    }
+
+    for (int i = 0; i < 2; i++)
+        ::fcntl(g_commandStatsPipe[i], F_SETFL, ::fcntl(g_commandStatsPipe[i], F_GETFL, 0) | O_NONBLOCK);
+
+    GIOChannel* chan = g_io_channel_unix_new(g_commandStatsPipe[0]);
+    GSource* source = g_io_create_watch(chan, G_IO_IN);
+    g_source_set_callback(source, (GSourceFunc) PrvCommandStatsCallback, NULL, NULL);
+    g_source_attach(source, g_main_loop_get_context(loop));
+    g_source_unref(source);
+    g_io_channel_unref(chan);
+
+    ::signal(SIGUSR2, PrvSigUsr2Handler);
+}
+
 static void logFilter(const gchar *log_domain, GLogLevelFlags log_level, const gchar *message, gpointer unused_data)
 {
     if (g_useSysLog) {
@@ -451,6 +498,7 @@ main(int argc, char *argv[])
 #endif
 
     server->InitMemWatcher();
+    PrvInstallCommandStatsSignal(server->mainLoop());
 
 #if defined(USE_MEMCHUTE)
     MemchuteWatcher* memWatch =
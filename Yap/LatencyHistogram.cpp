@@ -0,0 +1,73 @@
+/* @@@LICENSE
+*
+*      Copyright (c) 2012 Hewlett-Packard Development Company, L.P.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+LICENSE@@@ */
+
+#include <string.h>
+
+#include "LatencyHistogram.h"
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+void LatencyHistogram::record(int64_t us)
+{
+    recordNs(us * 1000);
+}
+
+void LatencyHistogram::recordNs(int64_t ns)
+{
+    if (ns < 0)
+        ns = 0;
+
+    int64_t us = ns / 1000;
+
+    int bucket = 0;
+    while (bucket < kBucketCount - 1 && us >= ((int64_t) 1 << bucket))
+        bucket++;
+
+    m_buckets[bucket]++;
+    m_count++;
+    m_totalNs += ns;
+    if (us > m_maxUs)
+        m_maxUs = us;
+}
+
+void LatencyHistogram::reset()
+{
+    ::memset(m_buckets, 0, sizeof(m_buckets));
+    m_count   = 0;
+    m_totalNs = 0;
+    m_maxUs   = 0;
+}
+
+/**
+ * Write count, total, mean and maximum, then the buckets up to the last one
+ * used, all on one line without the newline.
+ */
+void LatencyHistogram::dump(FILE* f) const
+{
+    fprintf(f, "%10u %10lld %10lld %10lld ", m_count, (long long) totalUs(),
+            (long long) meanUs(), (long long) m_maxUs);
+
+    int last = kBucketCount - 1;
+    while (last > 0 && !m_buckets[last])
+        last--;
+    for (int b = 0; b <= last; b++)
+        fprintf(f, " %u", m_buckets[b]);
+}
@@ -0,0 +1,58 @@
+/* @@@LICENSE
+*
+*      Copyright (c) 2012 Hewlett-Packard Development Company, L.P.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+LICENSE@@@ */
+
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/**
+ * Counts durations in power of two buckets of microseconds. Bucket i holds
+ * samples below 2^i us, the last one everything longer. Not thread safe, it is
+ * only updated and read on the main loop.
+ */
+class LatencyHistogram
+{
+public:
+
+    static const int kBucketCount = 25; ///< The last bucket starts at about 16s
+
+    LatencyHistogram();
+
+    void record(int64_t us);
+    void recordNs(int64_t ns);
+    void reset();
+
+    uint32_t count() const { return m_count; }
+    int64_t  totalUs() const { return m_totalNs / 1000; }
+    int64_t  meanUs() const { return m_count ? m_totalNs / 1000 / m_count : 0; }
+    int64_t  maxUs() const { return m_maxUs; }
+    uint32_t bucket(int i) const { return m_buckets[i]; }
+
+    void dump(FILE* f) const;
+
+private:
+
+    uint32_t m_buckets[kBucketCount];
+    uint32_t m_count;
+    int64_t  m_totalNs;     ///< Kept in ns so many short samples still add up
+    int64_t  m_maxUs;
+};
+
+#endif /* LATENCYHISTOGRAM_H */
@@ -28,6 +28,15 @@ LICENSE@@@ */
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sched.h>
+
+#if (defined(__i386__) || defined(__x86_64__)) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define OFFSCREEN_X86_KERNELS 1
+#include <immintrin.h>
+#endif
 
 extern "C" {
 #include <png.h>
@@ -115,6 +124,128 @@ public:
     ProcessMutex* m_mutex;
 };
 
+// Copies at least this big bypass the cache when the destination is shared
+// memory, they would only evict our own working set for another process to read
+static const int kStreamCopyMinBytes = 256 * 1024;
+
+typedef void (*PrvCopyRowFunc)(uint32_t* dst, const uint32_t* src, int count);
+
+/**
+ * Cached row copy. The C library's memcpy already picks the widest vector
+ * loads and stores the CPU has.
+ */
+static void PrvCopyRow(uint32_t* dst, const uint32_t* src, int count)
+{
+    ::memcpy(dst, src, count * sizeof(uint32_t));
+}
+
+#ifdef OFFSCREEN_X86_KERNELS
+
+__attribute__((target("sse2")))
+static void PrvStreamRowSSE2(uint32_t* dst, const uint32_t* src, int count)
+{
+    // Non-temporal stores need an aligned destination
+    while (count > 0 && ((uintptr_t) dst & 15)) {
+        *dst++ = *src++;
+        count--;
+    }
+
+    for (; count >= 16; count -= 16, src += 16, dst += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*) (src + 0));
+        __m128i b = _mm_loadu_si128((const __m128i*) (src + 4));
+        __m128i c = _mm_loadu_si128((const __m128i*) (src + 8));
+        __m128i d = _mm_loadu_si128((const __m128i*) (src + 12));
+        _mm_stream_si128((__m128i*) (dst + 0), a);
+        _mm_stream_si128((__m128i*) (dst + 4), b);
+        _mm_stream_si128((__m128i*) (dst + 8), c);
+        _mm_stream_si128((__m128i*) (dst + 12), d);
+    }
+
+    while (count-- > 0)
+        *dst++ = *src++;
+}
+
+__attribute__((target("avx2")))
+static void PrvStreamRowAVX2(uint32_t* dst, const uint32_t* src, int count)
+{
+    while (count > 0 && ((uintptr_t) dst & 31)) {
+        *dst++ = *src++;
+        count--;
+    }
+
+    for (; count >= 32; count -= 32, src += 32, dst += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*) (src + 0));
+        __m256i b = _mm256_loadu_si256((const __m256i*) (src + 8));
+        __m256i c = _mm256_loadu_si256((const __m256i*) (src + 16));
+        __m256i d = _mm256_loadu_si256((const __m256i*) (src + 24));
+        _mm256_stream_si256((__m256i*) (dst + 0), a);
+        _mm256_stream_si256((__m256i*) (dst + 8), b);
+        _mm256_stream_si256((__m256i*) (dst + 16), c);
+        _mm256_stream_si256((__m256i*) (dst + 24), d);
+    }
+
+    while (count-- > 0)
+        *dst++ = *src++;
+}
+
+#endif // OFFSCREEN_X86_KERNELS
+
+/**
+ * Pick the non-temporal row copy for this CPU once, or the cached one where
+ * there is none.
+ */
+static PrvCopyRowFunc PrvStreamRowKernel()
+{
+    static PrvCopyRowFunc kernel = 0;
+
+    if (!kernel) {
+        kernel = PrvCopyRow;
+#ifdef OFFSCREEN_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            kernel = PrvStreamRowAVX2;
+        else if (__builtin_cpu_supports("sse2"))
+            kernel = PrvStreamRowSSE2;
+#endif
+    }
+
+    return kernel;
+}
+
+/**
+ * Copy a rectangle of pixels row by row.
+ *
+ * @param stream Allow non-temporal stores, for destinations that another
+ *               process reads next.
+ */
+static void PrvCopyRect(uint32_t* dst, int dstStride, const uint32_t* src, int srcStride, int width, int height, bool stream)
+{
+    if (width <= 0 || height <= 0)
+        return;
+
+    // Rows that follow each other on both sides are a single copy
+    if (width == dstStride && width == srcStride) {
+        width *= height;
+        height = 1;
+    }
+
+    PrvCopyRowFunc copyRow = PrvCopyRow;
+    if (stream && width * height * (int) sizeof(uint32_t) >= kStreamCopyMinBytes)
+        copyRow = PrvStreamRowKernel();
+
+    for (int j = height; j > 0; j--) {
+        copyRow(dst, src, width);
+        src += srcStride;
+        dst += dstStride;
+    }
+
+#ifdef OFFSCREEN_X86_KERNELS
+    // Make the streamed pixels visible before the buffer mutex is released
+    if (copyRow != PrvCopyRow)
+        _mm_sfence();
+#endif
+}
+
 
 OffscreenBuffer::OffscreenBuffer(int width, int height)
     : m_mutex(0)
@@ -126,6 +257,7 @@ OffscreenBuffer::OffscreenBuffer(int width, int height)
         return;
 
     BufferInfo* info = (BufferInfo*) m_mutex->data();
+    info->sequence = 0;
     info->bufferWidth = width;
     info->bufferHeight = height;
 
@@ -207,11 +339,11 @@ OffscreenBuffer::~OffscreenBuffer()
 
 void OffscreenBuffer::getDimensions(int& width, int& height)
 {
-    OffscreenMutexLocker locker(m_mutex);
+    BufferInfo info;
+    readInfo(info);
 
-    BufferInfo* info = (BufferInfo*) m_mutex->data();
-    width = info->width;
-    height = info->height;
+    width = info.width;
+    height = info.height;
 }
 
 /**
@@ -224,13 +356,63 @@ void OffscreenBuffer::getDimensions(int& width, int& height)
  */
 void OffscreenBuffer::getContentRect(int& cx, int& cy, int& cw, int& ch)
 {
-    OffscreenMutexLocker locker(m_mutex);
+    BufferInfo info;
+    readInfo(info);
 
+    cx = info.scrollX;
+    cy = info.scrollY;
+    cw = info.width;
+    ch = info.height;
+}
+
+// Yields readInfo() waits for a writer before giving up on a consistent copy
+static const int kMaxInfoReadRetries = 1000;
+
+/**
+ * Take a consistent copy of the metadata without the mutex, which may be held
+ * for a long pixel copy. Changes are published with an odd/even sequence
+ * count by beginInfoUpdate() and endInfoUpdate().
+ *
+ * A writer that died in the middle of an update leaves the count odd for good,
+ * so after kMaxInfoReadRetries the copy is taken as it is.
+ */
+void OffscreenBuffer::readInfo(BufferInfo& snapshot) const
+{
+    const BufferInfo* info = (const BufferInfo*) m_mutex->data();
+
+    for (int tries = 0; ; tries++) {
+        uint32_t seq = info->sequence;
+
+        __sync_synchronize();
+        ::memcpy(&snapshot, (const void*) info, sizeof(BufferInfo));
+        __sync_synchronize();
+
+        if (!(seq & 1) && info->sequence == seq)
+            return;
+
+        if (tries == kMaxInfoReadRetries) {
+            fprintf(stderr, "OffscreenBuffer: metadata stuck in an update, using it as it is\n");
+            return;
+        }
+
+        // The writer is only a few stores away from done, unless it got preempted
+        sched_yield();
+    }
+}
+
+// Writers hold the mutex, these only keep readInfo() callers out
+void OffscreenBuffer::beginInfoUpdate()
+{
     BufferInfo* info = (BufferInfo*) m_mutex->data();
-    cx = info->scrollX;
-    cy = info->scrollY;
-    cw = info->width;
-    ch = info->height;
+    info->sequence++;
+    __sync_synchronize();
+}
+
+void OffscreenBuffer::endInfoUpdate()
+{
+    BufferInfo* info = (BufferInfo*) m_mutex->data();
+    __sync_synchronize();
+    info->sequence++;
 }
 
 void OffscreenBuffer::viewportSizeChanged(int w, int h)
@@ -238,19 +420,19 @@ void OffscreenBuffer::viewportSizeChanged(int w, int h)
     OffscreenMutexLocker locker(m_mutex);
 
     BufferInfo* info = (BufferInfo*) m_mutex->data();
-    info->viewportWidth = w;
-    info->viewportHeight = h;
 
-    if (info->viewportWidth  > info->width ||
-        info->viewportHeight > info->height) {
+    if (w > info->width || h > info->height) {
         printf("OffscreenBuffer: internal buffer size is smaller than the viewport size: "
                " viewport (%d, %d) buffer (%d, %d)\n",
-               info->viewportWidth, info->viewportHeight,
-               info->width, info->height);
+               w, h, info->width, info->height);
     }
 
+    beginInfoUpdate();
+    info->viewportWidth = w;
+    info->viewportHeight = h;
     info->xPadding = abs(info->width - info->viewportWidth) / 2;
     info->yPadding = abs(info->height - info->viewportHeight) / 2;
+    endInfoUpdate();
 }
 
 void OffscreenBuffer::contentsSizeChanged(int w, int h)
@@ -261,8 +443,13 @@ void OffscreenBuffer::contentsSizeChanged(int w, int h)
 
     // If the width doesn't match or the page dimensions changed to 0x0 (which means a url
     // change, we will just invalidate the whole content
-    if (info->contentsWidth != w || (w == 0 && h == 0)) {
+    bool reset = info->contentsWidth != w || (w == 0 && h == 0);
+    if (reset)
         invalidate();
+
+    beginInfoUpdate();
+
+    if (reset) {
         info->scrollX = - info->bufferWidth;
         info->scrollY = - info->bufferHeight;
     }
@@ -286,9 +473,6 @@ void OffscreenBuffer::contentsSizeChanged(int w, int h)
         info->stride = info->width;
         info->xPadding = abs(info->width - info->viewportWidth) / 2;
         info->yPadding = abs(info->height - info->viewportHeight) / 2;
-
-        printf("Contents changed: %d, %d    %d, %d, %d, %d\n",
-               w, h, info->width, info->height, info->xPadding, info->yPadding);
     }
     else {
 
@@ -297,23 +481,22 @@ void OffscreenBuffer::contentsSizeChanged(int w, int h)
         info->height = (info->bufferWidth * info->bufferHeight) / info->width;
         info->height = MIN(h, info->height);
         info->yPadding = (info->height - info->viewportHeight) / 2;
-
-        printf("Contents changed: %d, %d    %d, %d, %d, %d\n",
-               w, h,
-               info->width, info->height, info->xPadding, info->yPadding);
     }
 
     info->contentsWidth = w;
     info->contentsHeight = h;
+
+    endInfoUpdate();
 }
 
 bool OffscreenBuffer::scrollChanged(int& x, int& y)
 {
     bool ret = false;
 
-    OffscreenMutexLocker locker(m_mutex);
-
-    BufferInfo* info = (BufferInfo*) m_mutex->data();
+    // Only reads the metadata
+    BufferInfo snapshot;
+    readInfo(snapshot);
+    const BufferInfo* info = &snapshot;
 
     if (x + info->viewportWidth > info->contentsWidth)
         x = info->contentsWidth - info->viewportWidth;
@@ -395,29 +578,13 @@ void OffscreenBuffer::copyFromBuffer(uint32_t* srcBuffer, int srcStride, int src
     OffscreenRect dstRect(info->scrollX, info->scrollY, info->scrollX + info->width, info->scrollY + info->height);
     srcRect.intersect(dstRect);
 
-    uint32_t* src = 0;
-    uint32_t* dst = 0;
-    uint32_t* sp = 0;
-    uint32_t* dp = 0;
-
     if (srcRect.empty())
         return;
 
-    src = srcBuffer + (srcRect.top - srcPositionY) * srcStride + (srcRect.left - srcPositionX);
-    dst = m_buffer + (srcRect.top - info->scrollY) * info->stride + (srcRect.left - info->scrollX);
-
-    for (int j = (srcRect.bottom - srcRect.top); j > 0; j--) {
-        sp = src;
-        dp = dst;
-        src += srcStride;
-        dst += info->stride;
-
-        for (int i = (srcRect.right - srcRect.left); i > 0; i--) {
-            *dp++ = *sp++;
+    uint32_t* src = srcBuffer + (srcRect.top - srcPositionY) * srcStride + (srcRect.left - srcPositionX);
+    uint32_t* dst = m_buffer + (srcRect.top - info->scrollY) * info->stride + (srcRect.left - info->scrollX);
 
-            __builtin_prefetch(sp + 16);
-        }
-    }
+    PrvCopyRect(dst, info->stride, src, srcStride, srcRect.right - srcRect.left, srcRect.bottom - srcRect.top, true);
 }
 
 void OffscreenBuffer::copyFromBuffer(uint32_t* srcBuffer, int srcStride, int srcPositionX, int srcPositionY, int srcSizeWidth, int srcSizeHeight, int newScrollX, int newScrollY)
@@ -426,13 +593,10 @@ void OffscreenBuffer::copyFromBuffer(uint32_t* srcBuffer, int srcStride, int src
 
     BufferInfo* info = (BufferInfo*) m_mutex->data();
 
-    // updating the scroll position
+    // updating the scroll position, keeping what is still in view
     //printf("Setting scroll position: %d, %d\n", newScrollX, newScrollY);
 
-    info->scrollX = newScrollX;
-    info->scrollY = newScrollY;
-
-    invalidate();
+    scrollContentsLocked(newScrollX, newScrollY, 0);
 
     // updating the buffer
 
@@ -447,29 +611,118 @@ void OffscreenBuffer::copyFromBuffer(uint32_t* srcBuffer, int srcStride, int src
 
     // printf("Final srcRect: %d:%d, %d:%d\n", srcRect.left, srcRect.right, srcRect.top, srcRect.bottom);
 
-    uint32_t* src = 0;
-    uint32_t* dst = 0;
-    uint32_t* sp = 0;
-    uint32_t* dp = 0;
-
     if (srcRect.empty())
         return;
 
-    src = srcBuffer + (srcRect.top - srcPositionY) * srcStride + (srcRect.left - srcPositionX);
-    dst = m_buffer + (srcRect.top - info->scrollY) * info->stride + (srcRect.left - info->scrollX);
+    uint32_t* src = srcBuffer + (srcRect.top - srcPositionY) * srcStride + (srcRect.left - srcPositionX);
+    uint32_t* dst = m_buffer + (srcRect.top - info->scrollY) * info->stride + (srcRect.left - info->scrollX);
 
-    for (int j = (srcRect.bottom - srcRect.top); j > 0; j--) {
-        sp = src;
-        dp = dst;
-        src += srcStride;
-        dst += info->stride;
+    PrvCopyRect(dst, info->stride, src, srcStride, srcRect.right - srcRect.left, srcRect.bottom - srcRect.top, true);
+}
 
-        for (int i = (srcRect.right - srcRect.left); i > 0; i--) {
-            *dp++ = *sp++;
+/**
+ * Move the buffer to a new scroll position, keeping the pixels that stay in
+ * view instead of invalidating everything.
+ *
+ * @param exposed Filled with the parts of the page that came into view. They
+ *                are left white and have to be painted with copyFromBuffer().
+ *
+ * @return The number of rectangles in exposed.
+ */
+int OffscreenBuffer::scrollContents(int newScrollX, int newScrollY, ExposedRect exposed[kMaxExposedRects])
+{
+    OffscreenMutexLocker locker(m_mutex);
+
+    return scrollContentsLocked(newScrollX, newScrollY, exposed);
+}
 
-            __builtin_prefetch(sp + 16);
+static void PrvFillRect(uint32_t* dst, int stride, int width, int height)
+{
+    for (int j = height; j > 0; j--) {
+        ::memset(dst, 0xFF, width * sizeof(uint32_t));
+        dst += stride;
+    }
+}
+
+int OffscreenBuffer::scrollContentsLocked(int newScrollX, int newScrollY, ExposedRect* exposed)
+{
+    BufferInfo* info = (BufferInfo*) m_mutex->data();
+
+    OffscreenRect oldRect(info->scrollX, info->scrollY, info->scrollX + info->width, info->scrollY + info->height);
+    OffscreenRect newRect(newScrollX, newScrollY, newScrollX + info->width, newScrollY + info->height);
+
+    beginInfoUpdate();
+    info->scrollX = newScrollX;
+    info->scrollY = newScrollY;
+    endInfoUpdate();
+
+    if (newRect.empty())
+        return 0;
+
+    OffscreenRect keep(oldRect);
+    keep.intersect(newRect);
+
+    if (keep.empty()) {
+        invalidate();
+        if (exposed) {
+            exposed[0].left   = newRect.left;
+            exposed[0].top    = newRect.top;
+            exposed[0].right  = newRect.right;
+            exposed[0].bottom = newRect.bottom;
+        }
+        return 1;
+    }
+
+    // Move the rows that stay in view, walking away from the side they move
+    // towards so that none is overwritten before it has been moved
+    int width = keep.right - keep.left;
+    int height = keep.bottom - keep.top;
+    uint32_t* src = m_buffer + (keep.top - oldRect.top) * info->stride + (keep.left - oldRect.left);
+    uint32_t* dst = m_buffer + (keep.top - newRect.top) * info->stride + (keep.left - newRect.left);
+
+    if (src != dst) {
+        int step = info->stride;
+        if (dst > src) {
+            src += (height - 1) * step;
+            dst += (height - 1) * step;
+            step = -step;
+        }
+
+        for (int j = height; j > 0; j--) {
+            ::memmove(dst, src, width * sizeof(uint32_t));
+            src += step;
+            dst += step;
+        }
+    }
+
+    // A translation exposes at most one horizontal and one vertical strip
+    OffscreenRect strips[kMaxExposedRects];
+    int count = 0;
+
+    if (keep.top > newRect.top)
+        strips[count++] = OffscreenRect(newRect.left, newRect.top, newRect.right, keep.top);
+    else if (keep.bottom < newRect.bottom)
+        strips[count++] = OffscreenRect(newRect.left, keep.bottom, newRect.right, newRect.bottom);
+
+    if (keep.left > newRect.left)
+        strips[count++] = OffscreenRect(newRect.left, keep.top, keep.left, keep.bottom);
+    else if (keep.right < newRect.right)
+        strips[count++] = OffscreenRect(keep.right, keep.top, newRect.right, keep.bottom);
+
+    for (int i = 0; i < count; i++) {
+        const OffscreenRect& r = strips[i];
+        PrvFillRect(m_buffer + (r.top - newRect.top) * info->stride + (r.left - newRect.left),
+                    info->stride, r.right - r.left, r.bottom - r.top);
+
+        if (exposed) {
+            exposed[i].left   = r.left;
+            exposed[i].top    = r.top;
+            exposed[i].right  = r.right;
+            exposed[i].bottom = r.bottom;
         }
     }
+
+    return count;
 }
 
 void OffscreenBuffer::copyToBuffer(uint32_t* dstBuffer, int dstStride, int dstPositionX, int dstPositionY, int dstSizeWidth, int dstSizeHeight)
@@ -483,106 +736,354 @@ void OffscreenBuffer::copyToBuffer(uint32_t* dstBuffer, int dstStride, int dstPo
 
     srcRect.intersect(dstRect);
 
-    uint32_t* src = 0;
-    uint32_t* dst = 0;
-    uint32_t* sp = 0;
-    uint32_t* dp = 0;
-
     if (srcRect.empty())
         return;
 
     //printf("src Rect: %d:%d, %d:%d\n", srcRect.left, srcRect.right, srcRect.top, srcRect.bottom);
 
-    src = m_buffer + (srcRect.top - info->scrollY) * info->stride + (srcRect.left - info->scrollX);
-    dst = dstBuffer + (srcRect.top - dstRect.top) * dstStride + (srcRect.left - dstRect.left);
+    uint32_t* src = m_buffer + (srcRect.top - info->scrollY) * info->stride + (srcRect.left - info->scrollX);
+    uint32_t* dst = dstBuffer + (srcRect.top - dstRect.top) * dstStride + (srcRect.left - dstRect.left);
 
-    for (int j = (srcRect.bottom - srcRect.top); j > 0; j--) {
-        sp = src;
-        dp = dst;
-        src += info->stride;
-        dst += dstStride;
-        for (int i = (srcRect.right - srcRect.left); i > 0; i--) {
-            *dp++ = *sp++;
+    PrvCopyRect(dst, dstStride, src, info->stride, srcRect.right - srcRect.left, srcRect.bottom - srcRect.top, false);
+}
+
+// Scales with fewer destination pixels than this aren't worth waking up workers
+static const int kScaleParallelMinPixels = 128 * 1024;
+static const int kScaleMaxThreads = 4;
+
+/**
+ * One scale operation. The column tables are shared by all row bands.
+ *
+ * This is plain scalar code. The table lookups make the inner loops gathers,
+ * which compilers don't vectorize, so the speed comes from fixed point math,
+ * blending two channels per multiply and splitting big scales across threads.
+ */
+struct PrvScaleJob
+{
+    const uint32_t* src;
+    int             srcWidth;
+    int             srcHeight;
+    int             srcStride;
+    uint32_t*       dst;
+    int             dstWidth;
+    int             dstHeight;
+    int             dstStride;
+    OffscreenBuffer::ScaleFilter filter;
+
+    int*            x0;     ///< Source column, the first one for bilinear and box
+    int*            x1;     ///< Second column for bilinear, end of the span for box
+    int*            xw;     ///< Weight of x1 for bilinear, 0 to 256
+};
+
+struct PrvScaleBand
+{
+    PrvScaleJob*    job;
+    int             firstRow;
+    int             endRow;
+    pthread_mutex_t* lock;
+    pthread_cond_t* done;
+    int*            pending;
+};
+
+/**
+ * Map a destination position to a source position with pixel centers lined
+ * up, in 16.16 fixed point.
+ */
+static inline int PrvSourcePosition(int dst, int srcLen, int dstLen)
+{
+    int64_t pos = ((int64_t) (2 * dst + 1) * srcLen << 16) / (2 * dstLen) - 0x8000;
+    return (int) MAX(pos, (int64_t) 0);
+}
+
+/**
+ * Blend two pixels, two channels at a time. w is the weight of b, 0 to 256.
+ */
+static inline uint32_t PrvLerp(uint32_t a, uint32_t b, uint32_t w)
+{
+    uint32_t rb = ((a & 0x00FF00FF) * (256 - w) + (b & 0x00FF00FF) * w) >> 8;
+    uint32_t ag = (((a >> 8) & 0x00FF00FF) * (256 - w) + ((b >> 8) & 0x00FF00FF) * w) >> 8;
+
+    return (rb & 0x00FF00FF) | ((ag << 8) & 0xFF00FF00);
+}
+
+/**
+ * Step of the nearest filter in 16.16 fixed point. First and last pixels line
+ * up, the way scaleToBuffer always sampled, so existing callers get the same
+ * pixels as before the filters were added.
+ */
+static inline uint32_t PrvNearestStep(int srcLen, int dstLen)
+{
+    return dstLen > 1 ? ((srcLen - 1) << 16) / (dstLen - 1) : 0;
+}
 
-            __builtin_prefetch(sp + 16);
+static void PrvScaleNearestRows(const PrvScaleJob& job, int firstRow, int endRow)
+{
+    uint32_t yStep = PrvNearestStep(job.srcHeight, job.dstHeight);
+    int prevY = -1;
+
+    for (int j = firstRow; j < endRow; j++) {
+        int y = MIN((int) (((uint32_t) j * yStep) >> 16), job.srcHeight - 1);
+        uint32_t* dp = job.dst + j * job.dstStride;
+
+        // Enlarging repeats rows, copy the one just done
+        if (y == prevY) {
+            ::memcpy(dp, dp - job.dstStride, job.dstWidth * sizeof(uint32_t));
+            continue;
         }
+
+        const uint32_t* sp = job.src + y * job.srcStride;
+        for (int i = 0; i < job.dstWidth; i++)
+            dp[i] = sp[job.x0[i]];
+
+        prevY = y;
     }
 }
 
-static void PrvScale(uint32_t* src, int srcWidth, int srcHeight, int srcStride, uint32_t* dst, int dstWidth, int dstHeight, int dstStride)
+static void PrvScaleRowHorizontal(const PrvScaleJob& job, int y, uint32_t* row)
 {
-    uint32_t  xinc, yinc;
-    uint32_t  *sp, *sptr;
-    uint32_t  *dp, *dptr;
-    uint32_t  xacc, yacc;
-    uint32_t  iindex, jindex;
-    int32_t   i, j;
+    const uint32_t* sp = job.src + y * job.srcStride;
+    for (int i = 0; i < job.dstWidth; i++)
+        row[i] = PrvLerp(sp[job.x0[i]], sp[job.x1[i]], job.xw[i]);
+}
 
-    if (srcWidth <= 1 || srcHeight <= 1 || dstWidth <= 1 || dstHeight <= 1)
-        return;
+static void PrvScaleBilinearRows(const PrvScaleJob& job, int firstRow, int endRow)
+{
+    // The last two source rows scaled horizontally
+    uint32_t* rows[2] = { new uint32_t[job.dstWidth], new uint32_t[job.dstWidth] };
+    int rowY[2] = { -1, -1 };
+
+    for (int j = firstRow; j < endRow; j++) {
+        int pos = PrvSourcePosition(j, job.srcHeight, job.dstHeight);
+        int y0 = MIN(pos >> 16, job.srcHeight - 1);
+        int y1 = MIN(y0 + 1, job.srcHeight - 1);
+        uint32_t w = (pos & 0xFFFF) >> 8;
+
+        if (rowY[0] != y0) {
+            if (rowY[1] == y0) {
+                uint32_t* tmp = rows[0];
+                rows[0] = rows[1];
+                rows[1] = tmp;
+                rowY[1] = -1;
+            }
+            else {
+                PrvScaleRowHorizontal(job, y0, rows[0]);
+            }
+            rowY[0] = y0;
+        }
+        if (rowY[1] != y1) {
+            PrvScaleRowHorizontal(job, y1, rows[1]);
+            rowY[1] = y1;
+        }
+
+        uint32_t* dp = job.dst + j * job.dstStride;
+        const uint32_t* r0 = rows[0];
+        const uint32_t* r1 = rows[1];
+        for (int i = 0; i < job.dstWidth; i++)
+            dp[i] = PrvLerp(r0[i], r1[i], w);
+    }
+
+    delete [] rows[0];
+    delete [] rows[1];
+}
 
-    xinc = ((srcWidth  - 1) << 16) / (dstWidth  - 1);
-    yinc = ((srcHeight - 1) << 16) / (dstHeight - 1);
+static void PrvScaleBoxRows(const PrvScaleJob& job, int firstRow, int endRow)
+{
+    // Channel sums of each destination pixel of the current row
+    uint32_t* acc = new uint32_t[job.dstWidth * 4];
+
+    for (int j = firstRow; j < endRow; j++) {
+        int y0 = (int) ((int64_t) j * job.srcHeight / job.dstHeight);
+        int y1 = MAX((int) ((int64_t) (j + 1) * job.srcHeight / job.dstHeight), y0 + 1);
+
+        ::memset(acc, 0, job.dstWidth * 4 * sizeof(uint32_t));
+
+        for (int y = y0; y < y1; y++) {
+            const uint32_t* sp = job.src + y * job.srcStride;
+            uint32_t* a = acc;
+            for (int i = 0; i < job.dstWidth; i++, a += 4) {
+                for (int x = job.x0[i]; x < job.x1[i]; x++) {
+                    uint32_t p = sp[x];
+                    a[0] += p & 0xFF;
+                    a[1] += (p >> 8) & 0xFF;
+                    a[2] += (p >> 16) & 0xFF;
+                    a[3] += p >> 24;
+                }
+            }
+        }
+
+        // Divided exactly, a 16 bit reciprocal loses too much for big spans
+        uint32_t* dp = job.dst + j * job.dstStride;
+        const uint32_t* a = acc;
+        for (int i = 0; i < job.dstWidth; i++, a += 4) {
+            uint32_t area = (job.x1[i] - job.x0[i]) * (y1 - y0);
+            uint32_t half = area / 2;
+            dp[i] = (a[0] + half) / area |
+                    (a[1] + half) / area << 8 |
+                    (a[2] + half) / area << 16 |
+                    (a[3] + half) / area << 24;
+        }
+    }
+
+    delete [] acc;
+}
 
-    sp = src;
-    dp = dst;
+static void PrvScaleRows(const PrvScaleJob& job, int firstRow, int endRow)
+{
+    switch (job.filter) {
+    case OffscreenBuffer::ScaleNearest:
+        PrvScaleNearestRows(job, firstRow, endRow);
+        break;
+    case OffscreenBuffer::ScaleBox:
+        PrvScaleBoxRows(job, firstRow, endRow);
+        break;
+    case OffscreenBuffer::ScaleBilinear:
+    default:
+        PrvScaleBilinearRows(job, firstRow, endRow);
+        break;
+    }
+}
 
-    yacc = 0;
-    for (j = 0; j < dstHeight; j++)
-    {
-        jindex = yacc >> 16;
+static void PrvScaleBandJob(gpointer data, gpointer userData)
+{
+    PrvScaleBand* band = static_cast<PrvScaleBand*>(data);
 
-        sptr = sp + jindex * srcStride;
-        dptr = dp + j * dstStride;
+    PrvScaleRows(*band->job, band->firstRow, band->endRow);
 
-        xacc = 0;
+    pthread_mutex_lock(band->lock);
+    if (--(*band->pending) == 0)
+        pthread_cond_signal(band->done);
+    pthread_mutex_unlock(band->lock);
+}
+
+static GThreadPool* s_scalePool = 0;
+static pthread_once_t s_scalePoolOnce = PTHREAD_ONCE_INIT;
+
+static void PrvCreateScalePool()
+{
+    int workers = MIN((int) sysconf(_SC_NPROCESSORS_ONLN), kScaleMaxThreads) - 1;
+    if (workers <= 0 || !g_thread_supported())
+        return;
 
-        for (i = dstWidth; i > 0; i--)
-        {
-            iindex = xacc >> 16;
-            *dptr++ = *(sptr + iindex);
-            xacc += xinc;
+    s_scalePool = g_thread_pool_new(PrvScaleBandJob, NULL, workers, FALSE, NULL);
+}
+
+/**
+ * Scale src into dst, split into row bands on the worker threads for big
+ * images. The calling thread takes the first band and waits for the rest.
+ */
+static void PrvScale(const uint32_t* src, int srcWidth, int srcHeight, int srcStride,
+                     uint32_t* dst, int dstWidth, int dstHeight, int dstStride,
+                     OffscreenBuffer::ScaleFilter filter)
+{
+    if (srcWidth <= 0 || srcHeight <= 0 || dstWidth <= 0 || dstHeight <= 0)
+        return;
+
+    // Box filtering only makes sense when shrinking
+    if (filter == OffscreenBuffer::ScaleBox && (dstWidth > srcWidth || dstHeight > srcHeight))
+        filter = OffscreenBuffer::ScaleBilinear;
+
+    PrvScaleJob job;
+    job.src       = src;
+    job.srcWidth  = srcWidth;
+    job.srcHeight = srcHeight;
+    job.srcStride = srcStride;
+    job.dst       = dst;
+    job.dstWidth  = dstWidth;
+    job.dstHeight = dstHeight;
+    job.dstStride = dstStride;
+    job.filter    = filter;
+    job.x0        = new int[dstWidth];
+    job.x1        = new int[dstWidth];
+    job.xw        = new int[dstWidth];
+
+    uint32_t xStep = PrvNearestStep(srcWidth, dstWidth);
+
+    for (int i = 0; i < dstWidth; i++) {
+        if (filter == OffscreenBuffer::ScaleNearest) {
+            job.x0[i] = MIN((int) (((uint32_t) i * xStep) >> 16), srcWidth - 1);
+            job.x1[i] = job.x0[i];
+            job.xw[i] = 0;
         }
+        else if (filter == OffscreenBuffer::ScaleBox) {
+            job.x0[i] = (int) ((int64_t) i * srcWidth / dstWidth);
+            job.x1[i] = MAX((int) ((int64_t) (i + 1) * srcWidth / dstWidth), job.x0[i] + 1);
+            job.xw[i] = 0;
+        }
+        else {
+            int pos = PrvSourcePosition(i, srcWidth, dstWidth);
+            job.x0[i] = MIN(pos >> 16, srcWidth - 1);
+            job.x1[i] = MIN(job.x0[i] + 1, srcWidth - 1);
+            job.xw[i] = (pos & 0xFFFF) >> 8;
+        }
+    }
+
+    int bandCount = 1;
+    if (dstWidth * dstHeight >= kScaleParallelMinPixels) {
+        pthread_once(&s_scalePoolOnce, PrvCreateScalePool);
+        if (s_scalePool)
+            bandCount = MIN(kScaleMaxThreads, dstHeight);
+    }
 
-        yacc  += yinc;
+    if (bandCount == 1) {
+        PrvScaleRows(job, 0, dstHeight);
     }
+    else {
+        pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+        pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+        int pending = bandCount - 1;
+        PrvScaleBand bands[kScaleMaxThreads];
+
+        for (int b = 0; b < bandCount; b++) {
+            bands[b].job      = &job;
+            bands[b].firstRow = dstHeight * b / bandCount;
+            bands[b].endRow   = dstHeight * (b + 1) / bandCount;
+            bands[b].lock     = &lock;
+            bands[b].done     = &done;
+            bands[b].pending  = &pending;
+            if (b > 0)
+                g_thread_pool_push(s_scalePool, &bands[b], NULL);
+        }
+
+        PrvScaleRows(job, bands[0].firstRow, bands[0].endRow);
+
+        pthread_mutex_lock(&lock);
+        while (pending > 0)
+            pthread_cond_wait(&done, &lock);
+        pthread_mutex_unlock(&lock);
+
+        pthread_cond_destroy(&done);
+        pthread_mutex_destroy(&lock);
+    }
+
+    delete [] job.x0;
+    delete [] job.x1;
+    delete [] job.xw;
 }
 
-void OffscreenBuffer::scaleToBuffer(uint32_t* dstBuffer, int dstStride, int dstLeft, int dstTop, int dstRight, int dstBottom, int srcLeft, int srcTop, int srcRight, int srcBottom, double scale)
+void OffscreenBuffer::scaleToBuffer(uint32_t* dstBuffer, int dstStride, int dstLeft, int dstTop, int dstRight, int dstBottom, int srcLeft, int srcTop, int srcRight, int srcBottom, double scale, ScaleFilter filter)
 {
     OffscreenMutexLocker locker(m_mutex);
 
     BufferInfo* info = (BufferInfo*) m_mutex->data();
 
-    printf("Src: %d:%d, %d:%d\n", srcLeft, srcRight, srcTop, srcBottom);
-    printf("Dst: %d:%d, %d:%d\n", dstLeft, dstRight, dstTop, dstBottom);
-
     OffscreenRect srcRect(srcLeft, srcTop, srcRight, srcBottom);
-
     OffscreenRect bufferRect(info->scrollX, info->scrollY, info->scrollX + info->width, info->scrollY + info->height);
 
-    printf("Buf: %d:%d, %d:%d\n", bufferRect.left, bufferRect.right, bufferRect.top, bufferRect.bottom);
-
     srcRect.intersect(bufferRect);
     if (srcRect.empty())
         return;
 
-    printf("Int: %d:%d, %d:%d\n", srcRect.left, srcRect.right, srcRect.top, srcRect.bottom);
-
-    uint32_t* src = 0;
-    uint32_t* dst = 0;
-
     OffscreenRect dstScaledRect((int) (srcRect.left * scale), (int) (srcRect.top * scale), (int) (srcRect.right * scale), (int) (srcRect.bottom * scale));
-
     dstScaledRect.intersect(OffscreenRect(dstLeft, dstTop, dstRight, dstBottom));
+    if (dstScaledRect.empty())
+        return;
 
-    printf("Mod: %d:%d, %d:%d\n", dstScaledRect.left, dstScaledRect.right, dstScaledRect.top, dstScaledRect.bottom);
-
-
-    src = m_buffer + (srcRect.top - info->scrollY) * info->stride + (srcRect.left - info->scrollX);
-    dst = dstBuffer + (dstScaledRect.top - dstTop) * dstStride + (dstScaledRect.left - dstLeft);
+    uint32_t* src = m_buffer + (srcRect.top - info->scrollY) * info->stride + (srcRect.left - info->scrollX);
+    uint32_t* dst = dstBuffer + (dstScaledRect.top - dstTop) * dstStride + (dstScaledRect.left - dstLeft);
 
-    PrvScale(src, srcRect.right - srcRect.left, srcRect.bottom - srcRect.top, info->stride, dst, dstScaledRect.right - dstScaledRect.left, dstScaledRect.bottom - dstScaledRect.top, dstStride);
+    PrvScale(src, srcRect.right - srcRect.left, srcRect.bottom - srcRect.top, info->stride,
+             dst, dstScaledRect.right - dstScaledRect.left, dstScaledRect.bottom - dstScaledRect.top, dstStride,
+             filter);
 }
 
 void OffscreenBuffer::dump(const char* fileName)
@@ -620,8 +1121,64 @@ void OffscreenBuffer::dump(const char* fileName)
     }
 }
 
+OffscreenBuffer::PngOptions OffscreenBuffer::pngDefaultOptions()
+{
+    PngOptions options = { -1, PngFilterDefault, true };
+    return options;
+}
+
 /**
- * Write the offscreen browser image buffer to a 32-bit lossless PNG file.
+ * For thumbnails and captures that are thrown away soon.
+ */
+OffscreenBuffer::PngOptions OffscreenBuffer::pngFastOptions()
+{
+    PngOptions options = { 1, PngFilterNone, false };
+    return options;
+}
+
+/**
+ * For images that are kept.
+ */
+OffscreenBuffer::PngOptions OffscreenBuffer::pngSmallOptions()
+{
+    PngOptions options = { 9, PngFilterAdaptive, true };
+    return options;
+}
+
+// Buffer pixels are 0xAARRGGBB, PNG wants R, G, B (, A) bytes. The buffer
+// alpha isn't meaningful, the image is always opaque.
+
+static void PrvSwizzleRgba(uint8_t* dst, const uint32_t* src, int count)
+{
+    uint32_t* dp = reinterpret_cast<uint32_t*>(dst);
+    for (int i = 0; i < count; i++) {
+        uint32_t p = src[i];
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+        dp[i] = ((p >> 16) & 0xFF) | (p & 0xFF00) | ((p & 0xFF) << 16) | 0xFF000000;
+#else
+        dp[i] = (p << 8) | 0xFF;
+#endif
+    }
+}
+
+static void PrvSwizzleRgb(uint8_t* dst, const uint32_t* src, int count)
+{
+    for (int i = 0; i < count; i++) {
+        uint32_t p = src[i];
+        dst[0] = p >> 16;
+        dst[1] = p >> 8;
+        dst[2] = p;
+        dst += 3;
+    }
+}
+
+int OffscreenBuffer::writeToFile(FILE* pFile, int viewLeft, int viewTop, int viewRight, int viewBottom) const
+{
+    return writeToFile(pFile, viewLeft, viewTop, viewRight, viewBottom, pngDefaultOptions());
+}
+
+/**
+ * Write the offscreen browser image buffer to a lossless PNG file.
  *
  * @note All coordinates are view relative (i.e. relative to the current scroll position ) and
  * <strong>not</strong> relative to the origin of the page.
@@ -631,109 +1188,98 @@ void OffscreenBuffer::dump(const char* fileName)
  * @param viewTop The top edge of the rectangle to save (view relative).
  * @param viewRight The right edge of the rectangle to save (view relative).
  * @param viewBottom The bottom edge of the rectangle to save (view relative).
+ * @param options Compression settings and pixel format, see pngFastOptions() and pngSmallOptions().
  *
  * @return The error code. Zero means success.
  */
-int OffscreenBuffer::writeToFile(FILE* pFile, int viewLeft, int viewTop, int viewRight, int viewBottom) const
+int OffscreenBuffer::writeToFile(FILE* pFile, int viewLeft, int viewTop, int viewRight, int viewBottom, const PngOptions& options) const
 {
     OffscreenMutexLocker locker(m_mutex);
 
     BufferInfo* info = (BufferInfo*) m_mutex->data();
 
-    int nErr = 0;
-    const png_byte byBitDepth(8);
-    uint32_t* scanline(NULL);
-
     assert( viewTop < viewBottom );
     assert( viewLeft < viewRight );
 
-    png_structp pPngImage = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (NULL == pPngImage) {
-        nErr = ENOMEM; // Don't know why this will fail, let's say insufficient memory.
-    }
-
     int nImgWidth = viewRight - viewLeft;
     int nImgHeight = viewBottom - viewTop;
-    scanline = new uint32_t[nImgWidth];
-    if (NULL == scanline) {
-        nErr = ENOMEM;
-    }
-    ::memset(scanline, 0, nImgWidth*sizeof(uint32_t)); // Just to avoid valgrind warning
-
-    png_infop pPngInfo(NULL);
-    if (!nErr) {
-        pPngInfo = png_create_info_struct(pPngImage);
-        if (NULL == pPngInfo) {
-            nErr = ENOMEM; // Don't know why this will fail, let's say insufficient memory.
-        }
-    }
+    int nBytesPerPixel = options.alpha ? 4 : 3;
 
-    // Initialize I/O
-    if ( !nErr ) {
-        if ( setjmp( png_jmpbuf(pPngImage) ) )
-            nErr = EIO;
-        else
-            png_init_io(pPngImage, pFile);
+    png_structp pPngImage = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop pPngInfo = pPngImage ? png_create_info_struct(pPngImage) : NULL;
+    if (NULL == pPngInfo) {
+        png_destroy_write_struct(&pPngImage, NULL);
+        return ENOMEM; // Don't know why this will fail, let's say insufficient memory.
     }
 
-    // Write the header
-    if ( !nErr ) {
-        if (setjmp(png_jmpbuf(pPngImage))) {
-            nErr = EIO;
-        }
-        else {
-            png_set_IHDR(pPngImage, pPngInfo, nImgWidth, nImgHeight, byBitDepth, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-
-            png_write_info(pPngImage, pPngInfo);
-        }
-    }
+    // Rows are converted into a white scanline, which covers the part of the
+    // view outside the buffer
+    uint8_t* scanline = new uint8_t[nImgWidth * 4];
+    ::memset(scanline, 0xFF, nImgWidth * 4);
 
     OffscreenRect srcRect(info->scrollX, info->scrollY, info->scrollX + info->width, info->scrollY + info->height);
     OffscreenRect dstRect(viewLeft, viewTop, viewRight, viewBottom);
     srcRect.intersect(dstRect);
 
-    // Write the image data
-    if (!srcRect.empty() && !nErr) {
-
-        uint32_t* src = m_buffer + (srcRect.top - info->scrollY) * info->stride + (srcRect.left - info->scrollX);
+    int nErr = 0;
 
-        for (int j = (srcRect.bottom - srcRect.top); !nErr && j > 0; j--) {
+    // libpng reports errors with longjmp, one landing spot covers all calls
+    if (setjmp(png_jmpbuf(pPngImage))) {
+        nErr = EIO;
+    }
+    else {
+        png_init_io(pPngImage, pFile);
+
+        if (options.level >= 0)
+            png_set_compression_level(pPngImage, MIN(options.level, 9));
+
+        switch (options.filter) {
+        case PngFilterNone:
+            png_set_filter(pPngImage, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
+            break;
+        case PngFilterSub:
+            png_set_filter(pPngImage, PNG_FILTER_TYPE_BASE, PNG_FILTER_SUB);
+            break;
+        case PngFilterAdaptive:
+            png_set_filter(pPngImage, PNG_FILTER_TYPE_BASE, PNG_ALL_FILTERS);
+            break;
+        case PngFilterDefault:
+        default:
+            break;
+        }
 
-            uint32_t* sp = src;
-            unsigned char* r = reinterpret_cast<unsigned char*>(scanline);
+        png_set_IHDR(pPngImage, pPngInfo, nImgWidth, nImgHeight, 8,
+                     options.alpha ? PNG_COLOR_TYPE_RGBA : PNG_COLOR_TYPE_RGB,
+                     PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+        png_write_info(pPngImage, pPngInfo);
 
-            src += info->stride;
+        uint8_t* rowStart = scanline + (srcRect.left - viewLeft) * nBytesPerPixel;
+        int rowWidth = srcRect.right - srcRect.left;
+        const uint32_t* src = m_buffer + (srcRect.top - info->scrollY) * info->stride + (srcRect.left - info->scrollX);
 
-            for (int i = (srcRect.right - srcRect.left); !nErr && i > 0; i--) {
-                *r++ = (*sp >> 16) & 0xFF;
-                *r++ = (*sp >>  8) & 0xFF;
-                *r++ = (*sp >>  0) & 0xFF;
-                *r++ = 0xFF;
-                sp++;
+        for (int y = viewTop; y < viewBottom; y++) {
+            bool inBuffer = !srcRect.empty() && y >= srcRect.top && y < srcRect.bottom;
 
-                assert( (r - reinterpret_cast<unsigned char*>(scanline)) <= (nImgWidth*4) );
+            if (inBuffer) {
+                if (options.alpha)
+                    PrvSwizzleRgba(rowStart, src, rowWidth);
+                else
+                    PrvSwizzleRgb(rowStart, src, rowWidth);
+                src += info->stride;
             }
-
-            if (setjmp(png_jmpbuf(pPngImage))) {
-                nErr = EIO;
-            }
-            else {
-                png_write_row( pPngImage, reinterpret_cast<unsigned char*>(scanline) );
+            else if (!srcRect.empty() && y == srcRect.bottom) {
+                // Back to white below the buffer
+                ::memset(scanline, 0xFF, nImgWidth * nBytesPerPixel);
             }
+
+            png_write_row(pPngImage, scanline);
         }
+
+        png_write_end(pPngImage, NULL);
     }
 
+    png_destroy_write_struct(&pPngImage, &pPngInfo);
     delete [] scanline;
 
-    // Close file
-    if ( NULL != pPngImage ) {
-        if (setjmp(png_jmpbuf(pPngImage))) {
-            nErr = EIO;
-        }
-        else {
-            png_write_end(pPngImage, NULL);
-        }
-    }
-
     return nErr;
 }
@@ -26,6 +26,39 @@ class OffscreenBuffer
 {
 public:
 
+    // Part of the page that has to be painted again, in page coordinates
+    struct ExposedRect {
+        int left;
+        int top;
+        int right;
+        int bottom;
+    };
+
+    static const int kMaxExposedRects = 2;
+
+    enum ScaleFilter {
+        ScaleNearest,   ///< Samples with the first and last pixels lined up, the default
+        ScaleBilinear,
+        ScaleBox        ///< Averages the source pixels, for thumbnails. Enlarges like ScaleBilinear
+    };
+
+    enum PngFilter {
+        PngFilterDefault,   ///< Whatever libpng picks
+        PngFilterNone,
+        PngFilterSub,       ///< Cheap, helps with gradients and photos
+        PngFilterAdaptive   ///< Tries all filters on every row, smallest and slowest
+    };
+
+    struct PngOptions {
+        int       level;    ///< zlib level 0 to 9, -1 for the default
+        PngFilter filter;
+        bool      alpha;    ///< RGBA, otherwise RGB
+    };
+
+    static PngOptions pngDefaultOptions();
+    static PngOptions pngFastOptions();
+    static PngOptions pngSmallOptions();
+
     OffscreenBuffer(int width, int height);
     OffscreenBuffer(int key);
     ~OffscreenBuffer();
@@ -42,12 +75,14 @@ public:
     bool scrollAndContentsChanged(int x, int y, int w, int h);
     void copyFromBuffer(uint32_t* srcBuffer, int srcStride, int srcPositionX, int srcPositionY, int srcSizeWidth, int srcSizeHeight);
     void copyFromBuffer(uint32_t* srcBuffer, int srcStride, int srcPositionX, int srcPositionY, int srcSizeWidth, int srcSizeHeight, int newScrollX, int newScrollY);
+    int  scrollContents(int newScrollX, int newScrollY, ExposedRect exposed[kMaxExposedRects]);
 
     // To be used from the client side
     void copyToBuffer(uint32_t* dstBuffer, int dstStride, int dstPositionX, int dstPositionY, int dstSizeWidth, int dstSizeHeight);
-    void scaleToBuffer(uint32_t* dstBuffer, int dstStride, int dstLeft, int dstTop, int dstRight, int dstBottom, int srcLeft, int srcTop, int srcRight, int srcBottom, double scaleFactor);
+    void scaleToBuffer(uint32_t* dstBuffer, int dstStride, int dstLeft, int dstTop, int dstRight, int dstBottom, int srcLeft, int srcTop, int srcRight, int srcBottom, double scaleFactor, ScaleFilter filter = ScaleNearest);
 
     int writeToFile(FILE* pFile, int left, int top, int right, int bottom) const;
+    int writeToFile(FILE* pFile, int left, int top, int right, int bottom, const PngOptions& options) const;
 
     void dump(const char* fileName);
     void erase(void);
@@ -56,6 +91,7 @@ private:
 
     // assumes mutex is locked
     void invalidate();
+    int  scrollContentsLocked(int newScrollX, int newScrollY, ExposedRect* exposed);
 
     struct BufferInfo {
         int bufferId;
@@ -75,8 +111,15 @@ private:
         int stride;
         int xPadding;
         int yPadding;
+
+        // Appended so the fields above keep their offsets
+        volatile uint32_t sequence; ///< Odd while the fields above are being changed
     };
 
+    void readInfo(BufferInfo& snapshot) const;
+    void beginInfoUpdate();
+    void endInfoUpdate();
+
     ProcessMutex* m_mutex;
     uint32_t* m_buffer;
     uint32_t m_bufferSize;
@@ -0,0 +1,566 @@
+/* @@@LICENSE
+*
+*      Copyright (c) 2012 Hewlett-Packard Development Company, L.P.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+LICENSE@@@ */
+
+/**
+ * Microbenchmarks of the Yap layer: packet encoding and decoding of every field
+ * type, async command throughput, sync command round trips and message fan-out,
+ * between a YapClient and a YapServer in a forked process over the real sockets.
+ * Also times the OffscreenBuffer scale filters and checks they keep flat colors,
+ * failing the run if one doesn't.
+ *
+ * The client picks its features like any other, so YAP_TAGGED_PACKETS and
+ * YAP_SHARED_RING compare the encodings and transports.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <vector>
+#include <algorithm>
+
+#include <glib.h>
+
+#include "YapDefs.h"
+#include "YapPacket.h"
+#include "YapClient.h"
+#include "YapServer.h"
+#include "YapProxy.h"
+#include "OffscreenBuffer.h"
+
+static const char* kBenchServerName = "yapbench";
+
+static const int16_t kBenchCmdNoop   = 0x0001; // async: string payload
+static const int16_t kBenchCmdFanOut = 0x0002; // async: int count, int size
+static const int16_t kBenchCmdEcho   = 0x0003; // sync: long; long
+static const int16_t kBenchMsgStamp  = 0x2001; // long sentUs, string payload
+
+static const int kFieldsPerPacket   = 1000;
+static const int kMaxStringBytesPerPacket = 256 * 1024;
+static const int kPacketRepeats     = 2000;
+static const int kAsyncCommands     = 100000;
+static const int kSyncCommands      = 20000;
+static const int kFanOutMessages    = 20000;
+static const int kConnectTries      = 100;
+static const int kConnectRetryUs    = 10000;
+
+static int64_t monotonicTimeUs()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int64_t monotonicTimeNs()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void printPercentiles(const char* name, std::vector<int64_t>& samplesUs)
+{
+    if (samplesUs.empty())
+        return;
+
+    std::sort(samplesUs.begin(), samplesUs.end());
+
+    int count = samplesUs.size();
+    printf("%-28s p50 %6lld us  p90 %6lld us  p99 %6lld us  max %6lld us\n", name,
+           (long long) samplesUs[count / 2],
+           (long long) samplesUs[(count * 9) / 10],
+           (long long) samplesUs[(count * 99) / 100],
+           (long long) samplesUs[count - 1]);
+}
+
+class BenchServer : public YapServer
+{
+public:
+
+    BenchServer() : YapServer(kBenchServerName), m_payload(0), m_payloadLen(0) {}
+    ~BenchServer() { delete [] m_payload; }
+
+    virtual void clientConnected(YapProxy* proxy) {}
+
+    virtual void clientDisconnected(YapProxy* proxy)
+    {
+        g_main_loop_quit(mainLoop());
+    }
+
+    virtual void handleAsyncCommand(YapProxy* proxy, YapPacket* cmd)
+    {
+        int16_t cmdValue = 0;
+        (*cmd) >> cmdValue;
+
+        if (cmdValue == kBenchCmdNoop) {
+            const char* payload = 0;
+            (*cmd) >> payload;
+        }
+        else if (cmdValue == kBenchCmdFanOut) {
+            int32_t count = 0, size = 0;
+            (*cmd) >> count;
+            (*cmd) >> size;
+
+            setPayloadLength(size);
+            for (int i = 0; i < count; i++) {
+                YapPacket* msg = proxy->packetMessage();
+                (*msg) << kBenchMsgStamp;
+                (*msg) << monotonicTimeUs();
+                (*msg) << (const char*) m_payload;
+                proxy->sendMessage();
+            }
+            proxy->flushMessages();
+        }
+    }
+
+    virtual void handleSyncCommand(YapProxy* proxy, YapPacket* cmd, YapPacket* reply)
+    {
+        int16_t cmdValue = 0;
+        int64_t value = 0;
+
+        (*cmd) >> cmdValue;
+        if (cmdValue == kBenchCmdEcho) {
+            (*cmd) >> value;
+            (*reply) << value;
+        }
+    }
+
+private:
+
+    void setPayloadLength(int len)
+    {
+        if (len == m_payloadLen)
+            return;
+
+        delete [] m_payload;
+        m_payload = new char[len + 1];
+        ::memset(m_payload, 'x', len);
+        m_payload[len] = '\0';
+        m_payloadLen = len;
+    }
+
+    char* m_payload;
+    int   m_payloadLen;
+};
+
+class BenchClient : public YapClient
+{
+public:
+
+    BenchClient() : YapClient(kBenchServerName), received(0), disconnected(false) {}
+
+    virtual void serverConnected() {}
+    virtual void serverDisconnected() { disconnected = true; }
+
+    virtual void handleAsyncMessage(YapPacket* msg)
+    {
+        int16_t msgValue = 0;
+        int64_t sentUs = 0;
+
+        (*msg) >> msgValue;
+        (*msg) >> sentUs;
+
+        if (msgValue == kBenchMsgStamp) {
+            latenciesUs.push_back(monotonicTimeUs() - sentUs);
+            received++;
+        }
+    }
+
+    bool waitForMessages(int count)
+    {
+        GMainContext* ctxt = g_main_loop_get_context(mainLoop());
+        while (received < count && !disconnected)
+            g_main_context_iteration(ctxt, TRUE);
+
+        return received >= count;
+    }
+
+    std::vector<int64_t> latenciesUs;
+    int received;
+    bool disconnected;
+};
+
+/**
+ * The benchmarks, in the order main() runs them.
+ */
+class YapBench
+{
+public:
+
+    template <typename T>
+    static void packetFields(const char* name, T value, bool native);
+    static void packetStrings(int len, bool native);
+    static void packetBlocks();
+    static bool scaleFilters();
+
+    static void asyncCommands(BenchClient* client, int payloadLen);
+    static void syncCommands(BenchClient* client);
+    static void fanOut(BenchClient* client, int payloadLen);
+};
+
+template <typename T>
+void YapBench::packetFields(const char* name, T value, bool native)
+{
+    YapPacket* packet = YapPacket::createForWriting(native);
+
+    int64_t startNs = monotonicTimeNs();
+    for (int r = 0; r < kPacketRepeats; r++) {
+        packet->rewind();
+        for (int i = 0; i < kFieldsPerPacket; i++)
+            (*packet) << value;
+    }
+    int64_t encodeNs = monotonicTimeNs() - startNs;
+
+    YapPacket* reader = YapPacket::createForReading(packet);
+    T readValue;
+
+    startNs = monotonicTimeNs();
+    for (int r = 0; r < kPacketRepeats; r++) {
+        reader->rewind();
+        for (int i = 0; i < kFieldsPerPacket; i++)
+            (*reader) >> readValue;
+    }
+    int64_t decodeNs = monotonicTimeNs() - startNs;
+
+    double fields = (double) kPacketRepeats * kFieldsPerPacket;
+    printf("%-8s %-7s encode %6.1f ns/field  decode %6.1f ns/field\n", name,
+           native ? "native" : "tagged", encodeNs / fields, decodeNs / fields);
+
+    YapPacket::destroy(reader);
+    YapPacket::destroy(packet);
+}
+
+void YapBench::packetStrings(int len, bool native)
+{
+    char* value = new char[len + 1];
+    ::memset(value, 'x', len);
+    value[len] = '\0';
+
+    YapPacket* packet = YapPacket::createForWriting(native);
+
+    // Keep long strings to packets of a size the protocol actually sees
+    int fieldsPerPacket = MAX(1, MIN(kFieldsPerPacket, kMaxStringBytesPerPacket / (len + 8)));
+
+    int64_t startNs = monotonicTimeNs();
+    for (int r = 0; r < kPacketRepeats; r++) {
+        packet->rewind();
+        for (int i = 0; i < fieldsPerPacket; i++)
+            (*packet) << (const char*) value;
+    }
+    int64_t encodeNs = monotonicTimeNs() - startNs;
+
+    YapPacket* reader = YapPacket::createForReading(packet);
+    const char* readValue = 0;
+
+    startNs = monotonicTimeNs();
+    for (int r = 0; r < kPacketRepeats; r++) {
+        reader->rewind();
+        for (int i = 0; i < fieldsPerPacket; i++)
+            (*reader) >> readValue;
+    }
+    int64_t decodeNs = monotonicTimeNs() - startNs;
+
+    double mb = (double) kPacketRepeats * fieldsPerPacket * len / (1024 * 1024);
+    printf("string%-5d %-7s encode %7.1f MB/s  decode %7.1f MB/s\n", len,
+           native ? "native" : "tagged", mb * 1e9 / MAX(encodeNs, 1), mb * 1e9 / MAX(decodeNs, 1));
+
+    YapPacket::destroy(reader);
+    YapPacket::destroy(packet);
+    delete [] value;
+}
+
+// Arguments of GestureEvent, as generated by YapCodeGen
+struct BenchGestureArgs {
+    int32_t type;
+    int32_t contentX;
+    int32_t contentY;
+    double  scale;
+    double  rotate;
+    int32_t centerX;
+    int32_t centerY;
+} __attribute__((packed));
+
+static const int kCommandsPerPacket = 100;
+
+/**
+ * Decoding the arguments of a fixed layout command field by field versus as
+ * one block, both in the native encoding.
+ */
+void YapBench::packetBlocks()
+{
+    BenchGestureArgs args = { 1, 100, 200, 1.5, 0.0, 150, 250 };
+
+    YapPacket* packet = YapPacket::createForWriting(true);
+    for (int i = 0; i < kCommandsPerPacket; i++)
+        packet->writeBlock(&args, sizeof(args));
+
+    YapPacket* reader = YapPacket::createForReading(packet);
+    int32_t type = 0, contentX = 0, contentY = 0, centerX = 0, centerY = 0;
+    double scale = 0, rotate = 0;
+
+    int64_t startNs = monotonicTimeNs();
+    for (int r = 0; r < kPacketRepeats; r++) {
+        reader->rewind();
+        for (int i = 0; i < kCommandsPerPacket; i++) {
+            (*reader) >> type;
+            (*reader) >> contentX;
+            (*reader) >> contentY;
+            (*reader) >> scale;
+            (*reader) >> rotate;
+            (*reader) >> centerX;
+            (*reader) >> centerY;
+        }
+    }
+    int64_t fieldsNs = monotonicTimeNs() - startNs;
+
+    BenchGestureArgs readArgs;
+
+    startNs = monotonicTimeNs();
+    for (int r = 0; r < kPacketRepeats; r++) {
+        reader->rewind();
+        for (int i = 0; i < kCommandsPerPacket; i++)
+            reader->readBlock(&readArgs, sizeof(readArgs));
+    }
+    int64_t blockNs = monotonicTimeNs() - startNs;
+
+    double commands = (double) kPacketRepeats * kCommandsPerPacket;
+    printf("gesture  native  fields %6.1f ns/cmd    block  %6.1f ns/cmd\n",
+           fieldsNs / commands, blockNs / commands);
+
+    YapPacket::destroy(reader);
+    YapPacket::destroy(packet);
+}
+
+static const int kScaleSrcSize = 260;
+
+/**
+ * Scale a flat color with every filter to sizes up and down, which has to give
+ * back the same color, also for box spans of more than 64K pixels that once
+ * came out darker.
+ *
+ * @return false if a filter changed the color.
+ */
+bool YapBench::scaleFilters()
+{
+    static const uint32_t kColors[] = { 0xFFFFFFFF, 0x80C0FF01 };
+    static const int kDstSizes[][2] = { { 1, 1 }, { 7, 3 }, { 130, 130 }, { 260, 260 }, { 400, 300 } };
+    static const OffscreenBuffer::ScaleFilter kFilters[] = {
+        OffscreenBuffer::ScaleNearest, OffscreenBuffer::ScaleBilinear, OffscreenBuffer::ScaleBox
+    };
+    static const char* kFilterNames[] = { "nearest", "bilinear", "box" };
+    static const int kMaxDstPixels = 400 * 300;
+
+    OffscreenBuffer buffer(kScaleSrcSize, kScaleSrcSize);
+    uint32_t* src = new uint32_t[kScaleSrcSize * kScaleSrcSize];
+    uint32_t* dst = new uint32_t[kMaxDstPixels];
+    bool ok = true;
+
+    for (unsigned f = 0; f < sizeof(kFilters) / sizeof(kFilters[0]); f++) {
+        int64_t elapsedNs = 0;
+        int wrong = 0;
+
+        for (unsigned c = 0; c < sizeof(kColors) / sizeof(kColors[0]); c++) {
+            for (int i = 0; i < kScaleSrcSize * kScaleSrcSize; i++)
+                src[i] = kColors[c];
+            buffer.copyFromBuffer(src, kScaleSrcSize, 0, 0, kScaleSrcSize, kScaleSrcSize);
+
+            for (unsigned d = 0; d < sizeof(kDstSizes) / sizeof(kDstSizes[0]); d++) {
+                int w = kDstSizes[d][0];
+                int h = kDstSizes[d][1];
+
+                // The whole source goes to the destination rectangle it gets clipped to
+                double scale = (MAX(w, h) + 0.5) / kScaleSrcSize;
+
+                ::memset(dst, 0, w * h * sizeof(uint32_t));
+
+                int64_t startNs = monotonicTimeNs();
+                buffer.scaleToBuffer(dst, w, 0, 0, w, h, 0, 0, kScaleSrcSize, kScaleSrcSize, scale, kFilters[f]);
+                elapsedNs += monotonicTimeNs() - startNs;
+
+                for (int i = 0; i < w * h; i++) {
+                    if (dst[i] != kColors[c])
+                        wrong++;
+                }
+            }
+        }
+
+        printf("scale    %-8s %9.1f us/pass   %s\n", kFilterNames[f],
+               elapsedNs / 1000.0 / (sizeof(kColors) / sizeof(kColors[0])),
+               wrong ? "CHANGED FLAT COLORS" : "flat colors kept");
+
+        if (wrong)
+            ok = false;
+    }
+
+    delete [] src;
+    delete [] dst;
+
+    return ok;
+}
+
+/**
+ * Commands are queued back to back, a sync command at the end tells when the
+ * server has handled all of them.
+ */
+void YapBench::asyncCommands(BenchClient* client, int payloadLen)
+{
+    char* payload = new char[payloadLen + 1];
+    ::memset(payload, 'x', payloadLen);
+    payload[payloadLen] = '\0';
+
+    int64_t startUs = monotonicTimeUs();
+    for (int i = 0; i < kAsyncCommands; i++) {
+        YapPacket* cmd = client->packetCommand();
+        (*cmd) << kBenchCmdNoop;
+        (*cmd) << (const char*) payload;
+        client->sendAsyncCommand();
+    }
+
+    YapPacket* cmd = client->packetCommand();
+    (*cmd) << kBenchCmdEcho;
+    (*cmd) << (int64_t) 0;
+    client->sendSyncCommand();
+
+    int64_t elapsedUs = monotonicTimeUs() - startUs;
+    printf("async %5d byte commands     %9.0f commands/s\n", payloadLen,
+           kAsyncCommands * 1e6 / MAX(elapsedUs, 1));
+
+    delete [] payload;
+}
+
+void YapBench::syncCommands(BenchClient* client)
+{
+    std::vector<int64_t> samplesUs;
+    samplesUs.reserve(kSyncCommands);
+
+    for (int i = 0; i < kSyncCommands; i++) {
+        int64_t startUs = monotonicTimeUs();
+
+        YapPacket* cmd = client->packetCommand();
+        (*cmd) << kBenchCmdEcho;
+        (*cmd) << startUs;
+        if (!client->sendSyncCommand())
+            return;
+
+        samplesUs.push_back(monotonicTimeUs() - startUs);
+    }
+
+    printPercentiles("sync round trip", samplesUs);
+}
+
+void YapBench::fanOut(BenchClient* client, int payloadLen)
+{
+    client->latenciesUs.clear();
+    client->latenciesUs.reserve(kFanOutMessages);
+    client->received = 0;
+
+    int64_t startUs = monotonicTimeUs();
+
+    YapPacket* cmd = client->packetCommand();
+    (*cmd) << kBenchCmdFanOut;
+    (*cmd) << (int32_t) kFanOutMessages;
+    (*cmd) << (int32_t) payloadLen;
+    client->sendAsyncCommand();
+
+    if (!client->waitForMessages(kFanOutMessages)) {
+        fprintf(stderr, "Server went away after %d of %d messages\n", client->received, kFanOutMessages);
+        return;
+    }
+
+    int64_t elapsedUs = monotonicTimeUs() - startUs;
+
+    char name[64];
+    ::snprintf(name, sizeof(name), "fan-out %d byte messages", payloadLen);
+    printPercentiles(name, client->latenciesUs);
+    printf("%-28s %9.0f messages/s\n", "", kFanOutMessages * 1e6 / MAX(elapsedUs, 1));
+}
+
+static void runServer()
+{
+    BenchServer* server = new BenchServer;
+    if (server->serverSocketFd() < 0)
+        ::_exit(EXIT_FAILURE);
+
+    g_main_loop_run(server->mainLoop());
+    delete server;
+    ::_exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char* argv[])
+{
+    static const bool encodings[] = { false, true };
+
+    for (int e = 0; e < 2; e++) {
+        bool native = encodings[e];
+
+        YapBench::packetFields("bool",   true, native);
+        YapBench::packetFields("int8",   (int8_t) 0x12, native);
+        YapBench::packetFields("int16",  (int16_t) 0x1234, native);
+        YapBench::packetFields("uint16", (uint16_t) 0x1234, native);
+        YapBench::packetFields("int32",  (int32_t) 0x12345678, native);
+        YapBench::packetFields("int64",  (int64_t) 0x123456789LL, native);
+        YapBench::packetFields("double", 3.14159, native);
+        YapBench::packetStrings(16, native);
+        YapBench::packetStrings(4096, native);
+    }
+
+    YapBench::packetBlocks();
+
+    bool scaled = YapBench::scaleFilters();
+
+    pid_t serverPid = ::fork();
+    if (serverPid < 0) {
+        perror("fork");
+        return EXIT_FAILURE;
+    }
+
+    if (serverPid == 0)
+        runServer();
+
+    BenchClient* client = new BenchClient;
+
+    int tries = 0;
+    while (!client->connect()) {
+        if (++tries == kConnectTries) {
+            fprintf(stderr, "Failed to connect to the benchmark server\n");
+            ::kill(serverPid, SIGTERM);
+            return EXIT_FAILURE;
+        }
+
+        // The server may not be listening yet, and a failed connect() can't be retried
+        delete client;
+        ::usleep(kConnectRetryUs);
+        client = new BenchClient;
+    }
+
+    YapBench::asyncCommands(client, 16);
+    YapBench::asyncCommands(client, 1024);
+    YapBench::syncCommands(client);
+    YapBench::fanOut(client, 64);
+    YapBench::fanOut(client, 4096);
+
+    delete client;
+
+    int status = 0;
+    ::waitpid(serverPid, &status, 0);
+
+    return scaled ? EXIT_SUCCESS : EXIT_FAILURE;
+}
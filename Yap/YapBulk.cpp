@@ -0,0 +1,408 @@
+/* @@@LICENSE
+*
+*      Copyright (c) 2012 Hewlett-Packard Development Company, L.P.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+LICENSE@@@ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "YapBulk.h"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC         0x0001U
+#define MFD_ALLOW_SEALING   0x0002U
+#endif
+
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS         (1024 + 9)
+#define F_SEAL_SEAL         0x0001
+#define F_SEAL_SHRINK       0x0002
+#define F_SEAL_GROW         0x0004
+#define F_SEAL_WRITE        0x0008
+#endif
+
+#ifndef F_GET_SEALS
+#define F_GET_SEALS         (1024 + 10)
+#endif
+
+// Seals that keep the sender from changing a block after handing it over
+static const int kBulkSeals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
+
+static const char kShmPathTemplate[] = "/dev/shm/yapbulk.XXXXXX";
+
+static int createMemFd(const char* name)
+{
+#ifdef __NR_memfd_create
+    int fd = ::syscall(__NR_memfd_create, name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd >= 0 || errno != ENOSYS)
+        return fd;
+#endif
+
+    // Kernels before 3.17
+    char shmPath[sizeof(kShmPathTemplate)];
+    ::memcpy(shmPath, kShmPathTemplate, sizeof(kShmPathTemplate));
+
+    int fd2 = ::mkstemp(shmPath);
+    if (fd2 >= 0)
+        ::unlink(shmPath);
+
+    return fd2;
+}
+
+YapBulk::YapBulk(int fd, uint8_t* data, int len)
+    : m_fd(fd)
+    , m_data(data)
+    , m_len(len)
+{
+}
+
+YapBulk::~YapBulk()
+{
+    if (m_data)
+        ::munmap(m_data, m_len);
+    if (m_fd >= 0)
+        ::close(m_fd);
+}
+
+/**
+ * Create anonymous shared memory of len bytes that can be sealed, also used for
+ * IpcBuffer. The name only shows up in /proc.
+ *
+ * @return the descriptor, or -1.
+ */
+int YapBulk::createMemory(const char* name, int len)
+{
+    int fd = createMemFd(name);
+    if (fd < 0) {
+        fprintf(stderr, "YAP: Failed to create %s memory: %s\n", name, strerror(errno));
+        return -1;
+    }
+
+    if (::ftruncate(fd, len) != 0) {
+        fprintf(stderr, "YAP: Failed to size %s memory: %s\n", name, strerror(errno));
+        ::close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Copy data into a new sealed block.
+ */
+YapBulk* YapBulk::create(const void* data, int len)
+{
+    if (len <= 0)
+        return 0;
+
+    int fd = createMemory("yapbulk", len);
+    if (fd < 0)
+        return 0;
+
+    // Written without a shared mapping, F_SEAL_WRITE refuses to seal while one exists
+    const uint8_t* src = (const uint8_t*) data;
+    int written = 0;
+    while (written < len) {
+        int count = ::pwrite(fd, src + written, len - written, written);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+
+            fprintf(stderr, "YAP: Failed to fill bulk memory: %s\n", strerror(errno));
+            ::close(fd);
+            return 0;
+        }
+        written += count;
+    }
+
+    // Not supported by the /dev/shm fallback, the receiver copies those blocks
+    ::fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+
+    return map(fd, false);
+}
+
+/**
+ * Map a block, taking over fd. A block from the other side is only mapped if it
+ * is sealed, otherwise the sender could still change it under the receiver or
+ * shrink it and make it fault. Unsealed blocks are copied instead.
+ */
+YapBulk* YapBulk::map(int fd, bool checkSeals)
+{
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size <= 0 || st.st_size > 0x7fffffff) {
+        fprintf(stderr, "YAP: Invalid bulk memory\n");
+        ::close(fd);
+        return 0;
+    }
+
+    int seals = checkSeals ? ::fcntl(fd, F_GET_SEALS) : kBulkSeals;
+    if (seals < 0 || (seals & kBulkSeals) != kBulkSeals) {
+        YapBulk* bulk = copy(fd, st.st_size);
+        ::close(fd);
+        return bulk;
+    }
+
+    void* mem = ::mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        fprintf(stderr, "YAP: Failed to map bulk memory: %s\n", strerror(errno));
+        ::close(fd);
+        return 0;
+    }
+
+    return new YapBulk(fd, (uint8_t*) mem, st.st_size);
+}
+
+/**
+ * Read an unsealed block into private memory. A block the sender shrinks in
+ * the meantime is rejected.
+ */
+YapBulk* YapBulk::copy(int fd, int len)
+{
+    void* mem = ::mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        fprintf(stderr, "YAP: Failed to allocate bulk copy: %s\n", strerror(errno));
+        return 0;
+    }
+
+    uint8_t* dst = (uint8_t*) mem;
+    int done = 0;
+    while (done < len) {
+        int count = ::pread(fd, dst + done, len - done, done);
+        if (count < 0 && errno == EINTR)
+            continue;
+
+        if (count <= 0) {
+            fprintf(stderr, "YAP: Failed to copy bulk memory\n");
+            ::munmap(mem, len);
+            return 0;
+        }
+        done += count;
+    }
+
+    ::mprotect(mem, len, PROT_READ);
+    return new YapBulk(-1, dst, len);
+}
+
+YapBulkChannel::YapBulkChannel(int fd)
+    : m_fd(fd)
+    , m_lastSentId(0)
+{
+    // A receiver that stopped reading must not block the sender
+    ::fcntl(m_fd, F_SETFL, ::fcntl(m_fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+YapBulkChannel::~YapBulkChannel()
+{
+    ::close(m_fd);
+}
+
+/**
+ * Create the channel on the server side. peerFd is for the client and has to
+ * be passed on with sendFd() and closed.
+ */
+YapBulkChannel* YapBulkChannel::create(int& peerFd)
+{
+    int fds[2];
+    if (::socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) != 0) {
+        fprintf(stderr, "YAP: Failed to create bulk channel: %s\n", strerror(errno));
+        return 0;
+    }
+
+    peerFd = fds[1];
+    return new YapBulkChannel(fds[0]);
+}
+
+/**
+ * Send one descriptor along with a byte of data.
+ */
+static bool sendWithFd(int socketFd, int fd, const void* data, int len, int flags)
+{
+    struct iovec iov;
+    iov.iov_base = const_cast<void*>(data);
+    iov.iov_len  = len;
+
+    char control[CMSG_SPACE(sizeof(int))];
+    ::memset(control, 0, sizeof(control));
+
+    struct msghdr msg;
+    ::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+    ::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    while (::sendmsg(socketFd, &msg, flags) < 0) {
+        if (errno != EINTR)
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * @return the descriptor received along with len bytes of data, or -1. errno is
+ * EAGAIN if nothing was waiting on a non-blocking socket.
+ */
+static int receiveWithFd(int socketFd, void* data, int len)
+{
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len  = len;
+
+    char control[CMSG_SPACE(sizeof(int))];
+    ::memset(control, 0, sizeof(control));
+
+    struct msghdr msg;
+    ::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+
+    int count = 0;
+    while ((count = ::recvmsg(socketFd, &msg, MSG_CMSG_CLOEXEC)) < 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+
+    int fd = -1;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+        ::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+    // A descriptor that came with the wrong data is still ours to close
+    if (count != len || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        if (fd >= 0)
+            ::close(fd);
+        errno = EPROTO;
+        return -1;
+    }
+
+    if (fd < 0)
+        errno = EPROTO;
+    return fd;
+}
+
+/**
+ * Pass the channel to the client right after the reply to kYapCmdHello.
+ */
+bool YapBulkChannel::sendFd(int socketFd, int fd)
+{
+    char data = 'B';
+    if (!sendWithFd(socketFd, fd, &data, 1, 0)) {
+        fprintf(stderr, "YAP: Failed to send bulk channel: %s\n", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+int YapBulkChannel::receiveFd(int socketFd)
+{
+    char data = 0;
+    int fd = receiveWithFd(socketFd, &data, 1);
+    if (fd < 0)
+        fprintf(stderr, "YAP: Failed to receive bulk channel\n");
+
+    return fd;
+}
+
+/**
+ * @return the id to refer to the block by, 0 if it couldn't be sent. The block
+ * can be deleted right away, the receiver has its own reference.
+ */
+uint32_t YapBulkChannel::send(const YapBulk* bulk)
+{
+    return sendDescriptor(bulk->fd());
+}
+
+/**
+ * Pick up the block with the given id, dropping older ones nobody asked for.
+ */
+YapBulk* YapBulkChannel::receive(uint32_t id)
+{
+    int fd = receiveDescriptor(id);
+    if (fd < 0)
+        return 0;
+
+    return YapBulk::map(fd, true);
+}
+
+/**
+ * Like send() for any descriptor, e.g. of writable memory shared for longer.
+ * The caller keeps its own descriptor.
+ */
+uint32_t YapBulkChannel::sendDescriptor(int fd)
+{
+    uint32_t id = m_lastSentId + 1;
+    if (id == 0)
+        id = 1;
+
+    if (!sendWithFd(m_fd, fd, &id, sizeof(id), MSG_DONTWAIT)) {
+        fprintf(stderr, "YAP: Failed to send bulk %u: %s\n", id, strerror(errno));
+        return 0;
+    }
+
+    m_lastSentId = id;
+    return id;
+}
+
+/**
+ * @return the descriptor sent with the given id, owned by the caller, or -1.
+ * Doesn't wait: the sender queued the descriptor before the packet referring
+ * to it, so it is already there unless the sender never sent it.
+ */
+int YapBulkChannel::receiveDescriptor(uint32_t id)
+{
+    for (;;) {
+        uint32_t receivedId = 0;
+        int fd = receiveWithFd(m_fd, &receivedId, sizeof(receivedId));
+        if (fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                fprintf(stderr, "YAP: Bulk %u didn't arrive\n", id);
+            else
+                fprintf(stderr, "YAP: Failed to receive bulk %u\n", id);
+            return -1;
+        }
+
+        if (receivedId == id)
+            return fd;
+
+        ::close(fd);
+
+        // Ids only grow, a newer one means ours got lost
+        if ((int32_t) (receivedId - id) > 0) {
+            fprintf(stderr, "YAP: Bulk %u missing, got %u\n", id, receivedId);
+            return -1;
+        }
+    }
+}
@@ -0,0 +1,94 @@
+/* @@@LICENSE
+*
+*      Copyright (c) 2012 Hewlett-Packard Development Company, L.P.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+LICENSE@@@ */
+
+#ifndef YAPBULK_H
+#define YAPBULK_H
+
+#include <stdint.h>
+
+/**
+ * Read-only block of shared memory for payloads too large for a packet. The
+ * producer fills it, seals it and passes the descriptor to the other side
+ * through a YapBulkChannel; a command or message then refers to it by id.
+ *
+ * Backed by a sealed memfd where the kernel has them, otherwise by an unlinked
+ * file in /dev/shm. The receiver maps sealed blocks and copies the others.
+ */
+class YapBulk
+{
+public:
+
+    static YapBulk* create(const void* data, int len);
+    static int createMemory(const char* name, int len);
+    ~YapBulk();
+
+    const uint8_t* data() const { return m_data; }
+    int length() const { return m_len; }
+    int fd() const { return m_fd; }
+
+private:
+
+    static YapBulk* map(int fd, bool checkSeals);
+    static YapBulk* copy(int fd, int len);
+
+    YapBulk(int fd, uint8_t* data, int len);
+
+    int      m_fd;      ///< -1 for a copied block
+    uint8_t* m_data;
+    int      m_len;
+
+    YapBulk(const YapBulk&);
+    YapBulk& operator=(const YapBulk&);
+
+    friend class YapBulkChannel;
+};
+
+/**
+ * One end of the SOCK_SEQPACKET socket pair bulk descriptors travel over, see
+ * kYapFeatureBulk. Descriptors are numbered in the order they are sent and
+ * always sent before the packet referring to them, so the receiver finds them
+ * waiting. Ones the receiver never asks for are dropped when it asks for a
+ * later one.
+ */
+class YapBulkChannel
+{
+public:
+
+    static YapBulkChannel* create(int& peerFd);
+    YapBulkChannel(int fd);
+    ~YapBulkChannel();
+
+    uint32_t send(const YapBulk* bulk);
+    YapBulk* receive(uint32_t id);
+
+    uint32_t sendDescriptor(int fd);
+    int      receiveDescriptor(uint32_t id);
+
+    static bool sendFd(int socketFd, int fd);
+    static int  receiveFd(int socketFd);
+
+private:
+
+    int      m_fd;
+    uint32_t m_lastSentId;
+
+    YapBulkChannel(const YapBulkChannel&);
+    YapBulkChannel& operator=(const YapBulkChannel&);
+};
+
+#endif /* YAPBULK_H */
@@ -0,0 +1,173 @@
+/* @@@LICENSE
+*
+*      Copyright (c) 2012 Hewlett-Packard Development Company, L.P.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+LICENSE@@@ */
+
+#include <string.h>
+#include <errno.h>
+
+#include "YapDefs.h"
+#include "YapCapture.h"
+
+// Records are small and frequent, let stdio batch them
+static const int kCaptureBufferLen = 64 * 1024;
+
+struct YapCaptureFileHeader {
+    char     magic[6];
+    uint16_t version;
+};
+
+YapCaptureWriter::YapCaptureWriter(FILE* file)
+    : m_file(file)
+    , m_startUs(-1)
+{
+}
+
+YapCaptureWriter::~YapCaptureWriter()
+{
+    ::fclose(m_file);
+}
+
+YapCaptureWriter* YapCaptureWriter::open(const char* path)
+{
+    FILE* file = ::fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "YAP: Failed to open capture %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    ::setvbuf(file, NULL, _IOFBF, kCaptureBufferLen);
+
+    YapCaptureFileHeader header;
+    ::memcpy(header.magic, kYapCaptureMagic, sizeof(header.magic));
+    header.version = kYapCaptureVersion;
+
+    if (::fwrite(&header, sizeof(header), 1, file) != 1) {
+        fprintf(stderr, "YAP: Failed to write capture %s: %s\n", path, strerror(errno));
+        ::fclose(file);
+        return 0;
+    }
+
+    return new YapCaptureWriter(file);
+}
+
+/**
+ * Append a record. Connects and disconnects are flushed right away so a capture
+ * of a server that got killed is complete up to the last client change.
+ */
+void YapCaptureWriter::write(uint8_t type, uint32_t clientId, int64_t timeUs, uint32_t sequence,
+                             uint8_t flags, const uint8_t* data, int len)
+{
+    if (m_startUs < 0)
+        m_startUs = timeUs;
+
+    YapCaptureRecord record;
+    ::memset(&record, 0, sizeof(record));
+    record.type     = type;
+    record.flags    = flags & kPacketFlagNativeMask;
+    record.clientId = clientId;
+    record.timeUs   = timeUs - m_startUs;
+    record.len      = len;
+    record.sequence = sequence;
+
+    if (::fwrite(&record, sizeof(record), 1, m_file) != 1 ||
+        (len > 0 && ::fwrite(data, len, 1, m_file) != 1)) {
+        fprintf(stderr, "YAP: Failed to write capture: %s\n", strerror(errno));
+        return;
+    }
+
+    if (type == kYapCaptureConnect || type == kYapCaptureDisconnect)
+        ::fflush(m_file);
+}
+
+YapCaptureReader::YapCaptureReader(FILE* file)
+    : m_file(file)
+    , m_buffer(0)
+    , m_capacity(0)
+{
+}
+
+YapCaptureReader::~YapCaptureReader()
+{
+    delete [] m_buffer;
+    ::fclose(m_file);
+}
+
+YapCaptureReader* YapCaptureReader::open(const char* path)
+{
+    FILE* file = ::fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "YAP: Failed to open capture %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    YapCaptureFileHeader header;
+    if (::fread(&header, sizeof(header), 1, file) != 1 ||
+        ::memcmp(header.magic, kYapCaptureMagic, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "YAP: %s is not a capture\n", path);
+        ::fclose(file);
+        return 0;
+    }
+
+    if (header.version != kYapCaptureVersion) {
+        fprintf(stderr, "YAP: Capture version %d not supported\n", header.version);
+        ::fclose(file);
+        return 0;
+    }
+
+    return new YapCaptureReader(file);
+}
+
+/**
+ * Read the next record. data stays valid until the next call.
+ *
+ * @return false at the end of the capture, or if it is truncated.
+ */
+bool YapCaptureReader::next(YapCaptureRecord& record, const uint8_t*& data)
+{
+    if (::fread(&record, sizeof(record), 1, m_file) != 1)
+        return false;
+
+    if (record.len > (uint32_t) kMaxPacketLen) {
+        fprintf(stderr, "YAP: Invalid capture record length %u\n", record.len);
+        return false;
+    }
+
+    if (record.len > m_capacity) {
+        delete [] m_buffer;
+        m_capacity = record.len;
+        m_buffer   = new uint8_t[m_capacity];
+    }
+
+    if (record.len > 0 && ::fread(m_buffer, record.len, 1, m_file) != 1)
+        return false;
+
+    data = m_buffer;
+    return true;
+}
+
+/**
+ * Go back to the first record.
+ */
+bool YapCaptureReader::rewind()
+{
+    if (::fseek(m_file, sizeof(YapCaptureFileHeader), SEEK_SET) != 0) {
+        fprintf(stderr, "YAP: Failed to rewind capture: %s\n", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
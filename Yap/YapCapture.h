@@ -0,0 +1,101 @@
+/* @@@LICENSE
+*
+*      Copyright (c) 2012 Hewlett-Packard Development Company, L.P.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+LICENSE@@@ */
+
+#ifndef YAPCAPTURE_H
+#define YAPCAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Yap traffic capture, written by YapServer when YAP_CAPTURE names a file and
+ * replayed against a running server by YapReplay.
+ *
+ * The file starts with kYapCaptureMagic and a version, followed by records of
+ * a YapCaptureRecord header and the packet data. All fields are in host byte
+ * order; captures are meant to be replayed on the kind of device they came from.
+ */
+
+#define kYapCaptureMagic        "YAPCAP"
+#define kYapCaptureVersion      ((uint16_t)2)
+
+enum YapCaptureRecordType {
+    kYapCaptureConnect = 1,     // client finished the handshake, no data
+    kYapCaptureDisconnect,      // client went away, no data
+    kYapCaptureCommand,         // async command as received
+    kYapCaptureSyncCommand,     // sync command as received
+    kYapCaptureMessage,         // message as sent
+    kYapCaptureBulk             // the command numbered sequence came with bulk data or
+                                // a descriptor, which isn't captured, no data
+};
+
+struct YapCaptureRecord {
+    uint8_t  type;      ///< YapCaptureRecordType
+    uint8_t  flags;     ///< kPacketFlagNativeMask if the packet uses the native encoding
+    uint16_t reserved;
+    uint32_t clientId;  ///< Numbered in order of connection, starting at 1
+    int64_t  timeUs;    ///< Since the first record
+    uint32_t len;       ///< Packet bytes following the header
+    uint32_t sequence;  ///< Number of the command within its client, starting at 1, 0 for
+                        ///< connects, disconnects and messages
+};
+
+class YapCaptureWriter
+{
+public:
+
+    static YapCaptureWriter* open(const char* path);
+    ~YapCaptureWriter();
+
+    void write(uint8_t type, uint32_t clientId, int64_t timeUs, uint32_t sequence,
+               uint8_t flags, const uint8_t* data, int len);
+
+private:
+
+    YapCaptureWriter(FILE* file);
+
+    FILE*   m_file;
+    int64_t m_startUs;  ///< Time of the first record, -1 before
+
+    YapCaptureWriter(const YapCaptureWriter&);
+    YapCaptureWriter& operator=(const YapCaptureWriter&);
+};
+
+class YapCaptureReader
+{
+public:
+
+    static YapCaptureReader* open(const char* path);
+    ~YapCaptureReader();
+
+    bool next(YapCaptureRecord& record, const uint8_t*& data);
+    bool rewind();
+
+private:
+
+    YapCaptureReader(FILE* file);
+
+    FILE*    m_file;
+    uint8_t* m_buffer;  ///< Data of the last record
+    uint32_t m_capacity;
+
+    YapCaptureReader(const YapCaptureReader&);
+    YapCaptureReader& operator=(const YapCaptureReader&);
+};
+
+#endif /* YAPCAPTURE_H */
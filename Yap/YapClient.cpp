@@ -26,9 +26,12 @@ LICENSE@@@ */
 #include <errno.h>
 #include <byteswap.h>
 #include <sys/stat.h>
+#include <poll.h>
 
 #include "YapDefs.h"
 #include "YapPacket.h"
+#include "YapRing.h"
+#include "YapBulk.h"
 #include "YapClient.h"
 
 int YapClient::s_socketNum = 0;
@@ -37,6 +40,17 @@ static const int   kMaxPathLen       = 256;
 static const char* kSocketPathPrefix = "/tmp/yapserver.";
 static const int   kMaxConnections   = 10;
 
+// Wait for room in the socket buffer instead of spinning on EAGAIN
+static void waitWritable(int fd)
+{
+    struct pollfd pfd;
+    pfd.fd      = fd;
+    pfd.events  = POLLOUT;
+    pfd.revents = 0;
+
+    ::poll(&pfd, 1, -1);
+}
+
 class YapClientPriv
 {
 public:
@@ -59,10 +73,22 @@ public:
     GIOChannel*   msgIoChannel;
     GSource*      msgIoSource;
 
-    uint8_t*      msgBuffer;
-    uint8_t*      cmdBuffer;
-    uint8_t*      replyBuffer;
- 
+    uint32_t      cmdFeatures;      ///< Protocol features negotiated with kYapCmdHello
+    uint32_t      msgFeatures;      ///< Take effect on the msg socket after kYapMsgHello
+    bool          awaitingMsgHello;
+
+    YapRingPair*  rings;            ///< With kYapFeatureSharedRing
+    GIOChannel*   ringIoChannel;
+    GSource*      ringIoSource;
+    int           ringPktLen;       ///< Message bytes collected from the ring so far
+    uint8_t       ringPktFlags;
+
+    YapBulkChannel* bulk;           ///< With kYapFeatureBulk
+
+    bool          tracePending;     ///< Set by traceNextCommand()
+    int32_t       traceSeq;
+    int64_t       traceTimeUs;
+
     YapPacket*    msgPacket;
     YapPacket*    cmdPacket;
     YapPacket*    replyPacket;
@@ -80,9 +106,18 @@ public:
         , msgSocketFd(-1)
         , msgIoChannel(0)
         , msgIoSource(0)
-        , msgBuffer(0)
-        , cmdBuffer(0)
-        , replyBuffer(0)
+        , cmdFeatures(0)
+        , msgFeatures(0)
+        , awaitingMsgHello(false)
+        , rings(0)
+        , ringIoChannel(0)
+        , ringIoSource(0)
+        , ringPktLen(0)
+        , ringPktFlags(0)
+        , bulk(0)
+        , tracePending(false)
+        , traceSeq(0)
+        , traceTimeUs(0)
         , msgPacket(0)
         , cmdPacket(0)
         , replyPacket(0) {;}
@@ -168,10 +203,6 @@ YapClient::~YapClient()
     delete d->cmdPacket;
     delete d->replyPacket;
 
-    delete[] d->msgBuffer;
-    delete[] d->cmdBuffer;
-    delete[] d->replyBuffer;
-
     delete d;
 
     d = NULL;
@@ -218,6 +249,13 @@ bool YapClient::connect()
     if (!writeSocket(d->cmdSocketFd, d->msgServerSocketPostfix, strLen))
         return false;
 
+    if (!negotiateFeatures()) {
+        close(d->cmdSocketFd);
+        d->cmdSocketFd = -1;
+        fprintf(stderr, "YAP: Failed to negotiate protocol features\n");
+        return false;
+    }
+
     // Add io channel to know when the command socket is disconnected.
     d->cmdIoChannel = g_io_channel_unix_new(d->cmdSocketFd);
     d->cmdIoSource  = g_io_create_watch(d->cmdIoChannel, (GIOCondition) (G_IO_HUP));
@@ -228,6 +266,63 @@ bool YapClient::connect()
     return true;
 }
 
+/**
+ * Agree on the protocol features with the server. Servers without kYapCmdHello
+ * answer with an empty reply and we stay with the original framing.
+ */
+bool YapClient::negotiateFeatures()
+{
+    int32_t features = 0;
+
+    uint32_t supported = kYapSupportedFeatures;
+
+    // Keep the tagged encoding, e.g. for looking at the traffic
+    if (::getenv("YAP_TAGGED_PACKETS"))
+        supported &= ~kYapFeatureNativeEncoding;
+
+    // The shared memory transport is opt-in for now
+    if (!::getenv("YAP_SHARED_RING"))
+        supported &= ~kYapFeatureSharedRing;
+
+    YapPacket* cmd = packetCommand();
+    (*cmd) << (int16_t) kYapCmdHello;
+    (*cmd) << (int32_t) supported;
+
+    if (!writePacket(kPacketFlagSyncMask, d->cmdPacket))
+        return false;
+
+    if (!readPacket(d->cmdSocketFd, d->cmdFeatures, d->replyPacket, true))
+        return false;
+
+    d->replyPacket->reset();
+    if (d->replyPacket->m_readTotalLen > 0)
+        (*d->replyPacket) >> features;
+
+    d->cmdFeatures = (uint32_t) features & supported;
+    d->awaitingMsgHello = d->cmdFeatures != 0;
+
+    // The server passes the rings right after the reply
+    if (d->cmdFeatures & kYapFeatureSharedRing) {
+        d->rings = YapRingPair::receive(d->cmdSocketFd);
+        if (!d->rings)
+            return false;
+    }
+
+    // Followed by the bulk channel
+    if (d->cmdFeatures & kYapFeatureBulk) {
+        int bulkFd = YapBulkChannel::receiveFd(d->cmdSocketFd);
+        if (bulkFd < 0)
+            return false;
+
+        d->bulk = new YapBulkChannel(bulkFd);
+    }
+
+    d->cmdPacket->setFeatures(d->cmdFeatures);
+    d->replyPacket->setFeatures(d->cmdFeatures);
+
+    return true;
+}
+
 GMainLoop* YapClient::mainLoop() const
 {
     return d->mainLoop;
@@ -235,6 +330,7 @@ GMainLoop* YapClient::mainLoop() const
 
 YapPacket* YapClient::packetCommand()
 {
+    d->cmdPacket->shrink();
     d->cmdPacket->reset();
     return d->cmdPacket;
 }
@@ -265,72 +361,113 @@ const char* YapClient::postfix() const
 
 bool YapClient::sendAsyncCommand()
 {
-    char pktHeader[4] = { 0, 0, 0, 0 };
-    uint16_t pktLen = 0;
-
     if (d->cmdPacket->length() == 0) {
         fprintf(stderr, "Command is empty\n");
         return false;
     }
 
-    pktLen = d->cmdPacket->length();
-    pktLen = bswap_16(pktLen);
-    ::memset(pktHeader, 0, sizeof(pktHeader));
-    ::memcpy(pktHeader, &pktLen, 2);
+    return writePacket(0, d->cmdPacket);
+}
 
-    bool succeeded = writeSocket(d->cmdSocketFd, pktHeader, 4);
-    if (succeeded) {
-        succeeded = writeSocket(d->cmdSocketFd, (char*) d->cmdBuffer, d->cmdPacket->length());
+/**
+ * Send a command exactly as it appears in a YapCapture, see YapReplay.
+ */
+bool YapClient::sendCapturedCommand(const uint8_t* data, int len, bool native, bool sync)
+{
+    YapPacket* cmd = packetCommand();
+    if (!cmd->reserve(len)) {
+        fprintf(stderr, "YAP: Captured command too long: %d\n", len);
+        return false;
     }
 
-    return succeeded;
+    ::memcpy(cmd->m_buffer, data, len);
+    cmd->m_currWritePos = len;
+
+    bool ownNative = cmd->m_native;
+    cmd->setNative(native);
+
+    bool ok = sync ? sendSyncCommand() : sendAsyncCommand();
+
+    cmd->setNative(ownNative);
+    return ok;
 }
 
-bool YapClient::sendSyncCommand()
+/**
+ * Hand a block to the server ahead of the command referring to it.
+ *
+ * @return the id to put in the command, 0 if the server didn't negotiate
+ * kYapFeatureBulk or the block couldn't be sent.
+ */
+uint32_t YapClient::sendBulk(const YapBulk* bulk)
 {
-    char pktHeader[4] = { 0, 0, 0, 0 };
-    uint16_t pktLen;
-    char * ppp = 0;
+    if (!d->bulk || !bulk)
+        return 0;
 
-    if (d->cmdPacket->length() == 0) {
-        fprintf(stderr, "Command is empty\n");
-        return false;
-    }
+    return d->bulk->send(bulk);
+}
 
-    pktLen = 0;
-    ::memset(pktHeader, 0, sizeof(pktHeader));
+/**
+ * Pick up a block the server referred to in the message being handled.
+ */
+YapBulk* YapClient::receiveBulk(uint32_t id)
+{
+    if (!d->bulk || id == 0)
+        return 0;
 
-    pktLen = d->cmdPacket->length();
-    pktLen = bswap_16(pktLen);
-    ::memcpy(pktHeader, &pktLen, 2);
-    pktHeader[3] = kPacketFlagSyncMask;
+    return d->bulk->receive(id);
+}
 
-    if (!writeSocket(d->cmdSocketFd, pktHeader, 4))
-        goto Detached;
+/**
+ * Share a descriptor, e.g. of an IpcBuffer, like sendBulk() does with blocks.
+ */
+uint32_t YapClient::sendBulkFd(int fd)
+{
+    if (!d->bulk || fd < 0)
+        return 0;
 
-    if (!writeSocket(d->cmdSocketFd, (char*) d->cmdBuffer, d->cmdPacket->length()))
-        goto Detached;
+    return d->bulk->sendDescriptor(fd);
+}
 
+/**
+ * Tag the next input command with a sequence number and the time the input
+ * happened, in microseconds of CLOCK_MONOTONIC. The server reports them back
+ * in the message for the first frame that shows the result.
+ */
+void YapClient::traceNextCommand(int32_t seq, int64_t timeUs)
+{
+    d->tracePending = true;
+    d->traceSeq = seq;
+    d->traceTimeUs = timeUs;
+}
 
-    pktLen = 0;
-    ::memset(pktHeader, 0, sizeof(pktHeader));
+/**
+ * Called by generated input commands after their last argument.
+ */
+void YapClient::appendTrace(YapPacket* cmd)
+{
+    if (!d->tracePending)
+        return;
 
-    if (!readSocketSync(d->cmdSocketFd, pktHeader, 4))
-        goto Detached;
+    (*cmd) << d->traceSeq;
+    (*cmd) << d->traceTimeUs;
+    d->tracePending = false;
+}
 
-    ppp = ((char *)&pktHeader[0]);
-    pktLen   = *((uint16_t*) ppp);
-    pktLen   = bswap_16(pktLen);
-    if (pktLen > kMaxMsgLen) {
-        fprintf(stderr, "YAP: Message too large %u > %u\n", pktLen, kMaxMsgLen);
-        goto Detached;
+bool YapClient::sendSyncCommand()
+{
+    if (d->cmdPacket->length() == 0) {
+        fprintf(stderr, "Command is empty\n");
+        return false;
     }
 
-    if (!readSocketSync(d->cmdSocketFd, (char*) d->replyBuffer, pktLen))
+    if (!writePacket(kPacketFlagSyncMask, d->cmdPacket))
+        goto Detached;
+
+    d->replyPacket->shrink();
+    if (!readPacket(d->cmdSocketFd, d->cmdFeatures, d->replyPacket, true))
         goto Detached;
 
     d->replyPacket->reset();
-    d->replyPacket->setReadTotalLength(pktLen);
 
     return true;
 
@@ -343,6 +480,248 @@ bool YapClient::sendSyncCommand()
     return false;
 }
 
+/**
+ * Write the packet to the command socket, split into chunks of at most kMaxChunkLen
+ * when long frames are in use.
+ */
+bool YapClient::writePacket(uint8_t flags, YapPacket* packet)
+{
+    if (d->cmdFeatures & kYapFeatureSharedRing)
+        return writePacketToRing(flags, packet);
+
+    char pktHeader[kLongPacketHeaderLen];
+    int  hdrLen = YapPacket::headerLength(d->cmdFeatures);
+    int  len = packet->length();
+    int  maxChunkLen = (d->cmdFeatures & kYapFeatureLongFrames) ? kMaxChunkLen : len;
+    char* data = (char*) packet->m_buffer;
+
+    flags |= packet->encodingFlags();
+
+    do {
+        int chunkLen = MIN(len, maxChunkLen);
+        bool more = chunkLen < len;
+
+        YapPacket::writeHeader(d->cmdFeatures, more ? (flags | kPacketFlagMoreMask) : flags, chunkLen, pktHeader);
+
+        if (!writeSocket(d->cmdSocketFd, pktHeader, hdrLen))
+            return false;
+
+        if (chunkLen > 0 && !writeSocket(d->cmdSocketFd, data, chunkLen))
+            return false;
+
+        data += chunkLen;
+        len  -= chunkLen;
+    } while (len > 0);
+
+    return true;
+}
+
+/**
+ * Write the packet into the command ring, each chunk as one unit. Blocks while the
+ * ring is full, like writeSocket() does on a full socket buffer.
+ */
+bool YapClient::writePacketToRing(uint8_t flags, YapPacket* packet)
+{
+    if (!d->rings)
+        return false;
+
+    YapRing* ring = d->rings->commands();
+    char pktHeader[kLongPacketHeaderLen];
+    int  hdrLen = YapPacket::headerLength(d->cmdFeatures);
+    int  len = packet->length();
+    int  maxChunkLen = (d->cmdFeatures & kYapFeatureLongFrames) ? kMaxChunkLen : len;
+    const uint8_t* data = packet->m_buffer;
+
+    flags |= packet->encodingFlags();
+
+    do {
+        int chunkLen = MIN(len, maxChunkLen);
+        bool more = chunkLen < len;
+
+        YapPacket::writeHeader(d->cmdFeatures, more ? (flags | kPacketFlagMoreMask) : flags, chunkLen, pktHeader);
+
+        while (!ring->write((const uint8_t*) pktHeader, hdrLen, data, chunkLen)) {
+            // Let the server drain what we wrote so far
+            if (ring->takeConsumerWaiting())
+                d->rings->kick();
+
+            if (ring->waitForSpace(hdrLen + chunkLen) && !waitForRing())
+                return false;
+        }
+
+        data += chunkLen;
+        len  -= chunkLen;
+    } while (len > 0);
+
+    if (ring->takeConsumerWaiting())
+        d->rings->kick();
+
+    return true;
+}
+
+/**
+ * Sleep on our doorbell until the server made room in the command ring.
+ *
+ * @return false if the server went away.
+ */
+bool YapClient::waitForRing()
+{
+    struct pollfd pfd[2];
+    pfd[0].fd      = d->rings->eventFd();
+    pfd[0].events  = POLLIN;
+    pfd[0].revents = 0;
+    pfd[1].fd      = d->cmdSocketFd;
+    pfd[1].events  = 0;
+    pfd[1].revents = 0;
+
+    while (::poll(pfd, 2, -1) < 0) {
+        if (errno != EINTR)
+            return false;
+    }
+
+    if (pfd[1].revents & (POLLHUP | POLLERR))
+        return false;
+
+    d->rings->clearEvent();
+
+    // The wakeup may have been meant for the message watch as well
+    if (d->rings->messages()->available() > 0)
+        d->rings->kickSelf();
+
+    return true;
+}
+
+/**
+ * Messages come through the message ring from now on.
+ */
+void YapClient::startRings()
+{
+    if (!d->rings || d->ringIoSource)
+        return;
+
+    d->ringIoChannel = g_io_channel_unix_new(d->rings->eventFd());
+    d->ringIoSource  = g_io_create_watch(d->ringIoChannel, G_IO_IN);
+
+    g_source_set_callback(d->ringIoSource, (GSourceFunc) YapClientPriv::ioCallback, this, NULL);
+    g_source_attach(d->ringIoSource, d->mainCtxt);
+
+    // The server doesn't ring for messages written before we started watching
+    d->rings->kickSelf();
+}
+
+/**
+ * Dispatch all complete messages in the message ring. The server writes frames
+ * as a whole, only packets split into chunks can be incomplete.
+ *
+ * @return false on a broken frame.
+ */
+bool YapClient::readRingMessages()
+{
+    YapRing* ring = d->rings->messages();
+    char     pktHeader[kLongPacketHeaderLen];
+    int      hdrLen = YapPacket::headerLength(d->msgFeatures);
+
+    d->rings->clearEvent();
+
+    while (true) {
+        if (!ring->peek((uint8_t*) pktHeader, hdrLen)) {
+            if (ring->waitForData())
+                break;
+            continue;
+        }
+
+        int     chunkLen = 0;
+        uint8_t flags = 0;
+        YapPacket::readHeader(d->msgFeatures, pktHeader, chunkLen, flags);
+
+        if (chunkLen < 0 || !d->msgPacket->reserve(d->ringPktLen + chunkLen)) {
+            fprintf(stderr, "YAP: ERROR packet length too large: %d > %d\n", d->ringPktLen + chunkLen, d->msgPacket->m_maxLen);
+            return false;
+        }
+
+        ring->read((uint8_t*) pktHeader, hdrLen);
+        if (ring->read(d->msgPacket->m_buffer + d->ringPktLen, chunkLen) != chunkLen) {
+            fprintf(stderr, "YAP: Incomplete frame in message ring\n");
+            return false;
+        }
+
+        if (ring->takeProducerWaiting())
+            d->rings->kick();
+
+        if (d->ringPktLen == 0)
+            d->ringPktFlags = flags;
+        d->ringPktLen += chunkLen;
+
+        if ((d->msgFeatures & kYapFeatureLongFrames) && (flags & kPacketFlagMoreMask))
+            continue;
+
+        d->msgPacket->setReadTotalLength(d->ringPktLen);
+        d->msgPacket->setNative(d->ringPktFlags & kPacketFlagNativeMask);
+        d->msgPacket->reset();
+        d->ringPktLen = 0;
+
+        handleAsyncMessage(d->msgPacket);
+
+        // The handler may have lost the connection
+        if (!d->rings)
+            return true;
+
+        d->msgPacket->reset();
+        d->msgPacket->setReadTotalLength(0);
+        d->msgPacket->shrink();
+    }
+
+    return true;
+}
+
+/**
+ * Read a complete packet, collecting all of its chunks when long frames are in use.
+ *
+ * @param sync Read with readSocketSync(), used while waiting for a reply.
+ */
+bool YapClient::readPacket(int fd, uint32_t features, YapPacket* packet, bool sync)
+{
+    char    pktHeader[kLongPacketHeaderLen];
+    int     hdrLen = YapPacket::headerLength(features);
+    int     pktLen = 0;
+    int     chunkLen = 0;
+    uint8_t chunkFlags = 0;
+    uint8_t flags = 0;
+
+    packet->setReadTotalLength(0);
+
+    do {
+        bool ok = sync ? readSocketSync(fd, pktHeader, hdrLen) : readSocket(fd, pktHeader, hdrLen);
+        if (!ok) {
+            fprintf(stderr, "YAP: Failed to read packet header\n");
+            return false;
+        }
+
+        YapPacket::readHeader(features, pktHeader, chunkLen, chunkFlags);
+        if (pktLen == 0)
+            flags = chunkFlags;
+
+        if (chunkLen < 0 || !packet->reserve(pktLen + chunkLen)) {
+            fprintf(stderr, "YAP: ERROR packet length too large: %d > %d\n", pktLen + chunkLen, packet->m_maxLen);
+            return false;
+        }
+
+        char* buf = (char*) packet->m_buffer + pktLen;
+        ok = sync ? readSocketSync(fd, buf, chunkLen) : readSocket(fd, buf, chunkLen);
+        if (!ok) {
+            fprintf(stderr, "YAP: Failed to read packet data of length: %d\n", chunkLen);
+            return false;
+        }
+
+        pktLen += chunkLen;
+
+    } while ((features & kYapFeatureLongFrames) && (chunkFlags & kPacketFlagMoreMask));
+
+    packet->setReadTotalLength(pktLen);
+    packet->setNative(flags & kPacketFlagNativeMask);
+    return true;
+}
+
 bool YapClient::run()
 {
     if(d->mainLoop == NULL && d->mainCtxt != NULL)
@@ -375,13 +754,9 @@ void YapClient::init(const char* name)
     d->msgIoSource = 0;
 
 
-    d->msgBuffer = new uint8_t[kMaxMsgLen];
-    d->cmdBuffer = new uint8_t[kMaxMsgLen];
-    d->replyBuffer = new uint8_t[kMaxMsgLen];
-
-    d->msgPacket = new YapPacket(d->msgBuffer, 0);
-    d->cmdPacket = new YapPacket(d->cmdBuffer);
-    d->replyPacket = new YapPacket(d->replyBuffer, 0);
+    d->msgPacket = new YapPacket(0);
+    d->cmdPacket = new YapPacket();
+    d->replyPacket = new YapPacket(0);
 
     ::snprintf(d->cmdSocketPath, G_N_ELEMENTS(d->cmdSocketPath), "%s%s", kSocketPathPrefix, name);
 
@@ -456,6 +831,13 @@ void YapClient::ioCallback(GIOChannel* channel, GIOCondition condition)
         g_source_set_callback(d->msgIoSource, (GSourceFunc) YapClientPriv::ioCallback, this, NULL);
         g_source_attach(d->msgIoSource, d->mainCtxt);
     }
+    else if (channel == d->ringIoChannel) {
+        if (!readRingMessages()) {
+            serverDisconnected();
+            closeMsgSocket();
+            closeCmdSocket();
+        }
+    }
     else if (channel == d->cmdIoChannel) {
         if (condition & G_IO_HUP) {
             g_message("YAP: Server disconnected command socket");
@@ -466,42 +848,44 @@ void YapClient::ioCallback(GIOChannel* channel, GIOCondition condition)
     }
     else if (channel == d->msgIoChannel) {
 
-        char pktHeader[4] = { 0, 0, 0, 0 };
-        uint16_t pktLen = 0;
-        char * ppp = 0;
-
         // We either got a message or a server disconnect
         if (condition & G_IO_HUP)
             goto Detached;
 
-        // Get the packet header
-        if (!readSocket(d->msgSocketFd, pktHeader, 4)) {
-            fprintf(stderr, "YAP: Failed to read packet header\n");
+        if (!readPacket(d->msgSocketFd, d->msgFeatures, d->msgPacket, false))
             goto Detached;
-        }
 
-        ppp = ((char *)&pktHeader[0]);
-        pktLen   = *((uint16_t*) ppp);
-        pktLen   = bswap_16(pktLen);
+        d->msgPacket->reset();
 
-        if (pktLen > kMaxMsgLen) {
-            fprintf(stderr, "YAP: ERROR packet length too large: %u > %d\n", pktLen, kMaxMsgLen);
-            goto Detached;
-        }
+        if (d->awaitingMsgHello) {
+            int16_t msg = 0;
+            int32_t features = 0;
 
-        // Get the packet data
-        if (!readSocket(d->msgSocketFd, (char*) d->msgBuffer, pktLen)) {
-            fprintf(stderr, "YAP: Failed to read packet data of length: %d\n", pktLen);
-            goto Detached;
-        }
+            (*d->msgPacket) >> msg;
+            if (msg == kYapMsgHello) {
+                (*d->msgPacket) >> features;
 
-        d->msgPacket->reset();
-        d->msgPacket->setReadTotalLength(pktLen);
+                // Everything after this message is framed with the negotiated features
+                d->msgFeatures = (uint32_t) features;
+                d->msgPacket->setFeatures(d->msgFeatures);
+                d->awaitingMsgHello = false;
+
+                d->msgPacket->reset();
+                d->msgPacket->setReadTotalLength(0);
+
+                if (d->msgFeatures & kYapFeatureSharedRing)
+                    startRings();
+                return;
+            }
+
+            d->msgPacket->reset();
+        }
 
         handleAsyncMessage(d->msgPacket);
 
         d->msgPacket->reset();
         d->msgPacket->setReadTotalLength(0);
+        d->msgPacket->shrink();
 
         return;
 
@@ -563,8 +947,12 @@ bool YapClient::writeSocket(int fd, char* buf, int len)
     while (len > 0) {
         int count = ::write(fd, &buf[index], len);
         if (count <= 0) {
-            if (errno == EAGAIN || errno == EINTR)
+            if (errno == EINTR)
                 continue;
+            else if (errno == EAGAIN) {
+                waitWritable(fd);
+                continue;
+            }
             else {
                 fprintf(stderr, "Failed to write to socket. Error: %d, %s\n", errno, strerror(errno));
                 return false;
@@ -600,6 +988,21 @@ void YapClient::closeMsgSocket(void)
 
 void YapClient::closeCmdSocket(void)
 {
+    if(d->ringIoSource != NULL) {
+        g_source_destroy(d->ringIoSource);
+        d->ringIoSource = NULL;
+    }
+    if(d->ringIoChannel != NULL) {
+        g_io_channel_unref(d->ringIoChannel);
+        d->ringIoChannel = NULL;
+    }
+    delete d->rings;
+    d->rings = NULL;
+    d->ringPktLen = 0;
+
+    delete d->bulk;
+    d->bulk = NULL;
+
     if(d->cmdIoSource != NULL) {
         g_source_destroy(d->cmdIoSource);
         d->cmdIoSource = NULL;
@@ -24,6 +24,7 @@ LICENSE@@@ */
 
 class YapPacket;
 class YapClientPriv;
+class YapBulk;
 
 class YapClient
 {
@@ -51,14 +52,32 @@ public:
     bool sendAsyncCommand();
     bool sendSyncCommand();
 
+    void traceNextCommand(int32_t seq, int64_t timeUs);
+    bool sendCapturedCommand(const uint8_t* data, int len, bool native, bool sync);
+
+    uint32_t sendBulk(const YapBulk* bulk);
+    YapBulk* receiveBulk(uint32_t id);
+    uint32_t sendBulkFd(int fd);
+
     virtual void serverConnected() = 0;
     virtual void serverDisconnected() = 0;
     virtual void handleAsyncMessage(YapPacket* msg) = 0;
 
+protected:
+
+    void appendTrace(YapPacket* cmd);
+
 private:
 
     void init(const char* name);
     void ioCallback(GIOChannel* channel, GIOCondition condition);
+    bool negotiateFeatures();
+    bool writePacket(uint8_t flags, YapPacket* packet);
+    bool writePacketToRing(uint8_t flags, YapPacket* packet);
+    bool waitForRing();
+    void startRings();
+    bool readRingMessages();
+    bool readPacket(int fd, uint32_t features, YapPacket* packet, bool sync);
     bool readSocket(int fd, char* buf, int len);
     bool readSocketSync(int fd, char* buf, int len);
     bool writeSocket(int fd, char* buf, int len);
@@ -0,0 +1,62 @@
+/* @@@LICENSE
+*
+*      Copyright (c) 2012 Hewlett-Packard Development Company, L.P.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+LICENSE@@@ */
+
+#include <time.h>
+
+#include "YapCommandStats.h"
+
+void YapCommandStats::record(int len, int64_t ns)
+{
+    if (len > 0)
+        bytes += len;
+    latency.recordNs(ns);
+}
+
+void YapCommandStats::reset()
+{
+    bytes = 0;
+    latency.reset();
+}
+
+int64_t YapCommandStats::nowNs()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Write one line per entry that has been called at all, in a format meant for
+ * sort(1) and awk rather than for reading top to bottom.
+ */
+void YapCommandStats::dump(FILE* f, const char* title, const YapCommandStats* stats, int count)
+{
+    fprintf(f, "# %s\n", title);
+    fprintf(f, "# %-26s %12s %10s %10s %10s %10s  buckets (below 1, 2, 4, ... us)\n",
+            "name", "bytes", "count", "totalUs", "meanUs", "maxUs");
+
+    for (int i = 0; i < count; i++) {
+        const YapCommandStats& s = stats[i];
+        if (!s.latency.count())
+            continue;
+
+        fprintf(f, "%-28s %12llu ", s.name, (unsigned long long) s.bytes);
+        s.latency.dump(f);
+        fprintf(f, "\n");
+    }
+}
@@ -0,0 +1,48 @@
+/* @@@LICENSE
+*
+*      Copyright (c) 2012 Hewlett-Packard Development Company, L.P.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+LICENSE@@@ */
+
+#ifndef YAPCOMMANDSTATS_H
+#define YAPCOMMANDSTATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "LatencyHistogram.h"
+
+/**
+ * Call count, bytes and a histogram of execution times of one command handler
+ * or message sender, kept by code YapCodeGen generates with the stats option.
+ * Commands are dispatched and messages sent on the main loop, which is also
+ * where the stats are read.
+ *
+ * An aggregate, so the generated tables are initialized with just a name.
+ */
+struct YapCommandStats
+{
+    const char*      name;
+    uint64_t         bytes;
+    LatencyHistogram latency;
+
+    void record(int bytes, int64_t ns);
+    void reset();
+
+    static int64_t nowNs();
+    static void dump(FILE* f, const char* title, const YapCommandStats* stats, int count);
+};
+
+#endif /* YAPCOMMANDSTATS_H */
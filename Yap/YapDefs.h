@@ -22,10 +22,38 @@ LICENSE@@@ */
 #include <stdint.h>
 
 #define kMaxMsgLen              ((int)16384) // increased to 16k up from 4k
+#define kMaxPacketLen           ((int)(16 * 1024 * 1024)) // with kYapFeatureLongFrames
+#define kMaxChunkLen            ((int)65536) // largest frame payload with kYapFeatureLongFrames
+
+#define kPacketHeaderLen        4 // 16-bit length, flags
+#define kLongPacketHeaderLen    8 // 32-bit length, flags
 
 #define kPacketFlagSyncMask     ((uint8_t)(1 << 0))
 #define kPacketFlagCommandMask  ((uint8_t)(1 << 1))
 #define kPacketFlagReplyMask    ((uint8_t)(1 << 2))
 #define kPacketFlagMessageMask  ((uint8_t)(1 << 3))
+#define kPacketFlagMoreMask     ((uint8_t)(1 << 4)) // more chunks of this packet follow
+#define kPacketFlagNativeMask   ((uint8_t)(1 << 5)) // packet uses the native encoding
+
+// Protocol features, negotiated with kYapCmdHello right after connecting
+#define kYapFeatureLongFrames   ((uint32_t)(1 << 0)) // 32-bit framing, chunked packets
+#define kYapFeatureNativeEncoding ((uint32_t)(1 << 1)) // untagged host order fields, needs kYapFeatureLongFrames
+#define kYapFeatureSharedRing   ((uint32_t)(1 << 2)) // commands and messages through shared memory rings
+#define kYapFeatureBulk         ((uint32_t)(1 << 3)) // large payloads as memfds on a side channel, see YapBulk
+
+#define kYapSupportedFeatures   (kYapFeatureLongFrames | kYapFeatureNativeEncoding | kYapFeatureSharedRing | \
+                                 kYapFeatureBulk)
+
+// Scheduling class of a command, see YapServer::commandClass()
+enum YapCommandClass {
+    kYapCommandInput,   // dispatched as soon as it arrives
+    kYapCommandControl, // dispatched in order with the commands before it
+    kYapCommandBulk     // dispatched once no input is pending
+};
+
+// Sync command reserved for the protocol: int features; int features
+#define kYapCmdHello            ((int16_t)0x0FFF)
+// Message reserved for the protocol: int features. Last message framed without them
+#define kYapMsgHello            ((int16_t)0x2FFF)
 
 #endif /* YAPDEFS_H */
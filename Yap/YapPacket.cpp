@@ -35,25 +35,49 @@ typedef enum YapType_t {
     kYapTypeInt64  = (1 << 4),
     kYapTypeDouble = (1 << 5),
     kYapTypeString = (1 << 6),
-    kYapTypeUInt16 = (1 << 7)
+    kYapTypeUInt16 = (1 << 7),
+    kYapTypeLongString = (1 << 6) | (1 << 0) // 32-bit length, only fits kYapFeatureLongFrames packets
 } YapType_t;
 
-YapPacket::YapPacket(uint8_t* buffer)
-    : m_buffer(buffer)
+// Strings longer than this need the 32-bit length of kYapTypeLongString
+static const int kMaxShortStringLen = 0x7FFF;
+
+YapPacket::YapPacket()
+    : m_buffer(0)
+    , m_capacity(kMaxMsgLen)
+    , m_maxLen(kMaxMsgLen)
     , m_forWriting(true)
+    , m_native(false)
     , m_currReadPos(0)
     , m_readTotalLen(0)
     , m_currWritePos(0)
+    , m_scratch(0)
+    , m_scratchCapacity(0)
+    , m_scratchPos(0)
 {
+    m_buffer = new uint8_t[m_capacity];
 }
 
-YapPacket::YapPacket(uint8_t* buffer, int readTotalLen)
-    : m_buffer(buffer)
+YapPacket::YapPacket(int readTotalLen)
+    : m_buffer(0)
+    , m_capacity(kMaxMsgLen)
+    , m_maxLen(kMaxMsgLen)
     , m_forWriting(false)
+    , m_native(false)
     , m_currReadPos(0)
     , m_readTotalLen(readTotalLen)
     , m_currWritePos(0)
+    , m_scratch(0)
+    , m_scratchCapacity(0)
+    , m_scratchPos(0)
+{
+    m_buffer = new uint8_t[m_capacity];
+}
+
+YapPacket::~YapPacket()
 {
+    delete [] m_buffer;
+    delete [] m_scratch;
 }
 
 int YapPacket::length() const
@@ -64,6 +88,14 @@ int YapPacket::length() const
         return m_readTotalLen;
 }
 
+/**
+ * Whether a read packet has fields left, for optional trailing fields.
+ */
+bool YapPacket::hasMore() const
+{
+    return !m_forWriting && m_currReadPos < m_readTotalLen;
+}
+
 void YapPacket::setReadTotalLength(int len)
 {
     m_readTotalLen = len;    
@@ -73,12 +105,270 @@ void YapPacket::reset()
 {
     m_currWritePos = 0;
     m_currReadPos  = 0;
+    m_scratchPos   = 0;
+}
+
+/**
+ * Create a packet to write fields to outside of a connection, which may grow
+ * as if kYapFeatureLongFrames was negotiated. Delete it with destroy().
+ */
+YapPacket* YapPacket::createForWriting(bool native)
+{
+    YapPacket* packet = new YapPacket();
+    packet->setFeatures(kYapFeatureLongFrames);
+    packet->setNative(native);
+    return packet;
+}
+
+/**
+ * Create a packet to read back the fields written to another one.
+ */
+YapPacket* YapPacket::createForReading(const YapPacket* written)
+{
+    YapPacket* packet = new YapPacket(0);
+    packet->setFeatures(kYapFeatureLongFrames);
+    if (!packet->reserve(written->length())) {
+        delete packet;
+        return 0;
+    }
+
+    ::memcpy(packet->m_buffer, written->m_buffer, written->length());
+    packet->setReadTotalLength(written->length());
+    packet->setNative(written->m_native);
+    return packet;
+}
+
+void YapPacket::destroy(YapPacket* packet)
+{
+    delete packet;
+}
+
+/**
+ * Start writing over, or reading the fields again.
+ */
+void YapPacket::rewind()
+{
+    reset();
+}
+
+/**
+ * Packets can only grow beyond kMaxMsgLen once kYapFeatureLongFrames has been negotiated.
+ * Packets for writing use the native encoding once kYapFeatureNativeEncoding has been,
+ * packets for reading follow the kPacketFlagNativeMask of each packet instead.
+ */
+void YapPacket::setFeatures(uint32_t features)
+{
+    m_maxLen = (features & kYapFeatureLongFrames) ? kMaxPacketLen : kMaxMsgLen;
+
+    if (m_forWriting)
+        m_native = features & kYapFeatureNativeEncoding;
+}
+
+void YapPacket::setNative(bool native)
+{
+    m_native = native;
+}
+
+/**
+ * Frame flags describing the encoding of this packet.
+ */
+uint8_t YapPacket::encodingFlags() const
+{
+    return m_native ? kPacketFlagNativeMask : 0;
+}
+
+void YapPacket::writeNative(const void* val, int len)
+{
+    g_return_if_fail(reserve(m_currWritePos + len));
+
+    ::memcpy(m_buffer + m_currWritePos, val, len);
+    m_currWritePos += len;
+}
+
+bool YapPacket::readNative(void* val, int len)
+{
+    g_return_val_if_fail((m_currReadPos + len) <= m_readTotalLen, false);
+
+    ::memcpy(val, m_buffer + m_currReadPos, len);
+    m_currReadPos += len;
+    return true;
+}
+
+/**
+ * Write consecutive fixed width fields from a packed struct with one copy. The
+ * result is the same as writing them one by one.
+ *
+ * @return false if the packet uses the tagged encoding, nothing is written then.
+ */
+bool YapPacket::writeBlock(const void* val, int len)
+{
+    g_return_val_if_fail(m_forWriting, false);
+
+    if (!m_native)
+        return false;
+
+    g_return_val_if_fail(reserve(m_currWritePos + len), true);
+
+    ::memcpy(m_buffer + m_currWritePos, val, len);
+    m_currWritePos += len;
+    return true;
+}
+
+/**
+ * Read consecutive fixed width fields into a packed struct with one bounds
+ * check and one copy.
+ *
+ * @return false if the packet uses the tagged encoding, nothing is read then.
+ */
+bool YapPacket::readBlock(void* val, int len)
+{
+    g_return_val_if_fail(!m_forWriting, false);
+
+    if (!m_native)
+        return false;
+
+    if ((m_currReadPos + len) > m_readTotalLen) {
+        ::memset(val, 0, len);
+        g_return_val_if_fail((m_currReadPos + len) <= m_readTotalLen, true);
+    }
+
+    ::memcpy(val, m_buffer + m_currReadPos, len);
+    m_currReadPos += len;
+    return true;
+}
+
+/**
+ * Make sure the buffer holds at least len bytes, growing it up to the maximum packet length.
+ */
+bool YapPacket::reserve(int len)
+{
+    if (len <= m_capacity)
+        return true;
+
+    if (len > m_maxLen)
+        return false;
+
+    int capacity = MIN(MAX(len, m_capacity * 2), m_maxLen);
+    uint8_t* buffer = new uint8_t[capacity];
+    if (!buffer)
+        return false;
+
+    ::memcpy(buffer, m_buffer, m_capacity);
+    delete [] m_buffer;
+
+    m_buffer   = buffer;
+    m_capacity = capacity;
+
+    return true;
+}
+
+/**
+ * Give back the memory of an unusually large packet. Discards the packet contents.
+ */
+void YapPacket::shrink()
+{
+    if (m_scratchCapacity > kMaxMsgLen) {
+        delete [] m_scratch;
+        m_scratch = 0;
+        m_scratchCapacity = 0;
+        m_scratchPos = 0;
+    }
+
+    if (m_capacity <= kMaxMsgLen)
+        return;
+
+    delete [] m_buffer;
+    m_capacity = kMaxMsgLen;
+    m_buffer   = new uint8_t[m_capacity];
+}
+
+int YapPacket::headerLength(uint32_t features)
+{
+    return (features & kYapFeatureLongFrames) ? kLongPacketHeaderLen : kPacketHeaderLen;
+}
+
+/**
+ * Number of bytes needed to frame a packet of len bytes, including the header of every chunk.
+ */
+int YapPacket::framedLength(uint32_t features, int len)
+{
+    if (!(features & kYapFeatureLongFrames))
+        return kPacketHeaderLen + len;
+
+    int numChunks = MAX(1, (len + kMaxChunkLen - 1) / kMaxChunkLen);
+    return numChunks * kLongPacketHeaderLen + len;
+}
+
+/**
+ * Frame len bytes of packet data into out, which must hold framedLength() bytes. Without
+ * kYapFeatureLongFrames this is a single frame, otherwise the data is split into chunks of
+ * at most kMaxChunkLen, all but the last one flagged with kPacketFlagMoreMask.
+ */
+void YapPacket::writeFrames(uint32_t features, uint8_t flags, const uint8_t* data, int len, uint8_t* out)
+{
+    int hdrLen = headerLength(features);
+    int maxChunkLen = (features & kYapFeatureLongFrames) ? kMaxChunkLen : len;
+
+    do {
+        int chunkLen = MIN(len, maxChunkLen);
+        bool more = chunkLen < len;
+
+        writeHeader(features, more ? (flags | kPacketFlagMoreMask) : flags, chunkLen, (char*) out);
+        out += hdrLen;
+
+        if (chunkLen) {
+            ::memcpy(out, data, chunkLen);
+            out  += chunkLen;
+            data += chunkLen;
+            len  -= chunkLen;
+        }
+    } while (len > 0);
+}
+
+void YapPacket::writeHeader(uint32_t features, uint8_t flags, int len, char* header)
+{
+    if (features & kYapFeatureLongFrames) {
+        uint32_t pktLen = bswap_32((uint32_t) len);
+        ::memcpy(header, &pktLen, 4);
+        header[4] = 0;
+        header[5] = 0;
+        header[6] = 0;
+        header[7] = flags;
+    }
+    else {
+        uint16_t pktLen = bswap_16((uint16_t) len);
+        ::memcpy(header, &pktLen, 2);
+        header[2] = 0;
+        header[3] = flags;
+    }
+}
+
+void YapPacket::readHeader(uint32_t features, const char* header, int& len, uint8_t& flags)
+{
+    if (features & kYapFeatureLongFrames) {
+        uint32_t pktLen = 0;
+        ::memcpy(&pktLen, header, 4);
+        len   = (int) bswap_32(pktLen);
+        flags = header[7];
+    }
+    else {
+        uint16_t pktLen = 0;
+        ::memcpy(&pktLen, header, 2);
+        len   = bswap_16(pktLen);
+        flags = header[3];
+    }
 }
 
 void YapPacket::operator<<(bool val)
 {
     g_return_if_fail(m_forWriting);
-    g_return_if_fail((m_currWritePos + 2) <= kMaxMsgLen);
+
+    if (m_native) {
+        writeNative(&val, sizeof(val));
+        return;
+    }
+
+    g_return_if_fail(reserve(m_currWritePos + 2));
 
     m_buffer[m_currWritePos++] = kYapTypeBool;
     m_buffer[m_currWritePos++] = val;
@@ -87,7 +377,13 @@ void YapPacket::operator<<(bool val)
 void YapPacket::operator<<(int8_t val)
 {
     g_return_if_fail(m_forWriting);
-    g_return_if_fail((m_currWritePos + 2) <= kMaxMsgLen);
+
+    if (m_native) {
+        writeNative(&val, sizeof(val));
+        return;
+    }
+
+    g_return_if_fail(reserve(m_currWritePos + 2));
 
     m_buffer[m_currWritePos++] = kYapTypeInt8;
     m_buffer[m_currWritePos++] = val;
@@ -96,7 +392,13 @@ void YapPacket::operator<<(int8_t val)
 void YapPacket::operator<<(int16_t val)
 {
     g_return_if_fail(m_forWriting);
-    g_return_if_fail((m_currWritePos + 3) <= kMaxMsgLen);
+
+    if (m_native) {
+        writeNative(&val, sizeof(val));
+        return;
+    }
+
+    g_return_if_fail(reserve(m_currWritePos + 3));
 
     m_buffer[m_currWritePos++] = kYapTypeInt16;
 
@@ -111,7 +413,13 @@ void YapPacket::operator<<(int16_t val)
 void YapPacket::operator<<(uint16_t val)
 {
     g_return_if_fail(m_forWriting);
-    g_return_if_fail((m_currWritePos + 3) <= kMaxMsgLen);
+
+    if (m_native) {
+        writeNative(&val, sizeof(val));
+        return;
+    }
+
+    g_return_if_fail(reserve(m_currWritePos + 3));
 
     m_buffer[m_currWritePos++] = kYapTypeUInt16;
 
@@ -126,7 +434,13 @@ void YapPacket::operator<<(uint16_t val)
 void YapPacket::operator<<(int32_t val)
 {
     g_return_if_fail(m_forWriting);
-    g_return_if_fail((m_currWritePos + 5) <= kMaxMsgLen);
+
+    if (m_native) {
+        writeNative(&val, sizeof(val));
+        return;
+    }
+
+    g_return_if_fail(reserve(m_currWritePos + 5));
 
     m_buffer[m_currWritePos++] = kYapTypeInt32;
 
@@ -143,7 +457,13 @@ void YapPacket::operator<<(int32_t val)
 void YapPacket::operator<<(int64_t val)
 {
     g_return_if_fail(m_forWriting);
-    g_return_if_fail((m_currWritePos + 9) <= kMaxMsgLen);
+
+    if (m_native) {
+        writeNative(&val, sizeof(val));
+        return;
+    }
+
+    g_return_if_fail(reserve(m_currWritePos + 9));
 
     m_buffer[m_currWritePos++] = kYapTypeInt64;
 
@@ -164,7 +484,13 @@ void YapPacket::operator<<(int64_t val)
 void YapPacket::operator<<(double val)
 {
     g_return_if_fail(m_forWriting);
-    g_return_if_fail((m_currWritePos + 9) <= kMaxMsgLen);
+
+    if (m_native) {
+        writeNative(&val, sizeof(val));
+        return;
+    }
+
+    g_return_if_fail(reserve(m_currWritePos + 9));
 
     m_buffer[m_currWritePos++] = kYapTypeDouble;
 
@@ -185,18 +511,40 @@ void YapPacket::operator<<(double val)
 void YapPacket::operator<<(const char* val)
 {
     int strLen = val ? strlen(val) : 0;
+    bool longString = strLen > kMaxShortStringLen;
+    int lenSize = longString ? 4 : 2;
 
     g_return_if_fail(m_forWriting);
-    g_return_if_fail((m_currWritePos + strLen + 3) <= kMaxMsgLen);
 
-    m_buffer[m_currWritePos++] = kYapTypeString;
+    if (m_native) {
+        // Terminated so readers can use the string in place
+        int32_t nativeLen = strLen;
+        g_return_if_fail(reserve(m_currWritePos + sizeof(nativeLen) + strLen + 1));
+
+        writeNative(&nativeLen, sizeof(nativeLen));
+        writeNative(val, strLen);
+        m_buffer[m_currWritePos++] = 0;
+        return;
+    }
+
+    g_return_if_fail(reserve(m_currWritePos + strLen + lenSize + 1));
+
+    m_buffer[m_currWritePos++] = longString ? kYapTypeLongString : kYapTypeString;
 
     uint8_t* pSrc = (uint8_t*)(&strLen);
     uint8_t* pDst = m_buffer + m_currWritePos;
 
-    pDst[0] = pSrc[1];
-    pDst[1] = pSrc[0];
-    m_currWritePos += 2;
+    if (longString) {
+        pDst[0] = pSrc[3];
+        pDst[1] = pSrc[2];
+        pDst[2] = pSrc[1];
+        pDst[3] = pSrc[0];
+    }
+    else {
+        pDst[0] = pSrc[1];
+        pDst[1] = pSrc[0];
+    }
+    m_currWritePos += lenSize;
 
     if (strLen) {
         memcpy(m_buffer + m_currWritePos, val, strLen);
@@ -207,6 +555,12 @@ void YapPacket::operator<<(const char* val)
 void YapPacket::operator>>(bool& val)
 {
     g_return_if_fail(!m_forWriting);
+
+    if (m_native) {
+        readNative(&val, sizeof(val));
+        return;
+    }
+
     g_return_if_fail((m_currReadPos + 2) <= m_readTotalLen);
 
     YapType_t type = (YapType_t) m_buffer[m_currReadPos++];
@@ -221,6 +575,12 @@ void YapPacket::operator>>(bool& val)
 void YapPacket::operator>>(int8_t& val)
 {
     g_return_if_fail(!m_forWriting);
+
+    if (m_native) {
+        readNative(&val, sizeof(val));
+        return;
+    }
+
     g_return_if_fail((m_currReadPos + 2) <= m_readTotalLen);
 
     YapType_t type = (YapType_t) m_buffer[m_currReadPos++];
@@ -235,6 +595,12 @@ void YapPacket::operator>>(int8_t& val)
 void YapPacket::operator>>(int16_t& val)
 {
     g_return_if_fail(!m_forWriting);
+
+    if (m_native) {
+        readNative(&val, sizeof(val));
+        return;
+    }
+
     g_return_if_fail((m_currReadPos + 3) <= m_readTotalLen);
 
     YapType_t type = (YapType_t) m_buffer[m_currReadPos++];
@@ -254,6 +620,12 @@ void YapPacket::operator>>(int16_t& val)
 void YapPacket::operator>>(uint16_t& val)
 {
     g_return_if_fail(!m_forWriting);
+
+    if (m_native) {
+        readNative(&val, sizeof(val));
+        return;
+    }
+
     g_return_if_fail((m_currReadPos + 3) <= m_readTotalLen);
 
     YapType_t type = (YapType_t) m_buffer[m_currReadPos++];
@@ -273,6 +645,12 @@ void YapPacket::operator>>(uint16_t& val)
 void YapPacket::operator>>(int32_t& val)
 {
     g_return_if_fail(!m_forWriting);
+
+    if (m_native) {
+        readNative(&val, sizeof(val));
+        return;
+    }
+
     g_return_if_fail((m_currReadPos + 5) <= m_readTotalLen);
 
     YapType_t type = (YapType_t) m_buffer[m_currReadPos++];
@@ -294,6 +672,12 @@ void YapPacket::operator>>(int32_t& val)
 void YapPacket::operator>>(int64_t& val)
 {
     g_return_if_fail(!m_forWriting);
+
+    if (m_native) {
+        readNative(&val, sizeof(val));
+        return;
+    }
+
     g_return_if_fail((m_currReadPos + 9) <= m_readTotalLen);
 
     YapType_t type = (YapType_t) m_buffer[m_currReadPos++];
@@ -319,6 +703,12 @@ void YapPacket::operator>>(int64_t& val)
 void YapPacket::operator>>(double& val)
 {
     g_return_if_fail(!m_forWriting);
+
+    if (m_native) {
+        readNative(&val, sizeof(val));
+        return;
+    }
+
     g_return_if_fail((m_currReadPos + 9) <= m_readTotalLen);
 
     YapType_t type = (YapType_t) m_buffer[m_currReadPos++];
@@ -343,30 +733,132 @@ void YapPacket::operator>>(double& val)
 
 void YapPacket::operator>>(char*& val)
 {
+    const char* str = 0;
+    int strLen = 0;
+
     g_return_if_fail(!m_forWriting);
-    g_return_if_fail((m_currReadPos + 3) <= m_readTotalLen);
+    g_return_if_fail(findString(str, strLen));
+
+    val = (char*) malloc(strLen + 1);
+
+    memcpy(val, str, strLen);
+    val[strLen] = 0;
+}
+
+/**
+ * Read a string without taking ownership, see readString().
+ */
+void YapPacket::operator>>(const char*& val)
+{
+    uint32_t len = 0;
+    readString(val, len);
+}
+
+/**
+ * Read a string without taking ownership. The string stays valid until the
+ * packet is reset, which happens once the command or message has been dispatched.
+ * Natively encoded strings are used in place, tagged ones are copied to a
+ * scratch buffer that is reused between packets. Either way the string is
+ * NUL terminated.
+ *
+ * @param len Set to the string length, so callers don't have to scan it again.
+ */
+bool YapPacket::readString(const char*& val, uint32_t& len)
+{
+    const char* str = 0;
+    int strLen = 0;
+
+    g_return_val_if_fail(!m_forWriting, false);
+    g_return_val_if_fail(findString(str, strLen), false);
+
+    if (m_native) {
+        val = str;
+        len = strLen;
+        return true;
+    }
+
+    // Every string takes at least its length plus one byte in the packet, so
+    // the scratch buffer never has to grow while handing out strings
+    if (m_scratchCapacity < m_readTotalLen) {
+        g_return_val_if_fail(m_scratchPos == 0, false);
+
+        delete [] m_scratch;
+        m_scratchCapacity = MAX(m_readTotalLen, kMaxMsgLen);
+        m_scratch = new char[m_scratchCapacity];
+    }
+
+    g_return_val_if_fail((m_scratchPos + strLen + 1) <= m_scratchCapacity, false);
+
+    val = m_scratch + m_scratchPos;
+    len = strLen;
+
+    memcpy(m_scratch + m_scratchPos, str, strLen);
+    m_scratch[m_scratchPos + strLen] = 0;
+    m_scratchPos += strLen + 1;
+    return true;
+}
+
+/**
+ * Find the next string argument in the packet.
+ *
+ * @param str Set to the first character of the string, which is not terminated
+ *            in tagged packets.
+ * @param strLen Set to the string length.
+ */
+bool YapPacket::findString(const char*& str, int& strLen)
+{
+    if (m_native) {
+        int32_t nativeLen = 0;
+        g_return_val_if_fail(readNative(&nativeLen, sizeof(nativeLen)), false);
+        g_return_val_if_fail(nativeLen >= 0 && (m_currReadPos + nativeLen + 1) <= m_readTotalLen, false);
+        g_return_val_if_fail(m_buffer[m_currReadPos + nativeLen] == 0, false);
+
+        str    = (const char*) m_buffer + m_currReadPos;
+        strLen = nativeLen;
+
+        m_currReadPos += nativeLen + 1;
+        return true;
+    }
+
+    g_return_val_if_fail((m_currReadPos + 3) <= m_readTotalLen, false);
 
     YapType_t type = (YapType_t) m_buffer[m_currReadPos++];
-    if (type != kYapTypeString) {
+    if (type != kYapTypeString && type != kYapTypeLongString) {
         fprintf(stderr, "Arg type is not string: %d\n", type);
-        g_return_if_fail(false);
+        g_return_val_if_fail(false, false);
     }
 
-    int16_t strLen = 0;
+    int32_t len = 0;
 
     uint8_t* pSrc = m_buffer + m_currReadPos;
-    uint8_t* pDst = (uint8_t*)(&strLen);
 
-    pDst[0] = pSrc[1];
-    pDst[1] = pSrc[0];
-    m_currReadPos += 2;
+    if (type == kYapTypeLongString) {
+        g_return_val_if_fail((m_currReadPos + 4) <= m_readTotalLen, false);
 
-    g_return_if_fail((m_currReadPos + strLen) <= m_readTotalLen);
-    val = (char*) malloc(strLen + 1);
+        uint8_t* pDst = (uint8_t*)(&len);
 
-    memcpy(val, m_buffer + m_currReadPos, strLen);
-    val[strLen] = 0;
+        pDst[0] = pSrc[3];
+        pDst[1] = pSrc[2];
+        pDst[2] = pSrc[1];
+        pDst[3] = pSrc[0];
+        m_currReadPos += 4;
+    }
+    else {
+        int16_t shortLen = 0;
+        uint8_t* pDst = (uint8_t*)(&shortLen);
 
-    m_currReadPos += strLen;
-}
+        pDst[0] = pSrc[1];
+        pDst[1] = pSrc[0];
+        m_currReadPos += 2;
 
+        len = shortLen;
+    }
+
+    g_return_val_if_fail(len >= 0 && (m_currReadPos + len) <= m_readTotalLen, false);
+
+    str    = (const char*) m_buffer + m_currReadPos;
+    strLen = len;
+
+    m_currReadPos += len;
+    return true;
+}
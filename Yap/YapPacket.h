@@ -26,6 +26,7 @@ class YapPacket
 public:
 
     int length() const;
+    bool hasMore() const;
 
     // write functions
     void operator<<(bool val);
@@ -46,27 +47,62 @@ public:
     void operator>>(int64_t& val);
     void operator>>(double& val);
     void operator>>(char*& val);
+    void operator>>(const char*& val);
+    bool readString(const char*& val, uint32_t& len);
+
+    // Fixed width fields at once, only in the native encoding
+    bool writeBlock(const void* val, int len);
+    bool readBlock(void* val, int len);
+
+    // Packets that don't belong to a connection, e.g. to measure the encoding
+    static YapPacket* createForWriting(bool native);
+    static YapPacket* createForReading(const YapPacket* written);
+    static void destroy(YapPacket* packet);
+    void rewind();
 
 private:
 
     // Write only packet
-    YapPacket(uint8_t* buffer);
+    YapPacket();
     // Read only packet
-    YapPacket(uint8_t* buffer, int readTotalLen);
+    YapPacket(int readTotalLen);
 
-    ~YapPacket() {}
+    ~YapPacket();
 
     void setReadTotalLength(int len);
     void reset();
+    void setFeatures(uint32_t features);
+    void setNative(bool native);
+    uint8_t encodingFlags() const;
+    bool reserve(int len);
+    void shrink();
+
+    // Encoding without type tags, in host byte order
+    void writeNative(const void* val, int len);
+    bool readNative(void* val, int len);
+    bool findString(const char*& str, int& strLen);
+
+    // Framing
+    static int  headerLength(uint32_t features);
+    static int  framedLength(uint32_t features, int len);
+    static void writeFrames(uint32_t features, uint8_t flags, const uint8_t* data, int len, uint8_t* out);
+    static void writeHeader(uint32_t features, uint8_t flags, int len, char* header);
+    static void readHeader(uint32_t features, const char* header, int& len, uint8_t& flags);
 
     YapPacket(const YapPacket&);
     YapPacket& operator=(const YapPacket&);
     
     uint8_t* m_buffer;
+    int   m_capacity;
+    int   m_maxLen;
     bool  m_forWriting;
+    bool  m_native;
     int   m_currReadPos;
     int   m_readTotalLen;
     int   m_currWritePos;
+    char* m_scratch;        ///< Copies of borrowed tagged strings
+    int   m_scratchCapacity;
+    int   m_scratchPos;
 
     friend class YapProxy;
     friend class YapClient;
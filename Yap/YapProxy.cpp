@@ -29,30 +29,92 @@ LICENSE@@@ */
 #include <string.h>
 #include <byteswap.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
+#include <poll.h>
+#include <time.h>
 
 #include "YapDefs.h"
 #include "YapPacket.h"
+#include "YapRing.h"
+#include "YapBulk.h"
+#include "YapCapture.h"
 #include "YapServer.h"
 #include "YapProxy.h"
 
-static const int kMaxConnectTries = 5;
+// Connecting to the client's message socket is retried from the main loop
+static const int kMaxConnectTries = 20;
+static const int kConnectRetryMs = 50;
+
+// Number of messages handed to a single writev() call
+static const int kMaxBatchedMessages = 32;
+// Flush immediately instead of waiting for the main loop once this many messages are pending
+static const int kMaxPendingMessages = 256;
+// Messages a client may fall behind by before coalescible ones get dropped. Past
+// that the backlog keeps growing as long as the client keeps reading.
+static const int kMaxPendingBytes = 512 * 1024;
+// How long a client may stop reading messages before it gets disconnected
+static const int kFlushTimeoutMs = 2000;
+// Bytes read from the command socket at once
+static const int kRecvBufferLen = kMaxMsgLen;
+// Commands dispatched per main loop wakeup before other clients get a turn
+static const int kMaxCommandsPerWakeup = 32;
+// Deferred commands a client may pile up before they get dispatched in order again
+static const int kMaxDeferredBytes = 1024 * 1024;
 
 gboolean YapProxyIoFunction(GIOChannel* channel, GIOCondition condition, void* data);
+gboolean YapProxyFlushFunction(void* data);
+gboolean YapProxyWritableFunction(GIOChannel* channel, GIOCondition condition, void* data);
+gboolean YapProxyDrainFunction(void* data);
+gboolean YapProxyConnectFunction(void* data);
+gboolean YapProxyRingFunction(GIOChannel* channel, GIOCondition condition, void* data);
+
+// Wait for room in the socket buffer instead of spinning on EAGAIN. Returns
+// false if the peer hasn't made any within kFlushTimeoutMs.
+static bool waitWritable(int fd)
+{
+    struct pollfd pfd;
+    pfd.fd      = fd;
+    pfd.events  = POLLOUT;
+    pfd.revents = 0;
+
+    int ret = ::poll(&pfd, 1, kFlushTimeoutMs);
+    return ret > 0 || (ret < 0 && errno == EINTR);
+}
+
+// Same clock clients use to stamp input, see YapClient::traceNextCommand()
+static int64_t monotonicTimeUs()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-YapProxy::Message::Message( const char* hdr, const uint8_t* data, int dataLen ) : data(NULL)
+/**
+ * Frame a copy of dataLen bytes of message data. The copy can't be avoided as the
+ * message packet gets reused before the message is written, framing it in the same
+ * pass keeps it to one. Packets are capped at kMaxPacketLen, so is this copy.
+ */
+YapProxy::Message::Message( uint32_t features, uint8_t flags, const uint8_t* data, int dataLen )
+    : data(NULL)
+    , len(0)
+    , features(features)
+    , coalesceId(0)
+    , coalesceKey(NULL)
 {
-    ::memcpy(this->hdr, hdr, sizeof(this->hdr));
-    this->data = new uint8_t[dataLen];
+    int framedLen = YapPacket::framedLength(features, dataLen);
+
+    this->data = new uint8_t[framedLen];
     if (this->data != NULL) {
-        ::memcpy(this->data, data, dataLen);
+        YapPacket::writeFrames(features, flags, data, dataLen, this->data);
+        len = framedLen;
     }
-    len = dataLen;
 }
 
 YapProxy::Message::~Message()
 {
     delete [] data;
+    delete [] coalesceKey;
 }
 
 /**
@@ -69,17 +131,54 @@ YapProxy::YapProxy(YapServer* server, int cmdSocketFd, char* msgSocketPath, char
     , m_msgSocketFd(-1)
     , m_msgSocketPostfix(0)
     , m_privData(0)
-    , m_cmdBuffer(0)
-    , m_replyBuffer(0)
-    , m_msgBuffer(0)
+    , m_features(0)
+    , m_captureId(0)
     , m_ioChannel(0)
     , m_ioSource(0)
+    , m_flushSource(0)
+    , m_msgIoChannel(0)
+    , m_connectFd(-1)
+    , m_connectPath(0)
+    , m_connectTries(0)
+    , m_connectSource(0)
+    , m_writableSource(0)
+    , m_drainSource(0)
+    , m_recvBuffer(0)
+    , m_recvLen(0)
+    , m_recvPos(0)
+    , m_recvHeaderLen(0)
+    , m_recvChunkLeft(-1)
+    , m_recvPktLen(0)
+    , m_recvFlags(0)
+    , m_recvMore(false)
+    , m_recvTime(0)
+    , m_commandTime(0)
+    , m_recvSequence(0)
+    , m_commandSequence(0)
+    , m_deferredBytes(0)
+    , m_rings(0)
+    , m_ringIoChannel(0)
+    , m_ringIoSource(0)
+    , m_bulk(0)
+    , m_bulkPeerFd(-1)
     , m_inSyncMode(false)
     , m_terminate(false)
+    , m_pendingOffset(0)
+    , m_pendingBytes(0)
+    , m_lastWriteUs(0)
+    , m_overflowed(false)
     , m_packetCommand(0)
     , m_packetReply(0)
     , m_packetMessage(0)
+    , m_heldCommand(0)
+    , m_heldFlags(0)
+    , m_heldTime(0)
+    , m_heldSequence(0)
+    , m_holding(false)
+    , m_packetCoalesced(0)
 {
+    m_parkedHello.packet = 0;
+
     if (msgSocketPostfix) {
 
         int length = strlen(msgSocketPostfix);
@@ -92,73 +191,96 @@ YapProxy::YapProxy(YapServer* server, int cmdSocketFd, char* msgSocketPath, char
         }
     }
 
-    m_cmdBuffer   = new uint8_t[kMaxMsgLen];
-    m_replyBuffer = new uint8_t[kMaxMsgLen];
-    m_msgBuffer   = new uint8_t[kMaxMsgLen];
-
-    m_packetCommand = new YapPacket(m_cmdBuffer, 0);
-    m_packetReply   = new YapPacket(m_replyBuffer);
-    m_packetMessage = new YapPacket(m_msgBuffer);
+    m_packetCommand = new YapPacket(0);
+    m_packetReply   = new YapPacket();
+    m_packetMessage = new YapPacket();
+    m_heldCommand   = new YapPacket(0);
+    m_packetCoalesced = new YapPacket();
 
     GMainContext* mainCtxt = g_main_loop_get_context(m_server->mainLoop());
 
     if (m_cmdSocketFd != -1) {
+        m_recvBuffer = new uint8_t[kRecvBufferLen];
+
         m_ioChannel = g_io_channel_unix_new(m_cmdSocketFd);
         m_ioSource  = g_io_create_watch(m_ioChannel, (GIOCondition) (G_IO_IN | G_IO_HUP));
 
         g_source_set_callback(m_ioSource, (GSourceFunc) YapProxyIoFunction, this, NULL);
         g_source_attach(m_ioSource, mainCtxt);
         g_source_set_priority(m_ioSource, G_PRIORITY_HIGH);
+
+        m_captureId = m_server->captureClientId();
+        capture(kYapCaptureConnect, monotonicTimeUs(), 0, 0, 0, 0);
     }
 
     if (msgSocketPath) {
-        struct sockaddr_un socketAddr = {0};
-        socketAddr.sun_family = AF_LOCAL;
-        if (strlen(msgSocketPath) < sizeof(socketAddr.sun_path)) {
-            ::strncpy(socketAddr.sun_path, msgSocketPath, sizeof(socketAddr.sun_path));
-            socketAddr.sun_path[sizeof(socketAddr.sun_path)-1] = '\0';
-        }
-        else {
+        struct sockaddr_un socketAddr;
+        if (strlen(msgSocketPath) >= sizeof(socketAddr.sun_path)) {
             fprintf(stderr, "Socket path length too long\n");
             return;
         }
-        m_msgSocketFd = ::socket(PF_LOCAL, SOCK_STREAM, 0);
-
-        fprintf(stderr, "Connecting to browser-adapter (client) socket: %s ...\n", msgSocketPath);
 
-        int connectTryCount = 0;
-        bool connected = false;
-        while (connectTryCount < kMaxConnectTries) {
+        int length = strlen(msgSocketPath);
+        m_connectPath = new char[length + 1];
+        ::memcpy(m_connectPath, msgSocketPath, length + 1);
 
-            if (::connect(m_msgSocketFd, (struct sockaddr*) &socketAddr, SUN_LEN(&socketAddr)) == 0) {
-                connected = true;
-                break;
-            }
-            else if (errno == EAGAIN || errno == EINTR || errno == ETIMEDOUT) {
+        m_connectFd = ::socket(PF_LOCAL, SOCK_STREAM, 0);
+        if (m_connectFd < 0) {
+            fprintf(stderr, "Failed to create msg socket: %s\n", strerror(errno));
+            return;
+        }
 
-                fprintf(stderr, "Retrying connect. Error was: %s\n", strerror(errno));
-                connectTryCount++;
-                continue;
-            }
-            else {
+        // Messages are written from the main loop, a stalled client must not block it,
+        // and neither must a client that is slow to accept.
+        int flags = ::fcntl(m_connectFd, F_GETFL, 0);
+        ::fcntl(m_connectFd, F_SETFL, flags | O_NONBLOCK);
 
-                break;
-            }
-        }
+        fprintf(stderr, "Connecting to browser-adapter (client) socket: %s ...\n", msgSocketPath);
 
-        if (!connected) {
-            fprintf(stderr, "Failed to connect to client's msg socket. Messages will not work\n");
-            ::close(m_msgSocketFd);
-            m_msgSocketFd = -1;
-        }
-        else {
-            fprintf(stderr, "Connected to client socket\n");
+        if (!connectMessageSocket()) {
+            m_connectSource = g_timeout_source_new(kConnectRetryMs);
+            g_source_set_callback(m_connectSource, (GSourceFunc) YapProxyConnectFunction, this, NULL);
+            g_source_attach(m_connectSource, mainCtxt);
         }
     }
 }
 
 YapProxy::~YapProxy()
 {
+    capture(kYapCaptureDisconnect, monotonicTimeUs(), 0, 0, 0, 0);
+
+    // Give messages queued during the last dispatch a chance to go out
+    writePendingMessages();
+    cancelFlush();
+    cancelWritable();
+    cancelDrain();
+    cancelConnect();
+
+    m_server->cancelDeferred(this);
+    while (!m_deferredCommands.empty()) {
+        delete m_deferredCommands.front().packet;
+        m_deferredCommands.pop_front();
+    }
+    delete m_parkedHello.packet;
+
+    delete [] m_recvBuffer;
+
+    if (m_ringIoSource) {
+        g_source_destroy(m_ringIoSource);
+        g_source_unref(m_ringIoSource);
+    }
+    if (m_ringIoChannel)
+        g_io_channel_unref(m_ringIoChannel);
+
+    delete m_rings;
+
+    delete m_bulk;
+    if (m_bulkPeerFd >= 0)
+        ::close(m_bulkPeerFd);
+
+    if (m_msgIoChannel)
+        g_io_channel_unref(m_msgIoChannel);
+
     delete m_msgSocketPostfix;
     m_msgSocketPostfix = 0;
 
@@ -170,13 +292,11 @@ YapProxy::~YapProxy()
         g_io_channel_unref(m_ioChannel);
     }
 
-    delete [] m_cmdBuffer;
-    delete [] m_replyBuffer;
-    delete [] m_msgBuffer;
-
     delete m_packetCommand;
     delete m_packetReply;
     delete m_packetMessage;
+    delete m_heldCommand;
+    delete m_packetCoalesced;
 
     if (m_msgSocketFd != -1)
         ::close(m_msgSocketFd);
@@ -188,6 +308,56 @@ YapProxy::~YapProxy()
         delete m_queuedMessages.front();
         m_queuedMessages.pop();
     }
+
+    while (!m_pendingMessages.empty()) {
+        delete m_pendingMessages.front();
+        m_pendingMessages.pop_front();
+    }
+}
+
+void YapProxy::capture(uint8_t type, int64_t timeUs, uint32_t sequence, uint8_t flags, const uint8_t* data, int len)
+{
+    if (m_captureId)
+        m_server->captureTraffic(m_captureId, type, timeUs, sequence, flags, data, len);
+}
+
+/**
+ * Capture the command in m_packetCommand as it was received, before it gets
+ * deferred or coalesced.
+ */
+void YapProxy::captureCommand()
+{
+    if (!m_captureId)
+        return;
+
+    uint8_t type = kYapCaptureCommand;
+
+    if (m_recvFlags & kPacketFlagSyncMask) {
+        int16_t cmdValue = 0;
+
+        m_packetCommand->reset();
+        (*m_packetCommand) >> cmdValue;
+        m_packetCommand->reset();
+
+        // The replaying client negotiates features on its own
+        if (cmdValue == kYapCmdHello)
+            return;
+
+        type = kYapCaptureSyncCommand;
+    }
+
+    capture(type, m_recvTime, m_recvSequence, m_recvFlags,
+            m_packetCommand->m_buffer, m_packetCommand->m_readTotalLen);
+}
+
+/**
+ * Note that the command being dispatched refers to bulk data or a descriptor.
+ * Neither is captured, so YapReplay skips the command instead of leaving the
+ * server waiting for them.
+ */
+void YapProxy::captureBulk()
+{
+    capture(kYapCaptureBulk, m_commandTime, m_commandSequence, 0, 0, 0);
 }
 
 bool YapProxy::isRecordProxy() const
@@ -201,21 +371,39 @@ bool YapProxy::isRecordProxy() const
  */
 void YapProxy::transferQueuedMessage(YapProxy* srcProxy)
 {
+    // Still connecting, they go out along with our own queued messages
+    if (m_connectFd != -1) {
+        while (!srcProxy->m_queuedMessages.empty()) {
+            m_queuedMessages.push(srcProxy->m_queuedMessages.front());
+            srcProxy->m_queuedMessages.pop();
+        }
+        return;
+    }
+
+    if (m_pendingMessages.empty())
+        m_lastWriteUs = monotonicTimeUs();
+
     while (!srcProxy->m_queuedMessages.empty()) {
         Message* message = srcProxy->m_queuedMessages.front();
         srcProxy->m_queuedMessages.pop();
 
-        if (message) {
-            bool sent = writeSocket(m_msgSocketFd, message->hdr, sizeof(message->hdr));
-            if (sent)
-                sent = writeSocket(m_msgSocketFd, (char*)message->data, message->len);
+        if (!message)
+            continue;
 
+        // Recorded messages are always tagged and framed without any protocol features
+        if (message->features != m_features) {
+            Message* framed = new Message(m_features, 0, message->data + kPacketHeaderLen,
+                                          message->len - kPacketHeaderLen);
             delete message;
-
-            if (!sent) {
-                fprintf(stderr, "Error sending queued message");
-            }
+            message = framed;
         }
+
+        m_pendingMessages.push_back(message);
+        m_pendingBytes += message->len;
+    }
+
+    if (!writePendingMessages()) {
+        fprintf(stderr, "Error sending queued message");
     }
 }
 
@@ -231,6 +419,7 @@ void* YapProxy::privateData() const
 
 YapPacket* YapProxy::packetMessage()
 {
+    m_packetMessage->shrink();
     m_packetMessage->reset();
     return m_packetMessage;
 }
@@ -240,174 +429,1304 @@ void YapProxy::setTerminate()
     m_terminate = true;
 }
 
-void YapProxy::sendMessage()
+/**
+ * Send the message built in packetMessage().
+ *
+ * @param coalesceId If non zero the message only carries state and a message with the
+ *                   same id still waiting for the next flush is dropped in favor of this one.
+ * @param coalesceKey Optional key, only messages with the same id and key are coalesced.
+ */
+void YapProxy::sendMessage(int coalesceId, const char* coalesceKey)
 {
-    char     pktHeader[4];
-    uint16_t pktLen = 0;
-
     if (m_packetMessage->length() == 0) {
         fprintf(stderr, "Message is empty\n");
         return;
     }
 
-    ::memset(pktHeader, 0, sizeof(pktHeader));
+    Message* message = new Message(m_features, m_packetMessage->encodingFlags(),
+                                   m_packetMessage->m_buffer, m_packetMessage->length());
 
-    pktLen = m_packetMessage->length();
-    pktLen = bswap_16(pktLen);
-    ::memcpy(pktHeader, &pktLen, 2);
+    capture(kYapCaptureMessage, monotonicTimeUs(), 0, m_packetMessage->encodingFlags(),
+            m_packetMessage->m_buffer, m_packetMessage->length());
 
-    if (m_msgSocketFd != -1) {
-        bool sent = writeSocket(m_msgSocketFd, pktHeader, 4);
-        if (sent) {
-            sent = writeSocket(m_msgSocketFd, (char*) m_msgBuffer, m_packetMessage->length());
+    if (m_overflowed) {
+        delete message;
+    }
+    else if (m_msgSocketFd != -1) {
+        if (coalesceId) {
+            dropPendingMessage(coalesceId, coalesceKey);
+
+            message->coalesceId = coalesceId;
+            if (coalesceKey) {
+                int keyLen = strlen(coalesceKey);
+                message->coalesceKey = new char[keyLen + 1];
+                ::memcpy(message->coalesceKey, coalesceKey, keyLen + 1);
+            }
         }
-        if (!sent) {
-            fprintf(stderr, "ERROR sending message, errno=%d.", errno);
+
+        if (m_pendingBytes + message->len > kMaxPendingBytes) {
+            // The client isn't keeping up, make room before checking on it
+            writePendingMessages();
+            if (m_pendingBytes + message->len > kMaxPendingBytes)
+                dropCoalescibleMessages(message->len);
+
+            // Falling behind is fine while the client keeps reading, only a
+            // backlog that hasn't moved for kFlushTimeoutMs is fatal
+            if (!m_pendingMessages.empty() && m_pendingBytes + message->len > kMaxPendingBytes
+                && monotonicTimeUs() - m_lastWriteUs > (int64_t) kFlushTimeoutMs * 1000) {
+                delete message;
+                disconnectSlowClient();
+                return;
+            }
         }
+
+        // The backlog is only as old as its first message
+        if (m_pendingMessages.empty())
+            m_lastWriteUs = monotonicTimeUs();
+
+        // Batch with whatever else gets sent during this main loop dispatch
+        m_pendingMessages.push_back(message);
+        m_pendingBytes += message->len;
+
+        if ((int) m_pendingMessages.size() >= kMaxPendingMessages)
+            writePendingMessages();
+        else
+            scheduleFlush();
     }
     else {
         // Save this message for later and send if socket is opened.
-        m_queuedMessages.push(new Message(pktHeader, m_msgBuffer, m_packetMessage->length()));
+        m_queuedMessages.push(message);
     }
 }
 
-void YapProxy::ioFunction(GIOChannel* channel, GIOCondition condition)
+/**
+ * Write out all pending messages, waiting up to kFlushTimeoutMs for the client
+ * to read them. Call this before blocking on a reply from the client, otherwise
+ * messages are written from the main loop as the socket becomes writable.
+ *
+ * @return false if the messages could not be written.
+ */
+bool YapProxy::flushMessages()
 {
-    char     pktHeader[4] = { 0, 0, 0, 0 };
-    uint16_t pktLen    = 0;
-    uint8_t  pktFlags  = 0;
-    char * ppp = 0;
+    cancelFlush();
 
-    if (condition & G_IO_HUP)
-        goto Detached;
+    if (!writePendingMessages())
+        return false;
 
-    // Get the packet header
-    if (!readSocket(m_cmdSocketFd, pktHeader, 4)) {
-        fprintf(stderr, "YAP: Failed to read packet header\n");
-        goto Detached;
-    }
-    ppp = ((char *)&pktHeader[0]);
-    pktLen   = *((uint16_t*) ppp);
-    pktLen   = bswap_16(pktLen);
-    pktFlags = (pktHeader[3]);
-    if (pktLen > kMaxMsgLen) {
-        fprintf(stderr, "YAP: Invalid message length %u > %d\n", pktLen, kMaxMsgLen);
-        goto Detached;
-    }
+    bool ring = m_features & kYapFeatureSharedRing;
 
-    // Get the packet data
-    if (!readSocket(m_cmdSocketFd, (char*) m_cmdBuffer, pktLen)) {
-        fprintf(stderr, "YAP: Failed to read packet data of length: %d\n", pktLen);
-        goto Detached;
+    while (!m_pendingMessages.empty()) {
+
+        struct pollfd pfd;
+        pfd.fd      = ring ? m_rings->eventFd() : m_msgSocketFd;
+        pfd.events  = ring ? POLLIN : POLLOUT;
+        pfd.revents = 0;
+
+        int ret = ::poll(&pfd, 1, kFlushTimeoutMs);
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret <= 0) {
+            disconnectSlowClient();
+            return false;
+        }
+
+        if (ring) {
+            // The doorbell may have been rung for new commands as well
+            m_rings->clearEvent();
+            scheduleDrain();
+        }
+
+        if (!writePendingMessages())
+            return false;
     }
 
-    m_inSyncMode = pktFlags & kPacketFlagSyncMask;
+    return true;
+}
 
-    if (m_inSyncMode) {
-        m_packetCommand->reset();
-        m_packetCommand->setReadTotalLength(pktLen);
-        m_packetReply->reset();
+/**
+ * Write as many pending messages as the socket takes without blocking, several
+ * per writev() call. Whatever is left is written once the socket becomes writable.
+ *
+ * @return false if the messages could not be written.
+ */
+bool YapProxy::writePendingMessages()
+{
+    if (m_msgSocketFd == -1)
+        return m_pendingMessages.empty();
 
-        m_server->handleSyncCommand(this, m_packetCommand, m_packetReply);
+    if (m_features & kYapFeatureSharedRing)
+        return writePendingToRing();
 
-        pktLen = m_packetReply->length();
-        pktLen = bswap_16(pktLen);
-        ::memcpy(pktHeader, &pktLen, 2);
-        pktHeader[2] = pktFlags;
-        pktHeader[3] = 0;
+    while (!m_pendingMessages.empty()) {
 
-        if (!writeSocket(m_cmdSocketFd, pktHeader, 4)) {
-            goto Detached;
+        struct iovec iov[kMaxBatchedMessages];
+        int iovCount = 0;
+
+        for (std::deque<Message*>::const_iterator it = m_pendingMessages.begin();
+             it != m_pendingMessages.end() && iovCount < kMaxBatchedMessages; ++it) {
+            iov[iovCount].iov_base = (*it)->data;
+            iov[iovCount].iov_len  = (*it)->len;
+            iovCount++;
         }
 
-        if (m_packetReply->length() > 0) {
-            if (!writeSocket(m_cmdSocketFd, (char*) m_replyBuffer, m_packetReply->length())) {
-                goto Detached;
+        iov[0].iov_base = (uint8_t*) iov[0].iov_base + m_pendingOffset;
+        iov[0].iov_len -= m_pendingOffset;
+
+        int count = ::writev(m_msgSocketFd, iov, iovCount);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watchWritable();
+                return true;
+            }
+
+            fprintf(stderr, "ERROR sending message, errno=%d.", errno);
+
+            while (!m_pendingMessages.empty()) {
+                delete m_pendingMessages.front();
+                m_pendingMessages.pop_front();
             }
+            m_pendingOffset = 0;
+            m_pendingBytes  = 0;
+            return false;
         }
 
-        m_packetCommand->reset();
-        m_packetCommand->setReadTotalLength(0);
-        m_packetReply->reset();
+        // Retire the messages that went out completely
+        if (count > 0)
+            m_lastWriteUs = monotonicTimeUs();
+        m_pendingBytes -= count;
+        count += m_pendingOffset;
+        while (!m_pendingMessages.empty() && count >= m_pendingMessages.front()->len) {
+            count -= m_pendingMessages.front()->len;
+            delete m_pendingMessages.front();
+            m_pendingMessages.pop_front();
+        }
+        m_pendingOffset = count;
     }
-    else {
-        m_packetCommand->reset();
-        m_packetCommand->setReadTotalLength(pktLen);
 
-        m_server->handleAsyncCommand(this, m_packetCommand);
+    return true;
+}
 
-        m_packetCommand->reset();
-        m_packetCommand->setReadTotalLength(0);
-    }
+/**
+ * Move as many pending messages into the message ring as fit. Frames go in whole,
+ * so m_pendingOffset always is at a frame boundary. If the ring is full the client
+ * rings our doorbell once it made room.
+ */
+bool YapProxy::writePendingToRing()
+{
+    YapRing* ring = m_rings->messages();
+    bool written = false;
+    bool moved = false;
 
-    m_inSyncMode = false;
+    while (!m_pendingMessages.empty()) {
+        Message* message = m_pendingMessages.front();
 
-    if (m_terminate) {
-        goto Detached;
+        int     frameLen = 0;
+        uint8_t flags = 0;
+
+        YapPacket::readHeader(message->features, (const char*) message->data + m_pendingOffset, frameLen, flags);
+        frameLen += YapPacket::headerLength(message->features);
+
+        if (!ring->write(message->data + m_pendingOffset, frameLen, 0, 0)) {
+            if (written && ring->takeConsumerWaiting()) {
+                m_rings->kick();
+                written = false;
+            }
+
+            if (ring->waitForSpace(frameLen))
+                break;
+
+            continue;
+        }
+
+        written = true;
+        moved   = true;
+        m_pendingOffset += frameLen;
+        m_pendingBytes  -= frameLen;
+
+        if (m_pendingOffset == message->len) {
+            delete message;
+            m_pendingMessages.pop_front();
+            m_pendingOffset = 0;
+        }
     }
 
-    return;
+    if (written && ring->takeConsumerWaiting())
+        m_rings->kick();
 
- Detached:
+    if (moved)
+        m_lastWriteUs = monotonicTimeUs();
 
-    m_server->clientDisconnected(this);
-    delete this;
+    return true;
 }
 
-bool YapProxy::readSocket(int fd, char* buf, int len)
+/**
+ * Drop the pending message superseded by a newer one with the same coalesce id and key.
+ * The newer message is appended to the queue so other messages keep their order.
+ */
+void YapProxy::dropPendingMessage(int coalesceId, const char* coalesceKey)
 {
-    int index = 0;
+    std::deque<Message*>::iterator it = m_pendingMessages.begin();
 
-    while (len > 0) {
-        int count = ::read(fd, &buf[index], len);
-        if (count <= 0) {
-            if (errno == EAGAIN || errno == EINTR)
-                continue;
-            else {
-                fprintf(stderr, "Failed to read from socket. Error: %d, %s\n", errno, strerror(errno));
-                return false;
-            }
+    // A partially written message has to go out as is
+    if (it != m_pendingMessages.end() && m_pendingOffset > 0)
+        ++it;
+
+    for (; it != m_pendingMessages.end(); ++it) {
+        Message* message = *it;
+        if (message->coalesceId != coalesceId)
+            continue;
+
+        if ((message->coalesceKey == NULL) != (coalesceKey == NULL))
+            continue;
+
+        if (coalesceKey && strcmp(message->coalesceKey, coalesceKey) != 0)
+            continue;
+
+        m_pendingBytes -= message->len;
+        delete message;
+        m_pendingMessages.erase(it);
+        return;
+    }
+}
+
+/**
+ * Make room for needed bytes by dropping pending messages that only carry state,
+ * oldest first. The client gets the state with the next such message.
+ */
+void YapProxy::dropCoalescibleMessages(int needed)
+{
+    std::deque<Message*>::iterator it = m_pendingMessages.begin();
+
+    if (it != m_pendingMessages.end() && m_pendingOffset > 0)
+        ++it;
+
+    int dropped = 0;
+
+    while (it != m_pendingMessages.end() && m_pendingBytes + needed > kMaxPendingBytes) {
+        Message* message = *it;
+        if (!message->coalesceId) {
+            ++it;
+            continue;
         }
 
-        index  += count;
-        len    -= count;
+        m_pendingBytes -= message->len;
+        delete message;
+        it = m_pendingMessages.erase(it);
+        dropped++;
     }
 
-    return true;
+    if (dropped)
+        fprintf(stderr, "YAP: Client %s is behind, dropped %d messages\n",
+                m_msgSocketPostfix ? m_msgSocketPostfix : "", dropped);
 }
 
-bool YapProxy::writeSocket(int fd, char* buf, int len)
+/**
+ * Give up on a client that stopped reading its messages. Shutting down the sockets
+ * makes the command socket hang up, which cleans up this proxy from the main loop.
+ */
+void YapProxy::disconnectSlowClient()
 {
-    int index = 0;
+    if (m_overflowed)
+        return;
 
-    while (len > 0) {
-        int count = ::write(fd, &buf[index], len);
-        if (count <= 0) {
-            if (errno == EAGAIN || errno == EINTR)
-                continue;
-            else {
-                fprintf(stderr, "Failed to write to socket. Error: %d, %s\n", errno, strerror(errno));
-                return false;
-            }
-        }
+    fprintf(stderr, "YAP: Client %s stopped reading messages, disconnecting\n",
+            m_msgSocketPostfix ? m_msgSocketPostfix : "");
 
-        index  += count;
-        len    -= count;
+    m_overflowed = true;
+    m_terminate  = true;
+
+    cancelFlush();
+    cancelWritable();
+
+    while (!m_pendingMessages.empty()) {
+        delete m_pendingMessages.front();
+        m_pendingMessages.pop_front();
+    }
+    m_pendingOffset = 0;
+    m_pendingBytes  = 0;
+
+    if (m_msgSocketFd != -1)
+        ::shutdown(m_msgSocketFd, SHUT_RDWR);
+
+    if (m_cmdSocketFd != -1)
+        ::shutdown(m_cmdSocketFd, SHUT_RDWR);
+}
+
+/**
+ * Try to connect to the client's message socket without blocking.
+ *
+ * @return false if the client isn't accepting yet and we should try again later.
+ */
+bool YapProxy::connectMessageSocket()
+{
+    struct sockaddr_un socketAddr;
+    ::memset(&socketAddr, 0, sizeof(socketAddr));
+    socketAddr.sun_family = AF_LOCAL;
+    ::strncpy(socketAddr.sun_path, m_connectPath, sizeof(socketAddr.sun_path));
+    socketAddr.sun_path[sizeof(socketAddr.sun_path)-1] = '\0';
+
+    if (::connect(m_connectFd, (struct sockaddr*) &socketAddr, SUN_LEN(&socketAddr)) == 0 || errno == EISCONN) {
+        messageSocketConnected();
+        return true;
+    }
+
+    if ((errno == EAGAIN || errno == EINTR || errno == ETIMEDOUT || errno == EINPROGRESS || errno == EALREADY)
+        && ++m_connectTries < kMaxConnectTries) {
+        fprintf(stderr, "Retrying connect. Error was: %s\n", strerror(errno));
+        return false;
     }
 
+    fprintf(stderr, "Failed to connect to client's msg socket. Messages will not work\n");
+    ::close(m_connectFd);
+    m_connectFd = -1;
+
+    delete [] m_connectPath;
+    m_connectPath = 0;
+
     return true;
 }
 
-gboolean YapProxyIoFunction(GIOChannel* channel, GIOCondition condition, void* data)
+void YapProxy::messageSocketConnected()
 {
-    YapProxy* proxy = static_cast<YapProxy*>(data);
-    proxy->ioFunction(channel, condition);
-    return TRUE;
+    fprintf(stderr, "Connected to client socket\n");
+
+    m_msgSocketFd = m_connectFd;
+    m_connectFd = -1;
+
+    delete [] m_connectPath;
+    m_connectPath = 0;
+
+    m_msgIoChannel = g_io_channel_unix_new(m_msgSocketFd);
+
+    // Messages sent while we were connecting
+    if (!m_queuedMessages.empty())
+        transferQueuedMessage(this);
 }
 
-bool YapProxy::connected() const
+void YapProxy::cancelConnect()
+{
+    if (m_connectSource) {
+        g_source_destroy(m_connectSource);
+        g_source_unref(m_connectSource);
+        m_connectSource = 0;
+    }
+
+    if (m_connectFd != -1) {
+        ::close(m_connectFd);
+        m_connectFd = -1;
+    }
+
+    delete [] m_connectPath;
+    m_connectPath = 0;
+}
+
+void YapProxy::scheduleFlush()
+{
+    if (m_flushSource)
+        return;
+
+    GMainContext* mainCtxt = g_main_loop_get_context(m_server->mainLoop());
+
+    m_flushSource = g_idle_source_new();
+    g_source_set_priority(m_flushSource, G_PRIORITY_HIGH);
+    g_source_set_callback(m_flushSource, (GSourceFunc) YapProxyFlushFunction, this, NULL);
+    g_source_attach(m_flushSource, mainCtxt);
+}
+
+void YapProxy::cancelFlush()
 {
-    return (m_msgSocketFd >= 0);
+    if (m_flushSource) {
+        g_source_destroy(m_flushSource);
+        g_source_unref(m_flushSource);
+        m_flushSource = 0;
+    }
+}
+
+void YapProxy::watchWritable()
+{
+    if (m_writableSource || !m_msgIoChannel)
+        return;
+
+    GMainContext* mainCtxt = g_main_loop_get_context(m_server->mainLoop());
+
+    m_writableSource = g_io_create_watch(m_msgIoChannel, (GIOCondition) (G_IO_OUT | G_IO_ERR | G_IO_HUP));
+    g_source_set_priority(m_writableSource, G_PRIORITY_HIGH);
+    g_source_set_callback(m_writableSource, (GSourceFunc) YapProxyWritableFunction, this, NULL);
+    g_source_attach(m_writableSource, mainCtxt);
+}
+
+void YapProxy::cancelWritable()
+{
+    if (m_writableSource) {
+        g_source_destroy(m_writableSource);
+        g_source_unref(m_writableSource);
+        m_writableSource = 0;
+    }
+}
+
+/**
+ * @return true while messages are still waiting for the socket to become writable.
+ */
+bool YapProxy::writableFunction()
+{
+    if (writePendingMessages() && !m_pendingMessages.empty())
+        return true;
+
+    g_source_unref(m_writableSource);
+    m_writableSource = 0;
+    return false;
+}
+
+void YapProxy::ioFunction(GIOChannel* channel, GIOCondition condition)
+{
+    if (condition & G_IO_HUP) {
+        m_server->clientDisconnected(this);
+        delete this;
+        return;
+    }
+
+    receiveCommands();
+}
+
+/**
+ * Read whatever the client has sent so far and dispatch every complete command
+ * in it, up to kMaxCommandsPerWakeup. Commands left over are dispatched from an
+ * idle source so other clients get their turn first.
+ *
+ * Deletes this proxy if the client went away.
+ */
+void YapProxy::receiveCommands()
+{
+    int budget = kMaxCommandsPerWakeup;
+
+    while (budget > 0) {
+
+        if (m_recvPos == m_recvLen && (m_features & kYapFeatureSharedRing)) {
+            YapRing* ring = m_rings->commands();
+
+            m_recvPos = 0;
+            m_recvLen = ring->read(m_recvBuffer, kRecvBufferLen);
+
+            if (m_recvLen > 0 && ring->takeProducerWaiting())
+                m_rings->kick();
+
+            if (m_recvLen == 0) {
+                if (ring->waitForData())
+                    break;
+                continue;
+            }
+        }
+        else if (m_recvPos == m_recvLen) {
+            m_recvPos = 0;
+            m_recvLen = 0;
+
+            int count = ::recv(m_cmdSocketFd, m_recvBuffer, kRecvBufferLen, MSG_DONTWAIT);
+            if (count == 0)
+                goto Detached;
+
+            if (count < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+
+                fprintf(stderr, "Failed to read from socket. Error: %d, %s\n", errno, strerror(errno));
+                goto Detached;
+            }
+
+            m_recvLen = count;
+        }
+
+        if (m_deferredBytes > kMaxDeferredBytes) {
+            // The client keeps sending bulk commands, stop letting anything overtake them
+            if (!dispatchDeferredCommand())
+                return;
+
+            budget--;
+            continue;
+        }
+
+        int ret = parseReceived();
+        if (ret < 0)
+            goto Detached;
+
+        if (ret == 0)
+            continue;
+
+        captureCommand();
+
+        if (deferCommand())
+            continue;
+
+        if (coalesceCommand())
+            continue;
+
+        if (!dispatchHeldCommand())
+            goto Detached;
+
+        if (holdCommand())
+            continue;
+
+        if (!dispatchCommand(m_packetCommand, m_recvFlags, m_recvTime, m_recvSequence))
+            goto Detached;
+
+        budget--;
+    }
+
+    // Nothing newer is waiting to be folded in
+    if (!dispatchHeldCommand())
+        goto Detached;
+
+    if (m_recvPos < m_recvLen)
+        scheduleDrain();
+    else if ((m_features & kYapFeatureSharedRing) && m_rings->commands()->available() > 0)
+        scheduleDrain();
+
+    return;
+
+ Detached:
+
+    m_server->clientDisconnected(this);
+    delete this;
+}
+
+/**
+ * Move received bytes into m_packetCommand, collecting all chunks of a packet
+ * when long frames are in use.
+ *
+ * @return 1 once a packet is complete, 0 if more data is needed, -1 on errors.
+ */
+int YapProxy::parseReceived()
+{
+    int hdrLen = YapPacket::headerLength(m_features);
+
+    for (;;) {
+        if (m_recvChunkLeft < 0) {
+            if (m_recvPos == m_recvLen)
+                return 0;
+
+            int count = MIN(hdrLen - m_recvHeaderLen, m_recvLen - m_recvPos);
+            ::memcpy(m_recvHeader + m_recvHeaderLen, m_recvBuffer + m_recvPos, count);
+            m_recvHeaderLen += count;
+            m_recvPos       += count;
+
+            if (m_recvHeaderLen < hdrLen)
+                return 0;
+
+            int     chunkLen   = 0;
+            uint8_t chunkFlags = 0;
+
+            YapPacket::readHeader(m_features, m_recvHeader, chunkLen, chunkFlags);
+            if (m_recvPktLen == 0)
+                m_recvFlags = chunkFlags & ~kPacketFlagMoreMask;
+
+            if (chunkLen < 0 || !m_packetCommand->reserve(m_recvPktLen + chunkLen)) {
+                fprintf(stderr, "YAP: Invalid message length %d > %d\n", m_recvPktLen + chunkLen, m_packetCommand->m_maxLen);
+                return -1;
+            }
+
+            m_recvHeaderLen = 0;
+            m_recvChunkLeft = chunkLen;
+            m_recvMore      = (m_features & kYapFeatureLongFrames) && (chunkFlags & kPacketFlagMoreMask);
+        }
+
+        int count = MIN(m_recvChunkLeft, m_recvLen - m_recvPos);
+        if (count > 0) {
+            ::memcpy(m_packetCommand->m_buffer + m_recvPktLen, m_recvBuffer + m_recvPos, count);
+            m_recvPktLen    += count;
+            m_recvPos       += count;
+            m_recvChunkLeft -= count;
+        }
+
+        if (m_recvChunkLeft > 0)
+            return 0;
+
+        m_recvChunkLeft = -1;
+
+        if (!m_recvMore) {
+            m_packetCommand->setReadTotalLength(m_recvPktLen);
+            m_packetCommand->setNative(m_recvFlags & kPacketFlagNativeMask);
+            m_recvPktLen = 0;
+            m_recvTime   = monotonicTimeUs();
+            m_recvSequence++;
+            return 1;
+        }
+    }
+}
+
+/**
+ * Dispatch a command and write the reply of sync commands.
+ *
+ * @return false if the client should be disconnected.
+ */
+bool YapProxy::dispatchCommand(YapPacket* cmd, uint8_t pktFlags, int64_t receiveTime, uint32_t sequence)
+{
+    char     pktHeader[kLongPacketHeaderLen];
+    int      pktLen    = cmd->m_readTotalLen;
+    int      replyLen  = 0;
+    uint8_t  replyFlags = 0;
+    uint32_t features  = m_features;
+
+    if ((pktFlags & kPacketFlagSyncMask) && m_connectFd != -1
+        && parkHelloCommand(cmd, pktFlags, receiveTime, sequence))
+        return true;
+
+    m_inSyncMode  = pktFlags & kPacketFlagSyncMask;
+    m_commandTime = receiveTime;
+    m_commandSequence = sequence;
+
+    if (m_inSyncMode) {
+        cmd->reset();
+        cmd->setReadTotalLength(pktLen);
+        m_packetReply->shrink();
+        m_packetReply->reset();
+
+        if (!handleHelloCommand(cmd, features))
+            m_server->handleSyncCommand(this, cmd, m_packetReply);
+
+        // The reply to kYapCmdHello still goes out without the features it enables
+        replyLen   = m_packetReply->length();
+        replyFlags = (pktFlags & ~kPacketFlagNativeMask) | m_packetReply->encodingFlags();
+
+        if (YapPacket::framedLength(m_features, replyLen) == YapPacket::headerLength(m_features) + replyLen) {
+            ::memset(pktHeader, 0, sizeof(pktHeader));
+            YapPacket::writeHeader(m_features, replyFlags, replyLen, pktHeader);
+            if (!(m_features & kYapFeatureLongFrames)) {
+                // Short replies carry the flags in the third byte
+                pktHeader[2] = replyFlags;
+                pktHeader[3] = 0;
+            }
+
+            struct iovec iov[2];
+            iov[0].iov_base = pktHeader;
+            iov[0].iov_len  = YapPacket::headerLength(m_features);
+            iov[1].iov_base = m_packetReply->m_buffer;
+            iov[1].iov_len  = replyLen;
+
+            if (!writeSocketv(m_cmdSocketFd, iov, replyLen > 0 ? 2 : 1)) {
+                return false;
+            }
+        }
+        else {
+            // Chunk headers go out next to the reply data instead of framing a copy of it
+            char headers[kMaxBatchedMessages][kLongPacketHeaderLen];
+            struct iovec iov[kMaxBatchedMessages * 2];
+            const uint8_t* data = m_packetReply->m_buffer;
+            int left = replyLen;
+
+            while (left > 0) {
+                int iovCount = 0;
+
+                for (int i = 0; i < kMaxBatchedMessages && left > 0; i++) {
+                    int chunkLen = MIN(left, kMaxChunkLen);
+                    left -= chunkLen;
+
+                    YapPacket::writeHeader(m_features, left > 0 ? (replyFlags | kPacketFlagMoreMask) : replyFlags,
+                                           chunkLen, headers[i]);
+
+                    iov[iovCount].iov_base = headers[i];
+                    iov[iovCount].iov_len  = kLongPacketHeaderLen;
+                    iov[iovCount + 1].iov_base = (void*) data;
+                    iov[iovCount + 1].iov_len  = chunkLen;
+                    iovCount += 2;
+                    data += chunkLen;
+                }
+
+                if (!writeSocketv(m_cmdSocketFd, iov, iovCount))
+                    return false;
+            }
+        }
+
+        cmd->reset();
+        cmd->setReadTotalLength(0);
+        m_packetReply->reset();
+
+        // The client picks up the rings right after the reply to kYapCmdHello
+        if ((features & kYapFeatureSharedRing) && !(m_features & kYapFeatureSharedRing)) {
+            if (!m_rings->send(m_cmdSocketFd))
+                return false;
+        }
+
+        // Followed by the bulk channel
+        if (m_bulkPeerFd >= 0) {
+            bool sent = YapBulkChannel::sendFd(m_cmdSocketFd, m_bulkPeerFd);
+            ::close(m_bulkPeerFd);
+            m_bulkPeerFd = -1;
+
+            if (!sent)
+                return false;
+        }
+
+        if (features != m_features)
+            setFeatures(features);
+    }
+    else {
+        cmd->reset();
+        cmd->setReadTotalLength(pktLen);
+
+        m_server->handleAsyncCommand(this, cmd);
+
+        cmd->reset();
+        cmd->setReadTotalLength(0);
+    }
+
+    cmd->shrink();
+    m_inSyncMode = false;
+
+    return !m_terminate;
+}
+
+/**
+ * Input commands are dispatched right away. Bulk commands, and everything arriving
+ * behind them, wait for YapServer to dispatch them once no input is pending.
+ *
+ * @return true if the command in m_packetCommand has been deferred.
+ */
+bool YapProxy::deferCommand()
+{
+    int pktLen = m_packetCommand->m_readTotalLen;
+    YapCommandClass cmdClass = kYapCommandControl;
+
+    if (!(m_recvFlags & kPacketFlagSyncMask)) {
+        int16_t cmdValue = 0;
+
+        m_packetCommand->reset();
+        (*m_packetCommand) >> cmdValue;
+        m_packetCommand->reset();
+
+        cmdClass = m_server->commandClass(cmdValue);
+    }
+
+    if (cmdClass == kYapCommandInput)
+        return false;
+
+    if (cmdClass == kYapCommandControl && m_deferredCommands.empty())
+        return false;
+
+    DeferredCommand deferred;
+    deferred.flags  = m_recvFlags;
+    deferred.receiveTime = m_recvTime;
+    deferred.sequence = m_recvSequence;
+    deferred.packet = new YapPacket(0);
+    deferred.packet->setFeatures(m_features);
+    copyCommand(deferred.packet, m_packetCommand);
+
+    m_deferredCommands.push_back(deferred);
+    m_deferredBytes += pktLen;
+
+    m_packetCommand->reset();
+    m_packetCommand->setReadTotalLength(0);
+    m_packetCommand->shrink();
+
+    m_server->scheduleDeferred(this);
+    return true;
+}
+
+/**
+ * Dispatch the oldest deferred command.
+ *
+ * @return false if the client got disconnected, this proxy is gone then.
+ */
+bool YapProxy::dispatchDeferredCommand()
+{
+    if (m_deferredCommands.empty())
+        return true;
+
+    DeferredCommand deferred = m_deferredCommands.front();
+    m_deferredCommands.pop_front();
+    m_deferredBytes -= deferred.packet->m_readTotalLen;
+
+    bool ok = dispatchCommand(deferred.packet, deferred.flags, deferred.receiveTime, deferred.sequence);
+    delete deferred.packet;
+
+    if (!ok) {
+        m_server->clientDisconnected(this);
+        delete this;
+        return false;
+    }
+
+    return true;
+}
+
+bool YapProxy::hasDeferredCommands() const
+{
+    return !m_deferredCommands.empty();
+}
+
+/**
+ * Copy a received command, or one written by YapServer::coalesceCommands(), into
+ * a packet for reading.
+ */
+void YapProxy::copyCommand(YapPacket* dst, YapPacket* src)
+{
+    int len = src->length();
+
+    dst->reset();
+    dst->reserve(len);
+    ::memcpy(dst->m_buffer, src->m_buffer, len);
+    dst->setReadTotalLength(len);
+    dst->setNative(src->m_native);
+}
+
+/**
+ * Keep the command in m_packetCommand back if the server may fold newer commands
+ * into it. It gets dispatched once no more commands are waiting.
+ *
+ * @return true if the command is held.
+ */
+bool YapProxy::holdCommand()
+{
+    if (m_recvFlags & kPacketFlagSyncMask)
+        return false;
+
+    m_packetCommand->reset();
+    bool coalescible = m_server->canCoalesce(m_packetCommand);
+    m_packetCommand->reset();
+
+    if (!coalescible)
+        return false;
+
+    copyCommand(m_heldCommand, m_packetCommand);
+    m_heldFlags = m_recvFlags;
+    m_heldTime  = m_recvTime;
+    m_heldSequence = m_recvSequence;
+    m_holding   = true;
+
+    m_packetCommand->reset();
+    m_packetCommand->setReadTotalLength(0);
+    m_packetCommand->shrink();
+
+    return true;
+}
+
+/**
+ * Fold the command in m_packetCommand into the held command.
+ *
+ * @return true if it has been folded in and needs no dispatching of its own.
+ */
+bool YapProxy::coalesceCommand()
+{
+    if (!m_holding || (m_recvFlags & kPacketFlagSyncMask))
+        return false;
+
+    m_heldCommand->reset();
+    m_packetCommand->reset();
+    m_packetCoalesced->shrink();
+    m_packetCoalesced->reset();
+
+    bool merged = m_server->coalesceCommands(m_heldCommand, m_packetCommand, m_packetCoalesced);
+
+    m_heldCommand->reset();
+    m_packetCommand->reset();
+
+    if (!merged)
+        return false;
+
+    copyCommand(m_heldCommand, m_packetCoalesced);
+    m_heldFlags = (m_heldFlags & ~kPacketFlagNativeMask) | m_packetCoalesced->encodingFlags();
+
+    m_packetCommand->setReadTotalLength(0);
+    m_packetCommand->shrink();
+
+    return true;
+}
+
+/**
+ * @return false if the client should be disconnected.
+ */
+bool YapProxy::dispatchHeldCommand()
+{
+    if (!m_holding)
+        return true;
+
+    m_holding = false;
+    return dispatchCommand(m_heldCommand, m_heldFlags, m_heldTime, m_heldSequence);
+}
+
+void YapProxy::scheduleDrain()
+{
+    if (m_drainSource)
+        return;
+
+    GMainContext* mainCtxt = g_main_loop_get_context(m_server->mainLoop());
+
+    m_drainSource = g_idle_source_new();
+    g_source_set_priority(m_drainSource, G_PRIORITY_HIGH);
+    g_source_set_callback(m_drainSource, (GSourceFunc) YapProxyDrainFunction, this, NULL);
+    g_source_attach(m_drainSource, mainCtxt);
+}
+
+void YapProxy::cancelDrain()
+{
+    if (m_drainSource) {
+        g_source_destroy(m_drainSource);
+        g_source_unref(m_drainSource);
+        m_drainSource = 0;
+    }
+}
+
+/**
+ * Answer kYapCmdHello, which clients send right after connecting to find out
+ * which protocol features both sides support. The features only take effect
+ * once the reply has been written.
+ *
+ * @param features Set to the negotiated features.
+ * @return false if this is not a hello command.
+ */
+bool YapProxy::handleHelloCommand(YapPacket* cmdPacket, uint32_t& features)
+{
+    int16_t cmd = 0;
+    int32_t clientFeatures = 0;
+
+    (*cmdPacket) >> cmd;
+    if (cmd != kYapCmdHello) {
+        cmdPacket->reset();
+        return false;
+    }
+
+    (*cmdPacket) >> clientFeatures;
+
+    features = (uint32_t) clientFeatures & kYapSupportedFeatures;
+
+    // Replies without long frames have no room for kPacketFlagNativeMask
+    if (!(features & kYapFeatureLongFrames))
+        features &= ~kYapFeatureNativeEncoding;
+
+    // Switching the message framing needs a connected message socket, the
+    // reply waits for it unless connecting failed, see parkHelloCommand()
+    if (m_msgSocketFd == -1)
+        features = 0;
+
+    if (features & kYapFeatureSharedRing) {
+        m_rings = YapRingPair::create();
+        if (!m_rings)
+            features &= ~kYapFeatureSharedRing;
+    }
+
+    if ((features & kYapFeatureBulk) && !m_bulk) {
+        m_bulk = YapBulkChannel::create(m_bulkPeerFd);
+        if (!m_bulk)
+            features &= ~kYapFeatureBulk;
+    }
+
+    (*m_packetReply) << (int32_t) features;
+    return true;
+}
+
+/**
+ * Keep kYapCmdHello back while we are still connecting to the client's message
+ * socket. The features switch the message framing too, so the reply has to wait
+ * for the socket; the client blocks on it meanwhile and sends nothing else.
+ *
+ * @return true if cmd is kYapCmdHello and has been parked.
+ */
+bool YapProxy::parkHelloCommand(YapPacket* cmd, uint8_t pktFlags, int64_t receiveTime, uint32_t sequence)
+{
+    int16_t cmdValue = 0;
+
+    cmd->reset();
+    (*cmd) >> cmdValue;
+    cmd->reset();
+
+    if (cmdValue != kYapCmdHello || m_parkedHello.packet)
+        return false;
+
+    m_parkedHello.packet = new YapPacket(0);
+    m_parkedHello.packet->setFeatures(m_features);
+    copyCommand(m_parkedHello.packet, cmd);
+    m_parkedHello.flags       = pktFlags;
+    m_parkedHello.receiveTime = receiveTime;
+    m_parkedHello.sequence    = sequence;
+
+    cmd->reset();
+    cmd->setReadTotalLength(0);
+    cmd->shrink();
+
+    return true;
+}
+
+/**
+ * Answer the parked kYapCmdHello once connecting to the message socket succeeded
+ * or has been given up on.
+ *
+ * Deletes this proxy if the client went away.
+ */
+void YapProxy::dispatchParkedHello()
+{
+    if (!m_parkedHello.packet)
+        return;
+
+    DeferredCommand hello = m_parkedHello;
+    m_parkedHello.packet = 0;
+
+    bool ok = dispatchCommand(hello.packet, hello.flags, hello.receiveTime, hello.sequence);
+    delete hello.packet;
+
+    if (!ok) {
+        m_server->clientDisconnected(this);
+        delete this;
+    }
+}
+
+/**
+ * Switch to the negotiated features. Messages already queued keep the old framing,
+ * kYapMsgHello tells the client where the new framing starts.
+ */
+void YapProxy::setFeatures(uint32_t features)
+{
+    YapPacket* msg = packetMessage();
+    (*msg) << (int16_t) kYapMsgHello;
+    (*msg) << (int32_t) features;
+    sendMessage();
+
+    // Everything up to kYapMsgHello has to go out on the socket
+    if ((features & kYapFeatureSharedRing) && !(m_features & kYapFeatureSharedRing))
+        flushMessages();
+
+    m_features = features;
+
+    m_packetCommand->setFeatures(features);
+    m_packetReply->setFeatures(features);
+    m_packetMessage->setFeatures(features);
+    m_heldCommand->setFeatures(features);
+    m_packetCoalesced->setFeatures(features);
+
+    if (m_features & kYapFeatureSharedRing)
+        startRings();
+}
+
+/**
+ * Commands now arrive through the command ring, the command socket only carries
+ * sync replies and tells us when the client goes away.
+ */
+void YapProxy::startRings()
+{
+    if (m_ringIoSource)
+        return;
+
+    GMainContext* mainCtxt = g_main_loop_get_context(m_server->mainLoop());
+
+    m_ringIoChannel = g_io_channel_unix_new(m_rings->eventFd());
+    m_ringIoSource  = g_io_create_watch(m_ringIoChannel, G_IO_IN);
+
+    g_source_set_callback(m_ringIoSource, (GSourceFunc) YapProxyRingFunction, this, NULL);
+    g_source_attach(m_ringIoSource, mainCtxt);
+    g_source_set_priority(m_ringIoSource, G_PRIORITY_HIGH);
+
+    if (m_ioSource) {
+        g_source_destroy(m_ioSource);
+        g_source_unref(m_ioSource);
+    }
+
+    m_ioSource = g_io_create_watch(m_ioChannel, G_IO_HUP);
+
+    g_source_set_callback(m_ioSource, (GSourceFunc) YapProxyIoFunction, this, NULL);
+    g_source_attach(m_ioSource, mainCtxt);
+    g_source_set_priority(m_ioSource, G_PRIORITY_HIGH);
+
+    // Pick up whatever the client wrote before we started watching
+    scheduleDrain();
+}
+
+/**
+ * The client rang our doorbell, it wrote commands or made room for messages.
+ */
+void YapProxy::ringFunction()
+{
+    m_rings->clearEvent();
+
+    writePendingMessages();
+    receiveCommands();
+}
+
+bool YapProxy::readSocket(int fd, char* buf, int len)
+{
+    int index = 0;
+
+    while (len > 0) {
+        int count = ::read(fd, &buf[index], len);
+        if (count <= 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            else {
+                fprintf(stderr, "Failed to read from socket. Error: %d, %s\n", errno, strerror(errno));
+                return false;
+            }
+        }
+
+        index  += count;
+        len    -= count;
+    }
+
+    return true;
+}
+
+bool YapProxy::writeSocket(int fd, char* buf, int len)
+{
+    int index = 0;
+
+    while (len > 0) {
+        int count = ::write(fd, &buf[index], len);
+        if (count <= 0) {
+            if (errno == EINTR)
+                continue;
+            else if (errno == EAGAIN) {
+                if (waitWritable(fd))
+                    continue;
+
+                // Every other client waits while we block on this one
+                disconnectSlowClient();
+                return false;
+            }
+            else {
+                fprintf(stderr, "Failed to write to socket. Error: %d, %s\n", errno, strerror(errno));
+                return false;
+            }
+        }
+
+        index  += count;
+        len    -= count;
+    }
+
+    return true;
+}
+
+bool YapProxy::writeSocketv(int fd, struct iovec* iov, int iovCount)
+{
+    while (iovCount > 0) {
+        int count = ::writev(fd, iov, iovCount);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            else if (errno == EAGAIN) {
+                if (waitWritable(fd))
+                    continue;
+
+                // Every other client waits while we block on this one
+                disconnectSlowClient();
+                return false;
+            }
+            else {
+                fprintf(stderr, "Failed to write to socket. Error: %d, %s\n", errno, strerror(errno));
+                return false;
+            }
+        }
+
+        // Skip over whatever was written completely and adjust a partial write
+        while (iovCount > 0 && count >= (int) iov->iov_len) {
+            count -= iov->iov_len;
+            iov++;
+            iovCount--;
+        }
+        if (iovCount > 0) {
+            iov->iov_base = (uint8_t*) iov->iov_base + count;
+            iov->iov_len -= count;
+        }
+    }
+
+    return true;
+}
+
+gboolean YapProxyFlushFunction(void* data)
+{
+    YapProxy* proxy = static_cast<YapProxy*>(data);
+    proxy->cancelFlush();
+    proxy->writePendingMessages();
+    return FALSE;
+}
+
+gboolean YapProxyWritableFunction(GIOChannel* channel, GIOCondition condition, void* data)
+{
+    YapProxy* proxy = static_cast<YapProxy*>(data);
+    return proxy->writableFunction();
+}
+
+gboolean YapProxyConnectFunction(void* data)
+{
+    YapProxy* proxy = static_cast<YapProxy*>(data);
+    if (!proxy->connectMessageSocket())
+        return TRUE;
+
+    g_source_unref(proxy->m_connectSource);
+    proxy->m_connectSource = 0;
+
+    // May delete the proxy
+    proxy->dispatchParkedHello();
+    return FALSE;
+}
+
+gboolean YapProxyDrainFunction(void* data)
+{
+    YapProxy* proxy = static_cast<YapProxy*>(data);
+    proxy->cancelDrain();
+    proxy->receiveCommands();
+    return FALSE;
+}
+
+gboolean YapProxyRingFunction(GIOChannel* channel, GIOCondition condition, void* data)
+{
+    YapProxy* proxy = static_cast<YapProxy*>(data);
+    proxy->ringFunction();
+    return TRUE;
+}
+
+gboolean YapProxyIoFunction(GIOChannel* channel, GIOCondition condition, void* data)
+{
+    YapProxy* proxy = static_cast<YapProxy*>(data);
+    proxy->ioFunction(channel, condition);
+    return TRUE;
+}
+
+bool YapProxy::connected() const
+{
+    // Messages sent while still connecting are queued and go out once connected
+    return (m_msgSocketFd >= 0 || m_connectFd >= 0);
+}
+
+/**
+ * Hand a block to the client ahead of the message referring to it.
+ *
+ * @return the id to put in the message, 0 if the client didn't negotiate
+ * kYapFeatureBulk or the block couldn't be sent. The caller then has to fall
+ * back to sending the data some other way.
+ */
+uint32_t YapProxy::sendBulk(const YapBulk* bulk)
+{
+    if (!m_bulk || !bulk)
+        return 0;
+
+    return m_bulk->send(bulk);
+}
+
+/**
+ * Pick up a block the client referred to in the command being handled.
+ */
+YapBulk* YapProxy::receiveBulk(uint32_t id)
+{
+    if (!m_bulk || id == 0)
+        return 0;
+
+    captureBulk();
+
+    return m_bulk->receive(id);
+}
+
+/**
+ * @return the descriptor the client sent with YapClient::sendBulkFd(), owned by
+ * the caller, or -1.
+ */
+int YapProxy::receiveBulkFd(uint32_t id)
+{
+    if (!m_bulk || id == 0)
+        return -1;
+
+    captureBulk();
+
+    return m_bulk->receiveDescriptor(id);
 }
 
 int YapProxy::messageSocketFd() const
@@ -22,9 +22,16 @@ LICENSE@@@ */
 #include <stdint.h>
 #include <glib.h>
 #include <queue>
+#include <deque>
+
+#include "YapDefs.h"
 
 class YapServer;
 class YapPacket;
+class YapRingPair;
+class YapBulk;
+class YapBulkChannel;
+struct iovec;
 
 class YapProxy
 {
@@ -37,11 +44,18 @@ public:
     bool  isRecordProxy() const;
 
     YapPacket* packetMessage();
-    void sendMessage();
+    void sendMessage(int coalesceId = 0, const char* coalesceKey = 0);
+    bool flushMessages();
     void transferQueuedMessage(YapProxy* srcProxy);
 
     bool connected() const;
 
+    int64_t commandReceiveTime() const { return m_commandTime; }
+
+    uint32_t sendBulk(const YapBulk* bulk);
+    YapBulk* receiveBulk(uint32_t id);
+    int      receiveBulkFd(uint32_t id);
+
     int messageSocketFd() const;
     int commandSocketFd() const;
     int serverSocketFd() const;
@@ -49,11 +63,13 @@ public:
 private:
 
     struct Message {
-        char     hdr[4]; ///< Message header
-        uint8_t* data;   ///< Message data
-        int      len;    ///< Message data length
+        uint8_t* data;   ///< Framed message: packet header(s) and message data
+        int      len;    ///< Total length of headers and data
+        uint32_t features;    ///< Protocol features the message was framed with
+        int      coalesceId;  ///< Non zero if only the latest message with this id needs sending
+        char*    coalesceKey; ///< Optional key further qualifying coalesceId
 
-        Message( const char* hdr, const uint8_t* data, int dataLen );
+        Message( uint32_t features, uint8_t flags, const uint8_t* data, int dataLen );
         ~Message();
 
         private:
@@ -66,27 +82,112 @@ private:
     ~YapProxy();
 
     void ioFunction(GIOChannel* channel, GIOCondition condition);
+    void receiveCommands();
+    int  parseReceived();
+    bool dispatchCommand(YapPacket* cmd, uint8_t pktFlags, int64_t receiveTime, uint32_t sequence);
+    bool deferCommand();
+    bool dispatchDeferredCommand();
+    bool hasDeferredCommands() const;
+    bool holdCommand();
+    bool coalesceCommand();
+    bool dispatchHeldCommand();
+    void copyCommand(YapPacket* dst, YapPacket* src);
+    void scheduleDrain();
+    void cancelDrain();
+    bool handleHelloCommand(YapPacket* cmdPacket, uint32_t& features);
+    bool parkHelloCommand(YapPacket* cmd, uint8_t pktFlags, int64_t receiveTime, uint32_t sequence);
+    void dispatchParkedHello();
+    void setFeatures(uint32_t features);
     bool readSocket(int fd, char* buf, int len);
     bool writeSocket(int fd, char* buf, int len);
+    bool writeSocketv(int fd, struct iovec* iov, int iovCount);
+    bool writePendingMessages();
+    bool writePendingToRing();
+    void startRings();
+    void ringFunction();
+    void scheduleFlush();
+    void cancelFlush();
+    void watchWritable();
+    void cancelWritable();
+    bool writableFunction();
+    void dropPendingMessage(int coalesceId, const char* coalesceKey);
+    void dropCoalescibleMessages(int needed);
+    void disconnectSlowClient();
+    bool connectMessageSocket();
+    void messageSocketConnected();
+    void cancelConnect();
+    void capture(uint8_t type, int64_t timeUs, uint32_t sequence, uint8_t flags, const uint8_t* data, int len);
+    void captureCommand();
+    void captureBulk();
 
     YapServer*  m_server;
     int         m_cmdSocketFd;
     int         m_msgSocketFd;
     char*       m_msgSocketPostfix;
     void*       m_privData;
-    uint8_t*    m_cmdBuffer;
-    uint8_t*    m_replyBuffer;
-    uint8_t*    m_msgBuffer;
+    uint32_t    m_features; ///< Protocol features negotiated with kYapCmdHello
+    uint32_t    m_captureId; ///< Client number in the traffic capture, 0 if not captured
     GIOChannel* m_ioChannel;
     GSource*    m_ioSource;
+    GSource*    m_flushSource;
+    GIOChannel* m_msgIoChannel;
+    int         m_connectFd;     ///< Message socket while connecting to the client
+    char*       m_connectPath;
+    int         m_connectTries;
+    GSource*    m_connectSource;
+    GSource*    m_writableSource;
+    GSource*    m_drainSource;
+
+    uint8_t*    m_recvBuffer;    ///< Bytes received from the command socket
+    int         m_recvLen;       ///< Valid bytes in m_recvBuffer
+    int         m_recvPos;       ///< Bytes of m_recvBuffer already parsed
+    char        m_recvHeader[kLongPacketHeaderLen];
+    int         m_recvHeaderLen; ///< Bytes of the current frame header received
+    int         m_recvChunkLeft; ///< Payload bytes of the current frame still missing, -1 while reading a header
+    int         m_recvPktLen;    ///< Bytes of the current packet received
+    uint8_t     m_recvFlags;     ///< Flags of the current packet
+    bool        m_recvMore;      ///< More chunks follow the current frame
+    int64_t     m_recvTime;      ///< When the current packet was complete, in us of CLOCK_MONOTONIC
+    int64_t     m_commandTime;   ///< m_recvTime of the command being dispatched
+    uint32_t    m_recvSequence;  ///< Number of the current packet, counting from 1, see YapCaptureRecord
+    uint32_t    m_commandSequence; ///< m_recvSequence of the command being dispatched
+
+    struct DeferredCommand {
+        YapPacket* packet;
+        uint8_t    flags;
+        int64_t    receiveTime;
+        uint32_t   sequence;
+    };
+
+    std::deque<DeferredCommand> m_deferredCommands; ///< Waiting for YapServer to dispatch them
+    DeferredCommand m_parkedHello;  ///< kYapCmdHello waiting for the message socket, packet 0 if none
+    int         m_deferredBytes;
+
+    YapRingPair* m_rings;        ///< Shared memory transport, see kYapFeatureSharedRing
+    GIOChannel* m_ringIoChannel;
+    GSource*    m_ringIoSource;
+
+    YapBulkChannel* m_bulk;      ///< See kYapFeatureBulk
+    int         m_bulkPeerFd;    ///< Client end of m_bulk until it has been sent
 
     bool        m_inSyncMode;
     bool        m_terminate;
     std::queue<Message*> m_queuedMessages; ///< Messages sent before connection go here.
+    std::deque<Message*> m_pendingMessages; ///< Messages waiting for the next flush.
+    int         m_pendingOffset; ///< Bytes of the first pending message already written.
+    int         m_pendingBytes;  ///< Bytes of all pending messages, see kMaxPendingBytes.
+    int64_t     m_lastWriteUs;   ///< When the pending messages last made progress.
+    bool        m_overflowed;    ///< Client stopped reading messages and is being disconnected.
 
     YapPacket*  m_packetCommand;
     YapPacket*  m_packetReply;
     YapPacket*  m_packetMessage;
+    YapPacket*  m_heldCommand;     ///< Input command newer ones may get folded into
+    uint8_t     m_heldFlags;
+    int64_t     m_heldTime;        ///< Receive time of the oldest command folded in
+    uint32_t    m_heldSequence;
+    bool        m_holding;
+    YapPacket*  m_packetCoalesced; ///< Written by YapServer::coalesceCommands()
 
     // Copy not allowed
     YapProxy(const YapProxy&);
@@ -94,6 +195,11 @@ private:
 
     friend class YapServer;
     friend gboolean YapProxyIoFunction(GIOChannel* channel, GIOCondition condition, void* data);
+    friend gboolean YapProxyFlushFunction(void* data);
+    friend gboolean YapProxyWritableFunction(GIOChannel* channel, GIOCondition condition, void* data);
+    friend gboolean YapProxyDrainFunction(void* data);
+    friend gboolean YapProxyConnectFunction(void* data);
+    friend gboolean YapProxyRingFunction(GIOChannel* channel, GIOCondition condition, void* data);
 };
 
 #endif /* YAPPROXY_H */
@@ -0,0 +1,359 @@
+/* @@@LICENSE
+*
+*      Copyright (c) 2012 Hewlett-Packard Development Company, L.P.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+LICENSE@@@ */
+
+/**
+ * Re-drives a running BrowserServer with the commands of a traffic capture, see
+ * YapCapture.h. Each captured client gets its own connection, opened and closed
+ * when the original one was. Commands go out at the original pace, scaled by
+ * --speed, or as fast as the server takes them with --speed 0.
+ *
+ * Messages aren't compared byte for byte, their content depends on timing; the
+ * counts per client are printed at the end instead. Commands that came with bulk
+ * data or a descriptor are skipped, those aren't part of the capture. That makes
+ * clients that set up their page that way, like BrowserServer's ConnectMemFd,
+ * impossible to replay: they never get a page, and the summary says so.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <map>
+#include <set>
+#include <utility>
+
+#include <glib.h>
+
+#include "YapDefs.h"
+#include "YapClient.h"
+#include "YapCapture.h"
+
+// Records handled per main loop iteration when behind, so messages get read
+static const int kMaxRecordsPerStep = 64;
+// Time given to the server to answer the last commands
+static const int kDrainMs = 1000;
+
+static int64_t monotonicTimeUs()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Kept after the client is gone, for the summary
+struct ReplayStats {
+    int commands;
+    int skippedCommands;
+    int expectedMessages;
+    int messages;
+
+    ReplayStats() : commands(0), skippedCommands(0), expectedMessages(0), messages(0) {}
+};
+
+class ReplayClient : public YapClient
+{
+public:
+
+    ReplayClient(const char* name, ReplayStats* stats)
+        : YapClient(name, NULL)
+        , m_stats(stats) {}
+
+    virtual void serverConnected() {}
+    virtual void serverDisconnected() {}
+    virtual void handleAsyncMessage(YapPacket* msg) { m_stats->messages++; }
+
+private:
+
+    ReplayStats* m_stats;
+};
+
+class Replay
+{
+public:
+
+    Replay(YapCaptureReader* reader, const char* serverName, double speed);
+    ~Replay();
+
+    void run();
+
+private:
+
+    void findBulkCommands();
+    bool step();
+    void perform(const YapCaptureRecord& record, const uint8_t* data);
+    void finish();
+    void printSummary();
+    void schedule(int timeoutMs);
+
+    static gboolean stepCallback(void* data);
+    static gboolean quitCallback(void* data);
+
+    YapCaptureReader* m_reader;
+    const char*  m_serverName;
+    double       m_speed;
+    GMainLoop*   m_mainLoop;
+    int64_t      m_startUs;
+
+    YapCaptureRecord m_record;   ///< Read but not due yet if m_havePending
+    const uint8_t*   m_data;
+    bool         m_havePending;
+    int64_t      m_lastRecordUs;
+
+    std::map<uint32_t, ReplayClient*> m_clients;  ///< Connected clients
+    std::map<uint32_t, ReplayStats> m_stats;      ///< Every client seen so far
+    std::set<std::pair<uint32_t, uint32_t> > m_bulkCommands;  ///< Client and sequence of commands to skip
+};
+
+Replay::Replay(YapCaptureReader* reader, const char* serverName, double speed)
+    : m_reader(reader)
+    , m_serverName(serverName)
+    , m_speed(speed)
+    , m_mainLoop(0)
+    , m_startUs(0)
+    , m_data(0)
+    , m_havePending(false)
+    , m_lastRecordUs(0)
+{
+    ::memset(&m_record, 0, sizeof(m_record));
+    m_mainLoop = g_main_loop_new(NULL, FALSE);
+}
+
+Replay::~Replay()
+{
+    for (std::map<uint32_t, ReplayClient*>::iterator it = m_clients.begin(); it != m_clients.end(); ++it)
+        delete it->second;
+
+    g_main_loop_unref(m_mainLoop);
+}
+
+void Replay::run()
+{
+    findBulkCommands();
+
+    m_startUs = monotonicTimeUs();
+    schedule(0);
+    g_main_loop_run(m_mainLoop);
+
+    printSummary();
+}
+
+/**
+ * The kYapCaptureBulk records follow the commands they belong to, so they are
+ * collected in a first pass.
+ */
+void Replay::findBulkCommands()
+{
+    YapCaptureRecord record;
+    const uint8_t* data = 0;
+
+    while (m_reader->next(record, data)) {
+        if (record.type == kYapCaptureBulk)
+            m_bulkCommands.insert(std::make_pair(record.clientId, record.sequence));
+    }
+
+    m_reader->rewind();
+}
+
+void Replay::schedule(int timeoutMs)
+{
+    if (timeoutMs > 0)
+        g_timeout_add(timeoutMs, stepCallback, this);
+    else
+        g_idle_add(stepCallback, this);
+}
+
+gboolean Replay::stepCallback(void* data)
+{
+    Replay* replay = static_cast<Replay*>(data);
+    return replay->step();
+}
+
+gboolean Replay::quitCallback(void* data)
+{
+    Replay* replay = static_cast<Replay*>(data);
+    g_main_loop_quit(replay->m_mainLoop);
+    return FALSE;
+}
+
+/**
+ * Perform every record that is due, then wait for the next one.
+ */
+bool Replay::step()
+{
+    for (int i = 0; i < kMaxRecordsPerStep; i++) {
+        if (!m_havePending) {
+            if (!m_reader->next(m_record, m_data)) {
+                finish();
+                return false;
+            }
+            m_havePending = true;
+        }
+
+        if (m_speed > 0) {
+            int64_t dueUs = m_startUs + (int64_t) (m_record.timeUs / m_speed);
+            int64_t nowUs = monotonicTimeUs();
+
+            if (dueUs > nowUs) {
+                schedule((dueUs - nowUs + 999) / 1000);
+                return false;
+            }
+        }
+
+        m_havePending = false;
+        m_lastRecordUs = m_record.timeUs;
+        perform(m_record, m_data);
+    }
+
+    schedule(0);
+    return false;
+}
+
+void Replay::perform(const YapCaptureRecord& record, const uint8_t* data)
+{
+    std::map<uint32_t, ReplayClient*>::iterator it = m_clients.find(record.clientId);
+    ReplayClient* client = it != m_clients.end() ? it->second : 0;
+    ReplayStats& stats = m_stats[record.clientId];
+
+    switch (record.type) {
+    case kYapCaptureConnect:
+        if (client)
+            break;
+
+        client = new ReplayClient(m_serverName, &stats);
+        if (client->connect()) {
+            m_clients[record.clientId] = client;
+        }
+        else {
+            fprintf(stderr, "Client %u failed to connect\n", record.clientId);
+            delete client;
+        }
+        break;
+
+    case kYapCaptureDisconnect:
+        if (!client)
+            break;
+
+        m_clients.erase(it);
+        delete client;
+        break;
+
+    case kYapCaptureCommand:
+    case kYapCaptureSyncCommand:
+        if (!client)
+            break;
+
+        if (m_bulkCommands.count(std::make_pair(record.clientId, record.sequence))) {
+            fprintf(stderr, "Client %u: skipping command at %.1f ms, its bulk data wasn't captured\n",
+                    record.clientId, record.timeUs / 1000.0);
+            stats.skippedCommands++;
+            break;
+        }
+
+        if (client->sendCapturedCommand(data, record.len, record.flags & kPacketFlagNativeMask,
+                                        record.type == kYapCaptureSyncCommand)) {
+            stats.commands++;
+        }
+        else {
+            fprintf(stderr, "Client %u lost its connection\n", record.clientId);
+            m_clients.erase(it);
+            delete client;
+        }
+        break;
+
+    case kYapCaptureMessage:
+        stats.expectedMessages++;
+        break;
+
+    case kYapCaptureBulk:
+        break;
+
+    default:
+        fprintf(stderr, "Skipping unknown record type %d\n", record.type);
+        break;
+    }
+}
+
+void Replay::finish()
+{
+    g_timeout_add(kDrainMs, quitCallback, this);
+}
+
+void Replay::printSummary()
+{
+    double elapsedMs = (monotonicTimeUs() - m_startUs - kDrainMs * 1000) / 1000.0;
+
+    printf("Replayed %.1f ms of traffic in %.1f ms\n", m_lastRecordUs / 1000.0, elapsedMs);
+
+    int incomplete = 0;
+
+    for (std::map<uint32_t, ReplayStats>::iterator it = m_stats.begin(); it != m_stats.end(); ++it) {
+        printf("Client %u: %d commands (%d skipped), %d messages (%d captured)\n",
+               it->first, it->second.commands, it->second.skippedCommands,
+               it->second.messages, it->second.expectedMessages);
+
+        if (it->second.skippedCommands)
+            incomplete++;
+    }
+
+    if (incomplete) {
+        printf("%d clients weren't replayed faithfully. A client that connected its page with\n"
+               "shared buffers passed as descriptors (ConnectMemFd) has no page in the replay.\n",
+               incomplete);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    gchar*  serverName = 0;
+    gdouble speed = 1.0;
+    GError* gerror = NULL;
+
+    static GOptionEntry optEntries[] = {
+        {"server", 'n', 0, G_OPTION_ARG_STRING, &serverName, "Yap server name, browser by default", "NAME"},
+        {"speed", 's', 0, G_OPTION_ARG_DOUBLE, &speed, "speed up factor : 0 means as fast as possible", "X"},
+        { NULL }
+    };
+
+    GOptionContext* optContext = g_option_context_new("CAPTURE - replay Yap traffic");
+    g_option_context_add_main_entries(optContext, optEntries, NULL);
+
+    if (!g_option_context_parse(optContext, &argc, &argv, &gerror)) {
+        fprintf(stderr, "Error processing commandline args: \"%s\"\n", gerror->message);
+        g_error_free(gerror);
+        return EXIT_FAILURE;
+    }
+
+    g_option_context_free(optContext);
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s [--server NAME] [--speed X] CAPTURE\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    YapCaptureReader* reader = YapCaptureReader::open(argv[1]);
+    if (!reader)
+        return EXIT_FAILURE;
+
+    Replay replay(reader, serverName ? serverName : "browser", speed);
+    replay.run();
+
+    delete reader;
+    g_free(serverName);
+
+    return EXIT_SUCCESS;
+}
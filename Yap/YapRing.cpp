@@ -0,0 +1,415 @@
+/* @@@LICENSE
+*
+*      Copyright (c) 2012 Hewlett-Packard Development Company, L.P.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+LICENSE@@@ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+
+#include <glib.h>
+
+#include "YapRing.h"
+
+// Size of each ring, must be a power of two
+static const int kRingSize = 256 * 1024;
+static const int kRingHeaderLen = 256;
+static const int kRingPairFdCount = 3;
+
+static const char kShmPathTemplate[] = "/dev/shm/yapring.XXXXXX";
+
+YapRing::YapRing(uint8_t* mem, int size)
+    : m_header((Header*) mem)
+    , m_data(mem + kRingHeaderLen)
+    , m_size(size)
+{
+}
+
+int YapRing::memoryLength(int size)
+{
+    return kRingHeaderLen + size;
+}
+
+void YapRing::init()
+{
+    ::memset(m_header, 0, sizeof(Header));
+}
+
+int YapRing::available() const
+{
+    return m_header->head - m_header->tail;
+}
+
+int YapRing::space() const
+{
+    return m_size - available();
+}
+
+void YapRing::copyIn(uint32_t pos, const uint8_t* data, int len)
+{
+    uint32_t offset = pos & (m_size - 1);
+    int firstLen = MIN(len, (int) (m_size - offset));
+
+    ::memcpy(m_data + offset, data, firstLen);
+    if (firstLen < len)
+        ::memcpy(m_data, data + firstLen, len - firstLen);
+}
+
+void YapRing::copyOut(uint32_t pos, uint8_t* buf, int len) const
+{
+    uint32_t offset = pos & (m_size - 1);
+    int firstLen = MIN(len, (int) (m_size - offset));
+
+    ::memcpy(buf, m_data + offset, firstLen);
+    if (firstLen < len)
+        ::memcpy(buf + firstLen, m_data, len - firstLen);
+}
+
+/**
+ * Append header and data as one unit.
+ *
+ * @return false if there isn't room for both, nothing is written then.
+ */
+bool YapRing::write(const uint8_t* header, int headerLen, const uint8_t* data, int dataLen)
+{
+    uint32_t head = m_header->head;
+
+    if (space() < headerLen + dataLen)
+        return false;
+
+    // Don't let the copy overtake the consumer reading the old tail
+    __sync_synchronize();
+
+    copyIn(head, header, headerLen);
+    if (dataLen > 0)
+        copyIn(head + headerLen, data, dataLen);
+
+    // Publish the data before the new head
+    __sync_synchronize();
+    m_header->head = head + headerLen + dataLen;
+
+    return true;
+}
+
+/**
+ * Take up to len bytes out of the ring.
+ *
+ * @return the number of bytes read.
+ */
+int YapRing::read(uint8_t* buf, int len)
+{
+    uint32_t tail = m_header->tail;
+    int count = MIN(len, available());
+
+    if (count <= 0)
+        return 0;
+
+    // Don't read the data before seeing the head that published it
+    __sync_synchronize();
+    copyOut(tail, buf, count);
+
+    __sync_synchronize();
+    m_header->tail = tail + count;
+
+    return count;
+}
+
+/**
+ * Copy len bytes without taking them out of the ring.
+ */
+bool YapRing::peek(uint8_t* buf, int len) const
+{
+    if (available() < len)
+        return false;
+
+    __sync_synchronize();
+    copyOut(m_header->tail, buf, len);
+    return true;
+}
+
+/**
+ * Called by the consumer when it found the ring empty.
+ *
+ * @return false if data arrived meanwhile and the consumer must not sleep.
+ */
+bool YapRing::waitForData()
+{
+    m_header->consumerWaiting = 1;
+    __sync_synchronize();
+
+    if (available() > 0) {
+        m_header->consumerWaiting = 0;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Called by the producer when there is no room for len bytes.
+ *
+ * @return false if room was made meanwhile and the producer must not sleep.
+ */
+bool YapRing::waitForSpace(int len)
+{
+    m_header->producerWaiting = 1;
+    __sync_synchronize();
+
+    if (space() >= len) {
+        m_header->producerWaiting = 0;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Called by the producer after writing.
+ *
+ * @return true if the consumer is asleep and has to be woken up.
+ */
+bool YapRing::takeConsumerWaiting()
+{
+    __sync_synchronize();
+    return __sync_bool_compare_and_swap(&m_header->consumerWaiting, 1, 0);
+}
+
+/**
+ * Called by the consumer after reading.
+ *
+ * @return true if the producer is waiting for room and has to be woken up.
+ */
+bool YapRing::takeProducerWaiting()
+{
+    __sync_synchronize();
+    return __sync_bool_compare_and_swap(&m_header->producerWaiting, 1, 0);
+}
+
+YapRingPair::YapRingPair(int shmFd, uint8_t* mem, int memLen, int eventFd, int peerEventFd)
+    : m_shmFd(shmFd)
+    , m_mem(mem)
+    , m_memLen(memLen)
+    , m_eventFd(eventFd)
+    , m_peerEventFd(peerEventFd)
+    , m_commands(0)
+    , m_messages(0)
+{
+    m_commands = new YapRing(m_mem, kRingSize);
+    m_messages = new YapRing(m_mem + YapRing::memoryLength(kRingSize), kRingSize);
+}
+
+YapRingPair::~YapRingPair()
+{
+    delete m_commands;
+    delete m_messages;
+
+    ::munmap(m_mem, m_memLen);
+    ::close(m_shmFd);
+    ::close(m_eventFd);
+    ::close(m_peerEventFd);
+}
+
+static uint8_t* mapRings(int shmFd, int memLen)
+{
+    void* mem = ::mmap(NULL, memLen, PROT_READ | PROT_WRITE, MAP_SHARED, shmFd, 0);
+    if (mem == MAP_FAILED) {
+        fprintf(stderr, "YAP: Failed to map rings: %s\n", strerror(errno));
+        return 0;
+    }
+
+    return (uint8_t*) mem;
+}
+
+static int createEventFd()
+{
+    int fd = ::eventfd(0, 0);
+    if (fd >= 0)
+        ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    return fd;
+}
+
+/**
+ * Create the rings on the server side.
+ */
+YapRingPair* YapRingPair::create()
+{
+    int memLen = 2 * YapRing::memoryLength(kRingSize);
+    char shmPath[sizeof(kShmPathTemplate)];
+
+    ::memcpy(shmPath, kShmPathTemplate, sizeof(kShmPathTemplate));
+
+    int shmFd = ::mkstemp(shmPath);
+    if (shmFd < 0) {
+        fprintf(stderr, "YAP: Failed to create ring memory: %s\n", strerror(errno));
+        return 0;
+    }
+
+    // Only reachable through the descriptor from now on
+    ::unlink(shmPath);
+
+    if (::ftruncate(shmFd, memLen) != 0) {
+        fprintf(stderr, "YAP: Failed to size ring memory: %s\n", strerror(errno));
+        ::close(shmFd);
+        return 0;
+    }
+
+    uint8_t* mem = mapRings(shmFd, memLen);
+    if (!mem) {
+        ::close(shmFd);
+        return 0;
+    }
+
+    int serverEventFd = createEventFd();
+    int clientEventFd = createEventFd();
+    if (serverEventFd < 0 || clientEventFd < 0) {
+        fprintf(stderr, "YAP: Failed to create ring doorbells: %s\n", strerror(errno));
+        if (serverEventFd >= 0)
+            ::close(serverEventFd);
+        if (clientEventFd >= 0)
+            ::close(clientEventFd);
+        ::munmap(mem, memLen);
+        ::close(shmFd);
+        return 0;
+    }
+
+    YapRingPair* rings = new YapRingPair(shmFd, mem, memLen, serverEventFd, clientEventFd);
+    rings->m_commands->init();
+    rings->m_messages->init();
+
+    return rings;
+}
+
+/**
+ * Pass the ring memory and doorbells to the client, which picks them up with receive().
+ */
+bool YapRingPair::send(int socketFd) const
+{
+    char data = 'R';
+    struct iovec iov;
+    iov.iov_base = &data;
+    iov.iov_len  = 1;
+
+    char control[CMSG_SPACE(kRingPairFdCount * sizeof(int))];
+    ::memset(control, 0, sizeof(control));
+
+    struct msghdr msg;
+    ::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+
+    // The client's own doorbell is our peer doorbell and vice versa
+    int fds[kRingPairFdCount] = { m_shmFd, m_peerEventFd, m_eventFd };
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(fds));
+    ::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    while (::sendmsg(socketFd, &msg, 0) < 0) {
+        if (errno != EINTR) {
+            fprintf(stderr, "YAP: Failed to send rings: %s\n", strerror(errno));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Pick up the rings sent by the server.
+ */
+YapRingPair* YapRingPair::receive(int socketFd)
+{
+    char data = 0;
+    struct iovec iov;
+    iov.iov_base = &data;
+    iov.iov_len  = 1;
+
+    char control[CMSG_SPACE(kRingPairFdCount * sizeof(int))];
+    ::memset(control, 0, sizeof(control));
+
+    struct msghdr msg;
+    ::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+
+    int count = 0;
+    while ((count = ::recvmsg(socketFd, &msg, 0)) < 0) {
+        if (errno != EINTR)
+            break;
+    }
+
+    struct cmsghdr* cmsg = count == 1 ? CMSG_FIRSTHDR(&msg) : 0;
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(kRingPairFdCount * sizeof(int))) {
+        fprintf(stderr, "YAP: Failed to receive rings\n");
+        return 0;
+    }
+
+    int fds[kRingPairFdCount];
+    ::memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    int memLen = 2 * YapRing::memoryLength(kRingSize);
+    uint8_t* mem = mapRings(fds[0], memLen);
+    if (!mem) {
+        for (int i = 0; i < kRingPairFdCount; i++)
+            ::close(fds[i]);
+        return 0;
+    }
+
+    return new YapRingPair(fds[0], mem, memLen, fds[1], fds[2]);
+}
+
+static void ringDoorbell(int fd)
+{
+    uint64_t value = 1;
+    while (::write(fd, &value, sizeof(value)) < 0 && errno == EINTR)
+        ;
+}
+
+void YapRingPair::kick()
+{
+    ringDoorbell(m_peerEventFd);
+}
+
+/**
+ * Make our own doorbell readable again after consuming a wakeup that was meant
+ * for somebody else.
+ */
+void YapRingPair::kickSelf()
+{
+    ringDoorbell(m_eventFd);
+}
+
+void YapRingPair::clearEvent()
+{
+    uint64_t value = 0;
+    while (::read(m_eventFd, &value, sizeof(value)) < 0 && errno == EINTR)
+        ;
+}
@@ -0,0 +1,116 @@
+/* @@@LICENSE
+*
+*      Copyright (c) 2012 Hewlett-Packard Development Company, L.P.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+LICENSE@@@ */
+
+#ifndef YAPRING_H
+#define YAPRING_H
+
+#include <stdint.h>
+
+/**
+ * Lock-free byte ring in shared memory with a single producer and a single
+ * consumer, usually in different processes. Writes are all or nothing so the
+ * consumer never sees part of a frame.
+ *
+ * The side that finds the ring empty (or full) sets a waiting flag and goes to
+ * sleep on its doorbell. The other side rings the doorbell only if it finds the
+ * flag set after publishing its update.
+ */
+class YapRing
+{
+public:
+
+    YapRing(uint8_t* mem, int size);
+
+    static int memoryLength(int size);
+    void init();
+
+    bool write(const uint8_t* header, int headerLen, const uint8_t* data, int dataLen);
+    int  read(uint8_t* buf, int len);
+    bool peek(uint8_t* buf, int len) const;
+
+    int  available() const;
+    int  space() const;
+    int  size() const { return m_size; }
+
+    bool waitForData();
+    bool waitForSpace(int len);
+    bool takeConsumerWaiting();
+    bool takeProducerWaiting();
+
+private:
+
+    struct Header {
+        volatile uint32_t head;     ///< Bytes written so far, only changed by the producer
+        uint32_t          pad1[15];
+        volatile uint32_t tail;     ///< Bytes read so far, only changed by the consumer
+        uint32_t          pad2[15];
+        volatile int32_t  consumerWaiting;
+        volatile int32_t  producerWaiting;
+    };
+
+    void copyIn(uint32_t pos, const uint8_t* data, int len);
+    void copyOut(uint32_t pos, uint8_t* buf, int len) const;
+
+    Header*  m_header;
+    uint8_t* m_data;
+    uint32_t m_size;
+
+    YapRing(const YapRing&);
+    YapRing& operator=(const YapRing&);
+};
+
+/**
+ * Shared memory holding the command ring (client to server) and the message ring
+ * (server to client), plus an eventfd doorbell for each side. The server creates
+ * it and hands the file descriptors to the client over the command socket.
+ */
+class YapRingPair
+{
+public:
+
+    static YapRingPair* create();
+    static YapRingPair* receive(int socketFd);
+    ~YapRingPair();
+
+    bool send(int socketFd) const;
+
+    YapRing* commands() const { return m_commands; }
+    YapRing* messages() const { return m_messages; }
+
+    int  eventFd() const { return m_eventFd; }
+    void kick();
+    void kickSelf();
+    void clearEvent();
+
+private:
+
+    YapRingPair(int shmFd, uint8_t* mem, int memLen, int eventFd, int peerEventFd);
+
+    int      m_shmFd;
+    uint8_t* m_mem;
+    int      m_memLen;
+    int      m_eventFd;     ///< Rung by the other side
+    int      m_peerEventFd; ///< Wakes up the other side
+    YapRing* m_commands;
+    YapRing* m_messages;
+
+    YapRingPair(const YapRingPair&);
+    YapRingPair& operator=(const YapRingPair&);
+};
+
+#endif /* YAPRING_H */
@@ -25,19 +25,25 @@ LICENSE@@@ */
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <byteswap.h>
 #include <sys/stat.h>
 #include <pthread.h>
+#include <list>
+#include <algorithm>
 
 #include "YapProxy.h"
 #include "YapServer.h"
+#include "YapCapture.h"
 
 #include <QApplication>
 
 static const int   kMaxPathLen       = 256;
 static const char* kSocketPathPrefix = "/tmp/yapserver.";
 static const int   kMaxConnections   = 100;
+// Time a new client has to send its message socket name
+static const int   kHandshakeTimeoutMs = 5000;
 
 // Minimum that is good for performance/power reasons and 32-bit (signed) counter overflow
 static const int kDeadlockTimeoutMinSecs = 10;
@@ -69,6 +75,47 @@ private:
     static gboolean deadlockThreadTimerCallback(gpointer data);
 };
 
+/**
+ * A client that connected and is still sending the name of its message socket
+ * and its postfix, each as a big-endian int16 length followed by the string.
+ */
+class YapServerHandshake
+{
+public:
+
+    enum State {
+        StatePathLength,
+        StatePath,
+        StatePostfixLength,
+        StatePostfix,
+        StateDone
+    };
+
+    YapServer*  server;
+    int         socketFd;
+    GIOChannel* ioChannel;
+    GSource*    ioSource;
+    GSource*    timeoutSource;
+
+    State       state;
+    int16_t     length;         ///< Length field currently being read
+    char*       target;         ///< Where the current field goes
+    int         targetLen;
+    int         received;       ///< Bytes of the current field received so far
+
+    char*       msgSocketPath;
+    char*       msgSocketPostfix;
+
+    YapServerHandshake(YapServer* server, int socketFd);
+    ~YapServerHandshake();
+
+    int  readField();
+    bool advance();
+
+    static gboolean ioCallback(GIOChannel* channel, GIOCondition condition, void* data);
+    static gboolean timeoutCallback(void* data);
+};
+
 class YapServerPriv
 {
 public:
@@ -80,9 +127,18 @@ public:
     GIOChannel*   ioChannel;
     GSource*      ioSource;
 
+    std::list<YapServerHandshake*> handshakes;
+
+    std::list<YapProxy*> deferredProxies;  ///< Proxies with deferred commands, in turn order
+    GSource*      deferredSource;
+
     static gboolean ioCallback(GIOChannel* channel, GIOCondition condition, void* data);
+    static gboolean deferredCallback(void* data);
 
     YapServerDeadlockPriv* deadlockDetector;
+
+    YapCaptureWriter* capture;     ///< Set if YAP_CAPTURE names a file
+    uint32_t      capturedClients;
 };
 
 YapServerDeadlockPriv::YapServerDeadlockPriv(int deadlockTimeoutMs)
@@ -254,6 +310,142 @@ gboolean YapServerPriv::ioCallback(GIOChannel* channel, GIOCondition condition,
     return TRUE;
 }
 
+gboolean YapServerPriv::deferredCallback(void* data)
+{
+    YapServer* server = static_cast<YapServer*>(data);
+    return server->dispatchDeferred();
+}
+
+YapServerHandshake::YapServerHandshake(YapServer* server, int socketFd)
+    : server(server)
+    , socketFd(socketFd)
+    , ioChannel(0)
+    , ioSource(0)
+    , timeoutSource(0)
+    , state(StatePathLength)
+    , length(0)
+    , target((char*) &length)
+    , targetLen(sizeof(length))
+    , received(0)
+    , msgSocketPath(0)
+    , msgSocketPostfix(0)
+{
+}
+
+YapServerHandshake::~YapServerHandshake()
+{
+    if (ioSource) {
+        g_source_destroy(ioSource);
+        g_source_unref(ioSource);
+    }
+    if (ioChannel)
+        g_io_channel_unref(ioChannel);
+
+    if (timeoutSource) {
+        g_source_destroy(timeoutSource);
+        g_source_unref(timeoutSource);
+    }
+
+    if (msgSocketPath)
+        free(msgSocketPath);
+    if (msgSocketPostfix)
+        free(msgSocketPostfix);
+
+    if (socketFd != -1)
+        close(socketFd);
+}
+
+/**
+ * Read as much of the current field as is available, never beyond it since the
+ * client's first command follows right after the handshake.
+ *
+ * @return 1 once the field is complete, 0 if more data is needed, -1 on errors.
+ */
+int YapServerHandshake::readField()
+{
+    while (received < targetLen) {
+        int count = ::read(socketFd, target + received, targetLen - received);
+        if (count == 0)
+            return -1;
+
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            fprintf(stderr, "Failed to read from socket. Error: %d, %s\n", errno, strerror(errno));
+            return -1;
+        }
+
+        received += count;
+    }
+
+    return 1;
+}
+
+/**
+ * Move on to the next field once the current one is complete.
+ *
+ * @return false if the client sent garbage.
+ */
+bool YapServerHandshake::advance()
+{
+    switch (state) {
+    case StatePathLength:
+    case StatePostfixLength: {
+        int len = bswap_16(length);
+        if (len < 0 || len >= kMaxPathLen) {
+            fprintf(stderr, "YAP: Invalid message socket name length: %d\n", len);
+            return false;
+        }
+
+        char* str = (char*) malloc(len + 1);
+        str[len] = 0;
+
+        if (state == StatePathLength) {
+            msgSocketPath = str;
+            state = StatePath;
+        }
+        else {
+            msgSocketPostfix = str;
+            state = StatePostfix;
+        }
+
+        target    = str;
+        targetLen = len;
+        break;
+    }
+    case StatePath:
+        length    = 0;
+        target    = (char*) &length;
+        targetLen = sizeof(length);
+        state     = StatePostfixLength;
+        break;
+    case StatePostfix:
+    case StateDone:
+        state = StateDone;
+        break;
+    }
+
+    received = 0;
+    return true;
+}
+
+gboolean YapServerHandshake::ioCallback(GIOChannel* channel, GIOCondition condition, void* data)
+{
+    YapServerHandshake* handshake = static_cast<YapServerHandshake*>(data);
+    handshake->server->handshakeCallback(handshake);
+    return TRUE;
+}
+
+gboolean YapServerHandshake::timeoutCallback(void* data)
+{
+    YapServerHandshake* handshake = static_cast<YapServerHandshake*>(data);
+    handshake->server->handshakeTimeout(handshake);
+    return TRUE;
+}
+
 YapServer::YapServer(const char* name)
 {
     d = new YapServerPriv;
@@ -262,6 +454,9 @@ YapServer::YapServer(const char* name)
     d->mainLoop      = 0;
     d->mainCtxt      = 0;
     d->ioSource      = 0;
+    d->deferredSource = 0;
+    d->capture       = 0;
+    d->capturedClients = 0;
 
     ::snprintf(d->socketPath, G_N_ELEMENTS(d->socketPath), "%s%s", kSocketPathPrefix, name);
     ::unlink(d->socketPath);
@@ -271,9 +466,21 @@ YapServer::YapServer(const char* name)
 
 YapServer::~YapServer()
 {
+    while (!d->handshakes.empty()) {
+        delete d->handshakes.front();
+        d->handshakes.pop_front();
+    }
+
+    if (d->deferredSource) {
+        g_source_destroy(d->deferredSource);
+        g_source_unref(d->deferredSource);
+    }
+
     if (d->deadlockDetector) {
         delete d->deadlockDetector;
     }
+
+    delete d->capture;
     delete d;
 }
 
@@ -302,6 +509,9 @@ void YapServer::init()
         return;
     }
 
+    // Accept everything pending per wakeup without ever blocking in accept()
+    ::fcntl(d->socketFd, F_SETFL, ::fcntl(d->socketFd, F_GETFL, 0) | O_NONBLOCK);
+
     d->mainCtxt = g_main_context_default();
     d->mainLoop = g_main_loop_new(d->mainCtxt, TRUE);
 
@@ -310,6 +520,13 @@ void YapServer::init()
 
     g_source_set_callback(d->ioSource, (GSourceFunc) YapServerPriv::ioCallback, this, NULL);
     g_source_attach(d->ioSource, d->mainCtxt);
+
+    const char* capturePath = ::getenv("YAP_CAPTURE");
+    if (capturePath && capturePath[0]) {
+        d->capture = YapCaptureWriter::open(capturePath);
+        if (d->capture)
+            fprintf(stderr, "YAP: Capturing traffic to %s\n", capturePath);
+    }
 }
 
 GMainLoop* YapServer::mainLoop() const
@@ -361,69 +578,181 @@ void YapServer::setDeadlockDetectionInterval(const int IntervalInSeconds) {
     }
 }
 
+/**
+ * Accept new clients. Their handshake is read from the main loop as it comes in,
+ * so a slow client can't hold up the pages already open.
+ */
 void YapServer::ioCallback(GIOChannel* channel, GIOCondition condition)
 {
-    struct sockaddr_un  socketAddr;
-    socklen_t           socketAddrLen;
-    int                 socketFd = -1;
-    int16_t             msgSocketPathLen = 0;
-    char*               msgSocketPath = 0;
-    int16_t             msgSocketPostfixLen = 0;
-    char*               msgSocketPostfix = 0;
-
-    memset(&socketAddr,    0, sizeof(socketAddr));
-    memset(&socketAddrLen, 0, sizeof(socketAddrLen));
-
-    socketFd = ::accept(d->socketFd, (struct sockaddr*) &socketAddr, &socketAddrLen);
-    if (-1 == socketFd) {
-        fprintf(stderr, "YAP: Failed to accept inbound connection.\n");
-        goto Detached;
-    }
-    if (!readSocket(socketFd, (char*) &msgSocketPathLen, 2)) {
-        fprintf(stderr, "YAP: Failed to read message socket name length\n");
-        goto Detached;
-    }
-    msgSocketPathLen = bswap_16(msgSocketPathLen);
+    while (true) {
+        struct sockaddr_un  socketAddr;
+        socklen_t           socketAddrLen = sizeof(socketAddr);
 
-    msgSocketPath = (char*) malloc(msgSocketPathLen + 1);
-    if (!readSocket(socketFd, msgSocketPath, msgSocketPathLen)) {
-        fprintf(stderr, "YAP: Failed to read message socket name\n");
-        goto Detached;
-    }
-    msgSocketPath[msgSocketPathLen] = 0;
+        memset(&socketAddr, 0, sizeof(socketAddr));
+
+        int socketFd = ::accept(d->socketFd, (struct sockaddr*) &socketAddr, &socketAddrLen);
+        if (-1 == socketFd) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                fprintf(stderr, "YAP: Failed to accept inbound connection.\n");
+            return;
+        }
+
+        ::fcntl(socketFd, F_SETFL, ::fcntl(socketFd, F_GETFL, 0) | O_NONBLOCK);
+
+        YapServerHandshake* handshake = new YapServerHandshake(this, socketFd);
+        d->handshakes.push_back(handshake);
+
+        handshake->ioChannel = g_io_channel_unix_new(socketFd);
+        handshake->ioSource  = g_io_create_watch(handshake->ioChannel, (GIOCondition) (G_IO_IN | G_IO_HUP | G_IO_ERR));
+        g_source_set_callback(handshake->ioSource, (GSourceFunc) YapServerHandshake::ioCallback, handshake, NULL);
+        g_source_attach(handshake->ioSource, d->mainCtxt);
 
-    ::chmod( msgSocketPath, S_IRWXU | S_IRWXG | S_IRWXO );
+        handshake->timeoutSource = g_timeout_source_new(kHandshakeTimeoutMs);
+        g_source_set_callback(handshake->timeoutSource, YapServerHandshake::timeoutCallback, handshake, NULL);
+        g_source_attach(handshake->timeoutSource, d->mainCtxt);
 
-    if (!readSocket(socketFd, (char*) &msgSocketPostfixLen, 2)) {
-        fprintf(stderr, "YAP: Failed to read message socket name length\n");
-        goto Detached;
+        // Usually the whole handshake is already there
+        handshakeCallback(handshake);
     }
-    msgSocketPostfixLen = bswap_16(msgSocketPostfixLen);
+}
 
-    msgSocketPostfix = (char*) malloc(msgSocketPostfixLen + 1);
-    if (!readSocket(socketFd, msgSocketPostfix, msgSocketPostfixLen)) {
-        fprintf(stderr, "YAP: Failed to read message postifx name\n");
-        goto Detached;
+void YapServer::handshakeCallback(YapServerHandshake* handshake)
+{
+    while (handshake->state != YapServerHandshake::StateDone) {
+        int ret = handshake->readField();
+        if (ret == 0)
+            return;
+
+        if (ret < 0) {
+            fprintf(stderr, "YAP: Failed to read message socket name\n");
+            dropHandshake(handshake);
+            return;
+        }
+
+        if (!handshake->advance()) {
+            dropHandshake(handshake);
+            return;
+        }
     }
-    msgSocketPostfix[msgSocketPostfixLen] = 0;
 
-    YapProxy*           proxy;
-    proxy = new YapProxy(this, socketFd, msgSocketPath, msgSocketPostfix);
+    finishHandshake(handshake);
+}
+
+void YapServer::handshakeTimeout(YapServerHandshake* handshake)
+{
+    fprintf(stderr, "YAP: Client didn't complete the handshake within %d ms\n", kHandshakeTimeoutMs);
+    dropHandshake(handshake);
+}
+
+void YapServer::finishHandshake(YapServerHandshake* handshake)
+{
+    int socketFd = handshake->socketFd;
+    handshake->socketFd = -1;
+
+    // The proxy expects a blocking command socket, it uses MSG_DONTWAIT where needed
+    ::fcntl(socketFd, F_SETFL, ::fcntl(socketFd, F_GETFL, 0) & ~O_NONBLOCK);
+
+    ::chmod( handshake->msgSocketPath, S_IRWXU | S_IRWXG | S_IRWXO );
+
+    YapProxy* proxy = new YapProxy(this, socketFd, handshake->msgSocketPath, handshake->msgSocketPostfix);
+
+    dropHandshake(handshake);
+
     clientConnected(proxy);
+}
 
-    free(msgSocketPath);
-    free(msgSocketPostfix);
-    return;
+void YapServer::dropHandshake(YapServerHandshake* handshake)
+{
+    d->handshakes.remove(handshake);
+    delete handshake;
+}
 
- Detached:
+/**
+ * Scheduling class of a command. Commands are control commands unless the
+ * subclass says otherwise.
+ */
+YapCommandClass YapServer::commandClass(int16_t cmdValue) const
+{
+    return kYapCommandControl;
+}
 
-    if (msgSocketPath)
-        free(msgSocketPath);
-    if (msgSocketPostfix)
-        free(msgSocketPostfix);
-    if (-1 != socketFd) {
-        close(socketFd);
+/**
+ * Whether newer commands may get folded into this one while they are already
+ * waiting in the receive buffer, see coalesceCommands().
+ */
+bool YapServer::canCoalesce(YapPacket* cmd)
+{
+    return false;
+}
+
+/**
+ * Fold next into held, a command canCoalesce() accepted, by writing the combined
+ * command to merged. Both are dispatched separately if this returns false.
+ */
+bool YapServer::coalesceCommands(YapPacket* held, YapPacket* next, YapPacket* merged)
+{
+    return false;
+}
+
+/**
+ * Deferred commands are dispatched at default priority, one at a time and taking
+ * turns between proxies, so input commands arriving on the G_PRIORITY_HIGH watches
+ * always get dispatched first.
+ */
+void YapServer::scheduleDeferred(YapProxy* proxy)
+{
+    if (std::find(d->deferredProxies.begin(), d->deferredProxies.end(), proxy) == d->deferredProxies.end())
+        d->deferredProxies.push_back(proxy);
+
+    if (d->deferredSource)
+        return;
+
+    d->deferredSource = g_idle_source_new();
+    g_source_set_priority(d->deferredSource, G_PRIORITY_DEFAULT);
+    g_source_set_callback(d->deferredSource, YapServerPriv::deferredCallback, this, NULL);
+    g_source_attach(d->deferredSource, d->mainCtxt);
+}
+
+void YapServer::cancelDeferred(YapProxy* proxy)
+{
+    d->deferredProxies.remove(proxy);
+}
+
+bool YapServer::dispatchDeferred()
+{
+    if (!d->deferredProxies.empty()) {
+        YapProxy* proxy = d->deferredProxies.front();
+        d->deferredProxies.pop_front();
+
+        if (proxy->dispatchDeferredCommand() && proxy->hasDeferredCommands())
+            d->deferredProxies.push_back(proxy);
     }
+
+    if (!d->deferredProxies.empty())
+        return true;
+
+    g_source_unref(d->deferredSource);
+    d->deferredSource = 0;
+    return false;
+}
+
+/**
+ * Number a newly connected client for the capture.
+ *
+ * @return 0 if traffic isn't being captured.
+ */
+uint32_t YapServer::captureClientId()
+{
+    return d->capture ? ++d->capturedClients : 0;
+}
+
+void YapServer::captureTraffic(uint32_t clientId, uint8_t type, int64_t timeUs, uint32_t sequence,
+                               uint8_t flags, const uint8_t* data, int len)
+{
+    if (d->capture)
+        d->capture->write(type, clientId, timeUs, sequence, flags, data, len);
 }
 
 /**
@@ -445,28 +774,6 @@ void YapServer::deleteRecordProxy(YapProxy* proxy)
     }
 }
 
-bool YapServer::readSocket(int fd, char* buf, int len)
-{
-    int index = 0;
-
-    while (len > 0) {
-        int count = ::read(fd, &buf[index], len);
-        if (count <= 0) {
-            if (errno == EAGAIN || errno == EINTR)
-                continue;
-            else {
-                fprintf(stderr, "Failed to read from socket. Error: %d, %s\n", errno, strerror(errno));
-                return false;
-            }
-        }
-
-        index  += count;
-        len    -= count;
-    }
-
-    return true;
-}
-
 int YapServer::serverSocketFd() const
 {
     return d->socketFd;
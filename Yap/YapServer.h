@@ -22,7 +22,10 @@ LICENSE@@@ */
 #include <stdint.h>
 #include <glib.h>
 
+#include "YapDefs.h"
+
 class YapServerPriv;
+class YapServerHandshake;
 class YapProxy;
 class YapPacket;
 
@@ -47,12 +50,24 @@ public:
     virtual void clientDisconnected(YapProxy* proxy) = 0;
     virtual void handleAsyncCommand(YapProxy* proxy, YapPacket* cmd) = 0;
     virtual void handleSyncCommand(YapProxy* proxy, YapPacket* cmd, YapPacket* reply) = 0;
+    virtual YapCommandClass commandClass(int16_t cmdValue) const;
+    virtual bool canCoalesce(YapPacket* cmd);
+    virtual bool coalesceCommands(YapPacket* held, YapPacket* next, YapPacket* merged);
 
 private:
 
     void init();
     void ioCallback(GIOChannel* channel, GIOCondition condition);
-    bool readSocket(int fd, char* buf, int len);
+    void handshakeCallback(YapServerHandshake* handshake);
+    void handshakeTimeout(YapServerHandshake* handshake);
+    void finishHandshake(YapServerHandshake* handshake);
+    void dropHandshake(YapServerHandshake* handshake);
+    void scheduleDeferred(YapProxy* proxy);
+    void cancelDeferred(YapProxy* proxy);
+    bool dispatchDeferred();
+    uint32_t captureClientId();
+    void captureTraffic(uint32_t clientId, uint8_t type, int64_t timeUs, uint32_t sequence,
+                        uint8_t flags, const uint8_t* data, int len);
 
     YapServerPriv* d;
 
@@ -61,6 +76,8 @@ private:
     YapServer& operator=(const YapServer&);
 
     friend class YapServerPriv;
+    friend class YapServerHandshake;
+    friend class YapProxy;
 };
 
 #endif /* YAPSERVER_H */